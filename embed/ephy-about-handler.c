@@ -360,7 +360,7 @@ ephy_about_handler_handle_applications (EphyAboutHandler       *handler,
 static void
 history_service_query_urls_cb (EphyHistoryService     *history,
                                gboolean                success,
-                               GList                  *urls,
+                               EphyHistoryURLSet      *urls,
                                WebKitURISchemeRequest *request)
 {
   EphySnapshotService *snapshot_service;
@@ -368,7 +368,6 @@ history_service_query_urls_cb (EphyHistoryService     *history,
   GString *data_str;
   gsize data_length;
   char *lang;
-  GList *l;
   guint list_length;
 
   snapshot_service = ephy_snapshot_service_get_default ();
@@ -394,7 +393,7 @@ history_service_query_urls_cb (EphyHistoryService     *history,
                           _(NEW_TAB_PAGE_TITLE));
   g_free (lang);
 
-  list_length = g_list_length (urls);
+  list_length = ephy_history_url_set_get_length (urls);
 
   if (list_length == 0 || !success) {
     GtkIconInfo *icon_info;
@@ -425,8 +424,8 @@ history_service_query_urls_cb (EphyHistoryService     *history,
   g_string_append (data_str,
                    "<div id=\"most-visited-grid\">\n");
 
-  for (l = urls; l; l = g_list_next (l)) {
-    EphyHistoryURL *url = (EphyHistoryURL *)l->data;
+  for (guint i = 0; i < list_length; i++) {
+    const EphyHistoryURLRow *url = ephy_history_url_set_get_row (urls, i);
     const char *snapshot;
     g_autofree char *thumbnail_style = NULL;
     g_autofree char *entity_encoded_title = NULL;
@@ -437,7 +436,7 @@ history_service_query_urls_cb (EphyHistoryService     *history,
     if (snapshot)
       thumbnail_style = g_strdup_printf (" style=\"background: url(file://%s) no-repeat; background-size: 100%%;\"", snapshot);
     else
-      ephy_embed_shell_schedule_thumbnail_update (shell, url);
+      ephy_embed_shell_schedule_thumbnail_update (shell, url->url);
 
     /* Title and URL are controlled by web content and could be malicious. */
     entity_encoded_title = ephy_encode_for_html_entity (url->title);
@@ -488,7 +487,7 @@ ephy_history_query_new_for_overview (void)
   EphyHistoryQuery *query;
 
   query = ephy_history_query_new ();
-  query->sort_type = EPHY_HISTORY_SORT_MOST_VISITED;
+  query->sort_type = EPHY_HISTORY_SORT_FRECENCY;
   query->limit = EPHY_ABOUT_OVERVIEW_MAX_ITEMS;
   query->ignore_hidden = TRUE;
   query->ignore_local = TRUE;
@@ -505,9 +504,9 @@ ephy_about_handler_handle_html_overview (EphyAboutHandler       *handler,
 
   history = ephy_embed_shell_get_global_history_service (ephy_embed_shell_get_default ());
   query = ephy_history_query_new_for_overview ();
-  ephy_history_service_query_urls (history, query, NULL,
-                                   (EphyHistoryJobCallback)history_service_query_urls_cb,
-                                   g_object_ref (request));
+  ephy_history_service_query_url_set (history, query, NULL,
+                                      (EphyHistoryJobCallback)history_service_query_urls_cb,
+                                      g_object_ref (request));
   ephy_history_query_free (query);
 
   return TRUE;
@@ -229,22 +229,21 @@ web_process_extension_password_form_focused_message_received_cb (WebKitUserConte
 static void
 history_service_query_urls_cb (EphyHistoryService *service,
                                gboolean            success,
-                               GList              *urls,
+                               EphyHistoryURLSet  *urls,
                                EphyEmbedShell     *shell)
 {
   EphyEmbedShellPrivate *priv = ephy_embed_shell_get_instance_private (shell);
-  GList *l;
   GVariantBuilder builder;
 
   if (!success)
     return;
 
   g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ss)"));
-  for (l = urls; l; l = g_list_next (l)) {
-    EphyHistoryURL *url = (EphyHistoryURL *)l->data;
+  for (guint i = 0; i < ephy_history_url_set_get_length (urls); i++) {
+    const EphyHistoryURLRow *url = ephy_history_url_set_get_row (urls, i);
 
     g_variant_builder_add (&builder, "(ss)", url->url, url->title);
-    ephy_embed_shell_schedule_thumbnail_update (shell, (EphyHistoryURL *)l->data);
+    ephy_embed_shell_schedule_thumbnail_update (shell, url->url);
   }
 
   webkit_web_context_send_message_to_all_extensions (priv->web_context,
@@ -259,9 +258,9 @@ ephy_embed_shell_update_overview_urls (EphyEmbedShell *shell)
   g_autoptr (EphyHistoryQuery) query = NULL;
 
   query = ephy_history_query_new_for_overview ();
-  ephy_history_service_query_urls (priv->global_history_service, query, NULL,
-                                   (EphyHistoryJobCallback)history_service_query_urls_cb,
-                                   shell);
+  ephy_history_service_query_url_set (priv->global_history_service, query, NULL,
+                                      (EphyHistoryJobCallback)history_service_query_urls_cb,
+                                      shell);
 }
 
 static void
@@ -501,15 +500,22 @@ history_service_url_title_changed_cb (EphyHistoryService *service,
 }
 
 static void
-history_service_url_deleted_cb (EphyHistoryService *service,
-                                EphyHistoryURL     *url,
-                                EphyEmbedShell     *shell)
+history_service_urls_deleted_cb (EphyHistoryService *service,
+                                 GPtrArray          *urls,
+                                 EphyEmbedShell     *shell)
 {
   EphyEmbedShellPrivate *priv = ephy_embed_shell_get_instance_private (shell);
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_STRING_ARRAY);
+  for (guint i = 0; i < urls->len; i++) {
+    EphyHistoryURL *url = g_ptr_array_index (urls, i);
+    g_variant_builder_add (&builder, "s", url->url);
+  }
 
   webkit_web_context_send_message_to_all_extensions (priv->web_context,
-                                                     webkit_user_message_new ("History.DeleteURL",
-                                                                              g_variant_new ("s", url->url)));
+                                                     webkit_user_message_new ("History.DeleteURLs",
+                                                                              g_variant_builder_end (&builder)));
 }
 
 static void
@@ -570,23 +576,23 @@ got_snapshot_path_for_url_cb (EphySnapshotService *service,
 
 void
 ephy_embed_shell_schedule_thumbnail_update (EphyEmbedShell *shell,
-                                            EphyHistoryURL *url)
+                                            const char     *url)
 {
   EphyEmbedShellPrivate *priv = ephy_embed_shell_get_instance_private (shell);
   EphySnapshotService *service;
   const char *snapshot;
 
   service = ephy_snapshot_service_get_default ();
-  snapshot = ephy_snapshot_service_lookup_cached_snapshot_path (service, url->url);
+  snapshot = ephy_snapshot_service_lookup_cached_snapshot_path (service, url);
 
   if (snapshot) {
-    ephy_embed_shell_set_thumbnail_path (shell, url->url, snapshot);
+    ephy_embed_shell_set_thumbnail_path (shell, url, snapshot);
   } else {
     ephy_snapshot_service_get_snapshot_path_for_url_async (service,
-                                                           url->url,
+                                                           url,
                                                            priv->cancellable,
                                                            (GAsyncReadyCallback)got_snapshot_path_for_url_cb,
-                                                           g_strdup (url->url));
+                                                           g_strdup (url));
   }
 }
 
@@ -616,6 +622,9 @@ ephy_embed_shell_get_global_history_service (EphyEmbedShell *shell)
 
     filename = g_build_filename (ephy_profile_dir (), EPHY_HISTORY_FILE, NULL);
     priv->global_history_service = ephy_history_service_new (filename, mode);
+    g_settings_bind (EPHY_SETTINGS_MAIN, EPHY_PREFS_HISTORY_VISIT_RETENTION_DAYS,
+                     priv->global_history_service, "visit-retention-days",
+                     G_SETTINGS_BIND_GET);
 
     g_signal_connect_object (priv->global_history_service, "urls-visited",
                              G_CALLBACK (history_service_urls_visited_cb),
@@ -623,8 +632,8 @@ ephy_embed_shell_get_global_history_service (EphyEmbedShell *shell)
     g_signal_connect_object (priv->global_history_service, "url-title-changed",
                              G_CALLBACK (history_service_url_title_changed_cb),
                              shell, 0);
-    g_signal_connect_object (priv->global_history_service, "url-deleted",
-                             G_CALLBACK (history_service_url_deleted_cb),
+    g_signal_connect_object (priv->global_history_service, "urls-deleted",
+                             G_CALLBACK (history_service_urls_deleted_cb),
                              shell, 0);
     g_signal_connect_object (priv->global_history_service, "host-deleted",
                              G_CALLBACK (history_service_host_deleted_cb),
@@ -519,7 +519,7 @@ take_snapshot (EphyWebView *view)
 static void
 history_service_query_urls_cb (EphyHistoryService *service,
                                gboolean            success,
-                               GList              *urls,
+                               EphyHistoryURLSet  *urls,
                                EphyWebView        *view)
 {
   const char *url = webkit_web_view_get_uri (WEBKIT_WEB_VIEW (view));
@@ -531,8 +531,8 @@ history_service_query_urls_cb (EphyHistoryService *service,
   if (g_strcmp0 (url, view->pending_snapshot_uri) != 0)
     goto out;
 
-  for (GList *l = urls; l; l = g_list_next (l)) {
-    EphyHistoryURL *history_url = l->data;
+  for (guint i = 0; i < ephy_history_url_set_get_length (urls); i++) {
+    const EphyHistoryURLRow *history_url = ephy_history_url_set_get_row (urls, i);
 
     /* Take snapshot if this URL is one of the top history results. */
     if (strcmp (history_url->url, view->pending_snapshot_uri) == 0) {
@@ -567,9 +567,9 @@ maybe_take_snapshot (EphyWebView *view)
    */
   query = ephy_history_query_new_for_overview ();
   query->limit += 5;
-  ephy_history_service_query_urls (service, query, NULL,
-                                   (EphyHistoryJobCallback)history_service_query_urls_cb,
-                                   g_object_ref (view));
+  ephy_history_service_query_url_set (service, query, NULL,
+                                      (EphyHistoryJobCallback)history_service_query_urls_cb,
+                                      g_object_ref (view));
   ephy_history_query_free (query);
 
   return FALSE;
@@ -1376,6 +1376,24 @@ out:
   return TRUE;
 }
 
+static void
+apply_zoom_level (EphyWebView *view,
+                  double       zoom_level)
+{
+  double current_zoom;
+
+  /* A zoom level of 0 stands for the default one. */
+  if (zoom_level == 0.0)
+    zoom_level = g_settings_get_double (EPHY_SETTINGS_WEB, EPHY_PREFS_WEB_DEFAULT_ZOOM_LEVEL);
+
+  current_zoom = webkit_web_view_get_zoom_level (WEBKIT_WEB_VIEW (view));
+  if (zoom_level != current_zoom) {
+    view->is_setting_zoom = TRUE;
+    webkit_web_view_set_zoom_level (WEBKIT_WEB_VIEW (view), zoom_level);
+    view->is_setting_zoom = FALSE;
+  }
+}
+
 static void
 get_host_for_url_cb (gpointer service,
                      gboolean success,
@@ -1383,43 +1401,37 @@ get_host_for_url_cb (gpointer service,
                      gpointer user_data)
 {
   EphyHistoryHost *host;
-  EphyWebView *view;
-  double current_zoom;
-  double set_zoom;
 
   if (success == FALSE)
     return;
 
-  view = EPHY_WEB_VIEW (user_data);
   host = (EphyHistoryHost *)result_data;
 
-  current_zoom = webkit_web_view_get_zoom_level (WEBKIT_WEB_VIEW (view));
-
   /* Use default zoom level in case web page is
    *  - not visited before
    *  - uses default zoom level (0)
    */
-  if (host->visit_count == 0 || host->zoom_level == 0.0) {
-    set_zoom = g_settings_get_double (EPHY_SETTINGS_WEB, EPHY_PREFS_WEB_DEFAULT_ZOOM_LEVEL);
-  } else {
-    set_zoom = host->zoom_level;
-  }
-
-  if (set_zoom != current_zoom) {
-    view->is_setting_zoom = TRUE;
-    webkit_web_view_set_zoom_level (WEBKIT_WEB_VIEW (view), set_zoom);
-    view->is_setting_zoom = FALSE;
-  }
+  apply_zoom_level (EPHY_WEB_VIEW (user_data), host->visit_count == 0 ? 0.0 : host->zoom_level);
 }
 
 static void
 restore_zoom_level (EphyWebView *view,
                     const char  *address)
 {
-  if (ephy_embed_utils_address_has_web_scheme (address))
-    ephy_history_service_get_host_for_url (view->history_service,
-                                           address, view->cancellable,
-                                           (EphyHistoryJobCallback)get_host_for_url_cb, view);
+  double zoom_level;
+
+  if (!ephy_embed_utils_address_has_web_scheme (address))
+    return;
+
+  /* Most loads stay on hosts whose zoom level is already known. */
+  if (ephy_history_service_get_cached_zoom_level (view->history_service, address, &zoom_level)) {
+    apply_zoom_level (view, zoom_level);
+    return;
+  }
+
+  ephy_history_service_get_host_for_url (view->history_service,
+                                         address, view->cancellable,
+                                         (EphyHistoryJobCallback)get_host_for_url_cb, view);
 }
 
 static void
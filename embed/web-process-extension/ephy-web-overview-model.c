@@ -245,8 +245,8 @@ ephy_web_overview_model_set_url_title (EphyWebOverviewModel *model,
 }
 
 void
-ephy_web_overview_model_delete_url (EphyWebOverviewModel *model,
-                                    const char           *url)
+ephy_web_overview_model_delete_urls (EphyWebOverviewModel *model,
+                                     const char * const   *urls)
 {
   GList *l;
   gboolean changed = FALSE;
@@ -258,7 +258,7 @@ ephy_web_overview_model_delete_url (EphyWebOverviewModel *model,
     EphyWebOverviewModelItem *item = (EphyWebOverviewModelItem *)l->data;
     GList *next = l->next;
 
-    if (g_strcmp0 (item->url, url) == 0) {
+    if (g_strv_contains (urls, item->url)) {
       changed = TRUE;
 
       ephy_web_overview_model_item_free (item);
@@ -39,8 +39,8 @@ void                  ephy_web_overview_model_set_url_thumbnail (EphyWebOverview
 void                  ephy_web_overview_model_set_url_title     (EphyWebOverviewModel *model,
                                                                  const char           *url,
                                                                  const char           *title);
-void                  ephy_web_overview_model_delete_url        (EphyWebOverviewModel *model,
-                                                                 const char           *url);
+void                  ephy_web_overview_model_delete_urls       (EphyWebOverviewModel *model,
+                                                                 const char * const   *urls);
 void                  ephy_web_overview_model_delete_host       (EphyWebOverviewModel *model,
                                                                  const char           *host);
 void                  ephy_web_overview_model_clear             (EphyWebOverviewModel *model);
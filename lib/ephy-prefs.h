@@ -153,6 +153,7 @@ static const char * const ephy_prefs_web_schema[] = {
 #define EPHY_PREFS_START_IN_INCOGNITO_MODE            "start-in-incognito-mode"
 #define EPHY_PREFS_ACTIVE_CLEAR_DATA_ITEMS            "active-clear-data-items"
 #define EPHY_PREFS_USE_GOOGLE_SEARCH_SUGGESTIONS      "use-google-search-suggestions"
+#define EPHY_PREFS_HISTORY_VISIT_RETENTION_DAYS       "history-visit-retention-days"
 
 #define EPHY_PREFS_LOCKDOWN_SCHEMA            "org.gnome.Epiphany.lockdown"
 #define EPHY_PREFS_LOCKDOWN_FULLSCREEN        "disable-fullscreen"
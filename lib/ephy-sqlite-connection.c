@@ -33,6 +33,14 @@ struct _EphySQLiteConnection {
   char *database_path;
   sqlite3 *database;
   EphySQLiteConnectionMode mode;
+
+  /* Prepared statements handed back by finalized cached EphySQLiteStatements,
+   * keyed by their SQL text. Guarded by statement_cache_mutex since GSB
+   * lookups may share a connection between several threads. */
+  GHashTable *statement_cache;
+  GMutex statement_cache_mutex;
+  guint statement_cache_hits;
+  guint statement_cache_misses;
 };
 
 G_DEFINE_TYPE (EphySQLiteConnection, ephy_sqlite_connection, G_TYPE_OBJECT);
@@ -49,8 +57,12 @@ static GParamSpec *obj_properties[LAST_PROP];
 static void
 ephy_sqlite_connection_finalize (GObject *self)
 {
-  g_free (EPHY_SQLITE_CONNECTION (self)->database_path);
-  ephy_sqlite_connection_close (EPHY_SQLITE_CONNECTION (self));
+  EphySQLiteConnection *connection = EPHY_SQLITE_CONNECTION (self);
+
+  g_free (connection->database_path);
+  ephy_sqlite_connection_close (connection);
+  g_hash_table_unref (connection->statement_cache);
+  g_mutex_clear (&connection->statement_cache_mutex);
   G_OBJECT_CLASS (ephy_sqlite_connection_parent_class)->finalize (self);
 }
 
@@ -105,6 +117,9 @@ static void
 ephy_sqlite_connection_init (EphySQLiteConnection *self)
 {
   self->database = NULL;
+  self->statement_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free, (GDestroyNotify)sqlite3_finalize);
+  g_mutex_init (&self->statement_cache_mutex);
 }
 
 GQuark
@@ -135,16 +150,27 @@ gboolean
 ephy_sqlite_connection_open (EphySQLiteConnection  *self,
                              GError               **error)
 {
+  int flags;
+
   if (self->database) {
     set_error_from_string ("Connection already open.", error);
     return FALSE;
   }
 
-  if (sqlite3_open_v2 (self->database_path,
-                       &self->database,
-                       self->mode == EPHY_SQLITE_CONNECTION_MODE_MEMORY ? SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MEMORY
-                                                                        : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
-                       NULL) != SQLITE_OK) {
+  switch (self->mode) {
+    case EPHY_SQLITE_CONNECTION_MODE_MEMORY:
+      flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MEMORY;
+      break;
+    case EPHY_SQLITE_CONNECTION_MODE_READ_ONLY:
+      flags = SQLITE_OPEN_READONLY;
+      break;
+    case EPHY_SQLITE_CONNECTION_MODE_READWRITE:
+    default:
+      flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+      break;
+  }
+
+  if (sqlite3_open_v2 (self->database_path, &self->database, flags, NULL) != SQLITE_OK) {
     ephy_sqlite_connection_get_error (self, error);
     self->database = NULL;
     return FALSE;
@@ -169,6 +195,10 @@ ephy_sqlite_connection_open (EphySQLiteConnection  *self,
     }
 
     sqlite3_close (init_db);
+  } else if (self->mode == EPHY_SQLITE_CONNECTION_MODE_READ_ONLY) {
+    /* The journal mode is persistent, so a read-only connection to a WAL
+     * database gets concurrent reads without having to set it. */
+    ephy_sqlite_connection_execute (self, "PRAGMA main.cache_size=10000", error);
   } else {
     ephy_sqlite_connection_execute (self, "PRAGMA main.journal_mode=WAL", error);
     ephy_sqlite_connection_execute (self, "PRAGMA main.synchronous=NORMAL", error);
@@ -181,6 +211,12 @@ ephy_sqlite_connection_open (EphySQLiteConnection  *self,
 void
 ephy_sqlite_connection_close (EphySQLiteConnection *self)
 {
+  /* Cached statements must be finalized before closing, or sqlite3_close()
+   * will refuse to release the database handle. */
+  g_mutex_lock (&self->statement_cache_mutex);
+  g_hash_table_remove_all (self->statement_cache);
+  g_mutex_unlock (&self->statement_cache_mutex);
+
   if (self->database) {
     sqlite3_close (self->database);
     self->database = NULL;
@@ -255,6 +291,122 @@ ephy_sqlite_connection_create_statement (EphySQLiteConnection  *self,
                                               NULL));
 }
 
+/**
+ * ephy_sqlite_connection_create_cached_statement:
+ * @self: an #EphySQLiteConnection
+ * @sql: the SQL text of the statement
+ * @error: return location for a #GError
+ *
+ * Like ephy_sqlite_connection_create_statement(), but the underlying prepared
+ * statement is kept around by @self once the returned #EphySQLiteStatement is
+ * finalized, and handed out again (reset, with its bindings cleared) the next
+ * time the same @sql is requested. Use this only for statements with fixed SQL
+ * text that are executed often, so the cache stays small.
+ *
+ * Return value: (transfer full): a new #EphySQLiteStatement, or %NULL on error
+ **/
+EphySQLiteStatement *
+ephy_sqlite_connection_create_cached_statement (EphySQLiteConnection  *self,
+                                                const char            *sql,
+                                                GError               **error)
+{
+  sqlite3_stmt *prepared_statement = NULL;
+  char *key = NULL;
+
+  if (self->database == NULL) {
+    set_error_from_string ("Connection not open.", error);
+    return NULL;
+  }
+
+  g_mutex_lock (&self->statement_cache_mutex);
+  /* Steal the statement, so that nested users of the same SQL text (e.g. a
+   * lookup running while an identical one is still being stepped) get their
+   * own prepared statement instead of resetting one that is in use. */
+  if (g_hash_table_steal_extended (self->statement_cache, sql,
+                                   (gpointer *)&key, (gpointer *)&prepared_statement))
+    self->statement_cache_hits++;
+  else
+    self->statement_cache_misses++;
+  g_mutex_unlock (&self->statement_cache_mutex);
+
+  g_free (key);
+
+  if (prepared_statement == NULL &&
+      sqlite3_prepare_v2 (self->database, sql, -1, &prepared_statement, NULL) != SQLITE_OK) {
+    ephy_sqlite_connection_get_error (self, error);
+    return NULL;
+  }
+
+  return EPHY_SQLITE_STATEMENT (g_object_new (EPHY_TYPE_SQLITE_STATEMENT,
+                                              "prepared-statement", prepared_statement,
+                                              "connection", self,
+                                              "cached", TRUE,
+                                              NULL));
+}
+
+/**
+ * ephy_sqlite_connection_release_cached_statement:
+ * @self: an #EphySQLiteConnection
+ * @prepared_statement: (transfer full): a prepared statement created by
+ *   ephy_sqlite_connection_create_cached_statement()
+ *
+ * Return @prepared_statement to the statement cache of @self. This is called
+ * by #EphySQLiteStatement when it is finalized and should not be needed
+ * anywhere else.
+ **/
+void
+ephy_sqlite_connection_release_cached_statement (EphySQLiteConnection *self,
+                                                 sqlite3_stmt         *prepared_statement)
+{
+  const char *sql = sqlite3_sql (prepared_statement);
+
+  /* The connection may have been closed or reopened since the statement was
+   * handed out, in which case the statement belongs to a stale handle. */
+  if (self->database == NULL || sqlite3_db_handle (prepared_statement) != self->database) {
+    sqlite3_finalize (prepared_statement);
+    return;
+  }
+
+  sqlite3_reset (prepared_statement);
+  sqlite3_clear_bindings (prepared_statement);
+
+  g_mutex_lock (&self->statement_cache_mutex);
+  if (sql && !g_hash_table_contains (self->statement_cache, sql)) {
+    g_hash_table_insert (self->statement_cache, g_strdup (sql), prepared_statement);
+    prepared_statement = NULL;
+  }
+  g_mutex_unlock (&self->statement_cache_mutex);
+
+  /* Another statement with the same SQL text got there first. */
+  if (prepared_statement)
+    sqlite3_finalize (prepared_statement);
+}
+
+/**
+ * ephy_sqlite_connection_get_statement_cache_stats:
+ * @self: an #EphySQLiteConnection
+ * @hits: (out) (optional): return location for the number of cache hits
+ * @misses: (out) (optional): return location for the number of cache misses
+ *
+ * Retrieve how many calls to ephy_sqlite_connection_create_cached_statement()
+ * were served from the statement cache and how many had to prepare a new
+ * statement.
+ **/
+void
+ephy_sqlite_connection_get_statement_cache_stats (EphySQLiteConnection *self,
+                                                  guint                *hits,
+                                                  guint                *misses)
+{
+  g_assert (EPHY_IS_SQLITE_CONNECTION (self));
+
+  g_mutex_lock (&self->statement_cache_mutex);
+  if (hits)
+    *hits = self->statement_cache_hits;
+  if (misses)
+    *misses = self->statement_cache_misses;
+  g_mutex_unlock (&self->statement_cache_mutex);
+}
+
 gint64
 ephy_sqlite_connection_get_last_insert_id (EphySQLiteConnection *self)
 {
@@ -289,6 +441,13 @@ ephy_sqlite_connection_commit_transaction (EphySQLiteConnection  *self,
   return ephy_sqlite_connection_execute (self, "COMMIT", error);
 }
 
+gboolean
+ephy_sqlite_connection_rollback_transaction (EphySQLiteConnection  *self,
+                                             GError               **error)
+{
+  return ephy_sqlite_connection_execute (self, "ROLLBACK", error);
+}
+
 gboolean
 ephy_sqlite_connection_table_exists (EphySQLiteConnection *self,
                                      const char           *table_name)
@@ -296,8 +455,8 @@ ephy_sqlite_connection_table_exists (EphySQLiteConnection *self,
   GError *error = NULL;
   gboolean table_exists = FALSE;
 
-  EphySQLiteStatement *statement = ephy_sqlite_connection_create_statement (self,
-                                                                            "SELECT COUNT(type) FROM sqlite_master WHERE type='table' and name=?", &error);
+  EphySQLiteStatement *statement = ephy_sqlite_connection_create_cached_statement (self,
+                                                                                   "SELECT COUNT(type) FROM sqlite_master WHERE type='table' and name=?", &error);
   if (error) {
     g_warning ("Could not detect table existence: %s", error->message);
     g_error_free (error);
@@ -33,7 +33,8 @@ G_DECLARE_FINAL_TYPE (EphySQLiteConnection, ephy_sqlite_connection, EPHY, SQLITE
 
 typedef enum {
   EPHY_SQLITE_CONNECTION_MODE_MEMORY,
-  EPHY_SQLITE_CONNECTION_MODE_READWRITE
+  EPHY_SQLITE_CONNECTION_MODE_READWRITE,
+  EPHY_SQLITE_CONNECTION_MODE_READ_ONLY
 } EphySQLiteConnectionMode;
 
 EphySQLiteConnection *  ephy_sqlite_connection_new                     (EphySQLiteConnectionMode  mode, const char *database_path);
@@ -46,11 +47,15 @@ void                    ephy_sqlite_connection_get_error               (EphySQLi
 
 gboolean                ephy_sqlite_connection_execute                 (EphySQLiteConnection *self, const char *sql, GError **error);
 EphySQLiteStatement *   ephy_sqlite_connection_create_statement        (EphySQLiteConnection *self, const char *sql, GError **error);
+EphySQLiteStatement *   ephy_sqlite_connection_create_cached_statement (EphySQLiteConnection *self, const char *sql, GError **error);
+void                    ephy_sqlite_connection_release_cached_statement (EphySQLiteConnection *self, sqlite3_stmt *prepared_statement);
+void                    ephy_sqlite_connection_get_statement_cache_stats (EphySQLiteConnection *self, guint *hits, guint *misses);
 gint64                  ephy_sqlite_connection_get_last_insert_id      (EphySQLiteConnection *self);
 void                    ephy_sqlite_connection_enable_foreign_keys     (EphySQLiteConnection *self);
 
 gboolean                ephy_sqlite_connection_begin_transaction       (EphySQLiteConnection *self, GError **error);
 gboolean                ephy_sqlite_connection_commit_transaction      (EphySQLiteConnection *self, GError **error);
+gboolean                ephy_sqlite_connection_rollback_transaction    (EphySQLiteConnection *self, GError **error);
 
 gboolean                ephy_sqlite_connection_table_exists            (EphySQLiteConnection *self, const char *table_name);
 
@@ -28,6 +28,7 @@ enum {
   PROP_0,
   PROP_PREPARED_STATEMENT,
   PROP_CONNECTION,
+  PROP_CACHED,
   LAST_PROP
 };
 
@@ -37,6 +38,7 @@ struct _EphySQLiteStatement {
   GObject parent_instance;
   sqlite3_stmt *prepared_statement;
   EphySQLiteConnection *connection;
+  gboolean cached;
 };
 
 G_DEFINE_TYPE (EphySQLiteStatement, ephy_sqlite_statement, G_TYPE_OBJECT);
@@ -56,6 +58,9 @@ ephy_sqlite_statement_set_property (GObject      *object,
     case PROP_CONNECTION:
       self->connection = EPHY_SQLITE_CONNECTION (g_object_ref (g_value_get_object (value)));
       break;
+    case PROP_CACHED:
+      self->cached = g_value_get_boolean (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (self, property_id, pspec);
       break;
@@ -68,7 +73,10 @@ ephy_sqlite_statement_finalize (GObject *object)
   EphySQLiteStatement *self = EPHY_SQLITE_STATEMENT (object);
 
   if (self->prepared_statement) {
-    sqlite3_finalize (self->prepared_statement);
+    if (self->cached && self->connection)
+      ephy_sqlite_connection_release_cached_statement (self->connection, self->prepared_statement);
+    else
+      sqlite3_finalize (self->prepared_statement);
     self->prepared_statement = NULL;
   }
 
@@ -100,6 +108,13 @@ ephy_sqlite_statement_class_init (EphySQLiteStatementClass *klass)
                          EPHY_TYPE_SQLITE_CONNECTION,
                          G_PARAM_CONSTRUCT_ONLY | G_PARAM_WRITABLE | G_PARAM_STATIC_STRINGS);
 
+  obj_properties[PROP_CACHED] =
+    g_param_spec_boolean ("cached",
+                          "Cached",
+                          "Whether the prepared statement is returned to the connection's statement cache",
+                          FALSE,
+                          G_PARAM_CONSTRUCT_ONLY | G_PARAM_WRITABLE | G_PARAM_STATIC_STRINGS);
+
   g_object_class_install_properties (gobject_class, LAST_PROP, obj_properties);
 }
 
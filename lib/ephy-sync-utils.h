@@ -37,6 +37,14 @@ const SecretSchema *ephy_sync_utils_get_secret_schema (void) G_GNUC_CONST;
 #define EPHY_SYNC_BATCH_SIZE    80
 #define EPHY_SYNC_MAX_BATCHES   80
 
+/* The number of records to download from a collection at once. */
+#define EPHY_SYNC_DOWNLOAD_PAGE_SIZE 1000
+/* The number of downloaded records to decrypt in a row on one thread. */
+#define EPHY_SYNC_DECRYPT_BATCH_SIZE 100
+/* The number of downloaded pages of a collection that can wait to be decrypted
+ * before the next one is downloaded. */
+#define EPHY_SYNC_MAX_PENDING_PAGES 2
+
 char     *ephy_sync_utils_encode_hex                    (const guint8 *data,
                                                          gsize         data_len);
 guint8   *ephy_sync_utils_decode_hex                    (const char   *hex);
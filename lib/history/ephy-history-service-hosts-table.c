@@ -25,6 +25,118 @@
 #include "ephy-string.h"
 #include <glib/gi18n.h>
 
+/* How many host rows the history thread keeps around. A page load usually
+ * needs the same host several times: for the visit, its subresources and
+ * zoom level changes. */
+#define HOST_CACHE_SIZE 256
+
+static void
+host_cache_remove_link (EphyHistoryService *self,
+                        GList              *link)
+{
+  EphyHistoryHost *host = link->data;
+
+  g_hash_table_remove (self->host_cache, GINT_TO_POINTER (host->id));
+  g_queue_unlink (&self->host_cache_lru, link);
+  ephy_history_host_free (host);
+  g_list_free_1 (link);
+}
+
+static EphyHistoryHost *
+host_cache_lookup (EphyHistoryService *self,
+                   const char         *key)
+{
+  gpointer id;
+  GList *link;
+
+  if (!g_hash_table_lookup_extended (self->host_cache_keys, key, NULL, &id))
+    return NULL;
+
+  link = g_hash_table_lookup (self->host_cache, id);
+  if (link == NULL) {
+    /* The row was evicted or deleted since. */
+    g_hash_table_remove (self->host_cache_keys, key);
+    return NULL;
+  }
+
+  g_queue_unlink (&self->host_cache_lru, link);
+  g_queue_push_head_link (&self->host_cache_lru, link);
+
+  return link->data;
+}
+
+/* Refreshes the cached copy of @host, if any. */
+static GList *
+host_cache_update (EphyHistoryService *self,
+                   EphyHistoryHost    *host)
+{
+  GList *link;
+
+  link = g_hash_table_lookup (self->host_cache, GINT_TO_POINTER (host->id));
+  if (link != NULL) {
+    ephy_history_host_free (link->data);
+    link->data = ephy_history_host_copy (host);
+  }
+
+  return link;
+}
+
+static gboolean
+host_key_is_stale (gpointer key,
+                   gpointer id,
+                   gpointer user_data)
+{
+  EphyHistoryService *self = user_data;
+
+  return !g_hash_table_contains (self->host_cache, id);
+}
+
+static void
+host_cache_insert (EphyHistoryService *self,
+                   const char         *key,
+                   EphyHistoryHost    *host)
+{
+  GList *link;
+
+  link = host_cache_update (self, host);
+  if (link != NULL) {
+    g_queue_unlink (&self->host_cache_lru, link);
+  } else {
+    link = g_list_alloc ();
+    link->data = ephy_history_host_copy (host);
+    g_hash_table_insert (self->host_cache, GINT_TO_POINTER (host->id), link);
+  }
+  g_queue_push_head_link (&self->host_cache_lru, link);
+
+  if (self->host_cache_lru.length > HOST_CACHE_SIZE)
+    host_cache_remove_link (self, self->host_cache_lru.tail);
+
+  /* Several keys may map to the same row, e.g. http and https. */
+  g_hash_table_replace (self->host_cache_keys, g_strdup (key), GINT_TO_POINTER (host->id));
+  if (g_hash_table_size (self->host_cache_keys) > 4 * HOST_CACHE_SIZE)
+    g_hash_table_foreach_remove (self->host_cache_keys, host_key_is_stale, self);
+}
+
+/**
+ * ephy_history_service_clear_host_cache:
+ * @self: an #EphyHistoryService
+ *
+ * Forget all the host rows cached by
+ * ephy_history_service_get_host_row_from_url(). Needed whenever hosts are
+ * deleted or changed behind the back of the functions in this file.
+ **/
+void
+ephy_history_service_clear_host_cache (EphyHistoryService *self)
+{
+  g_assert (self->history_thread == g_thread_self ());
+
+  g_hash_table_remove_all (self->host_cache);
+  g_hash_table_remove_all (self->host_cache_keys);
+  g_queue_clear_full (&self->host_cache_lru, (GDestroyNotify)ephy_history_host_free);
+
+  ephy_history_service_invalidate_zoom_levels (self);
+}
+
 gboolean
 ephy_history_service_initialize_hosts_table (EphyHistoryService *self)
 {
@@ -59,9 +171,9 @@ ephy_history_service_add_host_row (EphyHistoryService *self,
   g_assert (self->history_thread == g_thread_self ());
   g_assert (self->history_database != NULL);
 
-  statement = ephy_sqlite_connection_create_statement (self->history_database,
-                                                       "INSERT INTO hosts (url, title, visit_count, zoom_level) "
-                                                       "VALUES (?, ?, ?, ?)", &error);
+  statement = ephy_sqlite_connection_create_cached_statement (self->history_database,
+                                                              "INSERT INTO hosts (url, title, visit_count, zoom_level) "
+                                                              "VALUES (?, ?, ?, ?)", &error);
 
   if (error) {
     g_warning ("Could not build hosts table addition statement: %s", error->message);
@@ -101,9 +213,9 @@ ephy_history_service_update_host_row (EphyHistoryService *self,
   g_assert (self->history_thread == g_thread_self ());
   g_assert (self->history_database != NULL);
 
-  statement = ephy_sqlite_connection_create_statement (self->history_database,
-                                                       "UPDATE hosts SET url=?, title=?, visit_count=?, zoom_level=?"
-                                                       "WHERE id=?", &error);
+  statement = ephy_sqlite_connection_create_cached_statement (self->history_database,
+                                                              "UPDATE hosts SET url=?, title=?, visit_count=?, zoom_level=?"
+                                                              "WHERE id=?", &error);
   if (error) {
     g_warning ("Could not build hosts table modification statement: %s", error->message);
     g_error_free (error);
@@ -127,6 +239,8 @@ ephy_history_service_update_host_row (EphyHistoryService *self,
   if (error) {
     g_warning ("Could not modify URL in urls table: %s", error->message);
     g_error_free (error);
+  } else {
+    host_cache_update (self, host);
   }
   g_object_unref (statement);
 }
@@ -136,11 +250,12 @@ ephy_history_service_get_host_row (EphyHistoryService *self,
                                    const gchar        *host_string,
                                    EphyHistoryHost    *host)
 {
+  EphySQLiteConnection *database;
   EphySQLiteStatement *statement = NULL;
   GError *error = NULL;
 
-  g_assert (self->history_thread == g_thread_self ());
-  g_assert (self->history_database != NULL);
+  database = ephy_history_service_get_database (self);
+  g_assert (database != NULL);
 
   if (host_string == NULL && host != NULL)
     host_string = host->url;
@@ -148,13 +263,13 @@ ephy_history_service_get_host_row (EphyHistoryService *self,
   g_assert (host_string || (host != NULL && host->id != -1));
 
   if (host != NULL && host->id != -1) {
-    statement = ephy_sqlite_connection_create_statement (self->history_database,
-                                                         "SELECT id, url, title, visit_count, zoom_level FROM hosts "
-                                                         "WHERE id=?", &error);
+    statement = ephy_sqlite_connection_create_cached_statement (database,
+                                                                "SELECT id, url, title, visit_count, zoom_level FROM hosts "
+                                                                "WHERE id=?", &error);
   } else {
-    statement = ephy_sqlite_connection_create_statement (self->history_database,
-                                                         "SELECT id, url, title, visit_count, zoom_level FROM hosts "
-                                                         "WHERE url=?", &error);
+    statement = ephy_sqlite_connection_create_cached_statement (database,
+                                                                "SELECT id, url, title, visit_count, zoom_level FROM hosts "
+                                                                "WHERE url=?", &error);
   }
 
   if (error) {
@@ -217,15 +332,16 @@ create_host_from_statement (EphySQLiteStatement *statement)
 GList *
 ephy_history_service_get_all_hosts (EphyHistoryService *self)
 {
+  EphySQLiteConnection *database;
   EphySQLiteStatement *statement = NULL;
   GList *hosts = NULL;
   GError *error = NULL;
 
-  g_assert (self->history_thread == g_thread_self ());
-  g_assert (self->history_database != NULL);
+  database = ephy_history_service_get_database (self);
+  g_assert (database != NULL);
 
-  statement = ephy_sqlite_connection_create_statement (self->history_database,
-                                                       "SELECT id, url, title, visit_count, zoom_level FROM hosts", &error);
+  statement = ephy_sqlite_connection_create_cached_statement (database,
+                                                              "SELECT id, url, title, visit_count, zoom_level FROM hosts", &error);
 
   if (error) {
     g_warning ("Could not build hosts query statement: %s", error->message);
@@ -251,6 +367,7 @@ GList *
 ephy_history_service_find_host_rows (EphyHistoryService *self,
                                      EphyHistoryQuery   *query)
 {
+  EphySQLiteConnection *database;
   EphySQLiteStatement *statement = NULL;
   GList *substring;
   GString *statement_str;
@@ -268,8 +385,8 @@ ephy_history_service_find_host_rows (EphyHistoryService *self,
 
   int i = 0;
 
-  g_assert (self->history_thread == g_thread_self ());
-  g_assert (self->history_database != NULL);
+  database = ephy_history_service_get_database (self);
+  g_assert (database != NULL);
 
   statement_str = g_string_new (base_statement);
 
@@ -294,7 +411,7 @@ ephy_history_service_find_host_rows (EphyHistoryService *self,
 
   statement_str = g_string_append (statement_str, "1 ");
 
-  statement = ephy_sqlite_connection_create_statement (self->history_database,
+  statement = ephy_sqlite_connection_create_statement (database,
                                                        statement_str->str, &error);
   g_string_free (statement_str, TRUE);
 
@@ -400,6 +517,32 @@ get_hostname_and_locations (const gchar  *url,
   return host_locations;
 }
 
+/**
+ * ephy_history_host_key_for_url:
+ * @url: a URL
+ *
+ * ephy_history_service_get_host_row_from_url() only looks at the scheme and
+ * the host name of a URL, except for local files. URLs with the same key map
+ * to the same host row, so it only needs to be looked up once for all of them.
+ *
+ * Return value: (transfer full): the key of the host of @url
+ **/
+char *
+ephy_history_host_key_for_url (const char *url)
+{
+  g_autofree char *scheme = g_uri_parse_scheme (url);
+  g_autofree char *hostname = NULL;
+
+  if (scheme != NULL && strcmp (scheme, "file") == 0)
+    return g_strdup (url);
+
+  hostname = ephy_string_get_host_name (url);
+  if (scheme == NULL || hostname == NULL)
+    return g_strdup ("about:blank");
+
+  return g_strconcat (scheme, "://", hostname, "/", NULL);
+}
+
 EphyHistoryHost *
 ephy_history_service_get_host_row_from_url (EphyHistoryService *self,
                                             const gchar        *url)
@@ -407,6 +550,19 @@ ephy_history_service_get_host_row_from_url (EphyHistoryService *self,
   GList *host_locations, *l;
   char *hostname;
   EphyHistoryHost *host = NULL;
+  g_autofree char *key = NULL;
+  gboolean use_cache = !ephy_history_service_is_reader_thread (self);
+
+  /* Only the history thread writes hosts, so only its cache is coherent. */
+  if (use_cache) {
+    key = ephy_history_host_key_for_url (url);
+    host = host_cache_lookup (self, key);
+    if (host != NULL) {
+      self->host_cache_hits++;
+      return ephy_history_host_copy (host);
+    }
+    self->host_cache_misses++;
+  }
 
   host_locations = get_hostname_and_locations (url, &hostname);
   g_assert (host_locations != NULL && hostname != NULL);
@@ -419,9 +575,15 @@ ephy_history_service_get_host_row_from_url (EphyHistoryService *self,
 
   if (host == NULL) {
     host = ephy_history_host_new (host_locations->data, hostname, 0, 0.0);
-    ephy_history_service_add_host_row (self, host);
+    /* Readers can't write. The host row is created by the first visit anyway,
+     * so hand out an unsaved host in the meantime. */
+    if (!ephy_history_service_is_reader_thread (self))
+      ephy_history_service_add_host_row (self, host);
   }
 
+  if (use_cache && host->id != -1)
+    host_cache_insert (self, key, host);
+
   g_free (hostname);
   g_list_free_full (host_locations, (GDestroyNotify)g_free);
 
@@ -446,8 +608,8 @@ ephy_history_service_delete_host_row (EphyHistoryService *self,
   else
     sql_statement = "DELETE FROM hosts WHERE url=?";
 
-  statement = ephy_sqlite_connection_create_statement (self->history_database,
-                                                       sql_statement, &error);
+  statement = ephy_sqlite_connection_create_cached_statement (self->history_database,
+                                                              sql_statement, &error);
 
   if (error) {
     g_warning ("Could not build urls table query statement: %s", error->message);
@@ -473,6 +635,15 @@ ephy_history_service_delete_host_row (EphyHistoryService *self,
     g_error_free (error);
   }
   g_object_unref (statement);
+
+  if (host->id != -1) {
+    GList *link = g_hash_table_lookup (self->host_cache, GINT_TO_POINTER (host->id));
+    if (link != NULL)
+      host_cache_remove_link (self, link);
+    ephy_history_service_invalidate_zoom_levels (self);
+  } else {
+    ephy_history_service_clear_host_cache (self);
+  }
 }
 
 void
@@ -497,4 +668,6 @@ ephy_history_service_delete_orphan_hosts (EphyHistoryService *self)
     g_warning ("Couldn't remove orphan hosts from database: %s", error->message);
     g_error_free (error);
   }
+
+  ephy_history_service_clear_host_cache (self);
 }
@@ -0,0 +1,379 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2; -*- */
+/*
+ *  Copyright © 2021 Epiphany Developers
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "ephy-debug.h"
+#include "ephy-history-service.h"
+#include "ephy-history-service-private.h"
+#include "ephy-sync-utils.h"
+
+#include <math.h>
+
+/* SQLite allows 999 parameters per statement unless built otherwise, and the
+ * widest row below has seven. */
+#define MAX_ROWS_PER_STATEMENT 128
+
+/* All the imported visits to one URL. */
+typedef struct {
+  const char *url;
+  const char *title;
+  char *sync_id;
+  EphyHistoryHost *host;
+  int id;
+  int visit_count;
+  gint64 last_visit_time;
+  double frecency;
+} ImportedURL;
+
+static void
+imported_url_free (ImportedURL *url)
+{
+  g_free (url->sync_id);
+  g_free (url);
+}
+
+static EphySQLiteStatement *
+create_multi_row_statement (EphyHistoryService  *self,
+                            const char          *prefix,
+                            const char          *row,
+                            const char          *suffix,
+                            guint                num_rows,
+                            GError             **error)
+{
+  g_autoptr (GString) sql = g_string_new (prefix);
+
+  for (guint i = 0; i < num_rows; i++) {
+    if (i > 0)
+      g_string_append (sql, ", ");
+    g_string_append (sql, row);
+  }
+  g_string_append (sql, suffix);
+
+  /* Only full chunks repeat, don't let the remainders pile up in the cache. */
+  if (num_rows == MAX_ROWS_PER_STATEMENT)
+    return ephy_sqlite_connection_create_cached_statement (self->history_database, sql->str, error);
+  return ephy_sqlite_connection_create_statement (self->history_database, sql->str, error);
+}
+
+/* Look up the rows of @urls that already exist. With @merge, the stored
+ * visits are folded into the imported ones so that the rows can be
+ * overwritten with the totals. */
+static gboolean
+lookup_url_rows (EphyHistoryService  *self,
+                 GPtrArray           *urls,
+                 GHashTable          *imported_urls,
+                 gboolean             merge,
+                 GError             **error)
+{
+  for (guint i = 0; i < urls->len; i += MAX_ROWS_PER_STATEMENT) {
+    guint num_rows = MIN (MAX_ROWS_PER_STATEMENT, urls->len - i);
+    EphySQLiteStatement *statement;
+
+    statement = create_multi_row_statement (self,
+                                            "SELECT id, url, visit_count, last_visit_time, sync_id, frecency "
+                                            "FROM urls WHERE url IN (", "?", ")",
+                                            num_rows, error);
+    if (!statement)
+      return FALSE;
+
+    for (guint j = 0; j < num_rows; j++) {
+      ImportedURL *url = g_ptr_array_index (urls, i + j);
+
+      if (!ephy_sqlite_statement_bind_string (statement, j, url->url, error)) {
+        g_object_unref (statement);
+        return FALSE;
+      }
+    }
+
+    while (ephy_sqlite_statement_step (statement, error)) {
+      ImportedURL *url = g_hash_table_lookup (imported_urls, ephy_sqlite_statement_get_column_as_string (statement, 1));
+      const char *sync_id;
+
+      /* Old profiles may store a URL more than once. Like
+       * ephy_history_service_get_url_row(), use the first row. */
+      if (!url || url->id != -1)
+        continue;
+
+      url->id = ephy_sqlite_statement_get_column_as_int (statement, 0);
+      if (!merge)
+        continue;
+
+      url->visit_count += ephy_sqlite_statement_get_column_as_int (statement, 2);
+      url->last_visit_time = MAX (url->last_visit_time, ephy_sqlite_statement_get_column_as_int64 (statement, 3));
+
+      sync_id = ephy_sqlite_statement_get_column_as_string (statement, 4);
+      if (sync_id) {
+        g_free (url->sync_id);
+        url->sync_id = g_strdup (sync_id);
+      }
+
+      if (ephy_sqlite_statement_get_column_type (statement, 5) != EPHY_SQLITE_COLUMN_TYPE_NULL)
+        url->frecency = ephy_history_frecency_sum (url->frecency,
+                                                   ephy_sqlite_statement_get_column_as_double (statement, 5));
+    }
+
+    g_object_unref (statement);
+
+    if (error && *error)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+update_url_rows (EphyHistoryService  *self,
+                 GPtrArray           *urls,
+                 GError             **error)
+{
+  for (guint i = 0; i < urls->len; i++) {
+    ImportedURL *url = g_ptr_array_index (urls, i);
+    EphySQLiteStatement *statement;
+
+    statement = ephy_sqlite_connection_create_cached_statement (self->history_database,
+                                                                "UPDATE urls SET visit_count=?, last_visit_time=?, sync_id=?, frecency=? "
+                                                                "WHERE id=?", error);
+    if (!statement)
+      return FALSE;
+
+    if (ephy_sqlite_statement_bind_int (statement, 0, url->visit_count, error) &&
+        ephy_sqlite_statement_bind_int64 (statement, 1, url->last_visit_time, error) &&
+        ephy_sqlite_statement_bind_string (statement, 2, url->sync_id, error) &&
+        ephy_sqlite_statement_bind_double (statement, 3, url->frecency, error) &&
+        ephy_sqlite_statement_bind_int (statement, 4, url->id, error))
+      ephy_sqlite_statement_step (statement, error);
+
+    g_object_unref (statement);
+
+    if (error && *error)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+insert_url_rows (EphyHistoryService  *self,
+                 GPtrArray           *urls,
+                 GError             **error)
+{
+  for (guint i = 0; i < urls->len; i += MAX_ROWS_PER_STATEMENT) {
+    guint num_rows = MIN (MAX_ROWS_PER_STATEMENT, urls->len - i);
+    EphySQLiteStatement *statement;
+    int column = 0;
+
+    statement = create_multi_row_statement (self,
+                                            "INSERT INTO urls (url, title, visit_count, typed_count, last_visit_time, host, sync_id, frecency) VALUES ",
+                                            "(?, ?, ?, 0, ?, ?, ?, ?)", "",
+                                            num_rows, error);
+    if (!statement)
+      return FALSE;
+
+    for (guint j = 0; j < num_rows; j++) {
+      ImportedURL *url = g_ptr_array_index (urls, i + j);
+
+      if (!ephy_sqlite_statement_bind_string (statement, column++, url->url, error) ||
+          !ephy_sqlite_statement_bind_string (statement, column++, url->title, error) ||
+          !ephy_sqlite_statement_bind_int (statement, column++, url->visit_count, error) ||
+          !ephy_sqlite_statement_bind_int64 (statement, column++, url->last_visit_time, error) ||
+          !ephy_sqlite_statement_bind_int (statement, column++, url->host->id, error) ||
+          !ephy_sqlite_statement_bind_string (statement, column++, url->sync_id, error) ||
+          !ephy_sqlite_statement_bind_double (statement, column++, url->frecency, error))
+        break;
+    }
+
+    if (!(error && *error))
+      ephy_sqlite_statement_step (statement, error);
+
+    g_object_unref (statement);
+
+    if (error && *error)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+insert_visit_rows (EphyHistoryService  *self,
+                   GPtrArray           *visits,
+                   GHashTable          *imported_urls,
+                   GError             **error)
+{
+  for (guint i = 0; i < visits->len; i += MAX_ROWS_PER_STATEMENT) {
+    guint num_rows = MIN (MAX_ROWS_PER_STATEMENT, visits->len - i);
+    EphySQLiteStatement *statement;
+    int column = 0;
+
+    statement = create_multi_row_statement (self,
+                                            "INSERT INTO visits (url, visit_time, visit_type) VALUES ",
+                                            "(?, ?, ?)", "",
+                                            num_rows, error);
+    if (!statement)
+      return FALSE;
+
+    for (guint j = 0; j < num_rows; j++) {
+      EphyHistoryPageVisit *visit = g_ptr_array_index (visits, i + j);
+      ImportedURL *url = g_hash_table_lookup (imported_urls, visit->url->url);
+
+      if (!ephy_sqlite_statement_bind_int (statement, column++, url->id, error) ||
+          !ephy_sqlite_statement_bind_int64 (statement, column++, visit->visit_time, error) ||
+          !ephy_sqlite_statement_bind_int (statement, column++, visit->visit_type, error))
+        break;
+    }
+
+    if (!(error && *error))
+      ephy_sqlite_statement_step (statement, error);
+
+    g_object_unref (statement);
+
+    if (error && *error)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * ephy_history_service_import_visit_rows:
+ * @self: an #EphyHistoryService
+ * @visits: (element-type EphyHistoryPageVisit): the visits to store
+ *
+ * Store many visits at once. Each host is resolved once however many
+ * visits it has, and the urls and visits rows are written with a few
+ * multi-row statements instead of one round trip per visit. Must run
+ * inside a transaction. On error, none of the visits are stored.
+ *
+ * Return value: %TRUE if all the visits were stored
+ **/
+gboolean
+ephy_history_service_import_visit_rows (EphyHistoryService *self,
+                                        GPtrArray          *visits)
+{
+  g_autoptr (GHashTable) hosts = NULL;
+  g_autoptr (GHashTable) imported_urls = NULL;
+  g_autoptr (GPtrArray) urls = NULL;
+  g_autoptr (GPtrArray) existing_urls = NULL;
+  g_autoptr (GPtrArray) new_urls = NULL;
+  g_autoptr (GPtrArray) valid_visits = NULL;
+  GHashTableIter iter;
+  gpointer value;
+  GError *error = NULL;
+  gint64 start_time = g_get_monotonic_time ();
+
+  g_assert (self->history_thread == g_thread_self ());
+  g_assert (self->history_database != NULL);
+
+  if (self->in_memory)
+    return TRUE;
+
+  /* Undo a partial import without undoing the rest of the transaction. */
+  if (!ephy_sqlite_connection_execute (self->history_database, "SAVEPOINT import_visits", &error))
+    goto out;
+
+  hosts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)ephy_history_host_free);
+  imported_urls = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify)imported_url_free);
+  urls = g_ptr_array_new ();
+  existing_urls = g_ptr_array_new ();
+  new_urls = g_ptr_array_new ();
+  valid_visits = g_ptr_array_new ();
+
+  for (guint i = 0; i < visits->len; i++) {
+    EphyHistoryPageVisit *visit = g_ptr_array_index (visits, i);
+    ImportedURL *url;
+
+    if (!visit->url->url)
+      continue;
+
+    url = g_hash_table_lookup (imported_urls, visit->url->url);
+    if (!url) {
+      g_autofree char *host_key = ephy_history_host_key_for_url (visit->url->url);
+      EphyHistoryHost *host = g_hash_table_lookup (hosts, host_key);
+
+      if (!host) {
+        host = ephy_history_service_get_host_row_from_url (self, visit->url->url);
+        g_hash_table_insert (hosts, g_steal_pointer (&host_key), host);
+      }
+
+      url = g_new0 (ImportedURL, 1);
+      url->url = visit->url->url;
+      url->host = host;
+      url->id = -1;
+      url->frecency = -INFINITY;
+      g_hash_table_insert (imported_urls, (gpointer)url->url, url);
+      g_ptr_array_add (urls, url);
+    }
+
+    if (visit->url->title)
+      url->title = visit->url->title;
+    if (!url->sync_id && visit->url->sync_id)
+      url->sync_id = g_strdup (visit->url->sync_id);
+    url->visit_count++;
+    url->last_visit_time = MAX (url->last_visit_time, visit->visit_time);
+    url->frecency = ephy_history_frecency_add_visit (url->frecency, visit->visit_time, visit->visit_type);
+    if (url->host->visit_count == 0 && url->host->zoom_level != 0.0)
+      ephy_history_service_invalidate_zoom_levels (self);
+    url->host->visit_count++;
+
+    g_ptr_array_add (valid_visits, visit);
+  }
+
+  g_hash_table_iter_init (&iter, hosts);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    ephy_history_service_update_host_row (self, value);
+
+  if (!lookup_url_rows (self, urls, imported_urls, TRUE, &error))
+    goto out;
+
+  for (guint i = 0; i < urls->len; i++) {
+    ImportedURL *url = g_ptr_array_index (urls, i);
+
+    if (!url->sync_id)
+      url->sync_id = ephy_sync_utils_get_random_sync_id ();
+
+    g_ptr_array_add (url->id == -1 ? new_urls : existing_urls, url);
+  }
+
+  if (!update_url_rows (self, existing_urls, &error) ||
+      !insert_url_rows (self, new_urls, &error) ||
+      !lookup_url_rows (self, new_urls, imported_urls, FALSE, &error) ||
+      !insert_visit_rows (self, valid_visits, imported_urls, &error) ||
+      !ephy_sqlite_connection_execute (self->history_database, "RELEASE import_visits", &error))
+    goto out;
+
+  LOG ("Imported %u visits to %u URLs on %u hosts in %" G_GINT64_FORMAT " ms",
+       valid_visits->len, urls->len, g_hash_table_size (hosts),
+       (g_get_monotonic_time () - start_time) / 1000);
+
+out:
+  if (error) {
+    g_warning ("Could not import history visits: %s", error->message);
+    g_error_free (error);
+
+    ephy_sqlite_connection_execute (self->history_database, "ROLLBACK TO import_visits", NULL);
+    ephy_sqlite_connection_execute (self->history_database, "RELEASE import_visits", NULL);
+    /* The cache may hold host rows that were just rolled back. */
+    ephy_history_service_clear_host_cache (self);
+    return FALSE;
+  }
+
+  return TRUE;
+}
@@ -0,0 +1,247 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2; -*- */
+/*
+ *  Copyright © 2021 Epiphany Developers
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "ephy-debug.h"
+#include "ephy-history-service.h"
+#include "ephy-history-service-private.h"
+
+/* How many old visits to look at per statement. */
+#define ROLL_UP_BATCH_SIZE 500
+
+/* How many free pages to give back to the file system per statement. */
+#define VACUUM_BATCH_SIZE 256
+
+/* The urls table already keeps the aggregates of all the visits to a URL:
+ * visit_count, last_visit_time and frecency. Visits older than the horizon
+ * are therefore only dropped, except for the most recent one of each URL, so
+ * that queries by time range still find the URL.
+ *
+ * Returns TRUE if there may be more visits to roll up.
+ */
+static gboolean
+roll_up_visits (EphyHistoryService  *self,
+                gint64               horizon,
+                GError             **error)
+{
+  EphySQLiteStatement *statement;
+  gint64 batch_end_time = 0;
+  int batch_end_id = -1;
+  int num_rows = 0;
+
+  /* Find where this batch ends, so that both statements cover the same
+   * visits no matter how many of them are deleted. */
+  statement = ephy_sqlite_connection_create_cached_statement (self->history_database,
+                                                              "SELECT visit_time, id FROM visits "
+                                                              "WHERE visit_time < ? AND (visit_time, id) > (?, ?) "
+                                                              "ORDER BY visit_time, id LIMIT ?", error);
+  if (!statement)
+    return FALSE;
+
+  if (ephy_sqlite_statement_bind_int64 (statement, 0, horizon, error) &&
+      ephy_sqlite_statement_bind_int64 (statement, 1, self->maintenance_cursor_time, error) &&
+      ephy_sqlite_statement_bind_int (statement, 2, self->maintenance_cursor_id, error) &&
+      ephy_sqlite_statement_bind_int (statement, 3, ROLL_UP_BATCH_SIZE, error)) {
+    while (ephy_sqlite_statement_step (statement, error)) {
+      batch_end_time = ephy_sqlite_statement_get_column_as_int64 (statement, 0);
+      batch_end_id = ephy_sqlite_statement_get_column_as_int (statement, 1);
+      num_rows++;
+    }
+  }
+  g_object_unref (statement);
+
+  if ((error && *error) || num_rows == 0)
+    return FALSE;
+
+  statement = ephy_sqlite_connection_create_cached_statement (self->history_database,
+                                                              "DELETE FROM visits "
+                                                              "WHERE (visit_time, id) > (?, ?) AND (visit_time, id) <= (?, ?) "
+                                                              "AND EXISTS (SELECT 1 FROM visits AS newer WHERE newer.url = visits.url "
+                                                              "AND (newer.visit_time, newer.id) > (visits.visit_time, visits.id))", error);
+  if (!statement)
+    return FALSE;
+
+  if (ephy_sqlite_statement_bind_int64 (statement, 0, self->maintenance_cursor_time, error) &&
+      ephy_sqlite_statement_bind_int (statement, 1, self->maintenance_cursor_id, error) &&
+      ephy_sqlite_statement_bind_int64 (statement, 2, batch_end_time, error) &&
+      ephy_sqlite_statement_bind_int (statement, 3, batch_end_id, error))
+    ephy_sqlite_statement_step (statement, error);
+  g_object_unref (statement);
+
+  if (error && *error)
+    return FALSE;
+
+  self->maintenance_cursor_time = batch_end_time;
+  self->maintenance_cursor_id = batch_end_id;
+
+  return num_rows == ROLL_UP_BATCH_SIZE;
+}
+
+static int
+get_pragma_value (EphyHistoryService  *self,
+                  const char          *sql,
+                  GError             **error)
+{
+  EphySQLiteStatement *statement;
+  int value = -1;
+
+  statement = ephy_sqlite_connection_create_statement (self->history_database, sql, error);
+  if (!statement)
+    return -1;
+
+  if (ephy_sqlite_statement_step (statement, error))
+    value = ephy_sqlite_statement_get_column_as_int (statement, 0);
+  g_object_unref (statement);
+
+  return value;
+}
+
+/* Returns TRUE if there may be more free pages to release. */
+static gboolean
+vacuum (EphyHistoryService  *self,
+        GError             **error)
+{
+  g_autofree char *sql = NULL;
+  int free_pages;
+
+  /* Incremental vacuum needs auto_vacuum, which new databases get when they
+   * are created. Older ones are only switched on request, see
+   * ephy_history_service_enable_incremental_vacuum(). */
+  if (get_pragma_value (self, "PRAGMA auto_vacuum", error) != 2)
+    return FALSE;
+
+  free_pages = get_pragma_value (self, "PRAGMA freelist_count", error);
+  if (free_pages <= 0)
+    return FALSE;
+
+  sql = g_strdup_printf ("PRAGMA incremental_vacuum(%d)", VACUUM_BATCH_SIZE);
+  if (!ephy_sqlite_connection_execute (self->history_database, sql, error))
+    return FALSE;
+
+  return free_pages > VACUUM_BATCH_SIZE;
+}
+
+/**
+ * ephy_history_service_enable_incremental_vacuum:
+ * @self: an #EphyHistoryService
+ *
+ * Switch a database created without auto_vacuum to incremental vacuum, so
+ * that maintenance can release its free pages. This takes a full VACUUM,
+ * which rewrites the whole file at once and can't run inside a transaction,
+ * so it is only done on request. Nothing is done if the database
+ * already uses incremental vacuum.
+ **/
+void
+ephy_history_service_enable_incremental_vacuum (EphyHistoryService *self)
+{
+  GError *error = NULL;
+  gint64 start_time = g_get_monotonic_time ();
+
+  g_assert (self->history_thread == g_thread_self ());
+  g_assert (self->history_database != NULL);
+
+  if (get_pragma_value (self, "PRAGMA auto_vacuum", &error) == 2)
+    return;
+
+  if (!error &&
+      ephy_sqlite_connection_execute (self->history_database, "PRAGMA auto_vacuum=INCREMENTAL", &error) &&
+      ephy_sqlite_connection_execute (self->history_database, "VACUUM", &error)) {
+    LOG ("Enabled incremental vacuum of history in %" G_GINT64_FORMAT " ms",
+         (g_get_monotonic_time () - start_time) / 1000);
+  }
+
+  if (error) {
+    g_warning ("Could not enable incremental vacuum of history: %s", error->message);
+    g_error_free (error);
+  }
+}
+
+/**
+ * ephy_history_service_run_maintenance:
+ * @self: an #EphyHistoryService
+ * @end_time: the monotonic time at which to yield, or -1 to run a whole
+ *   pass inside the current transaction
+ *
+ * Run the next steps of a maintenance pass: roll up the visits older than
+ * #EphyHistoryService:visit-retention-days, delete orphaned hosts, release
+ * free pages back to the file system and refresh the query planner
+ * statistics. Each step is split in short statements, so that the history
+ * thread can get back to its queue in between.
+ *
+ * Return value: %TRUE if the pass is complete
+ **/
+gboolean
+ephy_history_service_run_maintenance (EphyHistoryService *self,
+                                      gint64              end_time)
+{
+  GError *error = NULL;
+  int retention_days;
+
+  g_assert (self->history_thread == g_thread_self ());
+  g_assert (self->history_database != NULL);
+
+  if (self->maintenance_step == EPHY_HISTORY_MAINTENANCE_IDLE) {
+    self->maintenance_step = EPHY_HISTORY_MAINTENANCE_ROLL_UP_VISITS;
+    self->maintenance_start_time = g_get_monotonic_time ();
+    self->maintenance_cursor_time = G_MININT64;
+    self->maintenance_cursor_id = -1;
+  }
+
+  do {
+    switch (self->maintenance_step) {
+      case EPHY_HISTORY_MAINTENANCE_ROLL_UP_VISITS:
+        retention_days = g_atomic_int_get (&self->visit_retention_days);
+        if (retention_days <= 0 ||
+            !roll_up_visits (self, g_get_real_time () - retention_days * G_TIME_SPAN_DAY, &error))
+          self->maintenance_step = EPHY_HISTORY_MAINTENANCE_DELETE_ORPHAN_HOSTS;
+        break;
+      case EPHY_HISTORY_MAINTENANCE_DELETE_ORPHAN_HOSTS:
+        ephy_history_service_delete_orphan_hosts (self);
+        self->maintenance_step = EPHY_HISTORY_MAINTENANCE_VACUUM;
+        break;
+      case EPHY_HISTORY_MAINTENANCE_VACUUM:
+        if (!vacuum (self, &error))
+          self->maintenance_step = EPHY_HISTORY_MAINTENANCE_OPTIMIZE;
+        break;
+      case EPHY_HISTORY_MAINTENANCE_OPTIMIZE:
+        ephy_sqlite_connection_execute (self->history_database, "PRAGMA optimize", &error);
+        self->maintenance_step = EPHY_HISTORY_MAINTENANCE_IDLE;
+        break;
+      case EPHY_HISTORY_MAINTENANCE_IDLE:
+      default:
+        g_assert_not_reached ();
+    }
+
+    if (error) {
+      g_warning ("Could not run history maintenance: %s", error->message);
+      g_clear_error (&error);
+      self->maintenance_step = EPHY_HISTORY_MAINTENANCE_IDLE;
+    }
+
+    if (self->maintenance_step == EPHY_HISTORY_MAINTENANCE_IDLE) {
+      LOG ("History maintenance pass took %" G_GINT64_FORMAT " ms",
+           (g_get_monotonic_time () - self->maintenance_start_time) / 1000);
+      return TRUE;
+    }
+  } while (end_time < 0 || g_get_monotonic_time () < end_time);
+
+  return FALSE;
+}
@@ -24,6 +24,14 @@
 
 G_BEGIN_DECLS
 
+typedef enum {
+  EPHY_HISTORY_MAINTENANCE_IDLE,
+  EPHY_HISTORY_MAINTENANCE_ROLL_UP_VISITS,
+  EPHY_HISTORY_MAINTENANCE_DELETE_ORPHAN_HOSTS,
+  EPHY_HISTORY_MAINTENANCE_VACUUM,
+  EPHY_HISTORY_MAINTENANCE_OPTIMIZE
+} EphyHistoryMaintenanceStep;
+
 struct _EphyHistoryService {
   GObject parent_instance;
   char *history_filename;
@@ -32,17 +40,89 @@ struct _EphyHistoryService {
   gboolean history_thread_initialized;
   GCond history_thread_initialized_condition;
   GThread *history_thread;
-  GAsyncQueue *queue;
+
+  /* Pending messages: all writes run before QUIT, which runs before all
+   * reads. Each priority is FIFO. Protected by queue_mutex. */
+  GMutex queue_mutex;
+  GCond queue_cond;
+  GQueue write_queue;
+  GQueue quit_queue;
+  GQueue read_queue;
+  GHashTable *coalesced_messages; /* coalescing key -> queued message */
+
+  /* Queue statistics, protected by queue_mutex. */
+  guint max_queue_depth;
+  guint num_dequeued_messages;
+  guint num_superseded_messages;
+  gint64 total_queue_wait_time;
+  gint64 max_queue_wait_time;
+
   gboolean scheduled_to_quit;
   gboolean in_memory;
   int queue_urls_visited_id;
+
+  /* Job callbacks and signals waiting for the main loop, in completion
+   * order. A single idle source delivers all of them. Protected by
+   * delivery_mutex. */
+  GMutex delivery_mutex;
+  GArray *deliveries;
+  guint delivery_source_id;
+
+  /* Read-only connections on worker threads that serve read messages once
+   * the history thread has committed all the writes queued before them. */
+  GThreadPool *reader_pool;
+  int database_generation; /* atomic, bumped when the database is recreated */
+
+  gboolean url_fts_available;
+
+  /* Recently used host rows, only touched by the history thread. Several
+   * host keys can resolve to the same row, so they map to row ids. */
+  GHashTable *host_cache; /* host id -> link in host_cache_lru */
+  GHashTable *host_cache_keys; /* host key -> host id */
+  GQueue host_cache_lru; /* EphyHistoryHost, most recently used first */
+  guint host_cache_hits;
+  guint host_cache_misses;
+
+  /* Zoom levels returned by ephy_history_service_get_host_for_url(), only
+   * touched by the main thread. They are dropped whenever the atomic
+   * zoom_levels_generation changes. */
+  GHashTable *zoom_levels; /* host key -> double */
+  int zoom_levels_generation;
+  int cached_zoom_levels_generation;
+
+  /* Background maintenance. Only touched by the history thread, except
+   * visit_retention_days which is atomic. */
+  int visit_retention_days;
+  EphyHistoryMaintenanceStep maintenance_step;
+  gint64 next_maintenance_time;
+  gint64 maintenance_start_time;
+  gint64 maintenance_cursor_time;
+  int maintenance_cursor_id;
+
+  /* Group commit statistics, only touched by the history thread. */
+  guint num_write_batches;
+  guint num_batched_writes;
+  guint max_write_batch_size;
+  gint64 total_commit_time;
+  gint64 max_commit_time;
 };
 
+EphySQLiteConnection *   ephy_history_service_get_database            (EphyHistoryService *self);
+gboolean                 ephy_history_service_is_reader_thread        (EphyHistoryService *self);
+
+gboolean                 ephy_history_service_migrate_schema          (EphyHistoryService *self);
+gboolean                 ephy_history_service_run_maintenance         (EphyHistoryService *self, gint64 end_time);
+void                     ephy_history_service_enable_incremental_vacuum (EphyHistoryService *self);
+
 gboolean                 ephy_history_service_initialize_urls_table   (EphyHistoryService *self);
 EphyHistoryURL *         ephy_history_service_get_url_row             (EphyHistoryService *self, const char *url_string, EphyHistoryURL *url);
 void                     ephy_history_service_add_url_row             (EphyHistoryService *self, EphyHistoryURL *url);
 void                     ephy_history_service_update_url_row          (EphyHistoryService *self, EphyHistoryURL *url);
 GList*                   ephy_history_service_find_url_rows           (EphyHistoryService *self, EphyHistoryQuery *query);
+EphyHistoryURLSet *      ephy_history_service_find_url_set            (EphyHistoryService *self, EphyHistoryQuery *query);
+void                     ephy_history_service_add_url_frecency        (EphyHistoryService *self, EphyHistoryPageVisit *visit);
+double                   ephy_history_frecency_add_visit              (double frecency, gint64 visit_time, EphyHistoryPageVisitType visit_type);
+double                   ephy_history_frecency_sum                    (double a, double b);
 void                     ephy_history_service_delete_url              (EphyHistoryService *self, EphyHistoryURL *url);
 
 gboolean                 ephy_history_service_initialize_visits_table (EphyHistoryService *self);
@@ -58,5 +138,10 @@ GList*                   ephy_history_service_find_host_rows          (EphyHisto
 EphyHistoryHost *        ephy_history_service_get_host_row_from_url   (EphyHistoryService *self, const gchar *url);
 void                     ephy_history_service_delete_host_row         (EphyHistoryService *self, EphyHistoryHost *host);
 void                     ephy_history_service_delete_orphan_hosts     (EphyHistoryService *self);
+void                     ephy_history_service_clear_host_cache        (EphyHistoryService *self);
+void                     ephy_history_service_invalidate_zoom_levels  (EphyHistoryService *self);
+char *                   ephy_history_host_key_for_url                (const char *url);
+
+gboolean                 ephy_history_service_import_visit_rows       (EphyHistoryService *self, GPtrArray *visits);
 
 G_END_DECLS
@@ -0,0 +1,368 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2; -*- */
+/*
+ *  Copyright © 2021 Epiphany Developers
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "ephy-debug.h"
+#include "ephy-history-service.h"
+#include "ephy-history-service-private.h"
+
+#include <math.h>
+
+/* A schema migration brings the database from version N - 1 to version N,
+ * where N is its index in the migrations array below. Each migration runs in
+ * its own transaction, together with the update of the schema_version table,
+ * so a failed migration leaves the database at the previous version and is
+ * retried on the next startup.
+ *
+ * Never modify or reorder existing migrations, only append new ones.
+ */
+typedef gboolean (*EphyHistorySchemaMigration) (EphyHistoryService  *self,
+                                                GError             **error);
+
+static gboolean
+execute_statements (EphyHistoryService  *self,
+                    const char * const  *statements,
+                    GError             **error)
+{
+  for (guint i = 0; statements[i]; i++) {
+    if (!ephy_sqlite_connection_execute (self->history_database, statements[i], error))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+migrate_add_indexes (EphyHistoryService  *self,
+                     GError             **error)
+{
+  const char * const statements[] = {
+    "CREATE INDEX IF NOT EXISTS urls_url_index ON urls (url)",
+    "CREATE INDEX IF NOT EXISTS urls_host_index ON urls (host)",
+    "CREATE INDEX IF NOT EXISTS urls_visit_count_index ON urls (visit_count)",
+    "CREATE INDEX IF NOT EXISTS urls_last_visit_time_index ON urls (last_visit_time)",
+    "CREATE INDEX IF NOT EXISTS visits_url_visit_time_index ON visits (url, visit_time)",
+    /* The composite index above cannot serve visit_time range filters that are
+     * not constrained by url, e.g. ephy_history_service_find_visits_in_time(). */
+    "CREATE INDEX IF NOT EXISTS visits_visit_time_index ON visits (visit_time)",
+    "CREATE INDEX IF NOT EXISTS hosts_url_index ON hosts (url)",
+    "ANALYZE",
+    NULL
+  };
+
+  return execute_statements (self, statements, error);
+}
+
+/* Fails if SQLite has no FTS5 with the trigram tokenizer, which needs
+ * SQLite 3.34. */
+static gboolean
+create_url_fts_table (EphyHistoryService  *self,
+                      GError             **error)
+{
+  return ephy_sqlite_connection_execute (self->history_database,
+                                         "CREATE VIRTUAL TABLE urls_fts USING fts5 ("
+                                         "url, title, content='urls', content_rowid='id', tokenize='trigram')",
+                                         error);
+}
+
+static gboolean
+fill_url_fts_table (EphyHistoryService  *self,
+                    GError             **error)
+{
+  const char * const statements[] = {
+    /* Keep the index in sync with the urls table. Every visit rewrites the
+     * whole urls row, so only reindex rows whose text actually changed. */
+    "CREATE TRIGGER urls_fts_insert AFTER INSERT ON urls BEGIN "
+    "INSERT INTO urls_fts (rowid, url, title) VALUES (new.id, new.url, new.title); "
+    "END",
+    "CREATE TRIGGER urls_fts_delete AFTER DELETE ON urls BEGIN "
+    "INSERT INTO urls_fts (urls_fts, rowid, url, title) VALUES ('delete', old.id, old.url, old.title); "
+    "END",
+    "CREATE TRIGGER urls_fts_update AFTER UPDATE OF url, title ON urls "
+    "WHEN old.url IS NOT new.url OR old.title IS NOT new.title BEGIN "
+    "INSERT INTO urls_fts (urls_fts, rowid, url, title) VALUES ('delete', old.id, old.url, old.title); "
+    "INSERT INTO urls_fts (rowid, url, title) VALUES (new.id, new.url, new.title); "
+    "END",
+    "INSERT INTO urls_fts (urls_fts) VALUES ('rebuild')",
+    NULL
+  };
+
+  return execute_statements (self, statements, error);
+}
+
+static gboolean
+migrate_add_url_fts_index (EphyHistoryService  *self,
+                           GError             **error)
+{
+  GError *local_error = NULL;
+
+  /* Without FTS5, substring searches keep scanning the urls table. The
+   * migration still counts as done, so that the later ones run. The missing
+   * urls_fts table records the degraded mode, see retry_url_fts_index(). */
+  if (!create_url_fts_table (self, &local_error)) {
+    g_warning ("Not indexing history for substring search: %s", local_error->message);
+    g_error_free (local_error);
+    return TRUE;
+  }
+
+  return fill_url_fts_table (self, error);
+}
+
+/* Creates the index that migrate_add_url_fts_index() had to skip, in case
+ * SQLite has gained FTS5 since. */
+static void
+retry_url_fts_index (EphyHistoryService *self)
+{
+  GError *error = NULL;
+
+  if (!ephy_sqlite_connection_begin_transaction (self->history_database, &error))
+    goto out;
+
+  if (!create_url_fts_table (self, &error) || !fill_url_fts_table (self, &error)) {
+    ephy_sqlite_connection_rollback_transaction (self->history_database, NULL);
+    goto out;
+  }
+
+  if (ephy_sqlite_connection_commit_transaction (self->history_database, &error))
+    LOG ("Indexed history for substring search");
+
+out:
+  if (error) {
+    LOG ("Still not indexing history for substring search: %s", error->message);
+    g_error_free (error);
+  }
+}
+
+static gboolean
+update_url_frecency (EphyHistoryService  *self,
+                     int                  url_id,
+                     double               frecency,
+                     GError             **error)
+{
+  EphySQLiteStatement *statement;
+
+  statement = ephy_sqlite_connection_create_cached_statement (self->history_database,
+                                                              "UPDATE urls SET frecency=? WHERE id=?", error);
+  if (!statement)
+    return FALSE;
+
+  if (ephy_sqlite_statement_bind_double (statement, 0, frecency, error))
+    if (ephy_sqlite_statement_bind_int (statement, 1, url_id, error))
+      ephy_sqlite_statement_step (statement, error);
+
+  g_object_unref (statement);
+
+  return !(error && *error);
+}
+
+static gboolean
+migrate_add_url_frecency (EphyHistoryService  *self,
+                          GError             **error)
+{
+  EphySQLiteStatement *statement;
+  const char * const statements[] = {
+    "ALTER TABLE urls ADD COLUMN frecency REAL",
+    "CREATE INDEX urls_frecency_index ON urls (frecency)",
+    NULL
+  };
+  double frecency = -INFINITY;
+  int url_id = -1;
+
+  if (!execute_statements (self, statements, error))
+    return FALSE;
+
+  /* Replay the existing visits, one URL at a time. */
+  statement = ephy_sqlite_connection_create_statement (self->history_database,
+                                                       "SELECT url, visit_time, visit_type FROM visits ORDER BY url", error);
+  if (!statement)
+    return FALSE;
+
+  while (ephy_sqlite_statement_step (statement, error)) {
+    int id = ephy_sqlite_statement_get_column_as_int (statement, 0);
+
+    if (id != url_id) {
+      if (url_id != -1 && !update_url_frecency (self, url_id, frecency, error))
+        break;
+
+      url_id = id;
+      frecency = -INFINITY;
+    }
+
+    frecency = ephy_history_frecency_add_visit (frecency,
+                                                ephy_sqlite_statement_get_column_as_int64 (statement, 1),
+                                                ephy_sqlite_statement_get_column_as_int (statement, 2));
+  }
+
+  g_object_unref (statement);
+
+  if (error && *error)
+    return FALSE;
+
+  return url_id == -1 || update_url_frecency (self, url_id, frecency, error);
+}
+
+static gboolean
+migrate_add_url_sort_indexes (EphyHistoryService  *self,
+                              GError             **error)
+{
+  /* The sort keys of paginated URL queries, as spelled by
+   * ephy_history_service_find_url_rows(). visit_count can't be NULL and
+   * already has its index. */
+  const char * const statements[] = {
+    "CREATE INDEX urls_sort_last_visit_time_index ON urls (IFNULL(last_visit_time, 0))",
+    "CREATE INDEX urls_sort_title_index ON urls (LOWER(IFNULL(title, '')))",
+    "CREATE INDEX urls_sort_url_index ON urls (LOWER(IFNULL(url, '')))",
+    NULL
+  };
+
+  return execute_statements (self, statements, error);
+}
+
+static const EphyHistorySchemaMigration migrations[] = {
+  NULL, /* Version 0 is the unversioned schema. */
+  migrate_add_indexes,
+  migrate_add_url_fts_index,
+  migrate_add_url_frecency,
+  migrate_add_url_sort_indexes,
+};
+
+#define EPHY_HISTORY_SCHEMA_VERSION (G_N_ELEMENTS (migrations) - 1)
+
+static int
+get_schema_version (EphyHistoryService  *self,
+                    GError             **error)
+{
+  EphySQLiteStatement *statement;
+  int version = 0;
+
+  if (!ephy_sqlite_connection_table_exists (self->history_database, "schema_version")) {
+    if (!ephy_sqlite_connection_execute (self->history_database,
+                                         "CREATE TABLE schema_version (version INTEGER NOT NULL)", error))
+      return -1;
+
+    if (!ephy_sqlite_connection_execute (self->history_database,
+                                         "INSERT INTO schema_version (version) VALUES (0)", error))
+      return -1;
+
+    return 0;
+  }
+
+  statement = ephy_sqlite_connection_create_statement (self->history_database,
+                                                       "SELECT MAX(version) FROM schema_version", error);
+  if (!statement)
+    return -1;
+
+  if (ephy_sqlite_statement_step (statement, error))
+    version = ephy_sqlite_statement_get_column_as_int (statement, 0);
+
+  g_object_unref (statement);
+
+  return error && *error ? -1 : version;
+}
+
+static gboolean
+set_schema_version (EphyHistoryService  *self,
+                    int                  version,
+                    GError             **error)
+{
+  EphySQLiteStatement *statement;
+
+  statement = ephy_sqlite_connection_create_statement (self->history_database,
+                                                       "UPDATE schema_version SET version=?", error);
+  if (!statement)
+    return FALSE;
+
+  if (!ephy_sqlite_statement_bind_int (statement, 0, version, error)) {
+    g_object_unref (statement);
+    return FALSE;
+  }
+
+  ephy_sqlite_statement_step (statement, error);
+  g_object_unref (statement);
+
+  return !(error && *error);
+}
+
+/**
+ * ephy_history_service_migrate_schema:
+ * @self: an #EphyHistoryService
+ *
+ * Bring the schema of the history database up to date by running all the
+ * migrations newer than the version recorded in the schema_version table.
+ * The tables must have been initialized already.
+ *
+ * Return value: %TRUE if the database is at the current schema version
+ **/
+gboolean
+ephy_history_service_migrate_schema (EphyHistoryService *self)
+{
+  GError *error = NULL;
+  int version;
+
+  g_assert (self->history_thread == g_thread_self ());
+  g_assert (self->history_database != NULL);
+
+  version = get_schema_version (self, &error);
+  if (version < 0) {
+    g_warning ("Could not read history schema version: %s", error->message);
+    g_error_free (error);
+    return FALSE;
+  }
+
+  if (version > (int)EPHY_HISTORY_SCHEMA_VERSION) {
+    /* A newer Epiphany touched this profile. Migrations only ever add to the
+     * schema, so we can keep using it as is. */
+    LOG ("History schema version %d is newer than %d", version, (int)EPHY_HISTORY_SCHEMA_VERSION);
+    self->url_fts_available = ephy_sqlite_connection_table_exists (self->history_database, "urls_fts");
+    return TRUE;
+  }
+
+  for (int i = version + 1; i <= (int)EPHY_HISTORY_SCHEMA_VERSION; i++) {
+    gint64 start_time = g_get_monotonic_time ();
+
+    if (!ephy_sqlite_connection_begin_transaction (self->history_database, &error))
+      break;
+
+    if (!migrations[i] (self, &error) || !set_schema_version (self, i, &error)) {
+      ephy_sqlite_connection_rollback_transaction (self->history_database, NULL);
+      break;
+    }
+
+    if (!ephy_sqlite_connection_commit_transaction (self->history_database, &error))
+      break;
+
+    LOG ("Migrated history schema to version %d in %" G_GINT64_FORMAT " ms",
+         i, (g_get_monotonic_time () - start_time) / 1000);
+  }
+
+  if (!error && !ephy_sqlite_connection_table_exists (self->history_database, "urls_fts"))
+    retry_url_fts_index (self);
+
+  self->url_fts_available = ephy_sqlite_connection_table_exists (self->history_database, "urls_fts");
+
+  if (error) {
+    g_warning ("Could not migrate history schema: %s", error->message);
+    g_error_free (error);
+    return FALSE;
+  }
+
+  return TRUE;
+}
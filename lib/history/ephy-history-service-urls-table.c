@@ -23,6 +23,11 @@
 #include "ephy-history-service.h"
 #include "ephy-history-service-private.h"
 
+#include <math.h>
+
+/* Frecency decays with a half-life of 30 days. */
+#define FRECENCY_HALF_LIFE ((double)30 * 24 * 60 * 60 * G_USEC_PER_SEC)
+
 gboolean
 ephy_history_service_initialize_urls_table (EphyHistoryService *self)
 {
@@ -57,11 +62,12 @@ ephy_history_service_get_url_row (EphyHistoryService *self,
                                   const char         *url_string,
                                   EphyHistoryURL     *url)
 {
+  EphySQLiteConnection *database;
   EphySQLiteStatement *statement = NULL;
   GError *error = NULL;
 
-  g_assert (self->history_thread == g_thread_self ());
-  g_assert (self->history_database != NULL);
+  database = ephy_history_service_get_database (self);
+  g_assert (database != NULL);
 
   if (url_string == NULL && url != NULL)
     url_string = url->url;
@@ -69,13 +75,13 @@ ephy_history_service_get_url_row (EphyHistoryService *self,
   g_assert (url_string || (url != NULL && url->id != -1));
 
   if (url != NULL && url->id != -1) {
-    statement = ephy_sqlite_connection_create_statement (self->history_database,
-                                                         "SELECT id, url, title, visit_count, typed_count, last_visit_time, hidden_from_overview, sync_id FROM urls "
-                                                         "WHERE id=?", &error);
+    statement = ephy_sqlite_connection_create_cached_statement (database,
+                                                                "SELECT id, url, title, visit_count, typed_count, last_visit_time, hidden_from_overview, sync_id FROM urls "
+                                                                "WHERE id=?", &error);
   } else {
-    statement = ephy_sqlite_connection_create_statement (self->history_database,
-                                                         "SELECT id, url, title, visit_count, typed_count, last_visit_time, hidden_from_overview, sync_id FROM urls "
-                                                         "WHERE url=?", &error);
+    statement = ephy_sqlite_connection_create_cached_statement (database,
+                                                                "SELECT id, url, title, visit_count, typed_count, last_visit_time, hidden_from_overview, sync_id FROM urls "
+                                                                "WHERE url=?", &error);
   }
 
   if (error) {
@@ -137,9 +143,9 @@ ephy_history_service_add_url_row (EphyHistoryService *self,
   if (self->in_memory)
     return;
 
-  statement = ephy_sqlite_connection_create_statement (self->history_database,
-                                                       "INSERT INTO urls (url, title, visit_count, typed_count, last_visit_time, host, sync_id) "
-                                                       " VALUES (?, ?, ?, ?, ?, ?, ?)", &error);
+  statement = ephy_sqlite_connection_create_cached_statement (self->history_database,
+                                                              "INSERT INTO urls (url, title, visit_count, typed_count, last_visit_time, host, sync_id) "
+                                                              " VALUES (?, ?, ?, ?, ?, ?, ?)", &error);
   if (error) {
     g_warning ("Could not build urls table addition statement: %s", error->message);
     g_error_free (error);
@@ -183,9 +189,9 @@ ephy_history_service_update_url_row (EphyHistoryService *self,
   if (self->in_memory)
     return;
 
-  statement = ephy_sqlite_connection_create_statement (self->history_database,
-                                                       "UPDATE urls SET title=?, visit_count=?, typed_count=?, last_visit_time=?, hidden_from_overview=?, sync_id=? "
-                                                       "WHERE id=?", &error);
+  statement = ephy_sqlite_connection_create_cached_statement (self->history_database,
+                                                              "UPDATE urls SET title=?, visit_count=?, typed_count=?, last_visit_time=?, hidden_from_overview=?, sync_id=? "
+                                                              "WHERE id=?", &error);
   if (error) {
     g_warning ("Could not build urls table modification statement: %s", error->message);
     g_error_free (error);
@@ -213,6 +219,137 @@ ephy_history_service_update_url_row (EphyHistoryService *self,
   g_object_unref (statement);
 }
 
+/**
+ * ephy_history_frecency_add_visit:
+ * @frecency: the current frecency, or -%INFINITY for a URL without visits
+ * @visit_time: the time of the new visit, in microseconds
+ * @visit_type: the type of the new visit
+ *
+ * Add a visit to a frecency score. The score is the logarithm of the sum of
+ * the visit weights, each decayed from its visit time back to the epoch.
+ * Since all scores decay at the same rate, comparing stored scores ranks URLs
+ * as their decayed scores would at any later time, so they never need to be
+ * recomputed and can be indexed.
+ *
+ * Return value: the new frecency
+ **/
+double
+ephy_history_frecency_add_visit (double                   frecency,
+                                 gint64                   visit_time,
+                                 EphyHistoryPageVisitType visit_type)
+{
+  double weight;
+  double visit_frecency;
+
+  switch (visit_type) {
+    case EPHY_PAGE_VISIT_TYPED:
+      weight = 2.0;
+      break;
+    case EPHY_PAGE_VISIT_BOOKMARK:
+      weight = 1.5;
+      break;
+    case EPHY_PAGE_VISIT_NONE:
+    case EPHY_PAGE_VISIT_LINK:
+    case EPHY_PAGE_VISIT_HOMEPAGE:
+    default:
+      weight = 1.0;
+  }
+
+  visit_frecency = log (weight) + visit_time * (G_LN2 / FRECENCY_HALF_LIFE);
+
+  return ephy_history_frecency_sum (frecency, visit_frecency);
+}
+
+/**
+ * ephy_history_frecency_sum:
+ * @a: a frecency, or -%INFINITY
+ * @b: another frecency, or -%INFINITY
+ *
+ * Combine the frecencies of two disjoint sets of visits to the same URL.
+ *
+ * Return value: the frecency of all the visits
+ **/
+double
+ephy_history_frecency_sum (double a,
+                           double b)
+{
+  if (isinf (a))
+    return b;
+  if (isinf (b))
+    return a;
+
+  /* log (exp (a) + exp (b)) without overflowing. */
+  if (a > b)
+    return a + log1p (exp (b - a));
+  return b + log1p (exp (a - b));
+}
+
+void
+ephy_history_service_add_url_frecency (EphyHistoryService   *self,
+                                       EphyHistoryPageVisit *visit)
+{
+  EphySQLiteStatement *statement;
+  GError *error = NULL;
+  double frecency = -INFINITY;
+
+  g_assert (self->history_thread == g_thread_self ());
+  g_assert (self->history_database != NULL);
+
+  if (self->in_memory || visit->url->id == -1)
+    return;
+
+  statement = ephy_sqlite_connection_create_cached_statement (self->history_database,
+                                                              "SELECT frecency FROM urls WHERE id=?", &error);
+  if (error) {
+    g_warning ("Could not build urls table query statement: %s", error->message);
+    g_error_free (error);
+    return;
+  }
+
+  if (ephy_sqlite_statement_bind_int (statement, 0, visit->url->id, &error) == FALSE) {
+    g_warning ("Could not build urls table query statement: %s", error->message);
+    g_error_free (error);
+    g_object_unref (statement);
+    return;
+  }
+
+  if (ephy_sqlite_statement_step (statement, &error) &&
+      ephy_sqlite_statement_get_column_type (statement, 0) != EPHY_SQLITE_COLUMN_TYPE_NULL)
+    frecency = ephy_sqlite_statement_get_column_as_double (statement, 0);
+  g_object_unref (statement);
+
+  if (error) {
+    g_warning ("Could not get URL frecency: %s", error->message);
+    g_error_free (error);
+    return;
+  }
+
+  frecency = ephy_history_frecency_add_visit (frecency, visit->visit_time, visit->visit_type);
+
+  statement = ephy_sqlite_connection_create_cached_statement (self->history_database,
+                                                              "UPDATE urls SET frecency=? WHERE id=?", &error);
+  if (error) {
+    g_warning ("Could not build urls table modification statement: %s", error->message);
+    g_error_free (error);
+    return;
+  }
+
+  if (ephy_sqlite_statement_bind_double (statement, 0, frecency, &error) == FALSE ||
+      ephy_sqlite_statement_bind_int (statement, 1, visit->url->id, &error) == FALSE) {
+    g_warning ("Could not modify URL frecency: %s", error->message);
+    g_error_free (error);
+    g_object_unref (statement);
+    return;
+  }
+
+  ephy_sqlite_statement_step (statement, &error);
+  if (error) {
+    g_warning ("Could not modify URL frecency: %s", error->message);
+    g_error_free (error);
+  }
+  g_object_unref (statement);
+}
+
 static EphyHistoryURL *
 create_url_from_statement (EphySQLiteStatement *statement)
 {
@@ -231,15 +368,98 @@ create_url_from_statement (EphySQLiteStatement *statement)
   return url;
 }
 
-GList *
-ephy_history_service_find_url_rows (EphyHistoryService *self,
-                                    EphyHistoryQuery   *query)
+/* Builds an FTS5 query matching every substring long enough to be looked up
+ * in the trigram index, or returns %NULL if there is none. */
+static char *
+create_fts_match_query (GList *substring_list)
 {
+  GString *match = NULL;
+
+  for (GList *l = substring_list; l != NULL; l = l->next) {
+    const char *substring = l->data;
+
+    if (g_utf8_strlen (substring, -1) < 3)
+      continue;
+
+    if (!match)
+      match = g_string_new (NULL);
+    else
+      g_string_append (match, " AND ");
+
+    /* Quote the substring as an FTS5 string, so it is matched literally. */
+    g_string_append_c (match, '"');
+    for (const char *c = substring; *c; c++) {
+      if (*c == '"')
+        g_string_append_c (match, '"');
+      g_string_append_c (match, *c);
+    }
+    g_string_append_c (match, '"');
+  }
+
+  return match ? g_string_free (match, FALSE) : NULL;
+}
+
+/* The sort orders over a single urls column. Rows that compare equal are
+ * ordered by id in the same direction, so every row has a unique position
+ * that a query can resume from. NULL never compares, so nullable columns are
+ * coalesced, and so are the values bound for them by bind_url_sort_key(). The
+ * keys are indexed as is by migrate_add_url_sort_indexes(). */
+static const struct {
+  const char *key;
+  const char *key_parameter;
+  gboolean descending;
+} url_sort_keys[] = {
+  [EPHY_HISTORY_SORT_MOST_RECENTLY_VISITED] = { "IFNULL(urls.last_visit_time, 0)", "?", TRUE },
+  [EPHY_HISTORY_SORT_LEAST_RECENTLY_VISITED] = { "IFNULL(urls.last_visit_time, 0)", "?", FALSE },
+  [EPHY_HISTORY_SORT_MOST_VISITED] = { "urls.visit_count", "?", TRUE },
+  [EPHY_HISTORY_SORT_LEAST_VISITED] = { "urls.visit_count", "?", FALSE },
+  [EPHY_HISTORY_SORT_TITLE_ASCENDING] = { "LOWER(IFNULL(urls.title, ''))", "LOWER(?)", FALSE },
+  [EPHY_HISTORY_SORT_TITLE_DESCENDING] = { "LOWER(IFNULL(urls.title, ''))", "LOWER(?)", TRUE },
+  [EPHY_HISTORY_SORT_URL_ASCENDING] = { "LOWER(IFNULL(urls.url, ''))", "LOWER(?)", FALSE },
+  [EPHY_HISTORY_SORT_URL_DESCENDING] = { "LOWER(IFNULL(urls.url, ''))", "LOWER(?)", TRUE },
+};
+
+static gboolean
+has_url_sort_key (EphyHistorySortType sort_type)
+{
+  return sort_type < G_N_ELEMENTS (url_sort_keys) && url_sort_keys[sort_type].key != NULL;
+}
+
+static gboolean
+bind_url_sort_key (EphySQLiteStatement  *statement,
+                   int                   column,
+                   EphyHistorySortType   sort_type,
+                   EphyHistoryURL       *url,
+                   GError              **error)
+{
+  switch (sort_type) {
+    case EPHY_HISTORY_SORT_MOST_RECENTLY_VISITED:
+    case EPHY_HISTORY_SORT_LEAST_RECENTLY_VISITED:
+      return ephy_sqlite_statement_bind_int64 (statement, column, url->last_visit_time, error);
+    case EPHY_HISTORY_SORT_MOST_VISITED:
+    case EPHY_HISTORY_SORT_LEAST_VISITED:
+      return ephy_sqlite_statement_bind_int (statement, column, url->visit_count, error);
+    case EPHY_HISTORY_SORT_TITLE_ASCENDING:
+    case EPHY_HISTORY_SORT_TITLE_DESCENDING:
+      return ephy_sqlite_statement_bind_string (statement, column, url->title ? url->title : "", error);
+    case EPHY_HISTORY_SORT_URL_ASCENDING:
+    case EPHY_HISTORY_SORT_URL_DESCENDING:
+      return ephy_sqlite_statement_bind_string (statement, column, url->url ? url->url : "", error);
+    default:
+      g_assert_not_reached ();
+  }
+}
+
+static EphySQLiteStatement *
+create_find_urls_statement (EphyHistoryService *self,
+                            EphyHistoryQuery   *query)
+{
+  EphySQLiteConnection *database;
   EphySQLiteStatement *statement = NULL;
   GList *substring;
   GString *statement_str;
-  GList *urls = NULL;
   GError *error = NULL;
+  g_autofree char *fts_match = NULL;
   const char *base_statement = ""
                                "SELECT "
                                "DISTINCT urls.id, "
@@ -256,11 +476,25 @@ ephy_history_service_find_url_rows (EphyHistoryService *self,
 
   int i = 0;
 
-  g_assert (self->history_thread == g_thread_self ());
-  g_assert (self->history_database != NULL);
+  database = ephy_history_service_get_database (self);
+  g_assert (database != NULL);
+
+  if (query->page_after && !has_url_sort_key (query->sort_type)) {
+    g_warning ("History queries sorted by %d cannot be paginated", query->sort_type);
+    return NULL;
+  }
 
   statement_str = g_string_new (base_statement);
 
+  /* Substrings of at least three characters are looked up in the trigram
+   * index first. The LIKE clauses below still apply to the matching rows so
+   * results are exactly the same as without the index. */
+  if (self->url_fts_available)
+    fts_match = create_fts_match_query (query->substring_list);
+
+  if (fts_match)
+    statement_str = g_string_append (statement_str, "JOIN urls_fts ON urls_fts.rowid = urls.id ");
+
   if (query->from > 0 || query->to > 0) {
     statement_str = g_string_append (statement_str, "JOIN visits ON visits.url = urls.id WHERE ");
     if (query->from > 0)
@@ -283,43 +517,47 @@ ephy_history_service_find_url_rows (EphyHistoryService *self,
   for (substring = query->substring_list; substring != NULL; substring = substring->next)
     statement_str = g_string_append (statement_str, "(urls.url LIKE ? OR urls.title LIKE ?) AND ");
 
+  if (fts_match)
+    statement_str = g_string_append (statement_str, "urls_fts MATCH ? AND ");
+
+  /* Resume right after the last row of the previous page. Unlike an OFFSET,
+   * this lets SQLite seek directly to the page in the sort index. */
+  if (query->page_after) {
+    g_string_append_printf (statement_str, "(%s, urls.id) %s (%s, ?) AND ",
+                            url_sort_keys[query->sort_type].key,
+                            url_sort_keys[query->sort_type].descending ? "<" : ">",
+                            url_sort_keys[query->sort_type].key_parameter);
+  }
+
   statement_str = g_string_append (statement_str, "1 ");
 
-  switch (query->sort_type) {
-    case EPHY_HISTORY_SORT_MOST_VISITED:
-      statement_str = g_string_append (statement_str, "ORDER BY urls.visit_count DESC ");
-      break;
-    case EPHY_HISTORY_SORT_LEAST_VISITED:
-      statement_str = g_string_append (statement_str, "ORDER BY urls.visit_count ");
-      break;
-    case EPHY_HISTORY_SORT_MOST_RECENTLY_VISITED:
-      statement_str = g_string_append (statement_str, "ORDER BY urls.last_visit_time DESC ");
-      break;
-    case EPHY_HISTORY_SORT_LEAST_RECENTLY_VISITED:
-      statement_str = g_string_append (statement_str, "ORDER BY urls.last_visit_time ");
-      break;
-    case EPHY_HISTORY_SORT_TITLE_ASCENDING:
-      statement_str = g_string_append (statement_str, "ORDER BY LOWER(urls.title) ");
-      break;
-    case EPHY_HISTORY_SORT_TITLE_DESCENDING:
-      statement_str = g_string_append (statement_str, "ORDER BY LOWER(urls.title) DESC ");
-      break;
-    case EPHY_HISTORY_SORT_URL_ASCENDING:
-      statement_str = g_string_append (statement_str, "ORDER BY LOWER(urls.url) ");
-      break;
-    case EPHY_HISTORY_SORT_URL_DESCENDING:
-      statement_str = g_string_append (statement_str, "ORDER BY LOWER(urls.url) DESC ");
-      break;
-    case EPHY_HISTORY_SORT_NONE:
-    default:
-      g_warning ("We don't support this sorting method yet.");
+  if (has_url_sort_key (query->sort_type)) {
+    const char *direction = url_sort_keys[query->sort_type].descending ? " DESC" : "";
+
+    g_string_append_printf (statement_str, "ORDER BY %s%s, urls.id%s ",
+                            url_sort_keys[query->sort_type].key, direction, direction);
+  } else {
+    switch (query->sort_type) {
+      case EPHY_HISTORY_SORT_FRECENCY:
+        statement_str = g_string_append (statement_str, "ORDER BY urls.frecency DESC ");
+        break;
+      case EPHY_HISTORY_SORT_RELEVANCE:
+        if (fts_match)
+          statement_str = g_string_append (statement_str, "ORDER BY urls_fts.rank, urls.visit_count DESC ");
+        else
+          statement_str = g_string_append (statement_str, "ORDER BY urls.visit_count DESC ");
+        break;
+      case EPHY_HISTORY_SORT_NONE:
+      default:
+        g_warning ("We don't support this sorting method yet.");
+    }
   }
 
   if (query->limit) {
     statement_str = g_string_append (statement_str, "LIMIT ? ");
   }
 
-  statement = ephy_sqlite_connection_create_statement (self->history_database,
+  statement = ephy_sqlite_connection_create_statement (database,
                                                        statement_str->str, &error);
   g_string_free (statement_str, TRUE);
 
@@ -371,6 +609,23 @@ ephy_history_service_find_url_rows (EphyHistoryService *self,
     }
     g_free (string);
   }
+  if (fts_match) {
+    if (ephy_sqlite_statement_bind_string (statement, i++, fts_match, &error) == FALSE) {
+      g_warning ("Could not build urls table query statement: %s", error->message);
+      g_error_free (error);
+      g_object_unref (statement);
+      return NULL;
+    }
+  }
+  if (query->page_after) {
+    if (bind_url_sort_key (statement, i++, query->sort_type, query->page_after, &error) == FALSE ||
+        ephy_sqlite_statement_bind_int (statement, i++, query->page_after->id, &error) == FALSE) {
+      g_warning ("Could not build urls table query statement: %s", error->message);
+      g_error_free (error);
+      g_object_unref (statement);
+      return NULL;
+    }
+  }
 
   if (query->limit)
     if (ephy_sqlite_statement_bind_int (statement, i++, query->limit, &error) == FALSE) {
@@ -380,6 +635,21 @@ ephy_history_service_find_url_rows (EphyHistoryService *self,
       return NULL;
     }
 
+  return statement;
+}
+
+GList *
+ephy_history_service_find_url_rows (EphyHistoryService *self,
+                                    EphyHistoryQuery   *query)
+{
+  EphySQLiteStatement *statement;
+  GList *urls = NULL;
+  GError *error = NULL;
+
+  statement = create_find_urls_statement (self, query);
+  if (!statement)
+    return NULL;
+
   while (ephy_sqlite_statement_step (statement, &error))
     urls = g_list_prepend (urls, create_url_from_statement (statement));
 
@@ -397,6 +667,50 @@ ephy_history_service_find_url_rows (EphyHistoryService *self,
   return urls;
 }
 
+EphyHistoryURLSet *
+ephy_history_service_find_url_set (EphyHistoryService *self,
+                                   EphyHistoryQuery   *query)
+{
+  EphySQLiteStatement *statement;
+  EphyHistoryURLSet *set;
+  GError *error = NULL;
+
+  statement = create_find_urls_statement (self, query);
+  if (!statement)
+    return NULL;
+
+  set = ephy_history_url_set_new ();
+
+  /* The column strings are only valid until the next step, and are copied
+   * into the set. */
+  while (ephy_sqlite_statement_step (statement, &error)) {
+    EphyHistoryURLRow row = {
+      .id = ephy_sqlite_statement_get_column_as_int (statement, 0),
+      .url = ephy_sqlite_statement_get_column_as_string (statement, 1),
+      .title = ephy_sqlite_statement_get_column_as_string (statement, 2),
+      .visit_count = ephy_sqlite_statement_get_column_as_int (statement, 3),
+      .typed_count = ephy_sqlite_statement_get_column_as_int (statement, 4),
+      .last_visit_time = ephy_sqlite_statement_get_column_as_int64 (statement, 5),
+      .hidden = ephy_sqlite_statement_get_column_as_int (statement, 6),
+      .host_id = ephy_sqlite_statement_get_column_as_int (statement, 7),
+      .sync_id = ephy_sqlite_statement_get_column_as_string (statement, 8),
+    };
+
+    ephy_history_url_set_append (set, &row);
+  }
+
+  g_object_unref (statement);
+
+  if (error) {
+    g_warning ("Could not execute urls table query statement: %s", error->message);
+    g_error_free (error);
+    ephy_history_url_set_unref (set);
+    return NULL;
+  }
+
+  return set;
+}
+
 void
 ephy_history_service_delete_url (EphyHistoryService *self,
                                  EphyHistoryURL     *url)
@@ -415,8 +729,8 @@ ephy_history_service_delete_url (EphyHistoryService *self,
   else
     sql_statement = "DELETE FROM urls WHERE url=?";
 
-  statement = ephy_sqlite_connection_create_statement (self->history_database,
-                                                       sql_statement, &error);
+  statement = ephy_sqlite_connection_create_cached_statement (self->history_database,
+                                                              sql_statement, &error);
 
   if (error) {
     g_warning ("Could not build urls table query statement: %s", error->message);
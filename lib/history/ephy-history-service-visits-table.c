@@ -61,7 +61,7 @@ ephy_history_service_add_visit_row (EphyHistoryService   *self,
   if (self->in_memory)
     return;
 
-  statement = ephy_sqlite_connection_create_statement (
+  statement = ephy_sqlite_connection_create_cached_statement (
     self->history_database,
     "INSERT INTO visits (url, visit_time, visit_type) "
     " VALUES (?, ?, ?) ", &error);
@@ -106,6 +106,7 @@ GList *
 ephy_history_service_find_visit_rows (EphyHistoryService *self,
                                       EphyHistoryQuery   *query)
 {
+  EphySQLiteConnection *database;
   EphySQLiteStatement *statement = NULL;
   GList *substring;
   GString *statement_str;
@@ -125,8 +126,8 @@ ephy_history_service_find_visit_rows (EphyHistoryService *self,
 
   int i = 0;
 
-  g_assert (self->history_thread == g_thread_self ());
-  g_assert (self->history_database != NULL);
+  database = ephy_history_service_get_database (self);
+  g_assert (database != NULL);
 
   statement_str = g_string_new (base_statement);
 
@@ -151,7 +152,7 @@ ephy_history_service_find_visit_rows (EphyHistoryService *self,
 
   statement_str = g_string_append (statement_str, "1");
 
-  statement = ephy_sqlite_connection_create_statement (self->history_database,
+  statement = ephy_sqlite_connection_create_statement (database,
                                                        statement_str->str, &error);
   g_string_free (statement_str, TRUE);
 
@@ -21,6 +21,7 @@
 #include "config.h"
 #include "ephy-history-service.h"
 
+#include "ephy-debug.h"
 #include "ephy-history-service-private.h"
 #include "ephy-history-types.h"
 #include "ephy-lib-type-builtins.h"
@@ -44,8 +45,10 @@ typedef enum {
   SET_URL_HIDDEN,
   ADD_VISIT,
   ADD_VISITS,
+  IMPORT_VISITS,
   DELETE_URLS,
   DELETE_HOST,
+  COMPACT,
   CLEAR,
   /* QUIT */
   QUIT,
@@ -53,6 +56,7 @@ typedef enum {
   GET_URL,
   GET_HOST_FOR_URL,
   QUERY_URLS,
+  QUERY_URL_SET,
   QUERY_VISITS,
   GET_HOSTS,
   QUERY_HOSTS
@@ -65,6 +69,8 @@ enum {
   URL_TITLE_CHANGED,
   URL_DELETED,
   HOST_DELETED,
+  VISIT_URLS,
+  URLS_DELETED,
   LAST_SIGNAL
 };
 
@@ -81,11 +87,78 @@ typedef struct _EphyHistoryServiceMessage {
   GDestroyNotify method_argument_cleanup;
   GDestroyNotify result_cleanup;
   EphyHistoryJobCallback callback;
+  char *coalescing_key;
+  GList queue_link;
+  gint64 queued_time;
+  int zoom_levels_generation;
 } EphyHistoryServiceMessage;
 
+/* Consecutive write messages are executed in a single transaction, bounded
+ * by the number of messages and by how long the first of them may wait
+ * for its commit. */
+#define MAX_WRITE_BATCH_SIZE 256
+#define MAX_WRITE_BATCH_LATENCY (100 * 1000) /* microseconds */
+
+#define NUM_READER_THREADS 2
+
+/* Maintenance runs some time after startup and then daily, in slices short
+ * enough not to delay the messages queued meanwhile noticeably. */
+#define MAINTENANCE_DELAY (5 * G_TIME_SPAN_MINUTE)
+#define MAINTENANCE_INTERVAL G_TIME_SPAN_DAY
+#define MAINTENANCE_SLICE (20 * G_TIME_SPAN_MILLISECOND)
+
+/* Zoom levels are only remembered for this many hosts, about as many as a
+ * long browsing session visits. */
+#define MAX_CACHED_ZOOM_LEVELS 1024
+
+typedef enum {
+  DELIVER_MESSAGE,
+  DELIVER_URL_VISITED,
+  DELIVER_URL_TITLE_CHANGED,
+  DELIVER_URL_DELETED,
+  DELIVER_HOST_DELETED
+} EphyHistoryServiceDeliveryType;
+
+/* Something to hand over to the main thread: a completed message, or the
+ * argument of a signal emission. */
+typedef struct {
+  EphyHistoryServiceDeliveryType type;
+  gpointer data;
+} EphyHistoryServiceDelivery;
+
+typedef struct {
+  EphyHistoryService *service;
+  EphySQLiteConnection *database;
+  int database_generation;
+} EphyHistoryReader;
+
+static void
+ephy_history_reader_free (EphyHistoryReader *reader)
+{
+  if (reader->database) {
+    ephy_sqlite_connection_close (reader->database);
+    g_object_unref (reader->database);
+  }
+  g_free (reader);
+}
+
+/* Reader threads are exclusive to the pool of one service, so the reader
+ * state can live in thread-local storage. It is freed when the pool shuts
+ * its threads down. */
+static GPrivate reader_private = G_PRIVATE_INIT ((GDestroyNotify)ephy_history_reader_free);
+
 static gpointer run_history_service_thread (EphyHistoryService *self);
 static void ephy_history_service_process_message (EphyHistoryService        *self,
                                                   EphyHistoryServiceMessage *message);
+static void ephy_history_service_complete_message (EphyHistoryService        *self,
+                                                   EphyHistoryServiceMessage *message);
+static void ephy_history_service_message_free (EphyHistoryServiceMessage *message);
+static void ephy_history_service_delivery_clear (EphyHistoryServiceDelivery *delivery);
+static EphyHistoryServiceMessage *ephy_history_service_process_write_batch (EphyHistoryService        *self,
+                                                                             EphyHistoryServiceMessage *message);
+static gboolean ephy_history_service_message_is_batchable (EphyHistoryServiceMessage *message);
+static void run_history_reader (EphyHistoryServiceMessage *message,
+                                EphyHistoryService        *self);
 static gboolean ephy_history_service_execute_quit (EphyHistoryService *self,
                                                    gpointer            data,
                                                    gpointer           *result);
@@ -97,6 +170,7 @@ enum {
   PROP_0,
   PROP_HISTORY_FILENAME,
   PROP_MEMORY,
+  PROP_VISIT_RETENTION_DAYS,
   LAST_PROP
 };
 
@@ -120,6 +194,9 @@ ephy_history_service_set_property (GObject      *object,
     case PROP_MEMORY:
       self->in_memory = g_value_get_boolean (value);
       break;
+    case PROP_VISIT_RETENTION_DAYS:
+      g_atomic_int_set (&self->visit_retention_days, g_value_get_int (value));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (self, property_id, pspec);
       break;
@@ -137,6 +214,9 @@ ephy_history_service_get_property (GObject    *object,
     case PROP_HISTORY_FILENAME:
       g_value_set_string (value, self->history_filename);
       break;
+    case PROP_VISIT_RETENTION_DAYS:
+      g_value_set_int (value, g_atomic_int_get (&self->visit_retention_days));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -153,6 +233,23 @@ ephy_history_service_finalize (GObject *object)
   if (self->history_thread)
     g_thread_join (self->history_thread);
 
+  /* Reads queued after QUIT are never run. */
+  g_queue_foreach (&self->read_queue, (GFunc)ephy_history_service_message_free, NULL);
+  g_queue_foreach (&self->write_queue, (GFunc)ephy_history_service_message_free, NULL);
+  g_hash_table_unref (self->coalesced_messages);
+  g_mutex_clear (&self->queue_mutex);
+  g_cond_clear (&self->queue_cond);
+
+  /* Nobody is left to receive what the history thread completed last. */
+  g_clear_handle_id (&self->delivery_source_id, g_source_remove);
+  g_array_unref (self->deliveries);
+  g_mutex_clear (&self->delivery_mutex);
+
+  g_hash_table_unref (self->host_cache);
+  g_hash_table_unref (self->host_cache_keys);
+  g_queue_clear_full (&self->host_cache_lru, (GDestroyNotify)ephy_history_host_free);
+  g_hash_table_unref (self->zoom_levels);
+
   g_free (self->history_filename);
 
   G_OBJECT_CLASS (ephy_history_service_parent_class)->finalize (object);
@@ -175,7 +272,21 @@ ephy_history_service_constructed (GObject *object)
 
   G_OBJECT_CLASS (ephy_history_service_parent_class)->constructed (object);
 
-  self->queue = g_async_queue_new ();
+  g_mutex_init (&self->queue_mutex);
+  g_cond_init (&self->queue_cond);
+  g_queue_init (&self->write_queue);
+  g_queue_init (&self->quit_queue);
+  g_queue_init (&self->read_queue);
+  self->coalesced_messages = g_hash_table_new (g_str_hash, g_str_equal);
+
+  g_mutex_init (&self->delivery_mutex);
+  self->deliveries = g_array_new (FALSE, FALSE, sizeof (EphyHistoryServiceDelivery));
+  g_array_set_clear_func (self->deliveries, (GDestroyNotify)ephy_history_service_delivery_clear);
+
+  self->host_cache = g_hash_table_new (NULL, NULL);
+  self->host_cache_keys = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_queue_init (&self->host_cache_lru);
+  self->zoom_levels = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
 
   /* This value is checked in several functions to verify that they are only
    * ever run on the history thread. Accordingly, we'd better be sure it's set
@@ -291,6 +402,42 @@ ephy_history_service_class_init (EphyHistoryServiceClass *klass)
                   1,
                   G_TYPE_STRING | G_SIGNAL_TYPE_STATIC_SCOPE);
 
+/**
+ * EphyHistoryService::visit-urls:
+ * @service: the #EphyHistoryService that received the signal
+ * @urls: (element-type EphyHistoryURL): the visited URLs
+ *
+ * The ::visit-urls signal is the batched counterpart of ::visit-url.
+ * Unlike ::visit-url, it is emitted on the main thread, once for all the
+ * visits that completed since the previous main loop iteration.
+ **/
+  signals[VISIT_URLS] =
+    g_signal_new ("visit-urls",
+                  G_OBJECT_CLASS_TYPE (gobject_class),
+                  G_SIGNAL_RUN_LAST,
+                  0, NULL, NULL, NULL,
+                  G_TYPE_NONE,
+                  1,
+                  G_TYPE_PTR_ARRAY | G_SIGNAL_TYPE_STATIC_SCOPE);
+
+/**
+ * EphyHistoryService::urls-deleted:
+ * @service: the #EphyHistoryService that received the signal
+ * @urls: (element-type EphyHistoryURL): the deleted URLs
+ *
+ * The ::urls-deleted signal is the batched counterpart of ::url-deleted,
+ * emitted once for all the URLs deleted since the previous main loop
+ * iteration.
+ **/
+  signals[URLS_DELETED] =
+    g_signal_new ("urls-deleted",
+                  G_OBJECT_CLASS_TYPE (gobject_class),
+                  G_SIGNAL_RUN_LAST,
+                  0, NULL, NULL, NULL,
+                  G_TYPE_NONE,
+                  1,
+                  G_TYPE_PTR_ARRAY | G_SIGNAL_TYPE_STATIC_SCOPE);
+
   obj_properties[PROP_HISTORY_FILENAME] =
     g_param_spec_string ("history-filename",
                          "History filename",
@@ -305,6 +452,13 @@ ephy_history_service_class_init (EphyHistoryServiceClass *klass)
                           FALSE,
                           G_PARAM_CONSTRUCT_ONLY | G_PARAM_WRITABLE | G_PARAM_STATIC_STRINGS);
 
+  obj_properties[PROP_VISIT_RETENTION_DAYS] =
+    g_param_spec_int ("visit-retention-days",
+                      "Visit retention days",
+                      "How many days to keep every single visit for, 0 to keep them forever",
+                      0, G_MAXINT, 0,
+                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
   g_object_class_install_properties (gobject_class, LAST_PROP, obj_properties);
 }
 
@@ -323,14 +477,6 @@ ephy_history_service_new (const char               *history_filename,
                                              NULL));
 }
 
-static gint
-sort_messages (EphyHistoryServiceMessage *a,
-               EphyHistoryServiceMessage *b,
-               gpointer                   user_data)
-{
-  return a->type > b->type ? 1 : a->type == b->type ? 0 : -1;
-}
-
 static EphyHistoryServiceMessage *
 ephy_history_service_message_new (EphyHistoryService            *service,
                                   EphyHistoryServiceMessageType  type,
@@ -351,6 +497,7 @@ ephy_history_service_message_new (EphyHistoryService            *service,
   message->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
   message->callback = callback;
   message->user_data = user_data;
+  message->queue_link.data = message;
 
   return message;
 }
@@ -367,14 +514,115 @@ ephy_history_service_message_free (EphyHistoryServiceMessage *message)
   if (message->cancellable)
     g_object_unref (message->cancellable);
 
+  g_free (message->coalescing_key);
   g_free (message);
 }
 
+static GQueue *
+ephy_history_service_get_queue_for_message (EphyHistoryService        *self,
+                                            EphyHistoryServiceMessage *message)
+{
+  if (message->type < QUIT)
+    return &self->write_queue;
+  if (message->type == QUIT)
+    return &self->quit_queue;
+  return &self->read_queue;
+}
+
 static void
 ephy_history_service_send_message (EphyHistoryService        *self,
                                    EphyHistoryServiceMessage *message)
 {
-  g_async_queue_push_sorted (self->queue, message, (GCompareDataFunc)sort_messages, NULL);
+  EphyHistoryServiceMessage *superseded = NULL;
+  guint depth;
+
+  /* Only reads can be superseded, writes must all be executed. */
+  g_assert (!message->coalescing_key || message->type > QUIT);
+
+  g_mutex_lock (&self->queue_mutex);
+
+  if (message->coalescing_key) {
+    superseded = g_hash_table_lookup (self->coalesced_messages, message->coalescing_key);
+    if (superseded) {
+      g_queue_unlink (&self->read_queue, &superseded->queue_link);
+      self->num_superseded_messages++;
+    }
+    g_hash_table_replace (self->coalesced_messages, message->coalescing_key, message);
+  }
+
+  message->queued_time = g_get_monotonic_time ();
+  g_queue_push_tail_link (ephy_history_service_get_queue_for_message (self, message), &message->queue_link);
+
+  depth = self->write_queue.length + self->quit_queue.length + self->read_queue.length;
+  self->max_queue_depth = MAX (self->max_queue_depth, depth);
+
+  g_cond_signal (&self->queue_cond);
+  g_mutex_unlock (&self->queue_mutex);
+
+  /* The callback of a superseded query still runs, but without results. */
+  if (superseded) {
+    LOG ("History query superseded by a newer one after %" G_GINT64_FORMAT " us in the queue",
+         message->queued_time - superseded->queued_time);
+    superseded->success = FALSE;
+    ephy_history_service_complete_message (self, superseded);
+  }
+}
+
+/* Pops the next message, in priority order, waiting for one until the
+ * monotonic @end_time at most. An @end_time of -1 waits for as long as it
+ * takes, and 0 does not wait. Returns %NULL if there was no message. */
+static EphyHistoryServiceMessage *
+ephy_history_service_pop_message (EphyHistoryService *self,
+                                  gint64              end_time)
+{
+  EphyHistoryServiceMessage *message = NULL;
+  GList *link;
+  gint64 wait_time;
+  guint num_writes, num_reads;
+
+  g_assert (self->history_thread == g_thread_self ());
+
+  g_mutex_lock (&self->queue_mutex);
+
+  while (TRUE) {
+    link = g_queue_pop_head_link (&self->write_queue);
+    if (!link)
+      link = g_queue_pop_head_link (&self->quit_queue);
+    if (!link)
+      link = g_queue_pop_head_link (&self->read_queue);
+    if (link || end_time == 0)
+      break;
+
+    if (end_time < 0)
+      g_cond_wait (&self->queue_cond, &self->queue_mutex);
+    else if (!g_cond_wait_until (&self->queue_cond, &self->queue_mutex, end_time))
+      end_time = 0;
+  }
+
+  if (!link) {
+    g_mutex_unlock (&self->queue_mutex);
+    return NULL;
+  }
+
+  message = link->data;
+  if (message->coalescing_key &&
+      g_hash_table_lookup (self->coalesced_messages, message->coalescing_key) == message)
+    g_hash_table_remove (self->coalesced_messages, message->coalescing_key);
+
+  wait_time = g_get_monotonic_time () - message->queued_time;
+  self->num_dequeued_messages++;
+  self->total_queue_wait_time += wait_time;
+  self->max_queue_wait_time = MAX (self->max_queue_wait_time, wait_time);
+
+  num_writes = self->write_queue.length;
+  num_reads = self->read_queue.length;
+
+  g_mutex_unlock (&self->queue_mutex);
+
+  LOG ("History message %d waited %" G_GINT64_FORMAT " us, %u writes and %u reads still queued",
+       message->type, wait_time, num_writes, num_reads);
+
+  return message;
 }
 
 static void
@@ -419,6 +667,8 @@ ephy_history_service_open_database_connections (EphyHistoryService *self)
   if (self->history_database != NULL)
     g_object_unref (self->history_database);
 
+  ephy_history_service_clear_host_cache (self);
+
   self->history_database = ephy_sqlite_connection_new (self->in_memory ? EPHY_SQLITE_CONNECTION_MODE_MEMORY
                                                                        : EPHY_SQLITE_CONNECTION_MODE_READWRITE,
                                                        self->history_filename);
@@ -437,16 +687,47 @@ ephy_history_service_open_database_connections (EphyHistoryService *self)
     ephy_sqlite_connection_enable_foreign_keys (self->history_database);
   }
 
+  /* Only takes effect before the first table is created, i.e. on a new
+   * database. Existing ones are switched by the maintenance. */
+  ephy_sqlite_connection_execute (self->history_database, "PRAGMA auto_vacuum=INCREMENTAL", &error);
+  if (error) {
+    g_warning ("Could not enable incremental vacuum of history database: %s", error->message);
+    g_clear_error (&error);
+  }
+
   return (ephy_history_service_initialize_hosts_table (self) &&
           ephy_history_service_initialize_urls_table (self) &&
-          ephy_history_service_initialize_visits_table (self));
+          ephy_history_service_initialize_visits_table (self) &&
+          ephy_history_service_migrate_schema (self));
 }
 
 static void
 ephy_history_service_close_database_connections (EphyHistoryService *self)
 {
+  guint hits, misses;
+
   g_assert (self->history_thread == g_thread_self ());
 
+  ephy_sqlite_connection_get_statement_cache_stats (self->history_database, &hits, &misses);
+  LOG ("History statement cache: %u hits, %u misses", hits, misses);
+  LOG ("History host cache: %u hits, %u misses", self->host_cache_hits, self->host_cache_misses);
+
+  g_mutex_lock (&self->queue_mutex);
+  if (self->num_dequeued_messages > 0) {
+    LOG ("History queue: %u messages, %" G_GINT64_FORMAT " us average wait, %" G_GINT64_FORMAT " us max, "
+         "%u max depth, %u superseded queries",
+         self->num_dequeued_messages, self->total_queue_wait_time / self->num_dequeued_messages,
+         self->max_queue_wait_time, self->max_queue_depth, self->num_superseded_messages);
+  }
+  g_mutex_unlock (&self->queue_mutex);
+
+  if (self->num_write_batches > 0) {
+    LOG ("History group commit: %u writes in %u transactions (max %u per transaction), "
+         "%" G_GINT64_FORMAT " us average commit time, %" G_GINT64_FORMAT " us max",
+         self->num_batched_writes, self->num_write_batches, self->max_write_batch_size,
+         self->total_commit_time / self->num_write_batches, self->max_commit_time);
+  }
+
   ephy_sqlite_connection_close (self->history_database);
   g_object_unref (self->history_database);
   self->history_database = NULL;
@@ -459,8 +740,6 @@ ephy_history_service_execute_quit (EphyHistoryService *self,
 {
   g_assert (self->history_thread == g_thread_self ());
 
-  g_async_queue_unref (self->queue);
-
   self->scheduled_to_quit = TRUE;
 
   return FALSE;
@@ -489,72 +768,217 @@ run_history_service_thread (EphyHistoryService *self)
   if (!success)
     return NULL;
 
+  /* An in-memory database is private to its connection, so it can't be
+   * shared with readers. */
+  if (!self->in_memory) {
+    self->reader_pool = g_thread_pool_new ((GFunc)run_history_reader, self,
+                                           NUM_READER_THREADS, TRUE, NULL);
+  }
+
+  /* No need to maintain what is thrown away at exit. */
+  self->next_maintenance_time = self->in_memory ? -1 : g_get_monotonic_time () + MAINTENANCE_DELAY;
+
   do {
-    message = g_async_queue_try_pop (self->queue);
+    /* Block the thread until there's data in the queue, or until it's time
+     * for maintenance. A pass in progress goes on whenever the queue is empty. */
+    message = ephy_history_service_pop_message (self,
+                                                self->maintenance_step != EPHY_HISTORY_MAINTENANCE_IDLE ? 0
+                                                                                                        : self->next_maintenance_time);
     if (!message) {
-      /* Block the thread until there's data in the queue. */
-      message = g_async_queue_pop (self->queue);
+      if (ephy_history_service_run_maintenance (self, g_get_monotonic_time () + MAINTENANCE_SLICE))
+        self->next_maintenance_time = g_get_monotonic_time () + MAINTENANCE_INTERVAL;
+      continue;
     }
 
-    /* Process item. */
-    ephy_history_service_process_message (self, message);
+    /* Process item, along with any writes queued right behind it. */
+    if (ephy_history_service_message_is_batchable (message))
+      message = ephy_history_service_process_write_batch (self, message);
+
+    if (message)
+      ephy_history_service_process_message (self, message);
   } while (!self->scheduled_to_quit);
 
+  /* Let the readers finish the reads already handed to them. */
+  if (self->reader_pool)
+    g_thread_pool_free (self->reader_pool, FALSE, TRUE);
+  self->reader_pool = NULL;
+
   ephy_history_service_close_database_connections (self);
 
   return NULL;
 }
 
-static gboolean
-ephy_history_service_execute_job_callback (gpointer data)
+static void
+ephy_history_service_delivery_clear (EphyHistoryServiceDelivery *delivery)
 {
-  EphyHistoryServiceMessage *message = (EphyHistoryServiceMessage *)data;
+  switch (delivery->type) {
+    case DELIVER_MESSAGE:
+      ephy_history_service_message_free (delivery->data);
+      break;
+    case DELIVER_URL_VISITED:
+    case DELIVER_URL_TITLE_CHANGED:
+    case DELIVER_URL_DELETED:
+      ephy_history_url_free (delivery->data);
+      break;
+    case DELIVER_HOST_DELETED:
+      g_free (delivery->data);
+      break;
+  }
+}
 
-  g_assert (message->callback || message->type == CLEAR);
+/* Drops the cached zoom levels if the hosts changed since they were cached. */
+static void
+ephy_history_service_check_zoom_levels (EphyHistoryService *self)
+{
+  int generation = g_atomic_int_get (&self->zoom_levels_generation);
 
-  if (g_cancellable_is_cancelled (message->cancellable)) {
-    ephy_history_service_message_free (message);
-    return FALSE;
+  if (generation != self->cached_zoom_levels_generation) {
+    g_hash_table_remove_all (self->zoom_levels);
+    self->cached_zoom_levels_generation = generation;
   }
+}
+
+/**
+ * ephy_history_service_invalidate_zoom_levels:
+ * @self: an #EphyHistoryService
+ *
+ * Make the main thread forget the zoom levels it cached, because a host was
+ * deleted or its zoom level may apply differently now. May be called from
+ * any thread.
+ **/
+void
+ephy_history_service_invalidate_zoom_levels (EphyHistoryService *self)
+{
+  g_atomic_int_inc (&self->zoom_levels_generation);
+}
+
+static void
+ephy_history_service_cache_zoom_level (EphyHistoryService *self,
+                                       const char         *url,
+                                       EphyHistoryHost    *host,
+                                       int                 generation)
+{
+  double *zoom_level;
+
+  ephy_history_service_check_zoom_levels (self);
+
+  /* The host may have changed while it was looked up. */
+  if (generation != self->cached_zoom_levels_generation)
+    return;
+
+  if (g_hash_table_size (self->zoom_levels) >= MAX_CACHED_ZOOM_LEVELS)
+    g_hash_table_remove_all (self->zoom_levels);
+
+  /* Hosts that were never visited use the default zoom level, like hosts
+   * whose zoom level was never changed. */
+  zoom_level = g_new (double, 1);
+  *zoom_level = host->visit_count > 0 ? host->zoom_level : 0.0;
+  g_hash_table_replace (self->zoom_levels, ephy_history_host_key_for_url (url), zoom_level);
+}
+
+static void
+ephy_history_service_deliver_message (EphyHistoryServiceMessage *message)
+{
+  g_assert (message->callback || message->type == CLEAR);
+
+  if (message->type == GET_HOST_FOR_URL && message->success)
+    ephy_history_service_cache_zoom_level (message->service, (const char *)message->method_argument,
+                                           message->result, message->zoom_levels_generation);
+
+  if (g_cancellable_is_cancelled (message->cancellable))
+    return;
 
   if (message->callback)
     message->callback (message->service, message->success, message->result, message->user_data);
 
   if (message->type == CLEAR)
     g_signal_emit (message->service, signals[CLEARED], 0);
-
-  ephy_history_service_message_free (message);
-
-  return FALSE;
 }
 
-typedef struct {
-  EphyHistoryService *service;
-  gpointer user_data;
-  GDestroyNotify destroy_func;
-} SignalEmissionContext;
-
 static void
-signal_emission_context_free (SignalEmissionContext *ctx)
+emit_batched_urls (EphyHistoryService *self,
+                   guint               signal_id,
+                   GPtrArray          *urls)
 {
-  g_object_unref (ctx->service);
-  if (ctx->destroy_func && ctx->user_data)
-    ctx->destroy_func (ctx->user_data);
-  g_free (ctx);
+  if (urls->len == 0)
+    return;
+
+  g_signal_emit (self, signals[signal_id], 0, urls);
+  g_ptr_array_set_size (urls, 0);
 }
 
-static SignalEmissionContext *
-signal_emission_context_new (EphyHistoryService *service,
-                             gpointer            user_data,
-                             GDestroyNotify      destroy_func)
+static gboolean
+ephy_history_service_deliver (EphyHistoryService *self)
 {
-  SignalEmissionContext *ctx = g_new0 (SignalEmissionContext, 1);
+  g_autoptr (GArray) deliveries = NULL;
+  g_autoptr (GPtrArray) visited_urls = g_ptr_array_new ();
+  g_autoptr (GPtrArray) deleted_urls = g_ptr_array_new ();
+
+  g_mutex_lock (&self->delivery_mutex);
+  deliveries = self->deliveries;
+  self->deliveries = g_array_new (FALSE, FALSE, sizeof (EphyHistoryServiceDelivery));
+  g_array_set_clear_func (self->deliveries, (GDestroyNotify)ephy_history_service_delivery_clear);
+  self->delivery_source_id = 0;
+  g_mutex_unlock (&self->delivery_mutex);
+
+  /* Callbacks may drop the last reference to the service. */
+  g_object_ref (self);
+
+  for (guint i = 0; i < deliveries->len; i++) {
+    EphyHistoryServiceDelivery *delivery = &g_array_index (deliveries, EphyHistoryServiceDelivery, i);
+    EphyHistoryURL *url = delivery->data;
+
+    /* Consecutive visits and deletions are notified together, but never
+     * reordered with respect to anything else. */
+    if (delivery->type != DELIVER_URL_VISITED)
+      emit_batched_urls (self, VISIT_URLS, visited_urls);
+    if (delivery->type != DELIVER_URL_DELETED)
+      emit_batched_urls (self, URLS_DELETED, deleted_urls);
+
+    switch (delivery->type) {
+      case DELIVER_MESSAGE:
+        ephy_history_service_deliver_message (delivery->data);
+        break;
+      case DELIVER_URL_VISITED:
+        g_ptr_array_add (visited_urls, url);
+        break;
+      case DELIVER_URL_TITLE_CHANGED:
+        g_signal_emit (self, signals[URL_TITLE_CHANGED], 0, url->url, url->title);
+        break;
+      case DELIVER_URL_DELETED:
+        g_signal_emit (self, signals[URL_DELETED], 0, url);
+        g_ptr_array_add (deleted_urls, url);
+        break;
+      case DELIVER_HOST_DELETED:
+        g_signal_emit (self, signals[HOST_DELETED], 0, delivery->data);
+        break;
+    }
+  }
+
+  emit_batched_urls (self, VISIT_URLS, visited_urls);
+  emit_batched_urls (self, URLS_DELETED, deleted_urls);
 
-  ctx->service = g_object_ref (service);
-  ctx->user_data = user_data;
-  ctx->destroy_func = destroy_func;
+  /* The URLs in the batches are owned by the deliveries, free them only now. */
+  g_clear_pointer (&deliveries, g_array_unref);
+  g_object_unref (self);
 
-  return ctx;
+  return G_SOURCE_REMOVE;
+}
+
+/* Hands @data over to the main thread. Everything queued before the next
+ * main loop iteration is delivered from a single idle callback, in order. */
+static void
+ephy_history_service_queue_delivery (EphyHistoryService             *self,
+                                     EphyHistoryServiceDeliveryType  type,
+                                     gpointer                        data)
+{
+  EphyHistoryServiceDelivery delivery = { type, data };
+
+  g_mutex_lock (&self->delivery_mutex);
+  g_array_append_val (self->deliveries, delivery);
+  if (!self->delivery_source_id)
+    self->delivery_source_id = g_idle_add ((GSourceFunc)ephy_history_service_deliver, self);
+  g_mutex_unlock (&self->delivery_mutex);
 }
 
 static gboolean
@@ -573,6 +997,10 @@ ephy_history_service_execute_add_visit_helper (EphyHistoryService   *self,
     visit->url->host->zoom_level = zoom_level;
   }
 
+  /* The zoom level of a host only applies once it has been visited. */
+  if (visit->url->host->visit_count == 0 && visit->url->host->zoom_level != 0.0)
+    ephy_history_service_invalidate_zoom_levels (self);
+
   visit->url->host->visit_count++;
   ephy_history_service_update_host_row (self, visit->url->host);
 
@@ -604,10 +1032,15 @@ ephy_history_service_execute_add_visit_helper (EphyHistoryService   *self,
     ephy_history_service_update_url_row (self, visit->url);
   }
 
-  if (visit->url->notify_visit)
+  if (visit->url->notify_visit) {
     g_signal_emit (self, signals[VISIT_URL], 0, visit->url);
 
+    if (g_signal_has_handler_pending (self, signals[VISIT_URLS], 0, FALSE))
+      ephy_history_service_queue_delivery (self, DELIVER_URL_VISITED, ephy_history_url_copy (visit->url));
+  }
+
   ephy_history_service_add_visit_row (self, visit);
+  ephy_history_service_add_url_frecency (self, visit);
   return visit->id != -1;
 }
 
@@ -639,6 +1072,16 @@ ephy_history_service_execute_add_visits (EphyHistoryService *self,
   return success;
 }
 
+static gboolean
+ephy_history_service_execute_import_visits (EphyHistoryService *self,
+                                            GPtrArray          *visits,
+                                            gpointer           *result)
+{
+  g_assert (self->history_thread == g_thread_self ());
+
+  return ephy_history_service_import_visit_rows (self, visits);
+}
+
 static gboolean
 ephy_history_service_execute_find_visits (EphyHistoryService *self,
                                           EphyHistoryQuery   *query,
@@ -729,6 +1172,44 @@ ephy_history_service_add_visits (EphyHistoryService     *self,
   ephy_history_service_send_message (self, message);
 }
 
+/**
+ * ephy_history_service_import_visits:
+ * @self: an #EphyHistoryService
+ * @visits: (element-type EphyHistoryPageVisit): the visits to add
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: (nullable): called once all the visits are stored
+ * @user_data: data for @callback
+ *
+ * Add a large number of visits at once, e.g. when merging synced history or
+ * importing it from another browser. This is much faster than adding the
+ * visits one by one, but ::visit-url is not emitted for them.
+ **/
+void
+ephy_history_service_import_visits (EphyHistoryService     *self,
+                                    GPtrArray              *visits,
+                                    GCancellable           *cancellable,
+                                    EphyHistoryJobCallback  callback,
+                                    gpointer                user_data)
+{
+  EphyHistoryServiceMessage *message;
+  GPtrArray *copy;
+
+  g_assert (EPHY_IS_HISTORY_SERVICE (self));
+  g_assert (visits != NULL);
+
+  copy = g_ptr_array_new_full (visits->len, (GDestroyNotify)ephy_history_page_visit_free);
+  for (guint i = 0; i < visits->len; i++)
+    g_ptr_array_add (copy, ephy_history_page_visit_copy (g_ptr_array_index (visits, i)));
+
+  message = ephy_history_service_message_new (self, IMPORT_VISITS,
+                                              copy, (GDestroyNotify)g_ptr_array_unref,
+                                              NULL,
+                                              cancellable, callback, user_data);
+  ephy_history_service_send_message (self, message);
+
+  ephy_history_service_queue_urls_visited (self);
+}
+
 void
 ephy_history_service_find_visits_in_time (EphyHistoryService     *self,
                                           gint64                  from,
@@ -798,6 +1279,53 @@ ephy_history_service_query_urls (EphyHistoryService     *self,
                                               (GDestroyNotify)ephy_history_query_free,
                                               (GDestroyNotify)ephy_history_url_list_free,
                                               cancellable, callback, user_data);
+  message->coalescing_key = g_strdup (query->coalescing_key);
+  ephy_history_service_send_message (self, message);
+}
+
+static gboolean
+ephy_history_service_execute_query_url_set (EphyHistoryService *self,
+                                            EphyHistoryQuery   *query,
+                                            gpointer           *result)
+{
+  EphyHistoryURLSet *set = ephy_history_service_find_url_set (self, query);
+
+  *result = set;
+
+  return set != NULL;
+}
+
+/**
+ * ephy_history_service_query_url_set:
+ * @self: an #EphyHistoryService
+ * @query: an #EphyHistoryQuery
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: (nullable): the callback to call with the results
+ * @user_data: data for @callback
+ *
+ * Like ephy_history_service_query_urls(), but @callback receives the results
+ * as an #EphyHistoryURLSet, which is much cheaper to build and free than a
+ * list of #EphyHistoryURL. The set is freed after @callback returns, unless
+ * @callback takes a reference to it.
+ **/
+void
+ephy_history_service_query_url_set (EphyHistoryService     *self,
+                                    EphyHistoryQuery       *query,
+                                    GCancellable           *cancellable,
+                                    EphyHistoryJobCallback  callback,
+                                    gpointer                user_data)
+{
+  EphyHistoryServiceMessage *message;
+
+  g_assert (EPHY_IS_HISTORY_SERVICE (self));
+  g_assert (query != NULL);
+
+  message = ephy_history_service_message_new (self, QUERY_URL_SET,
+                                              ephy_history_query_copy (query),
+                                              (GDestroyNotify)ephy_history_query_free,
+                                              (GDestroyNotify)ephy_history_url_set_unref,
+                                              cancellable, callback, user_data);
+  message->coalescing_key = g_strdup (query->coalescing_key);
   ephy_history_service_send_message (self, message);
 }
 
@@ -837,16 +1365,6 @@ ephy_history_service_query_hosts (EphyHistoryService     *self,
   ephy_history_service_send_message (self, message);
 }
 
-static gboolean
-set_url_title_signal_emit (SignalEmissionContext *ctx)
-{
-  EphyHistoryURL *url = (EphyHistoryURL *)ctx->user_data;
-
-  g_signal_emit (ctx->service, signals[URL_TITLE_CHANGED], 0, url->url, url->title);
-
-  return FALSE;
-}
-
 static gboolean
 ephy_history_service_execute_set_url_title (EphyHistoryService *self,
                                             EphyHistoryURL     *url,
@@ -859,18 +1377,11 @@ ephy_history_service_execute_set_url_title (EphyHistoryService *self,
     g_free (title);
     return FALSE;
   } else {
-    SignalEmissionContext *ctx;
-
     g_free (url->title);
     url->title = title;
     ephy_history_service_update_url_row (self, url);
 
-    ctx = signal_emission_context_new (self,
-                                       ephy_history_url_copy (url),
-                                       (GDestroyNotify)ephy_history_url_free);
-    g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
-                     (GSourceFunc)set_url_title_signal_emit,
-                     ctx, (GDestroyNotify)signal_emission_context_free);
+    ephy_history_service_queue_delivery (self, DELIVER_URL_TITLE_CHANGED, ephy_history_url_copy (url));
     return TRUE;
   }
 }
@@ -938,6 +1449,10 @@ ephy_history_service_set_url_zoom_level (EphyHistoryService     *self,
   if (zoom_level == g_settings_get_double (EPHY_SETTINGS_WEB, EPHY_PREFS_WEB_DEFAULT_ZOOM_LEVEL))
     zoom_level = 0.0f;
 
+  /* Lookups already on their way can't be trusted either. */
+  ephy_history_service_invalidate_zoom_levels (self);
+  ephy_history_service_check_zoom_levels (self);
+
   variant = g_variant_new ("(sd)", url, zoom_level);
 
   message = ephy_history_service_message_new (self, SET_URL_ZOOM_LEVEL,
@@ -1050,17 +1565,43 @@ ephy_history_service_get_host_for_url (EphyHistoryService     *self,
   message = ephy_history_service_message_new (self, GET_HOST_FOR_URL,
                                               g_strdup (url), g_free, (GDestroyNotify)ephy_history_host_free,
                                               cancellable, callback, user_data);
+  message->zoom_levels_generation = g_atomic_int_get (&self->zoom_levels_generation);
   ephy_history_service_send_message (self, message);
 }
 
-static gboolean
-delete_urls_signal_emit (SignalEmissionContext *ctx)
+/**
+ * ephy_history_service_get_cached_zoom_level:
+ * @self: an #EphyHistoryService
+ * @url: a URL
+ * @zoom_level: (out): return location for the zoom level
+ *
+ * Look up the zoom level of the host of @url among the hosts recently
+ * returned by ephy_history_service_get_host_for_url(), without going
+ * through the database. As with the zoom level of an #EphyHistoryHost, 0.0
+ * means the default zoom level. Only call this from the main thread.
+ *
+ * Return value: %TRUE if the zoom level is known
+ **/
+gboolean
+ephy_history_service_get_cached_zoom_level (EphyHistoryService *self,
+                                            const char         *url,
+                                            double             *zoom_level)
 {
-  EphyHistoryURL *url = (EphyHistoryURL *)ctx->user_data;
+  g_autofree char *key = NULL;
+  double *cached;
 
-  g_signal_emit (ctx->service, signals[URL_DELETED], 0, url);
+  g_assert (EPHY_IS_HISTORY_SERVICE (self));
+  g_assert (url != NULL);
 
-  return FALSE;
+  ephy_history_service_check_zoom_levels (self);
+
+  key = ephy_history_host_key_for_url (url);
+  cached = g_hash_table_lookup (self->zoom_levels, key);
+  if (cached == NULL)
+    return FALSE;
+
+  *zoom_level = *cached;
+  return TRUE;
 }
 
 static gboolean
@@ -1070,20 +1611,13 @@ ephy_history_service_execute_delete_urls (EphyHistoryService *self,
 {
   GList *l;
   EphyHistoryURL *url;
-  SignalEmissionContext *ctx;
 
   for (l = urls; l != NULL; l = l->next) {
     url = l->data;
     ephy_history_service_delete_url (self, url);
 
-    if (url->notify_delete) {
-      ctx = signal_emission_context_new (self, ephy_history_url_copy (url),
-                                         (GDestroyNotify)ephy_history_url_free);
-      g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
-                       (GSourceFunc)delete_urls_signal_emit,
-                       ctx,
-                       (GDestroyNotify)signal_emission_context_free);
-    }
+    if (url->notify_delete)
+      ephy_history_service_queue_delivery (self, DELIVER_URL_DELETED, ephy_history_url_copy (url));
   }
 
   ephy_history_service_delete_orphan_hosts (self);
@@ -1092,35 +1626,68 @@ ephy_history_service_execute_delete_urls (EphyHistoryService *self,
 }
 
 static gboolean
-delete_host_signal_emit (SignalEmissionContext *ctx)
+ephy_history_service_execute_delete_host (EphyHistoryService     *self,
+                                          EphyHistoryHost        *host,
+                                          EphyHistoryJobCallback  callback,
+                                          gpointer                user_data)
 {
-  char *host = (char *)ctx->user_data;
+  ephy_history_service_delete_host_row (self, host);
 
-  g_signal_emit (ctx->service, signals[HOST_DELETED], 0, host);
+  ephy_history_service_queue_delivery (self, DELIVER_HOST_DELETED, g_strdup (host->url));
 
-  return FALSE;
+  return TRUE;
 }
 
 static gboolean
-ephy_history_service_execute_delete_host (EphyHistoryService     *self,
-                                          EphyHistoryHost        *host,
-                                          EphyHistoryJobCallback  callback,
-                                          gpointer                user_data)
+ephy_history_service_execute_compact (EphyHistoryService *self,
+                                      gpointer            data,
+                                      gpointer           *result)
 {
-  SignalEmissionContext *ctx;
+  g_assert (self->history_thread == g_thread_self ());
 
-  ephy_history_service_delete_host_row (self, host);
+  if (self->in_memory)
+    return TRUE;
 
-  ctx = signal_emission_context_new (self, g_strdup (host->url),
-                                     (GDestroyNotify)g_free);
-  g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
-                   (GSourceFunc)delete_host_signal_emit,
-                   ctx,
-                   (GDestroyNotify)signal_emission_context_free);
+  /* Switching an old database to incremental vacuum rewrites it, outside of
+   * any transaction. Background maintenance never does it. */
+  ephy_history_service_commit_transaction (self);
+  ephy_history_service_enable_incremental_vacuum (self);
+  ephy_history_service_open_transaction (self);
+
+  ephy_history_service_run_maintenance (self, -1);
+  self->next_maintenance_time = g_get_monotonic_time () + MAINTENANCE_INTERVAL;
 
   return TRUE;
 }
 
+/**
+ * ephy_history_service_compact:
+ * @self: an #EphyHistoryService
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: (nullable): called when done
+ * @user_data: data for @callback
+ *
+ * Run a maintenance pass right away instead of waiting for the background
+ * one: roll up the visits older than #EphyHistoryService:visit-retention-days
+ * and release the space they used. Databases created before incremental
+ * vacuum was enabled are switched to it first, which rewrites the whole file.
+ **/
+void
+ephy_history_service_compact (EphyHistoryService     *self,
+                              GCancellable           *cancellable,
+                              EphyHistoryJobCallback  callback,
+                              gpointer                user_data)
+{
+  EphyHistoryServiceMessage *message;
+
+  g_assert (EPHY_IS_HISTORY_SERVICE (self));
+
+  message = ephy_history_service_message_new (self, COMPACT,
+                                              NULL, NULL, NULL,
+                                              cancellable, callback, user_data);
+  ephy_history_service_send_message (self, message);
+}
+
 static gboolean
 ephy_history_service_execute_clear (EphyHistoryService *self,
                                     gpointer            pointer,
@@ -1136,6 +1703,9 @@ ephy_history_service_execute_clear (EphyHistoryService *self,
   ephy_history_service_open_database_connections (self);
   ephy_history_service_open_transaction (self);
 
+  /* Readers still hold connections to the deleted database. */
+  g_atomic_int_inc (&self->database_generation);
+
   return TRUE;
 }
 
@@ -1205,13 +1775,16 @@ static EphyHistoryServiceMethod methods[] = {
   (EphyHistoryServiceMethod)ephy_history_service_execute_set_url_hidden,
   (EphyHistoryServiceMethod)ephy_history_service_execute_add_visit,
   (EphyHistoryServiceMethod)ephy_history_service_execute_add_visits,
+  (EphyHistoryServiceMethod)ephy_history_service_execute_import_visits,
   (EphyHistoryServiceMethod)ephy_history_service_execute_delete_urls,
   (EphyHistoryServiceMethod)ephy_history_service_execute_delete_host,
+  (EphyHistoryServiceMethod)ephy_history_service_execute_compact,
   (EphyHistoryServiceMethod)ephy_history_service_execute_clear,
   (EphyHistoryServiceMethod)ephy_history_service_execute_quit,
   (EphyHistoryServiceMethod)ephy_history_service_execute_get_url,
   (EphyHistoryServiceMethod)ephy_history_service_execute_get_host_for_url,
   (EphyHistoryServiceMethod)ephy_history_service_execute_query_urls,
+  (EphyHistoryServiceMethod)ephy_history_service_execute_query_url_set,
   (EphyHistoryServiceMethod)ephy_history_service_execute_find_visits,
   (EphyHistoryServiceMethod)ephy_history_service_execute_get_hosts,
   (EphyHistoryServiceMethod)ephy_history_service_execute_query_hosts
@@ -1223,12 +1796,48 @@ ephy_history_service_message_is_write (EphyHistoryServiceMessage *message)
   return message->type < QUIT;
 }
 
+/* CLEAR commits and reopens the database on its own, so it can't be part of
+ * a batch. */
+static gboolean
+ephy_history_service_message_is_batchable (EphyHistoryServiceMessage *message)
+{
+  return ephy_history_service_message_is_write (message) && message->type != CLEAR;
+}
+
+static gboolean
+ephy_history_service_message_is_read (EphyHistoryServiceMessage *message)
+{
+  return message->type > QUIT;
+}
+
 static void
-ephy_history_service_process_message (EphyHistoryService        *self,
+ephy_history_service_execute_message (EphyHistoryService        *self,
                                       EphyHistoryServiceMessage *message)
 {
   EphyHistoryServiceMethod method;
 
+  method = methods[message->type];
+  message->result = NULL;
+  if (ephy_history_service_get_database (self))
+    message->success = method (message->service, message->method_argument, &message->result);
+  else
+    message->success = FALSE;
+}
+
+static void
+ephy_history_service_complete_message (EphyHistoryService        *self,
+                                       EphyHistoryServiceMessage *message)
+{
+  if (message->callback || message->type == CLEAR)
+    ephy_history_service_queue_delivery (self, DELIVER_MESSAGE, message);
+  else
+    ephy_history_service_message_free (message);
+}
+
+static void
+ephy_history_service_process_message (EphyHistoryService        *self,
+                                      EphyHistoryServiceMessage *message)
+{
   g_assert (self->history_thread == g_thread_self ());
 
   if (g_cancellable_is_cancelled (message->cancellable) &&
@@ -1237,22 +1846,176 @@ ephy_history_service_process_message (EphyHistoryService        *self,
     return;
   }
 
-  method = methods[message->type];
-  message->result = NULL;
-  if (message->service->history_database) {
-    ephy_history_service_open_transaction (self);
-    message->success = method (message->service, message->method_argument, &message->result);
-    ephy_history_service_commit_transaction (self);
-  } else {
-    message->success = FALSE;
+  if (self->reader_pool && ephy_history_service_message_is_read (message)) {
+    g_thread_pool_push (self->reader_pool, message, NULL);
+    return;
   }
 
-  if (message->callback || message->type == CLEAR)
-    g_idle_add ((GSourceFunc)ephy_history_service_execute_job_callback, message);
-  else
+  ephy_history_service_open_transaction (self);
+  ephy_history_service_execute_message (self, message);
+  ephy_history_service_commit_transaction (self);
+
+  ephy_history_service_complete_message (self, message);
+}
+
+/* Whether a newer message with the same coalescing key was queued while
+ * @message, already out of the queue, was waiting for a reader. */
+static gboolean
+ephy_history_service_message_is_superseded (EphyHistoryService        *self,
+                                            EphyHistoryServiceMessage *message)
+{
+  gboolean superseded;
+
+  if (!message->coalescing_key)
+    return FALSE;
+
+  g_mutex_lock (&self->queue_mutex);
+  superseded = g_hash_table_contains (self->coalesced_messages, message->coalescing_key);
+  if (superseded)
+    self->num_superseded_messages++;
+  g_mutex_unlock (&self->queue_mutex);
+
+  return superseded;
+}
+
+static void
+run_history_reader (EphyHistoryServiceMessage *message,
+                    EphyHistoryService        *self)
+{
+  EphyHistoryReader *reader = g_private_get (&reader_private);
+  int generation = g_atomic_int_get (&self->database_generation);
+  GError *error = NULL;
+
+  if (!reader) {
+    reader = g_new0 (EphyHistoryReader, 1);
+    reader->service = self;
+    g_private_set (&reader_private, reader);
+  }
+
+  g_assert (reader->service == self);
+
+  if (!reader->database || reader->database_generation != generation) {
+    if (reader->database) {
+      ephy_sqlite_connection_close (reader->database);
+      g_clear_object (&reader->database);
+    }
+
+    reader->database = ephy_sqlite_connection_new (EPHY_SQLITE_CONNECTION_MODE_READ_ONLY,
+                                                   self->history_filename);
+    reader->database_generation = generation;
+    if (!ephy_sqlite_connection_open (reader->database, &error)) {
+      g_warning ("Could not open read-only history database at %s: %s", self->history_filename, error->message);
+      g_error_free (error);
+      g_clear_object (&reader->database);
+    }
+  }
+
+  if (g_cancellable_is_cancelled (message->cancellable)) {
     ephy_history_service_message_free (message);
+    return;
+  }
+
+  if (ephy_history_service_message_is_superseded (self, message)) {
+    message->success = FALSE;
+    ephy_history_service_complete_message (self, message);
+    return;
+  }
+
+  /* Some reads run several queries, which must see the same snapshot. */
+  if (reader->database && !ephy_sqlite_connection_begin_transaction (reader->database, &error)) {
+    g_warning ("Could not open read-only history database transaction: %s", error->message);
+    g_clear_error (&error);
+  }
+
+  ephy_history_service_execute_message (self, message);
+
+  if (reader->database && !ephy_sqlite_connection_commit_transaction (reader->database, &error)) {
+    g_warning ("Could not end read-only history database transaction: %s", error->message);
+    g_clear_error (&error);
+  }
+
+  ephy_history_service_complete_message (self, message);
+}
+
+/* Executes @message and any batchable messages already waiting in the queue
+ * in a single transaction. Callbacks are only scheduled once the transaction
+ * has been committed. Returns the first message popped from the queue that
+ * could not be added to the batch, or %NULL. */
+static EphyHistoryServiceMessage *
+ephy_history_service_process_write_batch (EphyHistoryService        *self,
+                                          EphyHistoryServiceMessage *message)
+{
+  g_autoptr (GPtrArray) batch = g_ptr_array_new ();
+  gint64 start_time = g_get_monotonic_time ();
+  gint64 commit_time;
+
+  g_assert (self->history_thread == g_thread_self ());
+  g_assert (ephy_history_service_message_is_batchable (message));
+
+  ephy_history_service_open_transaction (self);
+
+  while (message) {
+    ephy_history_service_execute_message (self, message);
+    g_ptr_array_add (batch, message);
+    message = NULL;
+
+    if (batch->len >= MAX_WRITE_BATCH_SIZE ||
+        g_get_monotonic_time () - start_time >= MAX_WRITE_BATCH_LATENCY)
+      break;
+
+    message = ephy_history_service_pop_message (self, 0);
+    if (message && !ephy_history_service_message_is_batchable (message))
+      break;
+  }
+
+  commit_time = g_get_monotonic_time ();
+  ephy_history_service_commit_transaction (self);
+  commit_time = g_get_monotonic_time () - commit_time;
+
+  self->num_write_batches++;
+  self->num_batched_writes += batch->len;
+  self->max_write_batch_size = MAX (self->max_write_batch_size, batch->len);
+  self->total_commit_time += commit_time;
+  self->max_commit_time = MAX (self->max_commit_time, commit_time);
+
+  if (batch->len > 1)
+    LOG ("Committed %u history writes in one transaction, commit took %" G_GINT64_FORMAT " us",
+         batch->len, commit_time);
+
+  for (guint i = 0; i < batch->len; i++)
+    ephy_history_service_complete_message (self, g_ptr_array_index (batch, i));
+
+  return message;
+}
+
+gboolean
+ephy_history_service_is_reader_thread (EphyHistoryService *self)
+{
+  EphyHistoryReader *reader = g_private_get (&reader_private);
+
+  return reader && reader->service == self;
+}
+
+/**
+ * ephy_history_service_get_database:
+ * @self: an #EphyHistoryService
+ *
+ * Get the connection the calling thread should use. This is the read-only
+ * connection of the current reader thread, or the read/write connection when
+ * called from the history thread.
+ *
+ * Return value: (transfer none): an #EphySQLiteConnection, or %NULL if the
+ *               database could not be opened
+ **/
+EphySQLiteConnection *
+ephy_history_service_get_database (EphyHistoryService *self)
+{
+  if (ephy_history_service_is_reader_thread (self))
+    return ((EphyHistoryReader *)g_private_get (&reader_private))->database;
+
+  g_assert (self->history_thread == g_thread_self ());
 
-  return;
+  return self->history_database;
 }
 
 /* Public API. */
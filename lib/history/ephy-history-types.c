@@ -213,6 +213,135 @@ ephy_history_url_list_free (GList *list)
   g_list_free_full (list, (GDestroyNotify)ephy_history_url_free);
 }
 
+/* Rows are stored by value in a single array, and their strings are all
+ * copied into one string chunk, so a set of N rows takes a handful of
+ * allocations instead of several per row. */
+struct _EphyHistoryURLSet {
+  GArray *rows;
+  GStringChunk *strings;
+};
+
+static void
+ephy_history_url_set_clear (EphyHistoryURLSet *set)
+{
+  g_array_unref (set->rows);
+  g_string_chunk_free (set->strings);
+}
+
+/**
+ * ephy_history_url_set_new:
+ *
+ * Create an empty, reference counted set of URL rows. It can be handed over
+ * between threads, but must not be modified once shared.
+ *
+ * Return value: (transfer full): a new #EphyHistoryURLSet
+ **/
+EphyHistoryURLSet *
+ephy_history_url_set_new (void)
+{
+  EphyHistoryURLSet *set = g_atomic_rc_box_new0 (EphyHistoryURLSet);
+
+  set->rows = g_array_new (FALSE, FALSE, sizeof (EphyHistoryURLRow));
+  set->strings = g_string_chunk_new (4096);
+
+  return set;
+}
+
+EphyHistoryURLSet *
+ephy_history_url_set_ref (EphyHistoryURLSet *set)
+{
+  return g_atomic_rc_box_acquire (set);
+}
+
+void
+ephy_history_url_set_unref (EphyHistoryURLSet *set)
+{
+  if (set == NULL)
+    return;
+
+  g_atomic_rc_box_release_full (set, (GDestroyNotify)ephy_history_url_set_clear);
+}
+
+static const char *
+ephy_history_url_set_insert_string (EphyHistoryURLSet *set,
+                                    const char        *string)
+{
+  return string ? g_string_chunk_insert (set->strings, string) : NULL;
+}
+
+/**
+ * ephy_history_url_set_append:
+ * @set: an #EphyHistoryURLSet
+ * @row: the row to append
+ *
+ * Append a copy of @row to @set. The strings of @row are copied into @set.
+ **/
+void
+ephy_history_url_set_append (EphyHistoryURLSet       *set,
+                             const EphyHistoryURLRow *row)
+{
+  EphyHistoryURLRow copy = *row;
+
+  copy.url = ephy_history_url_set_insert_string (set, row->url);
+  copy.title = ephy_history_url_set_insert_string (set, row->title);
+  copy.sync_id = ephy_history_url_set_insert_string (set, row->sync_id);
+
+  g_array_append_val (set->rows, copy);
+}
+
+guint
+ephy_history_url_set_get_length (EphyHistoryURLSet *set)
+{
+  return set ? set->rows->len : 0;
+}
+
+/**
+ * ephy_history_url_set_get_row:
+ * @set: an #EphyHistoryURLSet
+ * @index: the index of the row
+ *
+ * Return value: (transfer none): the row at @index, valid as long as @set
+ **/
+const EphyHistoryURLRow *
+ephy_history_url_set_get_row (EphyHistoryURLSet *set,
+                              guint              index)
+{
+  g_assert (index < set->rows->len);
+
+  return &g_array_index (set->rows, EphyHistoryURLRow, index);
+}
+
+/**
+ * ephy_history_url_set_to_list:
+ * @set: an #EphyHistoryURLSet
+ *
+ * Convert @set to the list form returned by ephy_history_service_query_urls(),
+ * for code that still works with #EphyHistoryURL.
+ *
+ * Return value: (transfer full): a list of #EphyHistoryURL
+ **/
+GList *
+ephy_history_url_set_to_list (EphyHistoryURLSet *set)
+{
+  GList *urls = NULL;
+
+  for (guint i = ephy_history_url_set_get_length (set); i > 0; i--) {
+    const EphyHistoryURLRow *row = ephy_history_url_set_get_row (set, i - 1);
+    EphyHistoryURL *url = ephy_history_url_new (row->url, row->title, row->visit_count,
+                                                row->typed_count, row->last_visit_time);
+
+    url->id = row->id;
+    url->sync_id = g_strdup (row->sync_id);
+    url->hidden = row->hidden;
+    url->host = ephy_history_host_new (NULL, NULL, 0, 0.0);
+    url->host->id = row->host_id;
+
+    urls = g_list_prepend (urls, url);
+  }
+
+  return urls;
+}
+
 EphyHistoryQuery *
 ephy_history_query_new (void)
 {
@@ -223,6 +352,8 @@ void
 ephy_history_query_free (EphyHistoryQuery *query)
 {
   g_list_free_full (query->substring_list, g_free);
+  g_free (query->coalescing_key);
+  ephy_history_url_free (query->page_after);
   g_free (query);
 }
 
@@ -238,6 +369,8 @@ ephy_history_query_copy (EphyHistoryQuery *query)
   copy->ignore_hidden = query->ignore_hidden;
   copy->ignore_local = query->ignore_local;
   copy->host = query->host;
+  copy->coalescing_key = g_strdup (query->coalescing_key);
+  copy->page_after = ephy_history_url_copy (query->page_after);
 
   for (iter = query->substring_list; iter != NULL; iter = iter->next) {
     copy->substring_list = g_list_prepend (copy->substring_list, g_strdup (iter->data));
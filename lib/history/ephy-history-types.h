@@ -47,7 +47,9 @@ typedef enum {
   EPHY_HISTORY_SORT_TITLE_ASCENDING,
   EPHY_HISTORY_SORT_TITLE_DESCENDING,
   EPHY_HISTORY_SORT_URL_ASCENDING,
-  EPHY_HISTORY_SORT_URL_DESCENDING
+  EPHY_HISTORY_SORT_URL_DESCENDING,
+  EPHY_HISTORY_SORT_RELEVANCE,
+  EPHY_HISTORY_SORT_FRECENCY
 } EphyHistorySortType;
 
 typedef struct
@@ -74,6 +76,22 @@ typedef struct _EphyHistoryURL
   gboolean notify_delete;
 } EphyHistoryURL;
 
+/* A row of an EphyHistoryURLSet. The strings belong to the set. */
+typedef struct
+{
+  int id;
+  const char *url;
+  const char *title;
+  const char *sync_id;
+  int visit_count;
+  int typed_count;
+  gint64 last_visit_time; /* Microseconds */
+  gboolean hidden;
+  int host_id;
+} EphyHistoryURLRow;
+
+typedef struct _EphyHistoryURLSet EphyHistoryURLSet;
+
 typedef struct _EphyHistoryPageVisit
 {
   EphyHistoryURL* url;
@@ -92,6 +110,11 @@ typedef struct _EphyHistoryQuery
   gboolean ignore_local;
   gint host;
   EphyHistorySortType sort_type;
+  /* A newer query with the same key supersedes this one while it is queued. */
+  char *coalescing_key;
+  /* The last URL of the previous page, to fetch the next @limit URLs after
+   * it in @sort_type order. Not supported for frecency or relevance. */
+  EphyHistoryURL *page_after;
 } EphyHistoryQuery;
 
 EphyHistoryPageVisit *          ephy_history_page_visit_new (const char *url, gint64 visit_time, EphyHistoryPageVisitType visit_type);
@@ -114,12 +137,21 @@ void                            ephy_history_url_free (EphyHistoryURL *url);
 GList *                         ephy_history_url_list_copy (GList *original);
 void                            ephy_history_url_list_free (GList *list);
 
+EphyHistoryURLSet *             ephy_history_url_set_new (void);
+EphyHistoryURLSet *             ephy_history_url_set_ref (EphyHistoryURLSet *set);
+void                            ephy_history_url_set_unref (EphyHistoryURLSet *set);
+void                            ephy_history_url_set_append (EphyHistoryURLSet *set, const EphyHistoryURLRow *row);
+guint                           ephy_history_url_set_get_length (EphyHistoryURLSet *set);
+const EphyHistoryURLRow *       ephy_history_url_set_get_row (EphyHistoryURLSet *set, guint index);
+GList *                         ephy_history_url_set_to_list (EphyHistoryURLSet *set);
+
 EphyHistoryQuery *              ephy_history_query_new (void);
 void                            ephy_history_query_free (EphyHistoryQuery *query);
 EphyHistoryQuery *              ephy_history_query_copy (EphyHistoryQuery *query);
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(EphyHistoryHost, ephy_history_host_free)
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(EphyHistoryURL, ephy_history_url_free)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(EphyHistoryURLSet, ephy_history_url_set_unref)
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(EphyHistoryPageVisit, ephy_history_page_visit_free)
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(EphyHistoryQuery, ephy_history_query_free)
 
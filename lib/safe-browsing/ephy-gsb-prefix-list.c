@@ -0,0 +1,311 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2021 Epiphany Developers
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "ephy-gsb-prefix-list.h"
+
+#include "ephy-gsb-prefix-set.h"
+#include "ephy-gsb-utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* The hash prefixes of a threat list in lexicographic order, which is the
+ * order the indices of removals and the checksum of a threat list refer to.
+ * Prefixes are 4 to 32 bytes long, so each one is stored as its length
+ * followed by its bytes. Everything is done in a single pass over them.
+ */
+struct _EphyGSBPrefixList {
+  GByteArray *data;
+  gsize size;
+  gsize last_offset; /* Offset of the last prefix, if size > 0 */
+};
+
+static inline int
+compare_prefixes (const guint8 *a,
+                  gsize         a_len,
+                  const guint8 *b,
+                  gsize         b_len)
+{
+  int result = memcmp (a, b, MIN (a_len, b_len));
+
+  /* Same as SQLite compares blobs. */
+  if (result == 0)
+    result = (a_len > b_len) - (a_len < b_len);
+
+  return result;
+}
+
+EphyGSBPrefixList *
+ephy_gsb_prefix_list_new (void)
+{
+  EphyGSBPrefixList *list;
+
+  list = g_new0 (EphyGSBPrefixList, 1);
+  list->data = g_byte_array_new ();
+
+  return list;
+}
+
+void
+ephy_gsb_prefix_list_free (EphyGSBPrefixList *list)
+{
+  g_assert (list);
+
+  g_byte_array_free (list->data, TRUE);
+  g_free (list);
+}
+
+gsize
+ephy_gsb_prefix_list_get_size (EphyGSBPrefixList *list)
+{
+  g_assert (list);
+
+  return list->size;
+}
+
+/**
+ * ephy_gsb_prefix_list_append:
+ * @list: an #EphyGSBPrefixList
+ * @prefix: a hash prefix
+ * @length: the length of @prefix, between 4 and 32
+ *
+ * Add @prefix at the end of @list, unless it doesn't come after the last
+ * prefix of @list.
+ *
+ * Return value: %TRUE if @prefix was added
+ **/
+gboolean
+ephy_gsb_prefix_list_append (EphyGSBPrefixList *list,
+                             const guint8      *prefix,
+                             gsize              length)
+{
+  guint8 length_byte = length;
+
+  g_assert (list);
+  g_assert (prefix);
+  g_assert (length >= GSB_HASH_CUE_LEN && length <= GSB_HASH_SIZE);
+
+  if (list->size > 0) {
+    const guint8 *last = list->data->data + list->last_offset;
+
+    if (compare_prefixes (last + 1, last[0], prefix, length) >= 0)
+      return FALSE;
+  }
+
+  list->last_offset = list->data->len;
+  g_byte_array_append (list->data, &length_byte, 1);
+  g_byte_array_append (list->data, prefix, length);
+  list->size++;
+
+  return TRUE;
+}
+
+static int
+compare_indices (gconstpointer a,
+                 gconstpointer b)
+{
+  guint32 x = *(const guint32 *)a;
+  guint32 y = *(const guint32 *)b;
+
+  return (x > y) - (x < y);
+}
+
+/**
+ * ephy_gsb_prefix_list_remove:
+ * @list: an #EphyGSBPrefixList
+ * @indices: the indices of the prefixes to remove, in any order
+ * @num_indices: the length of @indices
+ * @num_removed: (out): the number of prefixes removed
+ *
+ * Remove the prefixes at @indices from @list. Indices that are out of range
+ * are ignored.
+ *
+ * Return value: (transfer full): the removed prefixes as #GBytes
+ **/
+GList *
+ephy_gsb_prefix_list_remove (EphyGSBPrefixList *list,
+                             const guint32     *indices,
+                             gsize              num_indices,
+                             gsize             *num_removed)
+{
+  GByteArray *data;
+  GList *removed = NULL;
+  guint32 *sorted;
+  gsize offset = 0;
+  gsize next = 0;
+
+  g_assert (list);
+  g_assert (indices || num_indices == 0);
+  g_assert (num_removed);
+
+  *num_removed = 0;
+  if (num_indices == 0)
+    return NULL;
+
+  sorted = g_new (guint32, num_indices);
+  memcpy (sorted, indices, num_indices * sizeof (guint32));
+  qsort (sorted, num_indices, sizeof (guint32), compare_indices);
+
+  data = g_byte_array_sized_new (list->data->len);
+  list->last_offset = 0;
+
+  for (gsize i = 0; i < list->size; i++) {
+    const guint8 *prefix = list->data->data + offset;
+    gsize length = 1 + prefix[0];
+
+    while (next < num_indices && sorted[next] < i)
+      next++;
+
+    if (next < num_indices && sorted[next] == i) {
+      removed = g_list_prepend (removed, g_bytes_new (prefix + 1, prefix[0]));
+      (*num_removed)++;
+    } else {
+      list->last_offset = data->len;
+      g_byte_array_append (data, prefix, length);
+    }
+
+    offset += length;
+  }
+
+  g_byte_array_free (list->data, TRUE);
+  list->data = data;
+  list->size -= *num_removed;
+
+  g_free (sorted);
+
+  return removed;
+}
+
+/**
+ * ephy_gsb_prefix_list_merge:
+ * @list: an #EphyGSBPrefixList
+ * @additions: the #EphyGSBPrefixList to add to @list
+ *
+ * Add the prefixes of @additions to @list, keeping it sorted. Prefixes that
+ * are in both are only kept once.
+ **/
+void
+ephy_gsb_prefix_list_merge (EphyGSBPrefixList *list,
+                            EphyGSBPrefixList *additions)
+{
+  GByteArray *data;
+  gsize offset = 0;
+  gsize added_offset = 0;
+  gsize size = 0;
+
+  g_assert (list);
+  g_assert (additions);
+
+  if (additions->size == 0)
+    return;
+
+  data = g_byte_array_sized_new (list->data->len + additions->data->len);
+
+  while (offset < list->data->len || added_offset < additions->data->len) {
+    const guint8 *prefix = list->data->data + offset;
+    const guint8 *added = additions->data->data + added_offset;
+    int result;
+
+    if (offset == list->data->len)
+      result = 1;
+    else if (added_offset == additions->data->len)
+      result = -1;
+    else
+      result = compare_prefixes (prefix + 1, prefix[0], added + 1, added[0]);
+
+    list->last_offset = data->len;
+    if (result <= 0) {
+      g_byte_array_append (data, prefix, 1 + prefix[0]);
+      offset += 1 + prefix[0];
+    } else {
+      g_byte_array_append (data, added, 1 + added[0]);
+    }
+    if (result >= 0)
+      added_offset += 1 + added[0];
+
+    size++;
+  }
+
+  g_byte_array_free (list->data, TRUE);
+  list->data = data;
+  list->size = size;
+}
+
+/**
+ * ephy_gsb_prefix_list_compute_checksum:
+ * @list: an #EphyGSBPrefixList
+ *
+ * Compute the SHA256 checksum of the prefixes of @list, concatenated in
+ * order.
+ *
+ * https://developers.google.com/safe-browsing/v4/local-databases#validation-checks
+ *
+ * Return value: (transfer full): the base64 encoded checksum
+ **/
+char *
+ephy_gsb_prefix_list_compute_checksum (EphyGSBPrefixList *list)
+{
+  GChecksum *checksum;
+  guint8 digest[64];
+  gsize digest_len = sizeof (digest);
+  gsize offset = 0;
+
+  g_assert (list);
+
+  checksum = g_checksum_new (GSB_HASH_TYPE);
+  while (offset < list->data->len) {
+    const guint8 *prefix = list->data->data + offset;
+
+    g_checksum_update (checksum, prefix + 1, prefix[0]);
+    offset += 1 + prefix[0];
+  }
+
+  g_checksum_get_digest (checksum, digest, &digest_len);
+  g_checksum_free (checksum);
+
+  return g_base64_encode (digest, digest_len);
+}
+
+/**
+ * ephy_gsb_prefix_list_get_cues:
+ * @list: an #EphyGSBPrefixList
+ * @cues: a #GArray of guint32
+ *
+ * Append the cues of the prefixes of @list to @cues, as returned by
+ * ephy_gsb_prefix_set_cue_to_uint().
+ **/
+void
+ephy_gsb_prefix_list_get_cues (EphyGSBPrefixList *list,
+                               GArray            *cues)
+{
+  gsize offset = 0;
+
+  g_assert (list);
+  g_assert (cues);
+
+  while (offset < list->data->len) {
+    const guint8 *prefix = list->data->data + offset;
+    guint32 cue = ephy_gsb_prefix_set_cue_to_uint (prefix + 1);
+
+    g_array_append_val (cues, cue);
+    offset += 1 + prefix[0];
+  }
+}
@@ -0,0 +1,47 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2021 Epiphany Developers
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _EphyGSBPrefixList EphyGSBPrefixList;
+
+EphyGSBPrefixList *ephy_gsb_prefix_list_new              (void);
+void               ephy_gsb_prefix_list_free             (EphyGSBPrefixList *list);
+gsize              ephy_gsb_prefix_list_get_size         (EphyGSBPrefixList *list);
+gboolean           ephy_gsb_prefix_list_append           (EphyGSBPrefixList *list,
+                                                          const guint8      *prefix,
+                                                          gsize              length);
+GList             *ephy_gsb_prefix_list_remove           (EphyGSBPrefixList *list,
+                                                          const guint32     *indices,
+                                                          gsize              num_indices,
+                                                          gsize             *num_removed);
+void               ephy_gsb_prefix_list_merge            (EphyGSBPrefixList *list,
+                                                          EphyGSBPrefixList *additions);
+char              *ephy_gsb_prefix_list_compute_checksum (EphyGSBPrefixList *list);
+void               ephy_gsb_prefix_list_get_cues         (EphyGSBPrefixList *list,
+                                                          GArray            *cues);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EphyGSBPrefixList, ephy_gsb_prefix_list_free)
+
+G_END_DECLS
@@ -0,0 +1,225 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2021 Epiphany Developers
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "ephy-gsb-prefix-set.h"
+
+#include "ephy-gsb-utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Cues are stored as runs: the first cue of a run in full, then the
+ * differences to the previous cue in 16 bits. Lists of a few hundred thousand
+ * random 32-bit cues have differences well below 2^16, so this takes about
+ * half the memory of a plain array. A lookup is a binary search over the runs
+ * followed by a linear scan of at most MAX_RUN_LENGTH deltas.
+ */
+#define MAX_RUN_LENGTH 64
+
+typedef struct {
+  guint32 first_cue;
+  guint32 deltas_offset; /* Index of the first delta of the run */
+} EphyGSBPrefixSetRun;
+
+struct _EphyGSBPrefixSet {
+  EphyGSBPrefixSetRun *runs;
+  gsize num_runs;
+  guint16 *deltas;
+  gsize num_deltas;
+  gsize size;
+};
+
+static int
+compare_cues (gconstpointer a,
+              gconstpointer b)
+{
+  guint32 x = *(const guint32 *)a;
+  guint32 y = *(const guint32 *)b;
+
+  return (x > y) - (x < y);
+}
+
+/**
+ * ephy_gsb_prefix_set_cue_to_uint:
+ * @cue: the first GSB_HASH_CUE_LEN bytes of a hash prefix
+ *
+ * Read @cue as a big-endian integer, so that the numeric order of cues is the
+ * lexicographic order of their bytes.
+ *
+ * Return value: @cue as an integer
+ **/
+guint32
+ephy_gsb_prefix_set_cue_to_uint (const guint8 *cue)
+{
+  guint32 value;
+
+  memcpy (&value, cue, GSB_HASH_CUE_LEN);
+
+  return GUINT32_FROM_BE (value);
+}
+
+/**
+ * ephy_gsb_prefix_set_new:
+ * @cues: an array of cues as returned by ephy_gsb_prefix_set_cue_to_uint(),
+ *   in any order and possibly with duplicates. It is sorted in place.
+ * @num_cues: the number of elements in @cues
+ *
+ * Build an immutable set of hash prefix cues that can be shared between
+ * threads.
+ *
+ * Return value: (transfer full): a new #EphyGSBPrefixSet
+ **/
+EphyGSBPrefixSet *
+ephy_gsb_prefix_set_new (guint32 *cues,
+                         gsize    num_cues)
+{
+  EphyGSBPrefixSet *set;
+  GArray *runs;
+  GArray *deltas;
+  gsize run_length = 0;
+
+  g_assert (cues || num_cues == 0);
+
+  if (num_cues > 0)
+    qsort (cues, num_cues, sizeof (guint32), compare_cues);
+
+  runs = g_array_new (FALSE, FALSE, sizeof (EphyGSBPrefixSetRun));
+  deltas = g_array_sized_new (FALSE, FALSE, sizeof (guint16), num_cues);
+
+  set = g_atomic_rc_box_new0 (EphyGSBPrefixSet);
+
+  for (gsize i = 0; i < num_cues; i++) {
+    guint32 delta;
+
+    if (i > 0 && cues[i] == cues[i - 1])
+      continue;
+
+    set->size++;
+    delta = i > 0 ? cues[i] - cues[i - 1] : 0;
+
+    if (runs->len == 0 || delta > G_MAXUINT16 || run_length == MAX_RUN_LENGTH) {
+      EphyGSBPrefixSetRun run = { cues[i], deltas->len };
+
+      g_array_append_val (runs, run);
+      run_length = 0;
+    } else {
+      guint16 delta16 = delta;
+
+      g_array_append_val (deltas, delta16);
+      run_length++;
+    }
+  }
+
+  set->num_runs = runs->len;
+  set->runs = (EphyGSBPrefixSetRun *)g_array_free (runs, FALSE);
+  set->num_deltas = deltas->len;
+  set->deltas = g_new (guint16, deltas->len);
+  memcpy (set->deltas, deltas->data, deltas->len * sizeof (guint16));
+  g_array_free (deltas, TRUE);
+
+  return set;
+}
+
+EphyGSBPrefixSet *
+ephy_gsb_prefix_set_ref (EphyGSBPrefixSet *set)
+{
+  g_assert (set);
+
+  return g_atomic_rc_box_acquire (set);
+}
+
+static void
+ephy_gsb_prefix_set_clear (EphyGSBPrefixSet *set)
+{
+  g_free (set->runs);
+  g_free (set->deltas);
+}
+
+void
+ephy_gsb_prefix_set_unref (EphyGSBPrefixSet *set)
+{
+  g_assert (set);
+
+  g_atomic_rc_box_release_full (set, (GDestroyNotify)ephy_gsb_prefix_set_clear);
+}
+
+/**
+ * ephy_gsb_prefix_set_get_size:
+ * @set: an #EphyGSBPrefixSet
+ *
+ * Return value: the number of distinct cues in @set
+ **/
+gsize
+ephy_gsb_prefix_set_get_size (EphyGSBPrefixSet *set)
+{
+  g_assert (set);
+
+  return set->size;
+}
+
+/**
+ * ephy_gsb_prefix_set_contains:
+ * @set: an #EphyGSBPrefixSet
+ * @cue: the first GSB_HASH_CUE_LEN bytes of a hash
+ *
+ * Check whether any hash prefix of @set starts with @cue.
+ *
+ * Return value: %TRUE if @cue is in @set
+ **/
+gboolean
+ephy_gsb_prefix_set_contains (EphyGSBPrefixSet *set,
+                              const guint8     *cue)
+{
+  guint32 value;
+  guint32 current;
+  gsize low = 0;
+  gsize high;
+  gsize end;
+
+  g_assert (set);
+  g_assert (cue);
+
+  if (set->num_runs == 0)
+    return FALSE;
+
+  value = ephy_gsb_prefix_set_cue_to_uint (cue);
+  if (value < set->runs[0].first_cue)
+    return FALSE;
+
+  /* Find the last run starting at or before @value. */
+  high = set->num_runs;
+  while (high - low > 1) {
+    gsize middle = low + (high - low) / 2;
+
+    if (set->runs[middle].first_cue <= value)
+      low = middle;
+    else
+      high = middle;
+  }
+
+  current = set->runs[low].first_cue;
+  end = low + 1 < set->num_runs ? set->runs[low + 1].deltas_offset : set->num_deltas;
+
+  for (gsize i = set->runs[low].deltas_offset; i < end && current < value; i++)
+    current += set->deltas[i];
+
+  return current == value;
+}
@@ -23,6 +23,7 @@
 
 #include "ephy-debug.h"
 #include "ephy-gsb-storage.h"
+#include "ephy-gsb-update-parser.h"
 #include "ephy-user-agent.h"
 
 #include <libsoup/soup.h>
@@ -30,30 +31,58 @@
 #include <stdio.h>
 #include <string.h>
 
-#define API_PREFIX        "https://safebrowsing.googleapis.com/v4/"
+#define DEFAULT_API_PREFIX "https://safebrowsing.googleapis.com/v4/"
 
 /* See comment in ephy_gsb_service_schedule_update(). */
 #define JITTER            2                               /* seconds */
 #define CURRENT_TIME      (g_get_real_time () / 1000000)  /* seconds */
 #define DEFAULT_WAIT_TIME (30 * 60)                       /* seconds */
 
+typedef struct {
+  GThread *thread;
+  GMainLoop *loop;
+  SoupSession *session;
+} EphyGSBWorker;
+
 struct _EphyGSBService {
   GObject parent_instance;
 
   char *api_key;
+  char *api_prefix;
   EphyGSBStorage *storage;
 
-  gboolean is_updating;
   guint source_id;
 
   gint64 next_full_hashes_time;
   gint64 next_list_updates_time;
+
+  /* Shared by all workers. */
+  GMutex back_off_mutex;
   gint64 back_off_exit_time;
   gint64 back_off_num_fails;
 
-  GThread *update_thread;
-  GMainLoop *update_loop;
-  SoupSession *session;
+  /* threatListUpdates:fetch and fullHashes:find requests run on separate
+   * threads, so that lookups never wait for a list update to finish. URLs are
+   * verified on a third one, which does nothing else and is the only one to
+   * read through the read-only connection of the storage, so that navigation
+   * never waits for other work in the process. A verification that needs
+   * full hashes from the server yields the thread until they arrive. */
+  EphyGSBWorker update_worker;
+  EphyGSBWorker full_hashes_worker;
+  EphyGSBWorker verify_worker;
+
+  /* The fullHashes:find requests that are queued or sent, by the hash
+   * prefixes they look up, so that verifications of the same prefixes wait
+   * for them rather than send their own. Their responses go to an in-memory
+   * cache in front of the database: the full hashes with their cacheDuration
+   * and the prefixes with their negativeCacheDuration. The requests are made
+   * for the threat lists as of the last update. All guarded by
+   * full_hashes_mutex. */
+  GMutex full_hashes_mutex;
+  GHashTable *pending_full_hashes;
+  GHashTable *positive_cache;
+  GHashTable *negative_cache;
+  GList *threat_lists;
 };
 
 G_DEFINE_TYPE (EphyGSBService, ephy_gsb_service, G_TYPE_OBJECT);
@@ -61,6 +90,7 @@ G_DEFINE_TYPE (EphyGSBService, ephy_gsb_service, G_TYPE_OBJECT);
 enum {
   PROP_0,
   PROP_API_KEY,
+  PROP_API_PREFIX,
   PROP_GSB_STORAGE,
   LAST_PROP
 };
@@ -75,6 +105,11 @@ enum {
 static guint signals[LAST_SIGNAL];
 
 static gboolean ephy_gsb_service_update (EphyGSBService *self);
+static void ephy_gsb_worker_invoke (EphyGSBWorker  *worker,
+                                    const char     *name,
+                                    GSourceFunc     func,
+                                    gpointer        data,
+                                    GDestroyNotify  notify);
 
 static inline gboolean
 json_object_has_non_null_string_member (JsonObject *object,
@@ -102,6 +137,28 @@ json_object_has_non_null_array_member (JsonObject *object,
   return JSON_NODE_HOLDS_ARRAY (node);
 }
 
+static gboolean
+ephy_gsb_service_store_back_off_mode_in_thread (EphyGSBService *self)
+{
+  gint64 back_off_exit_time;
+  gint64 back_off_num_fails;
+
+  g_assert (EPHY_IS_GSB_SERVICE (self));
+
+  if (!ephy_gsb_storage_is_operable (self->storage))
+    return G_SOURCE_REMOVE;
+
+  g_mutex_lock (&self->back_off_mutex);
+  back_off_exit_time = self->back_off_exit_time;
+  back_off_num_fails = self->back_off_num_fails;
+  g_mutex_unlock (&self->back_off_mutex);
+
+  ephy_gsb_storage_set_metadata (self->storage, "back_off_exit_time", back_off_exit_time);
+  ephy_gsb_storage_set_metadata (self->storage, "back_off_num_fails", back_off_num_fails);
+
+  return G_SOURCE_REMOVE;
+}
+
 /*
  * https://developers.google.com/safe-browsing/v4/request-frequency#back-off-mode
  */
@@ -112,11 +169,18 @@ ephy_gsb_service_update_back_off_mode (EphyGSBService *self)
 
   g_assert (EPHY_IS_GSB_SERVICE (self));
 
+  g_mutex_lock (&self->back_off_mutex);
   duration = (1 << self->back_off_num_fails++) * 15 * 60 * (g_random_double () + 1);
   self->back_off_exit_time = CURRENT_TIME + MIN (duration, 24 * 60 * 60);
+  g_mutex_unlock (&self->back_off_mutex);
 
-  ephy_gsb_storage_set_metadata (self->storage, "back_off_exit_time", self->back_off_exit_time);
-  ephy_gsb_storage_set_metadata (self->storage, "back_off_num_fails", self->back_off_num_fails);
+  /* Only the update worker writes to the database. Both workers may enter
+   * back-off mode. */
+  ephy_gsb_worker_invoke (&self->update_worker,
+                          "[epiphany] gsb_service_store_back_off_mode_in_thread",
+                          (GSourceFunc)ephy_gsb_service_store_back_off_mode_in_thread,
+                          g_object_ref (self),
+                          (GDestroyNotify)g_object_unref);
 
   LOG ("Set back-off mode for %ld seconds", duration);
 }
@@ -126,15 +190,65 @@ ephy_gsb_service_reset_back_off_mode (EphyGSBService *self)
 {
   g_assert (EPHY_IS_GSB_SERVICE (self));
 
+  g_mutex_lock (&self->back_off_mutex);
   self->back_off_num_fails = self->back_off_exit_time = 0;
+  g_mutex_unlock (&self->back_off_mutex);
 }
 
 static inline gboolean
 ephy_gsb_service_is_back_off_mode (EphyGSBService *self)
 {
+  gboolean is_back_off_mode;
+
   g_assert (EPHY_IS_GSB_SERVICE (self));
 
-  return self->back_off_num_fails > 0 && self->back_off_exit_time > CURRENT_TIME;
+  g_mutex_lock (&self->back_off_mutex);
+  is_back_off_mode = self->back_off_num_fails > 0 && self->back_off_exit_time > CURRENT_TIME;
+  g_mutex_unlock (&self->back_off_mutex);
+
+  return is_back_off_mode;
+}
+
+static inline gint64
+ephy_gsb_service_get_back_off_exit_time (EphyGSBService *self)
+{
+  gint64 back_off_exit_time;
+
+  g_mutex_lock (&self->back_off_mutex);
+  back_off_exit_time = self->back_off_exit_time;
+  g_mutex_unlock (&self->back_off_mutex);
+
+  return back_off_exit_time;
+}
+
+static void
+ephy_gsb_service_set_threat_lists (EphyGSBService *self,
+                                   GList          *threat_lists)
+{
+  g_mutex_lock (&self->full_hashes_mutex);
+  g_list_free_full (self->threat_lists, (GDestroyNotify)ephy_gsb_threat_list_free);
+  self->threat_lists = threat_lists;
+  g_mutex_unlock (&self->full_hashes_mutex);
+}
+
+static GList *
+ephy_gsb_service_get_threat_lists (EphyGSBService *self)
+{
+  GList *threat_lists = NULL;
+
+  g_mutex_lock (&self->full_hashes_mutex);
+  for (GList *l = self->threat_lists; l && l->data; l = l->next) {
+    EphyGSBThreatList *list = (EphyGSBThreatList *)l->data;
+
+    threat_lists = g_list_prepend (threat_lists,
+                                   ephy_gsb_threat_list_new (list->threat_type,
+                                                             list->platform_type,
+                                                             list->threat_entry_type,
+                                                             list->client_state));
+  }
+  g_mutex_unlock (&self->full_hashes_mutex);
+
+  return g_list_reverse (threat_lists);
 }
 
 static void
@@ -173,28 +287,87 @@ ephy_gsb_service_schedule_update (EphyGSBService *self)
 static gboolean
 ephy_gsb_service_update_finished_cb (EphyGSBService *self)
 {
-  g_atomic_int_set (&self->is_updating, FALSE);
   g_signal_emit (self, signals[UPDATE_FINISHED], 0);
   ephy_gsb_service_schedule_update (self);
 
   return G_SOURCE_REMOVE;
 }
 
+static void
+ephy_gsb_service_stage_additions_cb (const guint8 *prefixes,
+                                     gsize         num_prefixes,
+                                     gsize         prefix_len,
+                                     gpointer      user_data)
+{
+  EphyGSBService *self = EPHY_GSB_SERVICE (user_data);
+
+  ephy_gsb_storage_stage_hash_prefixes (self->storage, prefixes, num_prefixes, prefix_len);
+}
+
+static void
+ephy_gsb_service_update_list_cb (EphyGSBListUpdate *update,
+                                 gpointer           user_data)
+{
+  EphyGSBService *self = EPHY_GSB_SERVICE (user_data);
+  EphyGSBThreatList *list;
+  char *local_checksum;
+
+  if (!update->threat_type || !update->platform_type || !update->threat_entry_type) {
+    g_warning ("Threat list update has no threat type, platform type or threat entry type");
+    ephy_gsb_storage_discard_staged_hash_prefixes (self->storage);
+    return;
+  }
+
+  list = ephy_gsb_threat_list_new (update->threat_type,
+                                   update->platform_type,
+                                   update->threat_entry_type,
+                                   update->new_client_state);
+  LOG ("Updating list %s/%s/%s", list->threat_type, list->platform_type, list->threat_entry_type);
+
+  /* If full update, clear all previous hash prefixes for the given list. */
+  if (!g_strcmp0 (update->response_type, "FULL_UPDATE")) {
+    LOG ("FULL UPDATE, clearing all previous hash prefixes...");
+    ephy_gsb_storage_clear_hash_prefixes (self->storage, list);
+  }
+
+  /* Removals need to be handled before additions. The additions came first in
+   * the response, so they were only staged so far. */
+  ephy_gsb_storage_delete_hash_prefixes (self->storage, list,
+                                         (const guint32 *)update->removals->data,
+                                         update->removals->len);
+  ephy_gsb_storage_commit_hash_prefixes (self->storage, list);
+
+  /* Verify checksum. */
+  local_checksum = ephy_gsb_storage_compute_checksum (self->storage, list);
+  if (!g_strcmp0 (local_checksum, update->checksum)) {
+    LOG ("Local checksum matches the remote checksum, updating client state...");
+    ephy_gsb_storage_update_client_state (self->storage, list, FALSE);
+  } else {
+    LOG ("Local checksum does NOT match the remote checksum, clearing list...");
+    ephy_gsb_storage_clear_hash_prefixes (self->storage, list);
+    ephy_gsb_storage_update_client_state (self->storage, list, TRUE);
+  }
+
+  g_free (local_checksum);
+  ephy_gsb_threat_list_free (list);
+}
+
 static gboolean
 ephy_gsb_service_update_in_thread (EphyGSBService *self)
 {
-  JsonNode *body_node = NULL;
-  JsonObject *body_obj;
-  JsonArray *responses;
+  EphyGSBUpdateParser *parser = NULL;
+  GInputStream *stream = NULL;
   SoupMessage *msg = NULL;
   GList *threat_lists = NULL;
+  GError *error = NULL;
   char *url = NULL;
   char *body;
-  g_autoptr (GBytes) response_body = NULL;
+  char buffer[16384];
+  gssize num_read;
+  double duration;
   guint status_code;
 #if SOUP_CHECK_VERSION (2, 99, 4)
   g_autoptr (GBytes) bytes = NULL;
-  g_autoptr (GError) error = NULL;
 #endif
 
   g_assert (EPHY_IS_GSB_SERVICE (self));
@@ -218,119 +391,85 @@ ephy_gsb_service_update_in_thread (EphyGSBService *self)
   }
 
   body = ephy_gsb_utils_make_list_updates_request (threat_lists);
-  url = g_strdup_printf ("%sthreatListUpdates:fetch?key=%s", API_PREFIX, self->api_key);
+  url = g_strdup_printf ("%sthreatListUpdates:fetch?key=%s", self->api_prefix, self->api_key);
   msg = soup_message_new (SOUP_METHOD_POST, url);
 #if SOUP_CHECK_VERSION (2, 99, 4)
   bytes = g_bytes_new_take (body, strlen (body));
   soup_message_set_request_body_from_bytes (msg, "application/json", bytes);
-  response_body = soup_session_send_and_read (self->session, msg, NULL, &error);
-  if (!response_body) {
+#else
+  soup_message_set_request (msg, "application/json", SOUP_MEMORY_TAKE, body, strlen (body));
+#endif
+
+  /* Read the response as it arrives rather than all at once: a full update
+   * is tens of megabytes of JSON. */
+  stream = soup_session_send (self->update_worker.session, msg, NULL, &error);
+  if (!stream) {
     LOG ("Cannot update threat lists: %s", error->message);
+    g_clear_error (&error);
     ephy_gsb_service_update_back_off_mode (self);
-    self->next_list_updates_time = self->back_off_exit_time;
+    self->next_list_updates_time = ephy_gsb_service_get_back_off_exit_time (self);
     goto out;
   }
 
+#if SOUP_CHECK_VERSION (2, 99, 4)
   status_code = soup_message_get_status (msg);
 #else
-  soup_message_set_request (msg, "application/json", SOUP_MEMORY_TAKE, body, strlen (body));
-  soup_session_send_message (self->session, msg);
   status_code = msg->status_code;
-  response_body = g_bytes_new_static (msg->response_body->data, msg->response_body->length);
 #endif
 
   /* Handle unsuccessful responses. */
   if (status_code != 200) {
-    LOG ("Cannot update threat lists, got: %u, %s", status_code, (const char *)g_bytes_get_data (response_body, NULL));
+    LOG ("Cannot update threat lists, got: %u", status_code);
     ephy_gsb_service_update_back_off_mode (self);
-    self->next_list_updates_time = self->back_off_exit_time;
+    self->next_list_updates_time = ephy_gsb_service_get_back_off_exit_time (self);
     goto out;
   }
 
   /* Successful response, reset back-off mode. */
   ephy_gsb_service_reset_back_off_mode (self);
 
-  body_node = json_from_string (g_bytes_get_data (response_body, NULL), NULL);
-  if (!body_node || !JSON_NODE_HOLDS_OBJECT (body_node)) {
-    g_warning ("Response is not a valid JSON object");
-    goto out;
-  }
-
-  body_obj = json_node_get_object (body_node);
-  responses = json_object_get_array_member (body_obj, "listUpdateResponses");
-
-  for (guint i = 0; i < json_array_get_length (responses); i++) {
-    EphyGSBThreatList *list;
-    JsonObject *lur = json_array_get_object_element (responses, i);
-    const char *type = json_object_get_string_member (lur, "responseType");
-    JsonObject *checksum = json_object_get_object_member (lur, "checksum");
-    const char *remote_checksum = json_object_get_string_member (checksum, "sha256");
-    char *local_checksum;
-
-    list = ephy_gsb_threat_list_new (json_object_get_string_member (lur, "threatType"),
-                                     json_object_get_string_member (lur, "platformType"),
-                                     json_object_get_string_member (lur, "threatEntryType"),
-                                     json_object_get_string_member (lur, "newClientState"));
-    LOG ("Updating list %s/%s/%s", list->threat_type, list->platform_type, list->threat_entry_type);
-
-    /* If full update, clear all previous hash prefixes for the given list. */
-    if (!g_strcmp0 (type, "FULL_UPDATE")) {
-      LOG ("FULL UPDATE, clearing all previous hash prefixes...");
-      ephy_gsb_storage_clear_hash_prefixes (self->storage, list);
-    }
+  /* Lookups keep using the current lists until all of them are updated. */
+  ephy_gsb_storage_begin_update (self->storage);
 
-    /* Removals need to be handled before additions. */
-    if (json_object_has_non_null_array_member (lur, "removals")) {
-      JsonArray *removals = json_object_get_array_member (lur, "removals");
-      for (guint k = 0; k < json_array_get_length (removals); k++) {
-        JsonObject *tes = json_array_get_object_element (removals, k);
-        ephy_gsb_storage_delete_hash_prefixes (self->storage, list, tes);
-      }
-    }
-
-    /* Handle additions. */
-    if (json_object_has_non_null_array_member (lur, "additions")) {
-      JsonArray *additions = json_object_get_array_member (lur, "additions");
-      for (guint k = 0; k < json_array_get_length (additions); k++) {
-        JsonObject *tes = json_array_get_object_element (additions, k);
-        ephy_gsb_storage_insert_hash_prefixes (self->storage, list, tes);
-      }
-    }
-
-    /* Verify checksum. */
-    local_checksum = ephy_gsb_storage_compute_checksum (self->storage, list);
-    if (!g_strcmp0 (local_checksum, remote_checksum)) {
-      LOG ("Local checksum matches the remote checksum, updating client state...");
-      ephy_gsb_storage_update_client_state (self->storage, list, FALSE);
-    } else {
-      LOG ("Local checksum does NOT match the remote checksum, clearing list...");
-      ephy_gsb_storage_clear_hash_prefixes (self->storage, list);
-      ephy_gsb_storage_update_client_state (self->storage, list, TRUE);
-    }
-
-    g_free (local_checksum);
-    ephy_gsb_threat_list_free (list);
+  parser = ephy_gsb_update_parser_new (ephy_gsb_service_stage_additions_cb,
+                                       ephy_gsb_service_update_list_cb,
+                                       self);
+  while ((num_read = g_input_stream_read (stream, buffer, sizeof (buffer), NULL, &error)) > 0) {
+    if (!ephy_gsb_update_parser_feed (parser, buffer, num_read, &error))
+      break;
+  }
+  if (!error)
+    ephy_gsb_update_parser_finish (parser, &error);
+
+  /* The lists updated before an error are complete and their checksums were
+   * verified, so keep them. */
+  if (error) {
+    g_warning ("Cannot read threat list updates: %s", error->message);
+    g_clear_error (&error);
+    /* The additions of the list being read, if any, are incomplete. */
+    ephy_gsb_storage_discard_staged_hash_prefixes (self->storage);
   }
 
-  /* Update next update time. */
-  if (json_object_has_non_null_string_member (body_obj, "minimumWaitDuration")) {
-    const char *duration_str;
-    double duration;
+  ephy_gsb_storage_end_update (self->storage);
 
-    duration_str = json_object_get_string_member (body_obj, "minimumWaitDuration");
-    /* g_ascii_strtod() ignores trailing characters, i.e. 's' character. */
-    duration = g_ascii_strtod (duration_str, NULL);
+  /* Update next update time. */
+  duration = ephy_gsb_update_parser_get_minimum_wait_duration (parser);
+  if (duration >= 0)
     self->next_list_updates_time = CURRENT_TIME + (gint64)ceil (duration);
-  }
 
 out:
   g_free (url);
+  if (parser)
+    ephy_gsb_update_parser_free (parser);
+  if (stream)
+    g_object_unref (stream);
   if (msg)
     g_object_unref (msg);
-  if (body_node)
-    json_node_unref (body_node);
   g_list_free_full (threat_lists, (GDestroyNotify)ephy_gsb_threat_list_free);
 
+  if (ephy_gsb_storage_is_operable (self->storage))
+    ephy_gsb_service_set_threat_lists (self, ephy_gsb_storage_get_threat_lists (self->storage));
+
   ephy_gsb_storage_set_metadata (self->storage, "next_list_updates_time", self->next_list_updates_time);
 
   g_idle_add_full (G_PRIORITY_DEFAULT,
@@ -342,37 +481,82 @@ out:
 }
 
 static gpointer
-run_update_thread (EphyGSBService *self)
+run_worker_thread (EphyGSBWorker *worker)
 {
   GMainContext *context;
 
-  context = g_main_loop_get_context (self->update_loop);
+  context = g_main_loop_get_context (worker->loop);
   g_main_context_push_thread_default (context);
-  self->session = soup_session_new_with_options ("user-agent", ephy_user_agent_get (), NULL);
-  g_main_loop_run (self->update_loop);
-  g_object_unref (self->session);
+  worker->session = soup_session_new_with_options ("user-agent", ephy_user_agent_get (), NULL);
+  g_main_loop_run (worker->loop);
+  g_object_unref (worker->session);
   g_main_context_pop_thread_default (context);
 
   return NULL;
 }
 
-static gboolean
-ephy_gsb_service_update (EphyGSBService *self)
+static void
+ephy_gsb_worker_start (EphyGSBWorker *worker,
+                       const char    *name)
+{
+  GMainContext *context = g_main_context_new ();
+
+  worker->loop = g_main_loop_new (context, FALSE);
+  worker->thread = g_thread_new (name, (GThreadFunc)run_worker_thread, worker);
+  g_main_context_unref (context);
+}
+
+static void
+ephy_gsb_worker_quit (EphyGSBWorker *worker)
+{
+  if (g_main_loop_is_running (worker->loop))
+    g_main_loop_quit (worker->loop);
+}
+
+static void
+ephy_gsb_worker_join (EphyGSBWorker *worker)
+{
+  g_thread_join (worker->thread);
+  g_main_loop_unref (worker->loop);
+}
+
+static void
+ephy_gsb_worker_invoke (EphyGSBWorker  *worker,
+                        const char     *name,
+                        GSourceFunc     func,
+                        gpointer        data,
+                        GDestroyNotify  notify)
 {
   GSource *source;
 
+  source = g_timeout_source_new (0);
+  g_source_set_name (source, name);
+  g_source_set_callback (source, func, data, notify);
+  g_source_attach (source, g_main_loop_get_context (worker->loop));
+  g_source_unref (source);
+}
+
+static gboolean
+ephy_gsb_service_build_prefix_set_in_thread (EphyGSBService *self)
+{
+  g_assert (EPHY_IS_GSB_SERVICE (self));
+
+  ephy_gsb_storage_build_prefix_set (self->storage);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+ephy_gsb_service_update (EphyGSBService *self)
+{
   g_assert (EPHY_IS_GSB_SERVICE (self));
   g_assert (ephy_gsb_storage_is_operable (self->storage));
 
-  g_atomic_int_set (&self->is_updating, TRUE);
-  source = g_timeout_source_new (0);
-  g_source_set_name (source, "[epiphany] gsb_service_update_in_thread");
-  g_source_set_callback (source,
-                         (GSourceFunc)ephy_gsb_service_update_in_thread,
-                         g_object_ref (self),
-                         (GDestroyNotify)g_object_unref);
-  g_source_attach (source, g_main_loop_get_context (self->update_loop));
-  g_source_unref (source);
+  ephy_gsb_worker_invoke (&self->update_worker,
+                          "[epiphany] gsb_service_update_in_thread",
+                          (GSourceFunc)ephy_gsb_service_update_in_thread,
+                          g_object_ref (self),
+                          (GDestroyNotify)g_object_unref);
 
   return G_SOURCE_REMOVE;
 }
@@ -390,6 +574,10 @@ ephy_gsb_service_set_property (GObject      *object,
       g_free (self->api_key);
       self->api_key = g_value_dup_string (value);
       break;
+    case PROP_API_PREFIX:
+      g_free (self->api_prefix);
+      self->api_prefix = g_value_dup_string (value);
+      break;
     case PROP_GSB_STORAGE:
       if (self->storage)
         g_object_unref (self->storage);
@@ -412,6 +600,9 @@ ephy_gsb_service_get_property (GObject    *object,
     case PROP_API_KEY:
       g_value_set_string (value, self->api_key);
       break;
+    case PROP_API_PREFIX:
+      g_value_set_string (value, self->api_prefix);
+      break;
     case PROP_GSB_STORAGE:
       g_value_set_object (value, self->storage);
       break;
@@ -426,9 +617,18 @@ ephy_gsb_service_finalize (GObject *object)
   EphyGSBService *self = EPHY_GSB_SERVICE (object);
 
   g_free (self->api_key);
+  g_free (self->api_prefix);
 
-  g_thread_join (self->update_thread);
-  g_main_loop_unref (self->update_loop);
+  ephy_gsb_worker_join (&self->update_worker);
+  ephy_gsb_worker_join (&self->full_hashes_worker);
+  ephy_gsb_worker_join (&self->verify_worker);
+  g_mutex_clear (&self->back_off_mutex);
+
+  g_hash_table_unref (self->pending_full_hashes);
+  g_hash_table_unref (self->positive_cache);
+  g_hash_table_unref (self->negative_cache);
+  g_list_free_full (self->threat_lists, (GDestroyNotify)ephy_gsb_threat_list_free);
+  g_mutex_clear (&self->full_hashes_mutex);
 
   G_OBJECT_CLASS (ephy_gsb_service_parent_class)->finalize (object);
 }
@@ -442,8 +642,9 @@ ephy_gsb_service_dispose (GObject *object)
 
   g_clear_handle_id (&self->source_id, g_source_remove);
 
-  if (g_main_loop_is_running (self->update_loop))
-    g_main_loop_quit (self->update_loop);
+  ephy_gsb_worker_quit (&self->update_worker);
+  ephy_gsb_worker_quit (&self->full_hashes_worker);
+  ephy_gsb_worker_quit (&self->verify_worker);
 
   G_OBJECT_CLASS (ephy_gsb_service_parent_class)->dispose (object);
 }
@@ -458,6 +659,14 @@ ephy_gsb_service_constructed (GObject *object)
   if (!ephy_gsb_storage_is_operable (self->storage))
     return;
 
+  /* Loading the hash prefix cues reads the whole database, so keep it off
+   * the main thread. Lookups query the database until it is done. */
+  ephy_gsb_worker_invoke (&self->update_worker,
+                          "[epiphany] gsb_service_build_prefix_set_in_thread",
+                          (GSourceFunc)ephy_gsb_service_build_prefix_set_in_thread,
+                          g_object_ref (self),
+                          (GDestroyNotify)g_object_unref);
+
   /* Restore back-off parameters. */
   self->back_off_exit_time = ephy_gsb_storage_get_metadata (self->storage,
                                                             "back_off_exit_time",
@@ -471,6 +680,9 @@ ephy_gsb_service_constructed (GObject *object)
                                                                "next_full_hashes_time",
                                                                CURRENT_TIME);
 
+  /* Threat lists for fullHashes:find requests until the next update. */
+  self->threat_lists = ephy_gsb_storage_get_threat_lists (self->storage);
+
   /* Restore next threatListUpdates:fetch request time. */
   self->next_list_updates_time = ephy_gsb_storage_get_metadata (self->storage,
                                                                 "next_list_updates_time",
@@ -490,11 +702,20 @@ ephy_gsb_service_constructed (GObject *object)
 static void
 ephy_gsb_service_init (EphyGSBService *self)
 {
-  GMainContext *context = g_main_context_new ();
-
-  self->update_loop = g_main_loop_new (context, FALSE);
-  self->update_thread = g_thread_new ("EphyGSBService", (GThreadFunc)run_update_thread, self);
-  g_main_context_unref (context);
+  g_mutex_init (&self->back_off_mutex);
+
+  g_mutex_init (&self->full_hashes_mutex);
+  self->pending_full_hashes = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+                                                     (GDestroyNotify)g_bytes_unref, NULL);
+  self->positive_cache = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+                                                (GDestroyNotify)g_bytes_unref,
+                                                (GDestroyNotify)g_ptr_array_unref);
+  self->negative_cache = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+                                                (GDestroyNotify)g_bytes_unref, g_free);
+
+  ephy_gsb_worker_start (&self->update_worker, "EphyGSBService");
+  ephy_gsb_worker_start (&self->full_hashes_worker, "EphyGSBFullHashes");
+  ephy_gsb_worker_start (&self->verify_worker, "EphyGSBVerify");
 }
 
 static void
@@ -515,6 +736,13 @@ ephy_gsb_service_class_init (EphyGSBServiceClass *klass)
                          NULL,
                          G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
 
+  obj_properties[PROP_API_PREFIX] =
+    g_param_spec_string ("api-prefix",
+                         "API prefix",
+                         "The URL that the Google Safe Browsing API methods are relative to",
+                         DEFAULT_API_PREFIX,
+                         G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
   obj_properties[PROP_GSB_STORAGE] =
     g_param_spec_object ("gsb-storage",
                          "GSB filename",
@@ -553,23 +781,283 @@ ephy_gsb_service_new (const char *api_key,
 #endif
 }
 
+typedef struct {
+  char *threat_type;
+  char *platform_type;
+  char *threat_entry_type;
+  gint64 expires_at;
+} CachedFullHashMatch;
+
+static void
+cached_full_hash_match_free (CachedFullHashMatch *match)
+{
+  g_free (match->threat_type);
+  g_free (match->platform_type);
+  g_free (match->threat_entry_type);
+  g_free (match);
+}
+
+static void
+ephy_gsb_service_cache_full_hash (EphyGSBService    *self,
+                                  EphyGSBThreatList *list,
+                                  GBytes            *hash,
+                                  gint64             duration)
+{
+  CachedFullHashMatch *match;
+  GPtrArray *matches;
+
+  g_mutex_lock (&self->full_hashes_mutex);
+
+  matches = g_hash_table_lookup (self->positive_cache, hash);
+  if (!matches) {
+    matches = g_ptr_array_new_with_free_func ((GDestroyNotify)cached_full_hash_match_free);
+    g_hash_table_insert (self->positive_cache, g_bytes_ref (hash), matches);
+  }
+
+  for (guint i = 0; i < matches->len; i++) {
+    match = g_ptr_array_index (matches, i);
+    if (!g_strcmp0 (match->threat_type, list->threat_type) &&
+        !g_strcmp0 (match->platform_type, list->platform_type) &&
+        !g_strcmp0 (match->threat_entry_type, list->threat_entry_type)) {
+      match->expires_at = CURRENT_TIME + duration;
+      goto out;
+    }
+  }
+
+  match = g_new (CachedFullHashMatch, 1);
+  match->threat_type = g_strdup (list->threat_type);
+  match->platform_type = g_strdup (list->platform_type);
+  match->threat_entry_type = g_strdup (list->threat_entry_type);
+  match->expires_at = CURRENT_TIME + duration;
+  g_ptr_array_add (matches, match);
+
+out:
+  g_mutex_unlock (&self->full_hashes_mutex);
+}
+
+static void
+ephy_gsb_service_cache_negative (EphyGSBService *self,
+                                 GBytes         *prefix,
+                                 gint64          duration)
+{
+  gint64 *expires_at = g_new (gint64, 1);
+
+  *expires_at = CURRENT_TIME + duration;
+
+  g_mutex_lock (&self->full_hashes_mutex);
+  g_hash_table_replace (self->negative_cache, g_bytes_ref (prefix), expires_at);
+  g_mutex_unlock (&self->full_hashes_mutex);
+}
+
+static void
+ephy_gsb_service_prune_cache (EphyGSBService *self)
+{
+  GHashTableIter iter;
+  gpointer value;
+  gint64 now = CURRENT_TIME;
+
+  g_mutex_lock (&self->full_hashes_mutex);
+
+  g_hash_table_iter_init (&iter, self->negative_cache);
+  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+    if (*(gint64 *)value <= now)
+      g_hash_table_iter_remove (&iter);
+  }
+
+  /* Expired full hashes are kept as long as the database keeps them: a
+   * lookup that matches one must ask the server again, rather than find no
+   * full hash and go by the negative cache of the prefix. */
+  g_hash_table_iter_init (&iter, self->positive_cache);
+  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+    GPtrArray *matches = value;
+    gboolean expired = TRUE;
+
+    for (guint i = 0; i < matches->len && expired; i++)
+      expired = ((CachedFullHashMatch *)g_ptr_array_index (matches, i))->expires_at + GSB_EXPIRATION_THRESHOLD <= now;
+    if (expired)
+      g_hash_table_iter_remove (&iter);
+  }
+
+  g_mutex_unlock (&self->full_hashes_mutex);
+}
+
+/*
+ * ephy_gsb_service_lookup_cache:
+ * @prefixes: the local hash prefixes that @hashes match
+ * @hashes: the full hashes of the URL that match a local hash prefix
+ * @threats: (out): the threat types of the unexpired matches of @hashes
+ *
+ * Return value: %TRUE if the in-memory cache is enough to tell whether the
+ *               URL is safe, i.e. there is an unexpired full hash match, or
+ *               no full hash match and all @prefixes are negative-unexpired
+ */
+static gboolean
+ephy_gsb_service_lookup_cache (EphyGSBService  *self,
+                               GList           *prefixes,
+                               GList           *hashes,
+                               GList          **threats)
+{
+  gboolean has_expired_hashes = FALSE;
+  gboolean has_expired_prefixes = FALSE;
+  gint64 now = CURRENT_TIME;
+
+  g_assert (threats && !*threats);
+
+  g_mutex_lock (&self->full_hashes_mutex);
+
+  for (GList *l = hashes; l && l->data; l = l->next) {
+    GPtrArray *matches = g_hash_table_lookup (self->positive_cache, l->data);
+
+    for (guint i = 0; matches && i < matches->len; i++) {
+      CachedFullHashMatch *match = g_ptr_array_index (matches, i);
+
+      if (match->expires_at <= now)
+        has_expired_hashes = TRUE;
+      else if (!g_list_find_custom (*threats, match->threat_type, (GCompareFunc)g_strcmp0))
+        *threats = g_list_append (*threats, g_strdup (match->threat_type));
+    }
+  }
+
+  for (GList *l = prefixes; l && l->data && !has_expired_prefixes; l = l->next) {
+    gint64 *expires_at = g_hash_table_lookup (self->negative_cache, l->data);
+
+    has_expired_prefixes = !expires_at || *expires_at <= now;
+  }
+
+  g_mutex_unlock (&self->full_hashes_mutex);
+
+  return *threats || (!has_expired_hashes && !has_expired_prefixes);
+}
+
+/* The verification of a batch of URLs, which lives on the verify worker and
+ * may be put aside there while it waits for fullHashes:find responses. */
+typedef struct {
+  GTask *task;
+  gboolean single_url;
+  gsize num_urls;
+  EphyGSBUrlHashes *hashes;
+  GList **threats;
+  GList *prefixes_lookup;
+  GList **matching_prefixes;
+  GList **matching_hashes;
+  guint num_pending; /* Guarded by full_hashes_mutex */
+} VerifyRequest;
+
+static gboolean ephy_gsb_service_verify_full_hashes_in_thread (VerifyRequest *request);
+static void verify_request_return (VerifyRequest *request);
+
 typedef struct {
   EphyGSBService *self;
   GList *prefixes;
-  GMutex mutex;
-  GCond condition;
-} UpdateFullHashesData;
+  GPtrArray *waiters; /* The VerifyRequests waiting for the response */
+} FullHashesRequest;
+
+static void
+full_hashes_request_complete (FullHashesRequest *request)
+{
+  EphyGSBService *self = request->self;
+
+  g_mutex_lock (&self->full_hashes_mutex);
+
+  for (GList *l = request->prefixes; l; l = l->next) {
+    if (g_hash_table_lookup (self->pending_full_hashes, l->data) == request)
+      g_hash_table_remove (self->pending_full_hashes, l->data);
+  }
+
+  /* Resume the verifications that have all their responses now. They return
+   * when the source is destroyed, so that they still do, with the threats
+   * found so far, if the verify worker has already quit. */
+  for (guint i = 0; i < request->waiters->len; i++) {
+    VerifyRequest *waiter = g_ptr_array_index (request->waiters, i);
+
+    if (--waiter->num_pending == 0) {
+      ephy_gsb_worker_invoke (&self->verify_worker,
+                              "[epiphany] gsb_service_verify_full_hashes_in_thread",
+                              (GSourceFunc)ephy_gsb_service_verify_full_hashes_in_thread,
+                              waiter,
+                              (GDestroyNotify)verify_request_return);
+    }
+  }
+
+  g_mutex_unlock (&self->full_hashes_mutex);
+
+  g_list_free_full (request->prefixes, (GDestroyNotify)g_bytes_unref);
+  g_ptr_array_free (request->waiters, TRUE);
+  g_free (request);
+}
+
+/* What a fullHashes:find response changes in the database. Written by the
+ * update worker, so that it doesn't end up in the transaction of an update.
+ */
+typedef struct {
+  EphyGSBThreatList *list;
+  GBytes *hash;
+  gint64 duration;
+} FullHashMatch;
+
+typedef struct {
+  EphyGSBService *self;
+  GPtrArray *matches;
+  GList *prefixes;
+  gint64 negative_duration;
+  gint64 next_full_hashes_time; /* -1 if unchanged */
+} FullHashesResponse;
+
+static void
+full_hash_match_free (FullHashMatch *match)
+{
+  ephy_gsb_threat_list_free (match->list);
+  g_bytes_unref (match->hash);
+  g_free (match);
+}
+
+static void
+full_hashes_response_free (FullHashesResponse *response)
+{
+  g_object_unref (response->self);
+  g_ptr_array_unref (response->matches);
+  g_list_free_full (response->prefixes, (GDestroyNotify)g_bytes_unref);
+  g_free (response);
+}
 
 static gboolean
-ephy_gsb_service_update_full_hashes_in_thread (UpdateFullHashesData *data)
+ephy_gsb_service_store_full_hashes_in_thread (FullHashesResponse *response)
 {
-  EphyGSBService *self = data->self;
+  EphyGSBService *self = response->self;
+
+  g_assert (EPHY_IS_GSB_SERVICE (self));
+
+  if (!ephy_gsb_storage_is_operable (self->storage))
+    return G_SOURCE_REMOVE;
+
+  for (guint i = 0; i < response->matches->len; i++) {
+    FullHashMatch *match = g_ptr_array_index (response->matches, i);
+
+    ephy_gsb_storage_insert_full_hash (self->storage, match->list,
+                                       g_bytes_get_data (match->hash, NULL),
+                                       match->duration);
+  }
+
+  for (GList *l = response->prefixes; l && l->data; l = l->next)
+    ephy_gsb_storage_update_hash_prefix_expiration (self->storage, l->data, response->negative_duration);
+
+  if (response->next_full_hashes_time >= 0)
+    ephy_gsb_storage_set_metadata (self->storage, "next_full_hashes_time", response->next_full_hashes_time);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+ephy_gsb_service_update_full_hashes_in_thread (FullHashesRequest *request)
+{
+  EphyGSBService *self = request->self;
   SoupMessage *msg;
   GList *threat_lists;
   JsonNode *body_node;
   JsonObject *body_obj;
   JsonArray *matches;
   const char *duration_str;
+  FullHashesResponse *response;
   char *url;
   char *body;
   double duration;
@@ -582,44 +1070,41 @@ ephy_gsb_service_update_full_hashes_in_thread (UpdateFullHashesData *data)
 
   g_assert (EPHY_IS_GSB_SERVICE (self));
   g_assert (ephy_gsb_storage_is_operable (self->storage));
-  g_assert (data->prefixes);
-
-  g_mutex_lock (&data->mutex);
+  g_assert (request->prefixes);
 
   if (self->next_full_hashes_time > CURRENT_TIME) {
     LOG ("Cannot send fullHashes:find request. Requests are restricted for %ld seconds",
          self->next_full_hashes_time - CURRENT_TIME);
-    goto unlock;
+    return G_SOURCE_REMOVE;
   }
 
   if (ephy_gsb_service_is_back_off_mode (self)) {
     LOG ("Cannot send fullHashes:find request. Back-off mode is enabled for %ld seconds",
-         self->back_off_exit_time - CURRENT_TIME);
-    goto unlock;
+         ephy_gsb_service_get_back_off_exit_time (self) - CURRENT_TIME);
+    return G_SOURCE_REMOVE;
   }
 
-  threat_lists = ephy_gsb_storage_get_threat_lists (self->storage);
+  threat_lists = ephy_gsb_service_get_threat_lists (self);
   if (!threat_lists)
-    goto unlock;
+    return G_SOURCE_REMOVE;
 
-  body = ephy_gsb_utils_make_full_hashes_request (threat_lists, data->prefixes);
-  url = g_strdup_printf ("%sfullHashes:find?key=%s", API_PREFIX, self->api_key);
+  body = ephy_gsb_utils_make_full_hashes_request (threat_lists, request->prefixes);
+  url = g_strdup_printf ("%sfullHashes:find?key=%s", self->api_prefix, self->api_key);
   msg = soup_message_new (SOUP_METHOD_POST, url);
 #if SOUP_CHECK_VERSION (2, 99, 4)
   bytes = g_bytes_new_take (body, strlen (body));
   soup_message_set_request_body_from_bytes (msg, "application/json", bytes);
-  response_body = soup_session_send_and_read (self->session, msg, NULL, &error);
+  response_body = soup_session_send_and_read (self->full_hashes_worker.session, msg, NULL, &error);
   if (!response_body) {
     LOG ("Cannot update full hashes: %s", error->message);
     ephy_gsb_service_update_back_off_mode (self);
-    self->next_list_updates_time = self->back_off_exit_time;
     goto out;
   }
 
   status_code = soup_message_get_status (msg);
 #else
   soup_message_set_request (msg, "application/json", SOUP_MEMORY_TAKE, body, strlen (body));
-  soup_session_send_message (self->session, msg);
+  soup_session_send_message (self->full_hashes_worker.session, msg);
   status_code = msg->status_code;
   response_body = g_bytes_new_static (msg->response_body->data, msg->response_body->length);
 #endif
@@ -642,12 +1127,19 @@ ephy_gsb_service_update_full_hashes_in_thread (UpdateFullHashesData *data)
 
   body_obj = json_node_get_object (body_node);
 
+  ephy_gsb_service_prune_cache (self);
+
+  response = g_new0 (FullHashesResponse, 1);
+  response->self = g_object_ref (self);
+  response->matches = g_ptr_array_new_with_free_func ((GDestroyNotify)full_hash_match_free);
+  response->next_full_hashes_time = -1;
+
   if (json_object_has_non_null_array_member (body_obj, "matches")) {
     matches = json_object_get_array_member (body_obj, "matches");
 
     /* Update full hashes in database. */
     for (guint i = 0; i < json_array_get_length (matches); i++) {
-      EphyGSBThreatList *list;
+      FullHashMatch *full_hash_match;
       JsonObject *match = json_array_get_object_element (matches, i);
       const char *threat_type = json_object_get_string_member (match, "threatType");
       const char *platform_type = json_object_get_string_member (match, "platformType");
@@ -655,19 +1147,23 @@ ephy_gsb_service_update_full_hashes_in_thread (UpdateFullHashesData *data)
       JsonObject *threat = json_object_get_object_member (match, "threat");
       const char *hash_b64 = json_object_get_string_member (threat, "hash");
       const char *positive_duration;
-      guint8 *hash;
+      GBytes *hash;
+      guint8 *hash_data;
       gsize length;
 
-      list = ephy_gsb_threat_list_new (threat_type, platform_type, threat_entry_type, NULL);
-      hash = g_base64_decode (hash_b64, &length);
+      hash_data = g_base64_decode (hash_b64, &length);
+      hash = g_bytes_new_take (hash_data, length);
       positive_duration = json_object_get_string_member (match, "cacheDuration");
       /* g_ascii_strtod() ignores trailing characters, i.e. 's' character. */
       duration = g_ascii_strtod (positive_duration, NULL);
 
-      ephy_gsb_storage_insert_full_hash (self->storage, list, hash, floor (duration));
+      full_hash_match = g_new (FullHashMatch, 1);
+      full_hash_match->list = ephy_gsb_threat_list_new (threat_type, platform_type, threat_entry_type, NULL);
+      full_hash_match->hash = hash;
+      full_hash_match->duration = floor (duration);
+      g_ptr_array_add (response->matches, full_hash_match);
 
-      g_free (hash);
-      ephy_gsb_threat_list_free (list);
+      ephy_gsb_service_cache_full_hash (self, full_hash_match->list, hash, floor (duration));
     }
   }
 
@@ -675,8 +1171,11 @@ ephy_gsb_service_update_full_hashes_in_thread (UpdateFullHashesData *data)
   duration_str = json_object_get_string_member (body_obj, "negativeCacheDuration");
   /* g_ascii_strtod() ignores trailing characters, i.e. 's' character. */
   duration = g_ascii_strtod (duration_str, NULL);
-  for (GList *l = data->prefixes; l && l->data; l = l->next)
-    ephy_gsb_storage_update_hash_prefix_expiration (self->storage, l->data, floor (duration));
+  response->negative_duration = floor (duration);
+  for (GList *l = request->prefixes; l && l->data; l = l->next) {
+    response->prefixes = g_list_prepend (response->prefixes, g_bytes_ref (l->data));
+    ephy_gsb_service_cache_negative (self, l->data, floor (duration));
+  }
 
   /* Handle minimum wait duration. */
   if (json_object_has_non_null_string_member (body_obj, "minimumWaitDuration")) {
@@ -684,130 +1183,155 @@ ephy_gsb_service_update_full_hashes_in_thread (UpdateFullHashesData *data)
     /* g_ascii_strtod() ignores trailing characters, i.e. 's' character. */
     duration = g_ascii_strtod (duration_str, NULL);
     self->next_full_hashes_time = CURRENT_TIME + (gint64)ceil (duration);
-    ephy_gsb_storage_set_metadata (self->storage, "next_full_hashes_time", self->next_full_hashes_time);
+    response->next_full_hashes_time = self->next_full_hashes_time;
   }
 
+  ephy_gsb_worker_invoke (&self->update_worker,
+                          "[epiphany] gsb_service_store_full_hashes_in_thread",
+                          (GSourceFunc)ephy_gsb_service_store_full_hashes_in_thread,
+                          response,
+                          (GDestroyNotify)full_hashes_response_free);
+
   json_node_unref (body_node);
 out:
   g_free (url);
   g_list_free_full (threat_lists, (GDestroyNotify)ephy_gsb_threat_list_free);
   g_clear_object (&msg);
 
-unlock:
-  g_cond_signal (&data->condition);
-  g_mutex_unlock (&data->mutex);
-
   return G_SOURCE_REMOVE;
 }
 
+/* Asks the server for the full hashes of @prefixes, unless other
+ * verifications already are, and resumes @waiter once all the responses are
+ * in the cache.
+ */
 static void
-ephy_gsb_service_update_full_hashes_sync (EphyGSBService *self,
-                                          GList          *prefixes)
+ephy_gsb_service_update_full_hashes (EphyGSBService *self,
+                                     GList          *prefixes,
+                                     VerifyRequest  *waiter)
 {
-  UpdateFullHashesData data = { self, prefixes, { }, { } };
-  GSource *source;
+  FullHashesRequest *request = NULL;
 
-  g_mutex_lock (&data.mutex);
+  g_mutex_lock (&self->full_hashes_mutex);
 
-  source = g_timeout_source_new (0);
-  g_source_set_name (source, "[epiphany] gsb_service_update_full_hashes_in_thread");
-  g_source_set_callback (source,
-                         (GSourceFunc)ephy_gsb_service_update_full_hashes_in_thread,
-                         &data, NULL);
-  g_source_attach (source, g_main_loop_get_context (self->update_loop));
-  g_source_unref (source);
+  /* Only ask for the prefixes that no other verification is already asking for. */
+  for (GList *l = prefixes; l && l->data; l = l->next) {
+    FullHashesRequest *pending = g_hash_table_lookup (self->pending_full_hashes, l->data);
+
+    if (pending) {
+      if (!g_ptr_array_find (pending->waiters, waiter, NULL)) {
+        g_ptr_array_add (pending->waiters, waiter);
+        waiter->num_pending++;
+      }
+      continue;
+    }
+
+    if (!request) {
+      request = g_new0 (FullHashesRequest, 1);
+      request->self = self;
+      request->waiters = g_ptr_array_new ();
+      g_ptr_array_add (request->waiters, waiter);
+      waiter->num_pending++;
+    }
+
+    request->prefixes = g_list_prepend (request->prefixes, g_bytes_ref (l->data));
+    g_hash_table_insert (self->pending_full_hashes, g_bytes_ref (l->data), request);
+  }
+
+  g_mutex_unlock (&self->full_hashes_mutex);
 
-  g_cond_wait (&data.condition, &data.mutex);
-  g_mutex_unlock (&data.mutex);
+  if (request) {
+    ephy_gsb_worker_invoke (&self->full_hashes_worker,
+                            "[epiphany] gsb_service_update_full_hashes_in_thread",
+                            (GSourceFunc)ephy_gsb_service_update_full_hashes_in_thread,
+                            request,
+                            (GDestroyNotify)full_hashes_request_complete);
+  }
 }
 
-static void
-ephy_gsb_service_verify_url_thread (GTask          *task,
-                                    EphyGSBService *self,
-                                    const char     *url,
-                                    GCancellable   *cancellable)
-{
-  GList *hashes = NULL;
-  GList *cues = NULL;
-  GList *prefixes_lookup = NULL;
+/* Verifies a URL against the hash prefixes found for it, and those of the
+ * other URLs verified along with it, without asking the server. Returns %FALSE
+ * if the server has to be asked for the full hashes of @matching_prefixes,
+ * in which case @matching_prefixes and @matching_hashes are left for the
+ * caller to check the response against and then free.
+ */
+static gboolean
+ephy_gsb_service_verify_hashes_locally (EphyGSBService          *self,
+                                        const EphyGSBUrlHashes  *url_hashes,
+                                        GList                   *prefixes_lookup,
+                                        GList                  **matching_prefixes,
+                                        GList                  **matching_hashes,
+                                        GList                  **threats)
+{
   GList *hashes_lookup = NULL;
-  GList *matching_prefixes = NULL;
-  GList *matching_hashes = NULL;
-  GHashTable *matching_prefixes_set = NULL;
-  GHashTable *matching_hashes_set = NULL;
+  GHashTable *matching_prefixes_set;
   GHashTableIter iter;
   gpointer value;
   gboolean has_matching_expired_hashes = FALSE;
   gboolean has_matching_expired_prefixes = FALSE;
-  GList *threats = NULL;
+  gboolean decided = TRUE;
 
-  g_assert (EPHY_IS_GSB_SERVICE (self));
-  g_assert (G_IS_TASK (task));
-  g_assert (url);
-
-  /* If the local database is broken or an update is in course, we cannot
-   * really verify the URL, so we have no choice other than to consider it safe.
-   */
-  if (g_atomic_int_get (&self->is_updating)) {
-    LOG ("Local GSB database is being updated, cannot verify URL");
-    goto out;
-  }
-
-  if (!ephy_gsb_storage_is_operable (self->storage)) {
-    LOG ("Local GSB database is broken, cannot verify URL");
-    goto out;
-  }
-
-  hashes = ephy_gsb_utils_compute_hashes (url);
-  if (!hashes)
-    goto out;
+  *matching_prefixes = NULL;
+  *matching_hashes = NULL;
 
   matching_prefixes_set = g_hash_table_new (g_bytes_hash, g_bytes_equal);
-  matching_hashes_set = g_hash_table_new (g_bytes_hash, g_bytes_equal);
 
   /* Check for hash prefixes in database that match any of the full hashes. */
-  cues = ephy_gsb_utils_get_hash_cues (hashes);
-  prefixes_lookup = ephy_gsb_storage_lookup_hash_prefixes (self->storage, cues);
-  for (GList *p = prefixes_lookup; p && p->data; p = p->next) {
-    EphyGSBHashPrefixLookup *lookup = (EphyGSBHashPrefixLookup *)p->data;
+  for (guint i = 0; i < url_hashes->num_hashes; i++) {
+    const guint8 *hash = url_hashes->hashes[i];
+    gboolean matches = FALSE;
+
+    for (GList *p = prefixes_lookup; p && p->data; p = p->next) {
+      EphyGSBHashPrefixLookup *lookup = (EphyGSBHashPrefixLookup *)p->data;
+      gsize prefix_len;
+      const guint8 *prefix = g_bytes_get_data (lookup->prefix, &prefix_len);
 
-    for (GList *h = hashes; h && h->data; h = h->next) {
-      if (ephy_gsb_utils_hash_has_prefix (h->data, lookup->prefix)) {
+      if (memcmp (hash, prefix, prefix_len) == 0) {
         value = g_hash_table_lookup (matching_prefixes_set, lookup->prefix);
 
         /* Consider the prefix expired if it's expired in at least one threat list. */
         g_hash_table_replace (matching_prefixes_set,
                               lookup->prefix,
                               GINT_TO_POINTER (GPOINTER_TO_INT (value) || lookup->negative_expired));
-        g_hash_table_add (matching_hashes_set, h->data);
+        matches = TRUE;
       }
     }
+
+    if (matches)
+      *matching_hashes = g_list_prepend (*matching_hashes, g_bytes_new (hash, sizeof (url_hashes->hashes[0])));
   }
 
   /* If there are no database matches, then the URL is safe. */
-  if (g_hash_table_size (matching_hashes_set) == 0) {
+  if (!*matching_hashes) {
     LOG ("No database match, URL is safe");
     goto out;
   }
 
+  /* The responses to recent fullHashes:find requests are enough to tell
+   * whether the URL is safe more often than not. */
+  *matching_prefixes = g_hash_table_get_keys (matching_prefixes_set);
+  if (ephy_gsb_service_lookup_cache (self, *matching_prefixes, *matching_hashes, threats)) {
+    LOG ("In-memory cache hit, URL is %s", *threats ? "not safe" : "safe");
+    goto out;
+  }
+
   /* Check for full hashes matches.
    * All unexpired full hash matches are added directly to the result set.
    */
-  matching_hashes = g_hash_table_get_keys (matching_hashes_set);
-  hashes_lookup = ephy_gsb_storage_lookup_full_hashes (self->storage, matching_hashes);
+  hashes_lookup = ephy_gsb_storage_lookup_full_hashes (self->storage, *matching_hashes);
   for (GList *l = hashes_lookup; l && l->data; l = l->next) {
     EphyGSBHashFullLookup *lookup = (EphyGSBHashFullLookup *)l->data;
 
     if (lookup->expired)
       has_matching_expired_hashes = TRUE;
-    else if (!g_list_find_custom (threats, lookup->threat_type, (GCompareFunc)g_strcmp0))
-      threats = g_list_append (threats, g_strdup (lookup->threat_type));
+    else if (!g_list_find_custom (*threats, lookup->threat_type, (GCompareFunc)g_strcmp0))
+      *threats = g_list_append (*threats, g_strdup (lookup->threat_type));
   }
 
   /* Check for positive cache hit.
    * That is, there is at least one unexpired full hash match.
    */
-  if (threats) {
+  if (*threats) {
     LOG ("Positive cache hit, URL is not safe");
     goto out;
   }
@@ -829,37 +1353,174 @@ ephy_gsb_service_verify_url_thread (GTask          *task,
 
   /* At this point we have either expired full hash matches and/or
    * negative-expired hash prefix matches, so we need to find from
-   * the server whether the URL is safe or not. We do this by updating
-   * the full hashes of the matching prefixes with fresh values from
-   * server and re-checking for positive cache hits.
+   * the server whether the URL is safe or not.
    */
-  matching_prefixes = g_hash_table_get_keys (matching_prefixes_set);
-  ephy_gsb_service_update_full_hashes_sync (self, matching_prefixes);
+  decided = FALSE;
+
+out:
+  if (decided) {
+    g_clear_pointer (matching_prefixes, g_list_free);
+    g_list_free_full (*matching_hashes, (GDestroyNotify)g_bytes_unref);
+    *matching_hashes = NULL;
+  }
 
-  /* Repeat the full hash verification. */
   g_list_free_full (hashes_lookup, (GDestroyNotify)ephy_gsb_hash_full_lookup_free);
-  hashes_lookup = ephy_gsb_storage_lookup_full_hashes (self->storage, matching_hashes);
-  for (GList *l = hashes_lookup; l && l->data; l = l->next) {
-    EphyGSBHashFullLookup *lookup = (EphyGSBHashFullLookup *)l->data;
+  g_hash_table_unref (matching_prefixes_set);
+
+  return decided;
+}
+
+static void
+threats_free (GList *threats)
+{
+  g_list_free_full (threats, g_free);
+}
+
+static void
+verify_request_return (VerifyRequest *request)
+{
+  if (request->single_url) {
+    g_task_return_pointer (request->task, request->threats[0], NULL);
+  } else {
+    GPtrArray *retval = g_ptr_array_new_full (request->num_urls, (GDestroyNotify)threats_free);
+
+    for (gsize i = 0; i < request->num_urls; i++)
+      g_ptr_array_add (retval, request->threats[i]);
+
+    g_task_return_pointer (request->task, retval, (GDestroyNotify)g_ptr_array_unref);
+  }
+
+  for (gsize i = 0; request->matching_prefixes && i < request->num_urls; i++) {
+    g_list_free (request->matching_prefixes[i]);
+    g_list_free_full (request->matching_hashes[i], (GDestroyNotify)g_bytes_unref);
+  }
+  g_free (request->matching_prefixes);
+  g_free (request->matching_hashes);
+  g_list_free_full (request->prefixes_lookup, (GDestroyNotify)ephy_gsb_hash_prefix_lookup_free);
+  g_free (request->threats);
+  g_free (request->hashes);
+  g_object_unref (request->task);
+  g_free (request);
+}
+
+/* Verifies all the URLs of @request at once. The local database is looked up
+ * once for all of them, and the server is asked at most once too.
+ */
+static gboolean
+ephy_gsb_service_verify_in_thread (VerifyRequest *request)
+{
+  EphyGSBService *self = g_task_get_source_object (request->task);
+  char **urls = g_task_get_task_data (request->task);
+  GHashTable *fetch_set = NULL;
+  GList *fetch_prefixes;
+
+  g_assert (EPHY_IS_GSB_SERVICE (self));
+
+  request->num_urls = g_strv_length (urls);
+  request->hashes = g_new (EphyGSBUrlHashes, request->num_urls);
+  request->threats = g_new0 (GList *, request->num_urls);
+
+  /* If the local database is broken, we cannot really verify the URL, so we
+   * have no choice other than to consider it safe. Updates in course are not
+   * a problem, the lookups see the lists as they were before.
+   */
+  if (!ephy_gsb_storage_is_operable (self->storage)) {
+    LOG ("Local GSB database is broken, cannot verify URL");
+    goto out;
+  }
+
+  /* Invalid URLs are left without hashes, which makes them safe. */
+  for (gsize i = 0; i < request->num_urls; i++)
+    ephy_gsb_utils_compute_url_hashes (urls[i], &request->hashes[i]);
 
-    if (!lookup->expired &&
-        !g_list_find_custom (threats, lookup->threat_type, (GCompareFunc)g_strcmp0))
-      threats = g_list_append (threats, g_strdup (lookup->threat_type));
+  /* Almost always, no hash cue is in any threat list and this is all. */
+  request->prefixes_lookup = ephy_gsb_storage_lookup_hash_prefixes (self->storage,
+                                                                    request->hashes,
+                                                                    request->num_urls);
+  if (!request->prefixes_lookup) {
+    LOG ("No database match, URL is safe");
+    goto out;
+  }
+
+  request->matching_prefixes = g_new0 (GList *, request->num_urls);
+  request->matching_hashes = g_new0 (GList *, request->num_urls);
+
+  for (gsize i = 0; i < request->num_urls; i++) {
+    if (ephy_gsb_service_verify_hashes_locally (self, &request->hashes[i],
+                                                request->prefixes_lookup,
+                                                &request->matching_prefixes[i],
+                                                &request->matching_hashes[i],
+                                                &request->threats[i]))
+      continue;
+
+    if (!fetch_set)
+      fetch_set = g_hash_table_new (g_bytes_hash, g_bytes_equal);
+    for (GList *l = request->matching_prefixes[i]; l; l = l->next)
+      g_hash_table_add (fetch_set, l->data);
   }
 
+  if (!fetch_set)
+    goto out;
+
+  /* Update the full hashes of the matching prefixes of all the URLs with
+   * fresh values from server, and re-check for positive cache hits in
+   * ephy_gsb_service_verify_full_hashes_in_thread() once they're in. Until
+   * then, other URLs can be verified.
+   */
+  fetch_prefixes = g_hash_table_get_keys (fetch_set);
+  ephy_gsb_service_update_full_hashes (self, fetch_prefixes, request);
+  g_list_free (fetch_prefixes);
+  g_hash_table_unref (fetch_set);
+
+  return G_SOURCE_REMOVE;
+
 out:
-  g_task_return_pointer (task, threats, NULL);
+  verify_request_return (request);
 
-  g_list_free (matching_prefixes);
-  g_list_free (matching_hashes);
-  g_list_free_full (hashes, (GDestroyNotify)g_bytes_unref);
-  g_list_free_full (cues, (GDestroyNotify)g_bytes_unref);
-  g_list_free_full (prefixes_lookup, (GDestroyNotify)ephy_gsb_hash_prefix_lookup_free);
-  g_list_free_full (hashes_lookup, (GDestroyNotify)ephy_gsb_hash_full_lookup_free);
-  if (matching_prefixes_set)
-    g_hash_table_unref (matching_prefixes_set);
-  if (matching_hashes_set)
-    g_hash_table_unref (matching_hashes_set);
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+ephy_gsb_service_verify_full_hashes_in_thread (VerifyRequest *request)
+{
+  EphyGSBService *self = g_task_get_source_object (request->task);
+
+  g_assert (EPHY_IS_GSB_SERVICE (self));
+
+  /* Repeat the full hash verification. The responses, whichever verification
+   * asked for them, went to the in-memory cache too. */
+  for (gsize i = 0; i < request->num_urls; i++) {
+    if (request->matching_prefixes[i]) {
+      ephy_gsb_service_lookup_cache (self,
+                                     request->matching_prefixes[i],
+                                     request->matching_hashes[i],
+                                     &request->threats[i]);
+    }
+  }
+
+  /* verify_request_return() runs as the destroy notify of the source. */
+  return G_SOURCE_REMOVE;
+}
+
+static void
+ephy_gsb_service_verify (EphyGSBService      *self,
+                         char               **urls,
+                         gboolean             single_url,
+                         GAsyncReadyCallback  callback,
+                         gpointer             user_data)
+{
+  VerifyRequest *request;
+
+  request = g_new0 (VerifyRequest, 1);
+  request->task = g_task_new (self, NULL, callback, user_data);
+  request->single_url = single_url;
+  g_task_set_task_data (request->task, urls, (GDestroyNotify)g_strfreev);
+
+  ephy_gsb_worker_invoke (&self->verify_worker,
+                          "[epiphany] gsb_service_verify_in_thread",
+                          (GSourceFunc)ephy_gsb_service_verify_in_thread,
+                          request,
+                          NULL);
 }
 
 void
@@ -868,16 +1529,15 @@ ephy_gsb_service_verify_url (EphyGSBService      *self,
                              GAsyncReadyCallback  callback,
                              gpointer             user_data)
 {
-  GTask *task;
+  char **urls;
 
   g_assert (EPHY_IS_GSB_SERVICE (self));
   g_assert (url);
   g_assert (callback);
 
-  task = g_task_new (self, NULL, callback, user_data);
-  g_task_set_task_data (task, g_strdup (url), g_free);
-  g_task_run_in_thread (task, (GTaskThreadFunc)ephy_gsb_service_verify_url_thread);
-  g_object_unref (task);
+  urls = g_new0 (char *, 2);
+  urls[0] = g_strdup (url);
+  ephy_gsb_service_verify (self, urls, TRUE, callback, user_data);
 }
 
 GList *
@@ -888,3 +1548,46 @@ ephy_gsb_service_verify_url_finish (EphyGSBService *self,
 
   return g_task_propagate_pointer (G_TASK (result), NULL);
 }
+
+/**
+ * ephy_gsb_service_verify_urls:
+ * @self: an #EphyGSBService
+ * @urls: a %NULL-terminated array of URLs
+ * @callback: a #GAsyncReadyCallback to call when the URLs are verified
+ * @user_data: the data to pass to @callback
+ *
+ * Verify all of @urls with a single lookup of the local database and, if it
+ * has to be asked at all, a single request to the server. This is cheaper than
+ * verifying them one by one when many URLs are known at once, like the
+ * subresources of a page.
+ **/
+void
+ephy_gsb_service_verify_urls (EphyGSBService      *self,
+                              const char * const  *urls,
+                              GAsyncReadyCallback  callback,
+                              gpointer             user_data)
+{
+  g_assert (EPHY_IS_GSB_SERVICE (self));
+  g_assert (urls);
+  g_assert (callback);
+
+  ephy_gsb_service_verify (self, g_strdupv ((char **)urls), FALSE, callback, user_data);
+}
+
+/**
+ * ephy_gsb_service_verify_urls_finish:
+ * @self: an #EphyGSBService
+ * @result: the #GAsyncResult passed to the callback
+ *
+ * Return value: (transfer full): a #GPtrArray with the threats of each URL, in
+ *               the order they were passed, as a #GList of threat type strings
+ *               that is %NULL if the URL is safe. Free with g_ptr_array_unref().
+ **/
+GPtrArray *
+ephy_gsb_service_verify_urls_finish (EphyGSBService *self,
+                                     GAsyncResult   *result)
+{
+  g_assert (g_task_is_valid (result, self));
+
+  return g_task_propagate_pointer (G_TASK (result), NULL);
+}
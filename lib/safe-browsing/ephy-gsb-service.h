@@ -37,5 +37,11 @@ void            ephy_gsb_service_verify_url         (EphyGSBService      *self,
                                                      gpointer             user_data);
 GList          *ephy_gsb_service_verify_url_finish  (EphyGSBService  *self,
                                                      GAsyncResult    *result);
+void            ephy_gsb_service_verify_urls        (EphyGSBService      *self,
+                                                     const char * const  *urls,
+                                                     GAsyncReadyCallback  callback,
+                                                     gpointer             user_data);
+GPtrArray      *ephy_gsb_service_verify_urls_finish (EphyGSBService  *self,
+                                                     GAsyncResult    *result);
 
 G_END_DECLS
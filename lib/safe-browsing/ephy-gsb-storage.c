@@ -22,12 +22,12 @@
 #include "ephy-gsb-storage.h"
 
 #include "ephy-debug.h"
+#include "ephy-gsb-prefix-list.h"
+#include "ephy-gsb-prefix-set.h"
 #include "ephy-sqlite-connection.h"
 
 #include <string.h>
 
-#define EXPIRATION_THRESHOLD (8 * 60 * 60)
-
 /* Keep this lower than 6533 (SQLITE_MAX_VARIABLE_NUMBER / 5 slots) or else
  * you'll get "too many SQL variables" error in ephy_gsb_storage_insert_batch().
  * SQLITE_MAX_VARIABLE_NUMBER is hardcoded in sqlite3 (>= 3.22) as 32766.
@@ -53,10 +53,35 @@ static const char * const gsb_linux_threat_lists[][3] = {
 struct _EphyGSBStorage {
   GObject parent_instance;
 
+  /* Only written to from the update thread of the service, which also is the
+   * only one to use @db once the database is open. The flags are read from
+   * other threads too, hence atomically. */
   char *db_path;
   EphySQLiteConnection *db;
 
   gboolean is_operable;
+  gboolean is_updating;
+  gboolean has_staging_table;
+
+  /* The sorted hash prefixes of each threat list, as seen by @db, keyed by
+   * threat list. They are loaded on first use and then kept in step with the
+   * hash_prefix table, so that checksums and removals don't have to sort the
+   * table again on every update. */
+  GHashTable *prefix_lists;
+
+  /* The generation that lookups see: a read-only connection, which keeps
+   * reading the last committed state of the database while an update is
+   * written through @db, and the cues of all the hash prefixes in that
+   * state, so that lookups of URLs that match none of them don't need to
+   * query the database. Both are replaced when an update is committed. The
+   * cues are not loaded while @self is constructed, but by
+   * ephy_gsb_storage_build_prefix_set(); lookups query the database until
+   * then.
+   * Lookups are all made from the same thread, which thus has the connection
+   * and its cached statements to itself. */
+  GMutex generation_mutex;
+  EphySQLiteConnection *read_db;
+  EphyGSBPrefixSet *prefix_set;
 };
 
 G_DEFINE_TYPE (EphyGSBStorage, ephy_gsb_storage, G_TYPE_OBJECT);
@@ -125,7 +150,8 @@ ephy_gsb_storage_start_transaction (EphyGSBStorage *self)
 
   g_assert (EPHY_IS_GSB_STORAGE (self));
 
-  if (!self->is_operable)
+  /* An update runs in a single transaction. */
+  if (!self->is_operable || g_atomic_int_get (&self->is_updating))
     return;
 
   ephy_sqlite_connection_begin_transaction (self->db, &error);
@@ -142,7 +168,7 @@ ephy_gsb_storage_end_transaction (EphyGSBStorage *self)
 
   g_assert (EPHY_IS_GSB_STORAGE (self));
 
-  if (!self->is_operable)
+  if (!self->is_operable || g_atomic_int_get (&self->is_updating))
     return;
 
   ephy_sqlite_connection_commit_transaction (self->db, &error);
@@ -382,16 +408,216 @@ ephy_gsb_storage_open_db (EphyGSBStorage *self)
   return TRUE;
 }
 
+static void
+ephy_gsb_storage_set_generation (EphyGSBStorage       *self,
+                                 EphySQLiteConnection *read_db,
+                                 EphyGSBPrefixSet     *prefix_set)
+{
+  EphySQLiteConnection *old_read_db;
+  EphyGSBPrefixSet *old_prefix_set;
+
+  g_mutex_lock (&self->generation_mutex);
+  old_read_db = self->read_db;
+  old_prefix_set = self->prefix_set;
+  self->read_db = read_db;
+  self->prefix_set = prefix_set;
+  g_mutex_unlock (&self->generation_mutex);
+
+  /* Lookups in progress hold their own references to the old generation. */
+  g_clear_object (&old_read_db);
+  g_clear_pointer (&old_prefix_set, ephy_gsb_prefix_set_unref);
+}
+
+static EphySQLiteConnection *
+ephy_gsb_storage_get_read_db (EphyGSBStorage *self)
+{
+  EphySQLiteConnection *read_db;
+
+  g_mutex_lock (&self->generation_mutex);
+  read_db = self->read_db ? g_object_ref (self->read_db) : NULL;
+  g_mutex_unlock (&self->generation_mutex);
+
+  return read_db;
+}
+
+static EphyGSBPrefixSet *
+ephy_gsb_storage_get_prefix_set (EphyGSBStorage *self)
+{
+  EphyGSBPrefixSet *prefix_set;
+
+  g_mutex_lock (&self->generation_mutex);
+  prefix_set = self->prefix_set ? ephy_gsb_prefix_set_ref (self->prefix_set) : NULL;
+  g_mutex_unlock (&self->generation_mutex);
+
+  return prefix_set;
+}
+
+static EphySQLiteConnection *
+ephy_gsb_storage_open_read_db (EphyGSBStorage *self)
+{
+  EphySQLiteConnection *read_db;
+  GError *error = NULL;
+
+  read_db = ephy_sqlite_connection_new (EPHY_SQLITE_CONNECTION_MODE_READ_ONLY, self->db_path);
+  if (!ephy_sqlite_connection_open (read_db, &error)) {
+    g_warning ("Failed to open read-only GSB database at %s: %s", self->db_path, error->message);
+    g_error_free (error);
+    g_object_unref (read_db);
+    return NULL;
+  }
+
+  return read_db;
+}
+
+static char *
+ephy_gsb_storage_get_prefix_list_key (EphyGSBThreatList *list)
+{
+  return g_strdup_printf ("%s/%s/%s", list->threat_type, list->platform_type, list->threat_entry_type);
+}
+
+/* Returns the sorted hash prefixes of @list, loading them from the database
+ * if needed, or NULL on error. */
+static EphyGSBPrefixList *
+ephy_gsb_storage_get_prefix_list (EphyGSBStorage    *self,
+                                  EphyGSBThreatList *list)
+{
+  EphySQLiteStatement *statement;
+  EphyGSBPrefixList *prefix_list;
+  GError *error = NULL;
+  const char *sql;
+  char *key;
+
+  g_assert (EPHY_IS_GSB_STORAGE (self));
+  g_assert (list);
+
+  key = ephy_gsb_storage_get_prefix_list_key (list);
+  prefix_list = g_hash_table_lookup (self->prefix_lists, key);
+  if (prefix_list) {
+    g_free (key);
+    return prefix_list;
+  }
+
+  sql = "SELECT value FROM hash_prefix WHERE "
+        "threat_type=? AND platform_type=? AND threat_entry_type=? "
+        "ORDER BY value";
+  statement = ephy_sqlite_connection_create_cached_statement (self->db, sql, &error);
+  if (error) {
+    g_warning ("Failed to create select hash prefix statement: %s", error->message);
+    g_error_free (error);
+    g_free (key);
+    return NULL;
+  }
+
+  if (!bind_threat_list_params (statement, list, 0, 1, 2, -1)) {
+    g_object_unref (statement);
+    g_free (key);
+    return NULL;
+  }
+
+  prefix_list = ephy_gsb_prefix_list_new ();
+  while (ephy_sqlite_statement_step (statement, &error)) {
+    ephy_gsb_prefix_list_append (prefix_list,
+                                 ephy_sqlite_statement_get_column_as_blob (statement, 0),
+                                 ephy_sqlite_statement_get_column_size (statement, 0));
+  }
+
+  g_object_unref (statement);
+
+  if (error) {
+    g_warning ("Failed to execute select hash prefix statement: %s", error->message);
+    g_error_free (error);
+    ephy_gsb_prefix_list_free (prefix_list);
+    g_free (key);
+    return NULL;
+  }
+
+  LOG ("Loaded %lu hash prefixes of list %s", ephy_gsb_prefix_list_get_size (prefix_list), key);
+  g_hash_table_insert (self->prefix_lists, key, prefix_list);
+
+  return prefix_list;
+}
+
+/* Loads the cues of all the hash prefixes, as seen by @self->db. Returns NULL
+ * on error, in which case lookups fall back to querying the database. */
+static EphyGSBPrefixSet *
+ephy_gsb_storage_load_prefix_set (EphyGSBStorage *self)
+{
+  EphySQLiteStatement *statement;
+  EphyGSBPrefixSet *prefix_set = NULL;
+  GError *error = NULL;
+  GArray *cues;
+  gint64 start_time = g_get_monotonic_time ();
+
+  if (!self->is_operable)
+    return NULL;
+
+  /* After the first update, all the hash prefixes are in memory already. */
+  if (g_hash_table_size (self->prefix_lists) == G_N_ELEMENTS (gsb_linux_threat_lists)) {
+    GHashTableIter iter;
+    EphyGSBPrefixList *prefix_list;
+
+    cues = g_array_new (FALSE, FALSE, sizeof (guint32));
+    g_hash_table_iter_init (&iter, self->prefix_lists);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&prefix_list))
+      ephy_gsb_prefix_list_get_cues (prefix_list, cues);
+
+    prefix_set = ephy_gsb_prefix_set_new ((guint32 *)cues->data, cues->len);
+    LOG ("Built %u hash prefix cues in %" G_GINT64_FORMAT " ms",
+         cues->len, (g_get_monotonic_time () - start_time) / 1000);
+    g_array_free (cues, TRUE);
+
+    return prefix_set;
+  }
+
+  statement = ephy_sqlite_connection_create_statement (self->db, "SELECT cue FROM hash_prefix", &error);
+  if (error) {
+    g_warning ("Failed to create select hash prefix cue statement: %s", error->message);
+    g_error_free (error);
+    return NULL;
+  }
+
+  cues = g_array_new (FALSE, FALSE, sizeof (guint32));
+  while (ephy_sqlite_statement_step (statement, &error)) {
+    guint32 cue;
+
+    if (ephy_sqlite_statement_get_column_size (statement, 0) != GSB_HASH_CUE_LEN)
+      continue;
+
+    cue = ephy_gsb_prefix_set_cue_to_uint (ephy_sqlite_statement_get_column_as_blob (statement, 0));
+    g_array_append_val (cues, cue);
+  }
+
+  g_object_unref (statement);
+
+  if (error) {
+    g_warning ("Failed to execute select hash prefix cue statement: %s", error->message);
+    g_error_free (error);
+  } else {
+    prefix_set = ephy_gsb_prefix_set_new ((guint32 *)cues->data, cues->len);
+    LOG ("Loaded %u hash prefix cues in %" G_GINT64_FORMAT " ms",
+         cues->len, (g_get_monotonic_time () - start_time) / 1000);
+  }
+
+  g_array_free (cues, TRUE);
+
+  return prefix_set;
+}
+
 static void
 ephy_gsb_storage_clear_db (EphyGSBStorage *self)
 {
   g_assert (EPHY_IS_GSB_STORAGE (self));
 
+  ephy_gsb_storage_set_generation (self, NULL, NULL);
+
   if (self->db) {
     ephy_sqlite_connection_close (self->db);
     ephy_sqlite_connection_delete_database (self->db);
     g_clear_object (&self->db);
   }
+
+  self->has_staging_table = FALSE;
+  g_hash_table_remove_all (self->prefix_lists);
 }
 
 static gboolean
@@ -413,7 +639,10 @@ ephy_gsb_storage_init_db (EphyGSBStorage *self)
   if (!success)
     ephy_gsb_storage_clear_db (self);
 
-  self->is_operable = success;
+  g_atomic_int_set (&self->is_operable, success);
+
+  if (success)
+    ephy_gsb_storage_set_generation (self, ephy_gsb_storage_open_read_db (self), NULL);
 
   return success;
 }
@@ -421,10 +650,28 @@ ephy_gsb_storage_init_db (EphyGSBStorage *self)
 static gboolean
 ephy_gsb_storage_recreate_db (EphyGSBStorage *self)
 {
+  gboolean success;
+
   g_assert (EPHY_IS_GSB_STORAGE (self));
 
   ephy_gsb_storage_clear_db (self);
-  return ephy_gsb_storage_init_db (self);
+  success = ephy_gsb_storage_init_db (self);
+
+  /* Keep the rest of the update in a transaction on the new database. Its
+   * end loads the cues. */
+  if (success && g_atomic_int_get (&self->is_updating)) {
+    GError *error = NULL;
+
+    ephy_sqlite_connection_begin_transaction (self->db, &error);
+    if (error) {
+      g_warning ("Failed to begin transaction on GSB database: %s", error->message);
+      g_error_free (error);
+    }
+  } else if (success) {
+    ephy_gsb_storage_build_prefix_set (self);
+  }
+
+  return success;
 }
 
 static inline gboolean
@@ -482,10 +729,20 @@ ephy_gsb_storage_finalize (GObject *object)
 
   g_free (self->db_path);
   if (self->db) {
+    guint hits, misses;
+
+    ephy_sqlite_connection_get_statement_cache_stats (self->db, &hits, &misses);
+    LOG ("GSB statement cache: %u hits, %u misses", hits, misses);
+
     ephy_sqlite_connection_close (self->db);
     g_object_unref (self->db);
   }
 
+  g_clear_object (&self->read_db);
+  g_clear_pointer (&self->prefix_set, ephy_gsb_prefix_set_unref);
+  g_mutex_clear (&self->generation_mutex);
+  g_hash_table_unref (self->prefix_lists);
+
   G_OBJECT_CLASS (ephy_gsb_storage_parent_class)->finalize (object);
 }
 
@@ -508,7 +765,8 @@ ephy_gsb_storage_constructed (GObject *object)
         LOG ("GSB database schema incompatibility, recreating database...");
         ephy_gsb_storage_recreate_db (self);
       } else {
-        self->is_operable = TRUE;
+        g_atomic_int_set (&self->is_operable, TRUE);
+        ephy_gsb_storage_set_generation (self, ephy_gsb_storage_open_read_db (self), NULL);
       }
     }
   }
@@ -517,6 +775,9 @@ ephy_gsb_storage_constructed (GObject *object)
 static void
 ephy_gsb_storage_init (EphyGSBStorage *self)
 {
+  g_mutex_init (&self->generation_mutex);
+  self->prefix_lists = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                              (GDestroyNotify)ephy_gsb_prefix_list_free);
 }
 
 static void
@@ -560,7 +821,108 @@ ephy_gsb_storage_is_operable (EphyGSBStorage *self)
 {
   g_assert (EPHY_IS_GSB_STORAGE (self));
 
-  return self->is_operable;
+  return g_atomic_int_get (&self->is_operable);
+}
+
+/**
+ * ephy_gsb_storage_build_prefix_set:
+ * @self: an #EphyGSBStorage
+ *
+ * Load the cues of all the hash prefixes in memory, so that lookups of URLs
+ * that match none of them don't need to query the database. This reads the
+ * whole hash_prefix table, so call it from the thread that updates the
+ * database rather than from the main thread.
+ **/
+void
+ephy_gsb_storage_build_prefix_set (EphyGSBStorage *self)
+{
+  EphyGSBPrefixSet *prefix_set;
+
+  g_assert (EPHY_IS_GSB_STORAGE (self));
+
+  /* An update in course loads them when it ends. */
+  if (!self->is_operable || g_atomic_int_get (&self->is_updating))
+    return;
+
+  prefix_set = ephy_gsb_storage_load_prefix_set (self);
+
+  g_mutex_lock (&self->generation_mutex);
+  g_clear_pointer (&self->prefix_set, ephy_gsb_prefix_set_unref);
+  self->prefix_set = prefix_set;
+  g_mutex_unlock (&self->generation_mutex);
+}
+
+/**
+ * ephy_gsb_storage_discard_staged_hash_prefixes:
+ * @self: an #EphyGSBStorage
+ *
+ * Drop the hash prefixes set aside by ephy_gsb_storage_stage_hash_prefixes()
+ * without adding them to any threat list. Use this when the update of the
+ * list they were staged for is abandoned, so that they don't end up in the
+ * next one.
+ **/
+void
+ephy_gsb_storage_discard_staged_hash_prefixes (EphyGSBStorage *self)
+{
+  GError *error = NULL;
+
+  g_assert (EPHY_IS_GSB_STORAGE (self));
+
+  if (!self->is_operable || !self->has_staging_table)
+    return;
+
+  ephy_sqlite_connection_execute (self->db, "DELETE FROM hash_prefix_staged", &error);
+  if (error) {
+    g_warning ("Failed to clear hash_prefix_staged table: %s", error->message);
+    g_error_free (error);
+  }
+}
+
+/**
+ * ephy_gsb_storage_begin_update:
+ * @self: an #EphyGSBStorage
+ *
+ * Start writing the next generation of the threat lists. Until
+ * ephy_gsb_storage_end_update() is called, all changes are made in a single
+ * transaction and lookups keep seeing the previous generation.
+ **/
+void
+ephy_gsb_storage_begin_update (EphyGSBStorage *self)
+{
+  g_assert (EPHY_IS_GSB_STORAGE (self));
+  g_assert (!g_atomic_int_get (&self->is_updating));
+
+  ephy_gsb_storage_start_transaction (self);
+  ephy_gsb_storage_discard_staged_hash_prefixes (self);
+  g_atomic_int_set (&self->is_updating, TRUE);
+}
+
+/**
+ * ephy_gsb_storage_end_update:
+ * @self: an #EphyGSBStorage
+ *
+ * Commit the changes made since ephy_gsb_storage_begin_update() and make
+ * lookups see them.
+ **/
+void
+ephy_gsb_storage_end_update (EphyGSBStorage *self)
+{
+  EphyGSBPrefixSet *prefix_set;
+
+  g_assert (EPHY_IS_GSB_STORAGE (self));
+  g_assert (g_atomic_int_get (&self->is_updating));
+
+  /* Load the new cues before committing, so that the swap below is all that
+   * separates the two generations. */
+  prefix_set = ephy_gsb_storage_load_prefix_set (self);
+
+  g_atomic_int_set (&self->is_updating, FALSE);
+  ephy_gsb_storage_end_transaction (self);
+
+  g_mutex_lock (&self->generation_mutex);
+  g_clear_pointer (&self->prefix_set, ephy_gsb_prefix_set_unref);
+  self->prefix_set = prefix_set;
+  g_mutex_unlock (&self->generation_mutex);
 }
 
 /**
@@ -588,7 +950,7 @@ ephy_gsb_storage_get_metadata (EphyGSBStorage *self,
   g_assert (key);
 
   sql = "SELECT value FROM metadata WHERE key=?";
-  statement = ephy_sqlite_connection_create_statement (self->db, sql, &error);
+  statement = ephy_sqlite_connection_create_cached_statement (self->db, sql, &error);
   if (error) {
     g_warning ("Failed to create select metadata statement: %s", error->message);
     g_error_free (error);
@@ -642,7 +1004,7 @@ ephy_gsb_storage_set_metadata (EphyGSBStorage *self,
     return;
 
   sql = "UPDATE metadata SET value=? WHERE key=?";
-  statement = ephy_sqlite_connection_create_statement (self->db, sql, &error);
+  statement = ephy_sqlite_connection_create_cached_statement (self->db, sql, &error);
   if (error) {
     g_warning ("Failed to create update metadata statement: %s", error->message);
     g_error_free (error);
@@ -702,7 +1064,7 @@ ephy_gsb_storage_get_threat_lists (EphyGSBStorage *self)
     return NULL;
 
   sql = "SELECT threat_type, platform_type, threat_entry_type, client_state FROM threats";
-  statement = ephy_sqlite_connection_create_statement (self->db, sql, &error);
+  statement = ephy_sqlite_connection_create_cached_statement (self->db, sql, &error);
   if (error) {
     g_warning ("Failed to create select threat lists statement: %s", error->message);
     g_error_free (error);
@@ -746,13 +1108,7 @@ char *
 ephy_gsb_storage_compute_checksum (EphyGSBStorage    *self,
                                    EphyGSBThreatList *list)
 {
-  EphySQLiteStatement *statement;
-  GError *error = NULL;
-  const char *sql;
-  char *retval = NULL;
-  GChecksum *checksum;
-  guint8 *digest;
-  gsize digest_len = GSB_HASH_SIZE;
+  EphyGSBPrefixList *prefix_list;
 
   g_assert (EPHY_IS_GSB_STORAGE (self));
   g_assert (list);
@@ -760,45 +1116,11 @@ ephy_gsb_storage_compute_checksum (EphyGSBStorage    *self,
   if (!self->is_operable)
     return NULL;
 
-  sql = "SELECT value FROM hash_prefix WHERE "
-        "threat_type=? AND platform_type=? AND threat_entry_type=? "
-        "ORDER BY value";
-  statement = ephy_sqlite_connection_create_statement (self->db, sql, &error);
-  if (error) {
-    g_warning ("Failed to create select hash prefix statement: %s", error->message);
-    g_error_free (error);
+  prefix_list = ephy_gsb_storage_get_prefix_list (self, list);
+  if (!prefix_list)
     return NULL;
-  }
-
-  if (!bind_threat_list_params (statement, list, 0, 1, 2, -1)) {
-    g_object_unref (statement);
-    return NULL;
-  }
-
-  checksum = g_checksum_new (GSB_HASH_TYPE);
-  while (ephy_sqlite_statement_step (statement, &error)) {
-    g_checksum_update (checksum,
-                       ephy_sqlite_statement_get_column_as_blob (statement, 0),
-                       ephy_sqlite_statement_get_column_size (statement, 0));
-  }
-
-  if (error) {
-    g_warning ("Failed to execute select hash prefix statement: %s", error->message);
-    g_error_free (error);
-    ephy_gsb_storage_recreate_db (self);
-    goto out;
-  }
-
-  digest = g_malloc (digest_len);
-  g_checksum_get_digest (checksum, digest, &digest_len);
-  retval = g_base64_encode (digest, digest_len);
 
-  g_free (digest);
-out:
-  g_object_unref (statement);
-  g_checksum_free (checksum);
-
-  return retval;
+  return ephy_gsb_prefix_list_compute_checksum (prefix_list);
 }
 
 /**
@@ -835,7 +1157,7 @@ ephy_gsb_storage_update_client_state (EphyGSBStorage    *self,
           "WHERE threat_type=? AND platform_type=? AND threat_entry_type=?";
   }
 
-  statement = ephy_sqlite_connection_create_statement (self->db, sql, &error);
+  statement = ephy_sqlite_connection_create_cached_statement (self->db, sql, &error);
   if (error) {
     g_warning ("Failed to create update threats statement: %s", error->message);
     g_error_free (error);
@@ -885,7 +1207,7 @@ ephy_gsb_storage_clear_hash_prefixes (EphyGSBStorage    *self,
 
   sql = "DELETE FROM hash_prefix WHERE "
         "threat_type=? AND platform_type=? AND threat_entry_type=?";
-  statement = ephy_sqlite_connection_create_statement (self->db, sql, &error);
+  statement = ephy_sqlite_connection_create_cached_statement (self->db, sql, &error);
   if (error) {
     g_warning ("Failed to create delete hash prefix statement: %s", error->message);
     g_error_free (error);
@@ -902,68 +1224,15 @@ ephy_gsb_storage_clear_hash_prefixes (EphyGSBStorage    *self,
     g_warning ("Failed to execute clear hash prefix statement: %s", error->message);
     g_error_free (error);
     ephy_gsb_storage_recreate_db (self);
+  } else {
+    g_hash_table_replace (self->prefix_lists,
+                          ephy_gsb_storage_get_prefix_list_key (list),
+                          ephy_gsb_prefix_list_new ());
   }
 
   g_object_unref (statement);
 }
 
-static GList *
-ephy_gsb_storage_get_hash_prefixes_to_delete (EphyGSBStorage    *self,
-                                              EphyGSBThreatList *list,
-                                              GHashTable        *indices,
-                                              gsize             *num_prefixes)
-{
-  EphySQLiteStatement *statement;
-  GError *error = NULL;
-  GList *prefixes = NULL;
-  const char *sql;
-  guint index = 0;
-
-  g_assert (EPHY_IS_GSB_STORAGE (self));
-  g_assert (list);
-  g_assert (indices);
-
-  *num_prefixes = 0;
-
-  if (!self->is_operable)
-    return NULL;
-
-  sql = "SELECT value FROM hash_prefix WHERE "
-        "threat_type=? AND platform_type=? AND threat_entry_type=? "
-        "ORDER BY value";
-  statement = ephy_sqlite_connection_create_statement (self->db, sql, &error);
-  if (error) {
-    g_warning ("Failed to create select prefix value statement: %s", error->message);
-    g_error_free (error);
-    return NULL;
-  }
-
-  if (!bind_threat_list_params (statement, list, 0, 1, 2, -1)) {
-    g_object_unref (statement);
-    return NULL;
-  }
-
-  while (ephy_sqlite_statement_step (statement, &error)) {
-    if (g_hash_table_contains (indices, GUINT_TO_POINTER (index))) {
-      const guint8 *blob = ephy_sqlite_statement_get_column_as_blob (statement, 0);
-      gsize size = ephy_sqlite_statement_get_column_size (statement, 0);
-      prefixes = g_list_prepend (prefixes, g_bytes_new (blob, size));
-      *num_prefixes += 1;
-    }
-    index++;
-  }
-
-  if (error) {
-    g_warning ("Failed to execute select prefix value statement: %s", error->message);
-    g_error_free (error);
-    ephy_gsb_storage_recreate_db (self);
-  }
-
-  g_object_unref (statement);
-
-  return prefixes;
-}
-
 static EphySQLiteStatement *
 ephy_gsb_storage_make_delete_hash_prefix_statement (EphyGSBStorage *self,
                                                     gsize           num_prefixes)
@@ -1057,13 +1326,13 @@ out:
 static void
 ephy_gsb_storage_delete_hash_prefixes_internal (EphyGSBStorage    *self,
                                                 EphyGSBThreatList *list,
-                                                guint32           *indices,
+                                                const guint32     *indices,
                                                 gsize              num_indices)
 {
   EphySQLiteStatement *statement = NULL;
+  EphyGSBPrefixList *prefix_list;
   GList *prefixes = NULL;
   GList *head = NULL;
-  GHashTable *set;
   gsize num_prefixes = 0;
 
   g_assert (EPHY_IS_GSB_STORAGE (self));
@@ -1075,12 +1344,11 @@ ephy_gsb_storage_delete_hash_prefixes_internal (EphyGSBStorage    *self,
 
   LOG ("Deleting %lu hash prefixes...", num_indices);
 
-  /* Move indices from the array to a hash table set. */
-  set = g_hash_table_new (g_direct_hash, g_direct_equal);
-  for (gsize i = 0; i < num_indices; i++)
-    g_hash_table_add (set, GUINT_TO_POINTER (indices[i]));
+  prefix_list = ephy_gsb_storage_get_prefix_list (self, list);
+  if (!prefix_list)
+    return;
 
-  prefixes = ephy_gsb_storage_get_hash_prefixes_to_delete (self, list, set, &num_prefixes);
+  prefixes = ephy_gsb_prefix_list_remove (prefix_list, indices, num_indices, &num_prefixes);
   head = prefixes;
 
   ephy_gsb_storage_start_transaction (self);
@@ -1104,7 +1372,6 @@ ephy_gsb_storage_delete_hash_prefixes_internal (EphyGSBStorage    *self,
 
   ephy_gsb_storage_end_transaction (self);
 
-  g_hash_table_unref (set);
   g_list_free_full (prefixes, (GDestroyNotify)g_bytes_unref);
   if (statement)
     g_object_unref (statement);
@@ -1114,294 +1381,251 @@ ephy_gsb_storage_delete_hash_prefixes_internal (EphyGSBStorage    *self,
  * ephy_gsb_storage_delete_hash_prefixes:
  * @self: an #EphyGSBStorage
  * @list: an #EphyGSBThreatList
- * @tes: a ThreatEntrySet object as a #JsonObject
+ * @indices: the indices of the hash prefixes to delete, in the
+ *   lexicographically sorted list of the hash prefixes of @list
+ * @num_indices: the length of @indices
  *
  * Delete hash prefixes belonging to @list from the local database. Use this
- * when handling the response of a threatListUpdates:fetch request.
+ * when handling the removals of a threatListUpdates:fetch response, before
+ * the additions are committed.
  **/
 void
 ephy_gsb_storage_delete_hash_prefixes (EphyGSBStorage    *self,
                                        EphyGSBThreatList *list,
-                                       JsonObject        *tes)
+                                       const guint32     *indices,
+                                       gsize              num_indices)
 {
-  JsonObject *raw_indices;
-  JsonObject *rice_indices;
-  JsonArray *indices_arr;
-  const char *compression;
-  guint32 *indices;
-  gsize num_indices;
-
   g_assert (EPHY_IS_GSB_STORAGE (self));
   g_assert (list);
-  g_assert (tes);
+  g_assert (indices || num_indices == 0);
 
-  if (!self->is_operable)
+  if (!self->is_operable || num_indices == 0)
     return;
 
-  compression = json_object_get_string_member (tes, "compressionType");
-  if (!g_strcmp0 (compression, GSB_COMPRESSION_TYPE_RICE)) {
-    rice_indices = json_object_get_object_member (tes, "riceIndices");
-    indices = ephy_gsb_utils_rice_delta_decode (rice_indices, &num_indices);
-  } else {
-    raw_indices = json_object_get_object_member (tes, "rawIndices");
-    indices_arr = json_object_get_array_member (raw_indices, "indices");
-    num_indices = json_array_get_length (indices_arr);
-
-    indices = g_malloc (num_indices * sizeof (guint32));
-    for (gsize i = 0; i < num_indices; i++)
-      indices[i] = json_array_get_int_element (indices_arr, i);
-  }
-
   ephy_gsb_storage_delete_hash_prefixes_internal (self, list, indices, num_indices);
-
-  g_free (indices);
 }
 
-static EphySQLiteStatement *
-ephy_gsb_storage_make_insert_hash_prefix_statement (EphyGSBStorage *self,
-                                                    gsize           num_prefixes)
+static gboolean
+ephy_gsb_storage_ensure_staging_table (EphyGSBStorage *self)
 {
-  EphySQLiteStatement *statement;
   GError *error = NULL;
-  GString *sql;
-
-  g_assert (EPHY_IS_GSB_STORAGE (self));
-
-  if (!self->is_operable)
-    return NULL;
 
-  sql = g_string_new ("INSERT INTO hash_prefix "
-                      "(cue, value, threat_type, platform_type, threat_entry_type) VALUES ");
-  for (gsize i = 0; i < num_prefixes; i++)
-    g_string_append (sql, "(?, ?, ?, ?, ?),");
-  /* Remove trailing comma character. */
-  g_string_erase (sql, sql->len - 1, -1);
+  if (self->has_staging_table)
+    return TRUE;
 
-  statement = ephy_sqlite_connection_create_statement (self->db, sql->str, &error);
+  /* SQLite spills temporary tables to disk, so staging a full update doesn't
+   * keep it in memory. */
+  ephy_sqlite_connection_execute (self->db,
+                                  "CREATE TEMP TABLE IF NOT EXISTS hash_prefix_staged (value BLOB NOT NULL)",
+                                  &error);
   if (error) {
-    g_warning ("Failed to create insert hash prefix statement: %s", error->message);
+    g_warning ("Failed to create hash_prefix_staged table: %s", error->message);
     g_error_free (error);
+    return FALSE;
   }
 
-  g_string_free (sql, TRUE);
+  self->has_staging_table = TRUE;
 
-  return statement;
+  return TRUE;
 }
 
-static void
-ephy_gsb_storage_insert_hash_prefixes_batch (EphyGSBStorage      *self,
-                                             EphyGSBThreatList   *list,
-                                             const guint8        *prefixes,
-                                             gsize                start,
-                                             gsize                end,
-                                             gsize                len,
-                                             EphySQLiteStatement *stmt)
+/**
+ * ephy_gsb_storage_stage_hash_prefixes:
+ * @self: an #EphyGSBStorage
+ * @prefixes: the hash prefixes, one after the other
+ * @num_prefixes: the number of hash prefixes in @prefixes
+ * @prefix_len: the length of each hash prefix, between 4 and 32
+ *
+ * Set hash prefixes aside until ephy_gsb_storage_commit_hash_prefixes() adds
+ * them to a threat list. The additions of a threatListUpdates:fetch response
+ * come before its removals, which refer to the list as it was before the
+ * additions.
+ **/
+void
+ephy_gsb_storage_stage_hash_prefixes (EphyGSBStorage *self,
+                                      const guint8   *prefixes,
+                                      gsize           num_prefixes,
+                                      gsize           prefix_len)
 {
-  EphySQLiteStatement *statement = NULL;
+  EphySQLiteStatement *statement;
   GError *error = NULL;
-  gsize id = 0;
-  gboolean free_statement = TRUE;
 
   g_assert (EPHY_IS_GSB_STORAGE (self));
-  g_assert (list);
-  g_assert (prefixes);
+  g_assert (prefixes || num_prefixes == 0);
+  g_assert (prefix_len >= GSB_HASH_CUE_LEN && prefix_len <= GSB_HASH_SIZE);
 
-  if (!self->is_operable)
+  if (!self->is_operable || num_prefixes == 0 || !ephy_gsb_storage_ensure_staging_table (self))
     return;
 
-  if (stmt) {
-    statement = stmt;
-    ephy_sqlite_statement_reset (statement);
-    free_statement = FALSE;
-  } else {
-    statement = ephy_gsb_storage_make_insert_hash_prefix_statement (self, (end - start + 1) / len);
-    if (!statement)
-      return;
+  statement = ephy_sqlite_connection_create_cached_statement (self->db,
+                                                              "INSERT INTO hash_prefix_staged (value) VALUES (?)",
+                                                              &error);
+  if (error) {
+    g_warning ("Failed to create insert staged hash prefix statement: %s", error->message);
+    g_error_free (error);
+    return;
   }
 
-  for (gsize k = start; k < end; k += len) {
-    if (!ephy_sqlite_statement_bind_blob (statement, id++, prefixes + k, GSB_HASH_CUE_LEN, NULL) ||
-        !ephy_sqlite_statement_bind_blob (statement, id++, prefixes + k, len, NULL) ||
-        !bind_threat_list_params (statement, list, id, id + 1, id + 2, -1)) {
-      g_warning ("Failed to bind values in hash prefix statement");
-      goto out;
-    }
-    id += 3;
+  ephy_gsb_storage_start_transaction (self);
+
+  for (gsize i = 0; i < num_prefixes; i++) {
+    if (!ephy_sqlite_statement_bind_blob (statement, 0, prefixes + i * prefix_len, prefix_len, &error))
+      break;
+    ephy_sqlite_statement_step (statement, &error);
+    if (error)
+      break;
+    ephy_sqlite_statement_reset (statement);
   }
 
-  ephy_sqlite_statement_step (statement, &error);
+  ephy_gsb_storage_end_transaction (self);
+
   if (error) {
-    g_warning ("Failed to execute insert hash prefix statement: %s", error->message);
+    g_warning ("Failed to execute insert staged hash prefix statement: %s", error->message);
     g_error_free (error);
-    ephy_gsb_storage_recreate_db (self);
   }
 
-out:
-  if (free_statement && statement)
-    g_object_unref (statement);
+  g_object_unref (statement);
 }
 
 static void
-ephy_gsb_storage_insert_hash_prefixes_internal (EphyGSBStorage    *self,
-                                                EphyGSBThreatList *list,
-                                                const guint8      *prefixes,
-                                                gsize              num_prefixes,
-                                                gsize              prefix_len)
+ephy_gsb_storage_merge_staged_hash_prefixes (EphyGSBStorage    *self,
+                                             EphyGSBPrefixList *prefix_list)
 {
-  EphySQLiteStatement *statement = NULL;
-  gsize num_batches;
-
-  g_assert (EPHY_IS_GSB_STORAGE (self));
-  g_assert (list);
-  g_assert (prefixes);
+  EphySQLiteStatement *statement;
+  EphyGSBPrefixList *additions;
+  GError *error = NULL;
 
-  if (!self->is_operable)
+  /* Only the additions need sorting, then they are merged into the list. */
+  statement = ephy_sqlite_connection_create_cached_statement (self->db,
+                                                              "SELECT value FROM hash_prefix_staged ORDER BY value",
+                                                              &error);
+  if (error) {
+    g_warning ("Failed to create select staged hash prefix statement: %s", error->message);
+    g_error_free (error);
+    g_hash_table_remove_all (self->prefix_lists);
     return;
-
-  LOG ("Inserting %lu hash prefixes of size %ld...", num_prefixes, prefix_len);
-
-  ephy_gsb_storage_start_transaction (self);
-
-  num_batches = num_prefixes / BATCH_SIZE;
-  if (num_batches > 0) {
-    /* Reuse statement to increase performance. */
-    statement = ephy_gsb_storage_make_insert_hash_prefix_statement (self, BATCH_SIZE);
-
-    for (gsize i = 0; i < num_batches; i++) {
-      ephy_gsb_storage_insert_hash_prefixes_batch (self, list, prefixes,
-                                                   i * prefix_len * BATCH_SIZE,
-                                                   (i + 1) * prefix_len * BATCH_SIZE,
-                                                   prefix_len,
-                                                   statement);
-    }
   }
 
-  if (num_prefixes % BATCH_SIZE != 0) {
-    ephy_gsb_storage_insert_hash_prefixes_batch (self, list, prefixes,
-                                                 num_batches * prefix_len * BATCH_SIZE,
-                                                 num_prefixes * prefix_len - 1,
-                                                 prefix_len,
-                                                 NULL);
+  additions = ephy_gsb_prefix_list_new ();
+  while (ephy_sqlite_statement_step (statement, &error)) {
+    /* Duplicates are skipped, like INSERT OR IGNORE does. */
+    ephy_gsb_prefix_list_append (additions,
+                                 ephy_sqlite_statement_get_column_as_blob (statement, 0),
+                                 ephy_sqlite_statement_get_column_size (statement, 0));
   }
 
-  ephy_gsb_storage_end_transaction (self);
+  if (error) {
+    g_warning ("Failed to execute select staged hash prefix statement: %s", error->message);
+    g_error_free (error);
+    /* The lists will be loaded again from the database. */
+    g_hash_table_remove_all (self->prefix_lists);
+  } else {
+    ephy_gsb_prefix_list_merge (prefix_list, additions);
+  }
 
-  if (statement)
-    g_object_unref (statement);
+  ephy_gsb_prefix_list_free (additions);
+  g_object_unref (statement);
 }
 
 /**
- * ephy_gsb_storage_insert_hash_prefixes:
+ * ephy_gsb_storage_commit_hash_prefixes:
  * @self: an #EphyGSBStorage
  * @list: an #EphyGSBThreatList
- * @tes: a ThreatEntrySet object as a #JsonObject
  *
- * Insert hash prefixes belonging to @list in the local database. Use this
- * when handling the response of a threatListUpdates:fetch request.
+ * Add the hash prefixes set aside by ephy_gsb_storage_stage_hash_prefixes()
+ * to @list.
  **/
 void
-ephy_gsb_storage_insert_hash_prefixes (EphyGSBStorage    *self,
-                                       EphyGSBThreatList *list,
-                                       JsonObject        *tes)
+ephy_gsb_storage_commit_hash_prefixes (EphyGSBStorage    *self,
+                                       EphyGSBThreatList *list)
 {
-  JsonObject *raw_hashes;
-  JsonObject *rice_hashes;
-  const char *compression;
-  const char *prefixes_b64;
-  guint32 *items = NULL;
-  guint8 *prefixes;
-  gsize prefixes_len;
-  gsize prefix_len;
-  gsize num_prefixes;
+  EphySQLiteStatement *statement;
+  EphyGSBPrefixList *prefix_list;
+  GError *error = NULL;
+  const char *sql;
 
   g_assert (EPHY_IS_GSB_STORAGE (self));
   g_assert (list);
-  g_assert (tes);
 
-  if (!self->is_operable)
+  if (!self->is_operable || !self->has_staging_table)
     return;
 
-  compression = json_object_get_string_member (tes, "compressionType");
-  if (!g_strcmp0 (compression, GSB_COMPRESSION_TYPE_RICE)) {
-    rice_hashes = json_object_get_object_member (tes, "riceHashes");
-    items = ephy_gsb_utils_rice_delta_decode (rice_hashes, &num_prefixes);
+  /* Load the list as it is before the additions. */
+  prefix_list = ephy_gsb_storage_get_prefix_list (self, list);
 
-    prefixes = g_malloc (num_prefixes * GSB_RICE_PREFIX_LEN);
-    for (gsize i = 0; i < num_prefixes; i++)
-      memcpy (prefixes + i * GSB_RICE_PREFIX_LEN, &items[i], GSB_RICE_PREFIX_LEN);
+  sql = "INSERT OR IGNORE INTO hash_prefix "
+        "(cue, value, threat_type, platform_type, threat_entry_type) "
+        "SELECT substr(value, 1, 4), value, ?, ?, ? FROM hash_prefix_staged";
+  statement = ephy_sqlite_connection_create_cached_statement (self->db, sql, &error);
+  if (error) {
+    g_warning ("Failed to create commit hash prefix statement: %s", error->message);
+    g_error_free (error);
+    ephy_gsb_storage_discard_staged_hash_prefixes (self);
+    return;
+  }
 
-    prefix_len = GSB_RICE_PREFIX_LEN;
+  if (!bind_threat_list_params (statement, list, 0, 1, 2, -1)) {
+    ephy_gsb_storage_discard_staged_hash_prefixes (self);
   } else {
-    raw_hashes = json_object_get_object_member (tes, "rawHashes");
-    prefix_len = json_object_get_int_member (raw_hashes, "prefixSize");
-    prefixes_b64 = json_object_get_string_member (raw_hashes, "rawHashes");
+    ephy_gsb_storage_start_transaction (self);
 
-    prefixes = g_base64_decode (prefixes_b64, &prefixes_len);
-    num_prefixes = prefixes_len / prefix_len;
+    ephy_sqlite_statement_step (statement, &error);
+    if (error) {
+      g_warning ("Failed to execute commit hash prefix statement: %s", error->message);
+      g_error_free (error);
+      ephy_gsb_storage_recreate_db (self);
+    } else {
+      if (prefix_list)
+        ephy_gsb_storage_merge_staged_hash_prefixes (self, prefix_list);
+      ephy_gsb_storage_discard_staged_hash_prefixes (self);
+      ephy_gsb_storage_end_transaction (self);
+    }
   }
 
-  ephy_gsb_storage_insert_hash_prefixes_internal (self, list, prefixes, num_prefixes, prefix_len);
+  g_object_unref (statement);
+}
 
-  g_free (items);
-  g_free (prefixes);
+static int
+compare_cues (gconstpointer a,
+              gconstpointer b)
+{
+  return memcmp (a, b, GSB_HASH_CUE_LEN);
 }
 
-/**
- * ephy_gsb_storage_lookup_hash_prefixes:
- * @self: an #EphyGSBStorage
- * @cues: a #GList of hash cues as #GBytes
- *
- * Retrieve the hash prefixes and their negative cache expiration time from the
- * local database that begin with the hash cues in @cues. The hash cue length is
- * specified by the GSB_HASH_CUE_LEN macro.
- *
- * Return value: (element-type #EphyGSBHashPrefixLookup) (transfer-full):
- *               a #GList containing the lookup result.  The caller takes
- *               ownership of the list and its content. Use g_list_free_full()
- *               with ephy_gsb_hash_prefix_lookup_free() as free_func when done
- *               using the list.
- **/
-GList *
-ephy_gsb_storage_lookup_hash_prefixes (EphyGSBStorage *self,
-                                       GList          *cues)
+static gboolean
+ephy_gsb_storage_lookup_hash_prefixes_batch (EphyGSBStorage       *self,
+                                             EphySQLiteConnection *read_db,
+                                             const guint32        *cues,
+                                             gsize                 num_cues,
+                                             GList               **retval)
 {
   EphySQLiteStatement *statement;
   GError *error = NULL;
-  GList *retval = NULL;
   GString *sql;
-  guint id = 0;
-
-  g_assert (EPHY_IS_GSB_STORAGE (self));
-  g_assert (cues);
-
-  if (!self->is_operable)
-    return NULL;
 
   sql = g_string_new ("SELECT value, negative_expires_at <= (CAST(strftime('%s', 'now') AS INT)) "
                       "FROM hash_prefix WHERE cue IN (");
-  for (GList *l = cues; l && l->data; l = l->next)
+  for (gsize i = 0; i < num_cues; i++)
     g_string_append (sql, "?,");
   /* Replace trailing comma character with close parenthesis character. */
   g_string_overwrite (sql, sql->len - 1, ")");
 
-  statement = ephy_sqlite_connection_create_statement (self->db, sql->str, &error);
+  statement = ephy_sqlite_connection_create_statement (read_db, sql->str, &error);
   g_string_free (sql, TRUE);
 
   if (error) {
     g_warning ("Failed to create select hash prefix statement: %s", error->message);
     g_error_free (error);
-    return NULL;
+    return FALSE;
   }
 
-  for (GList *l = cues; l && l->data; l = l->next) {
-    ephy_sqlite_statement_bind_blob (statement, id++,
-                                     g_bytes_get_data (l->data, NULL), GSB_HASH_CUE_LEN,
-                                     &error);
+  for (gsize i = 0; i < num_cues; i++) {
+    ephy_sqlite_statement_bind_blob (statement, i, &cues[i], GSB_HASH_CUE_LEN, &error);
     if (error) {
       g_warning ("Failed to bind cue value as blob: %s", error->message);
       g_error_free (error);
       g_object_unref (statement);
-      return NULL;
+      return FALSE;
     }
   }
 
@@ -1409,18 +1633,101 @@ ephy_gsb_storage_lookup_hash_prefixes (EphyGSBStorage *self,
     const guint8 *blob = ephy_sqlite_statement_get_column_as_blob (statement, 0);
     gsize size = ephy_sqlite_statement_get_column_size (statement, 0);
     gboolean negative_expired = ephy_sqlite_statement_get_column_as_boolean (statement, 1);
-    retval = g_list_prepend (retval, ephy_gsb_hash_prefix_lookup_new (blob, size, negative_expired));
+    *retval = g_list_prepend (*retval, ephy_gsb_hash_prefix_lookup_new (blob, size, negative_expired));
   }
 
+  g_object_unref (statement);
+
   if (error) {
     g_warning ("Failed to execute select hash prefix statement: %s", error->message);
     g_error_free (error);
-    g_list_free_full (retval, (GDestroyNotify)ephy_gsb_hash_prefix_lookup_free);
-    retval = NULL;
-    ephy_gsb_storage_recreate_db (self);
+    /* Leave the URLs undecided. A broken database is recreated by the update
+     * thread, the only one writing to it, when it next fails to write. */
+    return FALSE;
   }
 
-  g_object_unref (statement);
+  return TRUE;
+}
+
+/**
+ * ephy_gsb_storage_lookup_hash_prefixes:
+ * @self: an #EphyGSBStorage
+ * @urls: an array of URL hashes
+ * @num_urls: the length of @urls
+ *
+ * Retrieve the hash prefixes and their negative cache expiration time from the
+ * local database that begin with the cue of any of the hashes in @urls. The
+ * hash cue length is specified by the GSB_HASH_CUE_LEN macro.
+ *
+ * Return value: (element-type #EphyGSBHashPrefixLookup) (transfer-full):
+ *               a #GList containing the lookup result.  The caller takes
+ *               ownership of the list and its content. Use g_list_free_full()
+ *               with ephy_gsb_hash_prefix_lookup_free() as free_func when done
+ *               using the list.
+ **/
+GList *
+ephy_gsb_storage_lookup_hash_prefixes (EphyGSBStorage         *self,
+                                       const EphyGSBUrlHashes *urls,
+                                       gsize                   num_urls)
+{
+  g_autoptr (EphySQLiteConnection) read_db = NULL;
+  g_autoptr (EphyGSBPrefixSet) prefix_set = NULL;
+  g_autoptr (GArray) candidates = NULL;
+  GList *retval = NULL;
+  guint num_candidates = 0;
+
+  g_assert (EPHY_IS_GSB_STORAGE (self));
+  g_assert (urls || num_urls == 0);
+
+  if (!ephy_gsb_storage_is_operable (self))
+    return NULL;
+
+  /* Most URLs have no cue in common with any threat list. Find out in memory,
+   * and only go to the database for the cues that do match. */
+  prefix_set = ephy_gsb_storage_get_prefix_set (self);
+  for (gsize i = 0; i < num_urls; i++) {
+    for (guint j = 0; j < urls[i].num_hashes; j++) {
+      const guint8 *cue = urls[i].hashes[j];
+      guint32 value;
+
+      if (prefix_set && !ephy_gsb_prefix_set_contains (prefix_set, cue))
+        continue;
+
+      if (!candidates)
+        candidates = g_array_new (FALSE, FALSE, sizeof (guint32));
+      memcpy (&value, cue, GSB_HASH_CUE_LEN);
+      g_array_append_val (candidates, value);
+    }
+  }
+
+  if (!candidates)
+    return NULL;
+
+  /* URLs of the same site share most of their cues. */
+  g_array_sort (candidates, compare_cues);
+  for (guint i = 0; i < candidates->len; i++) {
+    if (num_candidates == 0 ||
+        compare_cues (&g_array_index (candidates, guint32, i),
+                      &g_array_index (candidates, guint32, num_candidates - 1)) != 0)
+      g_array_index (candidates, guint32, num_candidates++) = g_array_index (candidates, guint32, i);
+  }
+
+  /* Without a read connection, e.g. while the database is recreated, the
+   * URLs cannot be verified. The write connection belongs to the update
+   * thread. */
+  read_db = ephy_gsb_storage_get_read_db (self);
+  if (!read_db)
+    return NULL;
+
+  for (guint i = 0; i < num_candidates; i += BATCH_SIZE) {
+    if (!ephy_gsb_storage_lookup_hash_prefixes_batch (self, read_db,
+                                                      &g_array_index (candidates, guint32, i),
+                                                      MIN (num_candidates - i, BATCH_SIZE),
+                                                      &retval)) {
+      g_list_free_full (retval, (GDestroyNotify)ephy_gsb_hash_prefix_lookup_free);
+      return NULL;
+    }
+  }
 
   return g_list_reverse (retval);
 }
@@ -1445,6 +1752,7 @@ ephy_gsb_storage_lookup_full_hashes (EphyGSBStorage *self,
                                      GList          *hashes)
 {
   EphySQLiteStatement *statement;
+  g_autoptr (EphySQLiteConnection) read_db = NULL;
   GError *error = NULL;
   GList *retval = NULL;
   GString *sql;
@@ -1453,7 +1761,12 @@ ephy_gsb_storage_lookup_full_hashes (EphyGSBStorage *self,
   g_assert (EPHY_IS_GSB_STORAGE (self));
   g_assert (hashes);
 
-  if (!self->is_operable)
+  if (!ephy_gsb_storage_is_operable (self))
+    return NULL;
+
+  /* See ephy_gsb_storage_lookup_hash_prefixes(). */
+  read_db = ephy_gsb_storage_get_read_db (self);
+  if (!read_db)
     return NULL;
 
   sql = g_string_new ("SELECT value, threat_type, platform_type, threat_entry_type, "
@@ -1464,7 +1777,7 @@ ephy_gsb_storage_lookup_full_hashes (EphyGSBStorage *self,
   /* Replace trailing comma character with close parenthesis character. */
   g_string_overwrite (sql, sql->len - 1, ")");
 
-  statement = ephy_sqlite_connection_create_statement (self->db, sql->str, &error);
+  statement = ephy_sqlite_connection_create_statement (read_db, sql->str, &error);
   g_string_free (sql, TRUE);
 
   if (error) {
@@ -1504,7 +1817,6 @@ ephy_gsb_storage_lookup_full_hashes (EphyGSBStorage *self,
     g_error_free (error);
     g_list_free_full (retval, (GDestroyNotify)ephy_gsb_hash_full_lookup_free);
     retval = NULL;
-    ephy_gsb_storage_recreate_db (self);
   }
 
   g_object_unref (statement);
@@ -1547,7 +1859,7 @@ ephy_gsb_storage_insert_full_hash (EphyGSBStorage    *self,
   sql = "INSERT OR IGNORE INTO hash_full "
         "(value, threat_type, platform_type, threat_entry_type) "
         "VALUES (?, ?, ?, ?)";
-  statement = ephy_sqlite_connection_create_statement (self->db, sql, &error);
+  statement = ephy_sqlite_connection_create_cached_statement (self->db, sql, &error);
   if (error) {
     g_warning ("Failed to create insert full hash statement: %s", error->message);
     goto out;
@@ -1572,7 +1884,7 @@ ephy_gsb_storage_insert_full_hash (EphyGSBStorage    *self,
   g_clear_object (&statement);
   sql = "UPDATE hash_full SET expires_at=(CAST(strftime('%s', 'now') AS INT)) + ? "
         "WHERE value=? AND threat_type=? AND platform_type=? AND threat_entry_type=?";
-  statement = ephy_sqlite_connection_create_statement (self->db, sql, &error);
+  statement = ephy_sqlite_connection_create_cached_statement (self->db, sql, &error);
   if (error) {
     g_warning ("Failed to create update full hash statement: %s", error->message);
     goto out;
@@ -1609,7 +1921,7 @@ out:
  * @self: an #EphyGSBStorage
  *
  * Delete long expired full hashes from the local database. The expiration
- * threshold is specified by the EXPIRATION_THRESHOLD macro.
+ * threshold is specified by the GSB_EXPIRATION_THRESHOLD macro.
  **/
 void
 ephy_gsb_storage_delete_old_full_hashes (EphyGSBStorage *self)
@@ -1623,18 +1935,18 @@ ephy_gsb_storage_delete_old_full_hashes (EphyGSBStorage *self)
   if (!self->is_operable)
     return;
 
-  LOG ("Deleting full hashes expired for more than %d seconds", EXPIRATION_THRESHOLD);
+  LOG ("Deleting full hashes expired for more than %d seconds", GSB_EXPIRATION_THRESHOLD);
 
   sql = "DELETE FROM hash_full "
         "WHERE expires_at <= (CAST(strftime('%s', 'now') AS INT)) - ?";
-  statement = ephy_sqlite_connection_create_statement (self->db, sql, &error);
+  statement = ephy_sqlite_connection_create_cached_statement (self->db, sql, &error);
   if (error) {
     g_warning ("Failed to create delete full hash statement: %s", error->message);
     g_error_free (error);
     return;
   }
 
-  ephy_sqlite_statement_bind_int64 (statement, 0, EXPIRATION_THRESHOLD, &error);
+  ephy_sqlite_statement_bind_int64 (statement, 0, GSB_EXPIRATION_THRESHOLD, &error);
   if (error) {
     g_warning ("Failed to bind int64 in delete full hash statement: %s", error->message);
     g_error_free (error);
@@ -1678,7 +1990,7 @@ ephy_gsb_storage_update_hash_prefix_expiration (EphyGSBStorage *self,
   sql = "UPDATE hash_prefix "
         "SET negative_expires_at=(CAST(strftime('%s', 'now') AS INT)) + ? "
         "WHERE value=?";
-  statement = ephy_sqlite_connection_create_statement (self->db, sql, &error);
+  statement = ephy_sqlite_connection_create_cached_statement (self->db, sql, &error);
   if (error) {
     g_warning ("Failed to create update hash prefix statement: %s", error->message);
     g_error_free (error);
@@ -28,10 +28,15 @@ G_BEGIN_DECLS
 
 #define EPHY_TYPE_GSB_STORAGE (ephy_gsb_storage_get_type ())
 
+/* How long expired full hashes are kept, so that matching them asks the
+ * server again rather than passing as a miss. */
+#define GSB_EXPIRATION_THRESHOLD (8 * 60 * 60) /* seconds */
+
 G_DECLARE_FINAL_TYPE (EphyGSBStorage, ephy_gsb_storage, EPHY, GSB_STORAGE, GObject)
 
 EphyGSBStorage *ephy_gsb_storage_new                            (const char *db_path);
 gboolean        ephy_gsb_storage_is_operable                    (EphyGSBStorage *self);
+void            ephy_gsb_storage_build_prefix_set               (EphyGSBStorage *self);
 gint64          ephy_gsb_storage_get_metadata                   (EphyGSBStorage *self,
                                                                  const char     *key,
                                                                  gint64          default_value);
@@ -39,6 +44,8 @@ void            ephy_gsb_storage_set_metadata                   (EphyGSBStorage
                                                                  const char     *key,
                                                                  gint64          value);
 GList          *ephy_gsb_storage_get_threat_lists               (EphyGSBStorage *self);
+void            ephy_gsb_storage_begin_update                   (EphyGSBStorage *self);
+void            ephy_gsb_storage_end_update                     (EphyGSBStorage *self);
 char           *ephy_gsb_storage_compute_checksum               (EphyGSBStorage    *self,
                                                                  EphyGSBThreatList *list);
 void            ephy_gsb_storage_update_client_state            (EphyGSBStorage    *self,
@@ -48,12 +55,18 @@ void            ephy_gsb_storage_clear_hash_prefixes            (EphyGSBStorage
                                                                  EphyGSBThreatList *list);
 void            ephy_gsb_storage_delete_hash_prefixes           (EphyGSBStorage    *self,
                                                                  EphyGSBThreatList *list,
-                                                                 JsonObject        *tes);
-void            ephy_gsb_storage_insert_hash_prefixes           (EphyGSBStorage    *self,
-                                                                 EphyGSBThreatList *list,
-                                                                 JsonObject        *tes);
-GList          *ephy_gsb_storage_lookup_hash_prefixes           (EphyGSBStorage *self,
-                                                                 GList          *cues);
+                                                                 const guint32     *indices,
+                                                                 gsize              num_indices);
+void            ephy_gsb_storage_stage_hash_prefixes            (EphyGSBStorage    *self,
+                                                                 const guint8      *prefixes,
+                                                                 gsize              num_prefixes,
+                                                                 gsize              prefix_len);
+void            ephy_gsb_storage_commit_hash_prefixes           (EphyGSBStorage    *self,
+                                                                 EphyGSBThreatList *list);
+void            ephy_gsb_storage_discard_staged_hash_prefixes   (EphyGSBStorage    *self);
+GList          *ephy_gsb_storage_lookup_hash_prefixes           (EphyGSBStorage         *self,
+                                                                 const EphyGSBUrlHashes *urls,
+                                                                 gsize                   num_urls);
 GList          *ephy_gsb_storage_lookup_full_hashes             (EphyGSBStorage *self,
                                                                  GList          *hashes);
 void            ephy_gsb_storage_insert_full_hash               (EphyGSBStorage    *self,
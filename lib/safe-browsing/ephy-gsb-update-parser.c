@@ -0,0 +1,843 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2021 Epiphany Developers
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "ephy-gsb-update-parser.h"
+
+#include "ephy-gsb-utils.h"
+
+#include <gio/gio.h>
+#include <string.h>
+
+/* This parses the body of a threatListUpdates:fetch response as it arrives,
+ * without building a tree of it. Only the members Epiphany uses are kept;
+ * the base64 strings of the additions and removals, which make up nearly all
+ * of a response, are decoded as they are read and handed over in batches.
+ *
+ * https://developers.google.com/safe-browsing/v4/reference/rest/v4/threatListUpdates/fetch
+ */
+
+#define MAX_DEPTH       32
+#define MAX_TOKEN_LEN   4096 /* Longer strings and literals are cut */
+#define RICE_BATCH_SIZE 1024
+
+typedef enum {
+  LEX_DEFAULT,
+  LEX_STRING,
+  LEX_ESCAPE,
+  LEX_UNICODE,
+  LEX_LITERAL
+} LexState;
+
+typedef enum {
+  EXPECT_VALUE,
+  EXPECT_KEY,
+  EXPECT_COLON,
+  EXPECT_COMMA,
+  EXPECT_END
+} ExpectState;
+
+typedef enum {
+  FRAME_IGNORED,
+  FRAME_ROOT,         /* FetchThreatListUpdatesResponse */
+  FRAME_RESPONSES,    /* listUpdateResponses */
+  FRAME_LIST,         /* ListUpdateResponse */
+  FRAME_CHECKSUM,     /* Checksum */
+  FRAME_ADDITIONS,    /* additions */
+  FRAME_REMOVALS,     /* removals */
+  FRAME_ENTRY_SET,    /* ThreatEntrySet */
+  FRAME_RAW_HASHES,   /* RawHashes */
+  FRAME_RAW_INDICES,  /* RawIndices */
+  FRAME_INDICES,      /* RawIndices.indices */
+  FRAME_RICE          /* RiceDeltaEncoding */
+} FrameKind;
+
+typedef struct {
+  FrameKind kind;
+  gboolean is_array;
+} Frame;
+
+struct _EphyGSBUpdateParser {
+  EphyGSBUpdateParserAdditionsFunc additions_func;
+  EphyGSBUpdateParserListFunc list_func;
+  gpointer user_data;
+
+  /* Tokenizer */
+  LexState lex_state;
+  ExpectState expect;
+  Frame stack[MAX_DEPTH];
+  guint depth;
+  gboolean string_is_key;
+  gboolean string_is_streamed;
+  GString *key;
+  GString *token;
+  gunichar unicode_value;
+  guint unicode_len;
+
+  /* The ListUpdateResponse being parsed */
+  EphyGSBListUpdate update;
+
+  /* The ThreatEntrySet being parsed */
+  gboolean is_removal;
+  int base64_state;
+  guint base64_save;
+  GByteArray *decoded;
+  gint64 prefix_size;
+  guint32 rice_first_value;
+  gint64 rice_parameter;
+  gint64 rice_num_entries;
+  gboolean has_rice_parameter;
+  gboolean has_rice_num_entries;
+  gboolean rice_started;
+  guint32 rice_last_value;
+  gsize rice_num_decoded;
+  gsize rice_bit_offset;
+
+  double minimum_wait_duration;
+};
+
+static void
+parser_clear_update (EphyGSBUpdateParser *self)
+{
+  g_clear_pointer (&self->update.threat_type, g_free);
+  g_clear_pointer (&self->update.platform_type, g_free);
+  g_clear_pointer (&self->update.threat_entry_type, g_free);
+  g_clear_pointer (&self->update.response_type, g_free);
+  g_clear_pointer (&self->update.new_client_state, g_free);
+  g_clear_pointer (&self->update.checksum, g_free);
+  g_array_set_size (self->update.removals, 0);
+}
+
+static void
+parser_reset_entry (EphyGSBUpdateParser *self)
+{
+  self->base64_state = 0;
+  self->base64_save = 0;
+  g_byte_array_set_size (self->decoded, 0);
+  self->prefix_size = 0;
+  self->rice_first_value = 0;
+  self->rice_parameter = 0;
+  self->rice_num_entries = 0;
+  self->has_rice_parameter = FALSE;
+  self->has_rice_num_entries = FALSE;
+  self->rice_started = FALSE;
+  self->rice_last_value = 0;
+  self->rice_num_decoded = 0;
+  self->rice_bit_offset = 0;
+}
+
+/**
+ * ephy_gsb_update_parser_new:
+ * @additions_func: called with each batch of hash prefixes added to the list
+ *   being parsed
+ * @list_func: called at the end of each ListUpdateResponse, after all its
+ *   additions were passed to @additions_func
+ * @user_data: data to pass to @additions_func and @list_func
+ *
+ * Create a parser for the body of a threatListUpdates:fetch response.
+ *
+ * Return value: (transfer full): a new #EphyGSBUpdateParser
+ **/
+EphyGSBUpdateParser *
+ephy_gsb_update_parser_new (EphyGSBUpdateParserAdditionsFunc additions_func,
+                            EphyGSBUpdateParserListFunc      list_func,
+                            gpointer                         user_data)
+{
+  EphyGSBUpdateParser *self;
+
+  g_assert (additions_func);
+  g_assert (list_func);
+
+  self = g_new0 (EphyGSBUpdateParser, 1);
+  self->additions_func = additions_func;
+  self->list_func = list_func;
+  self->user_data = user_data;
+  self->expect = EXPECT_VALUE;
+  self->key = g_string_new (NULL);
+  self->token = g_string_new (NULL);
+  self->update.removals = g_array_new (FALSE, FALSE, sizeof (guint32));
+  self->decoded = g_byte_array_new ();
+  self->minimum_wait_duration = -1;
+
+  return self;
+}
+
+void
+ephy_gsb_update_parser_free (EphyGSBUpdateParser *self)
+{
+  g_assert (self);
+
+  parser_clear_update (self);
+  g_array_free (self->update.removals, TRUE);
+  g_byte_array_free (self->decoded, TRUE);
+  g_string_free (self->key, TRUE);
+  g_string_free (self->token, TRUE);
+
+  g_free (self);
+}
+
+static void
+parser_emit_values (EphyGSBUpdateParser *self,
+                    const guint32       *values,
+                    gsize                num_values)
+{
+  if (num_values == 0)
+    return;
+
+  /* Rice-encoded hash prefixes are stored the way they were decoded. */
+  if (self->is_removal)
+    g_array_append_vals (self->update.removals, values, num_values);
+  else
+    self->additions_func ((const guint8 *)values, num_values, GSB_RICE_PREFIX_LEN, self->user_data);
+}
+
+static void
+parser_decode_rice (EphyGSBUpdateParser *self,
+                    gboolean             flush)
+{
+  guint32 values[RICE_BATCH_SIZE];
+  gsize num_values = 0;
+  gboolean valid_parameter;
+
+  /* Members with default values are left out of the response, so unless the
+   * members the deltas depend on came first, wait for the end of the object. */
+  if (!flush && (!self->has_rice_parameter || !self->has_rice_num_entries))
+    return;
+
+  if (!self->rice_started) {
+    values[num_values++] = self->rice_first_value;
+    self->rice_last_value = self->rice_first_value;
+    self->rice_started = TRUE;
+  }
+
+  valid_parameter = self->rice_parameter >= 2 && self->rice_parameter <= 28;
+  while (valid_parameter && self->rice_num_decoded < (gsize)self->rice_num_entries) {
+    gsize max_deltas = MIN (G_N_ELEMENTS (values) - num_values,
+                            (gsize)self->rice_num_entries - self->rice_num_decoded);
+    gsize num_deltas;
+
+    num_deltas = ephy_gsb_utils_rice_decode_deltas (self->decoded->data, self->decoded->len,
+                                                    &self->rice_bit_offset, self->rice_parameter,
+                                                    values + num_values, max_deltas);
+    if (num_deltas == 0)
+      break;
+
+    for (gsize i = num_values; i < num_values + num_deltas; i++) {
+      self->rice_last_value += values[i];
+      values[i] = self->rice_last_value;
+    }
+
+    num_values += num_deltas;
+    self->rice_num_decoded += num_deltas;
+
+    if (num_values == G_N_ELEMENTS (values)) {
+      parser_emit_values (self, values, num_values);
+      num_values = 0;
+    }
+  }
+
+  parser_emit_values (self, values, num_values);
+
+  /* Only keep the bytes that were not fully decoded. */
+  g_byte_array_remove_range (self->decoded, 0, self->rice_bit_offset / 8);
+  self->rice_bit_offset %= 8;
+
+  if (flush && valid_parameter && self->rice_num_decoded < (gsize)self->rice_num_entries)
+    g_warning ("Rice-encoded data ends after %" G_GSIZE_FORMAT " of %" G_GINT64_FORMAT " entries",
+               self->rice_num_decoded, self->rice_num_entries);
+}
+
+static void
+parser_decode_raw_hashes (EphyGSBUpdateParser *self,
+                          gboolean             flush)
+{
+  gsize num_prefixes;
+
+  if (self->prefix_size < GSB_HASH_CUE_LEN || self->prefix_size > (gint64)GSB_HASH_SIZE) {
+    /* prefixSize may still come after rawHashes. */
+    if (flush && self->decoded->len > 0)
+      g_warning ("Invalid hash prefix size %" G_GINT64_FORMAT, self->prefix_size);
+    return;
+  }
+
+  num_prefixes = self->decoded->len / self->prefix_size;
+  if (num_prefixes > 0) {
+    self->additions_func (self->decoded->data, num_prefixes, self->prefix_size, self->user_data);
+    g_byte_array_remove_range (self->decoded, 0, num_prefixes * self->prefix_size);
+  }
+
+  if (flush && self->decoded->len > 0)
+    g_warning ("Raw hashes end with a partial hash prefix");
+}
+
+static void
+parser_decode (EphyGSBUpdateParser *self,
+               gboolean             flush)
+{
+  if (self->depth == 0)
+    return;
+
+  if (self->stack[self->depth - 1].kind == FRAME_RAW_HASHES)
+    parser_decode_raw_hashes (self, flush);
+  else if (self->stack[self->depth - 1].kind == FRAME_RICE)
+    parser_decode_rice (self, flush);
+}
+
+static void
+parser_append_base64 (EphyGSBUpdateParser *self,
+                      const char          *data,
+                      gsize                length)
+{
+  gsize old_len = self->decoded->len;
+  gsize decoded_len;
+
+  if (length == 0)
+    return;
+
+  g_byte_array_set_size (self->decoded, old_len + (length / 4) * 3 + 3);
+  decoded_len = g_base64_decode_step (data, length, self->decoded->data + old_len,
+                                      &self->base64_state, &self->base64_save);
+  g_byte_array_set_size (self->decoded, old_len + decoded_len);
+}
+
+static void
+parser_append_string (EphyGSBUpdateParser *self,
+                      const char          *data,
+                      gsize                length)
+{
+  if (self->string_is_streamed) {
+    parser_append_base64 (self, data, length);
+    return;
+  }
+
+  length = MIN (length, MAX_TOKEN_LEN - MIN (self->token->len, MAX_TOKEN_LEN));
+  g_string_append_len (self->token, data, length);
+}
+
+static FrameKind
+parser_get_child_kind (EphyGSBUpdateParser *self,
+                       gboolean             is_array)
+{
+  const char *key = self->key->str;
+
+  if (self->depth == 0)
+    return is_array ? FRAME_IGNORED : FRAME_ROOT;
+
+  switch (self->stack[self->depth - 1].kind) {
+    case FRAME_ROOT:
+      if (is_array && !strcmp (key, "listUpdateResponses"))
+        return FRAME_RESPONSES;
+      break;
+    case FRAME_RESPONSES:
+      if (!is_array)
+        return FRAME_LIST;
+      break;
+    case FRAME_LIST:
+      if (is_array && !strcmp (key, "additions"))
+        return FRAME_ADDITIONS;
+      if (is_array && !strcmp (key, "removals"))
+        return FRAME_REMOVALS;
+      if (!is_array && !strcmp (key, "checksum"))
+        return FRAME_CHECKSUM;
+      break;
+    case FRAME_ADDITIONS:
+    case FRAME_REMOVALS:
+      if (!is_array)
+        return FRAME_ENTRY_SET;
+      break;
+    case FRAME_ENTRY_SET:
+      if (is_array)
+        break;
+      if (!self->is_removal && !strcmp (key, "rawHashes"))
+        return FRAME_RAW_HASHES;
+      if (!self->is_removal && !strcmp (key, "riceHashes"))
+        return FRAME_RICE;
+      if (self->is_removal && !strcmp (key, "rawIndices"))
+        return FRAME_RAW_INDICES;
+      if (self->is_removal && !strcmp (key, "riceIndices"))
+        return FRAME_RICE;
+      break;
+    case FRAME_RAW_INDICES:
+      if (is_array && !strcmp (key, "indices"))
+        return FRAME_INDICES;
+      break;
+    case FRAME_IGNORED:
+    case FRAME_CHECKSUM:
+    case FRAME_INDICES:
+    case FRAME_RAW_HASHES:
+    case FRAME_RICE:
+    default:
+      break;
+  }
+
+  return FRAME_IGNORED;
+}
+
+static gboolean
+parser_push (EphyGSBUpdateParser  *self,
+             gboolean              is_array,
+             GError              **error)
+{
+  Frame frame;
+
+  if (self->depth == MAX_DEPTH) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                 "JSON nested deeper than %d levels", MAX_DEPTH);
+    return FALSE;
+  }
+
+  frame.kind = parser_get_child_kind (self, is_array);
+  frame.is_array = is_array;
+  self->stack[self->depth++] = frame;
+
+  switch (frame.kind) {
+    case FRAME_ADDITIONS:
+      self->is_removal = FALSE;
+      break;
+    case FRAME_REMOVALS:
+      self->is_removal = TRUE;
+      break;
+    case FRAME_RAW_HASHES:
+    case FRAME_RICE:
+      parser_reset_entry (self);
+      break;
+    default:
+      break;
+  }
+
+  self->expect = is_array ? EXPECT_VALUE : EXPECT_KEY;
+
+  return TRUE;
+}
+
+static void
+parser_pop (EphyGSBUpdateParser *self)
+{
+  switch (self->stack[self->depth - 1].kind) {
+    case FRAME_RAW_HASHES:
+    case FRAME_RICE:
+      parser_decode (self, TRUE);
+      parser_reset_entry (self);
+      break;
+    case FRAME_LIST:
+      self->list_func (&self->update, self->user_data);
+      parser_clear_update (self);
+      break;
+    default:
+      break;
+  }
+
+  self->depth--;
+  self->expect = self->depth == 0 ? EXPECT_END : EXPECT_COMMA;
+}
+
+static void
+parser_set_string (char       **field,
+                   const char  *value)
+{
+  g_free (*field);
+  *field = g_strdup (value);
+}
+
+static gboolean
+parse_int64 (const char *str,
+             gint64     *value)
+{
+  char *end;
+
+  *value = g_ascii_strtoll (str, &end, 10);
+
+  return end != str && *end == '\0';
+}
+
+static void
+parser_handle_value (EphyGSBUpdateParser *self,
+                     const char          *value,
+                     gboolean             is_string)
+{
+  const char *key = self->key->str;
+  gint64 number;
+
+  if (self->depth == 0)
+    return;
+
+  switch (self->stack[self->depth - 1].kind) {
+    case FRAME_ROOT:
+      if (is_string && !strcmp (key, "minimumWaitDuration")) {
+        /* g_ascii_strtod() ignores trailing characters, i.e. 's' character. */
+        self->minimum_wait_duration = g_ascii_strtod (value, NULL);
+      }
+      break;
+    case FRAME_LIST:
+      if (!is_string)
+        break;
+      if (!strcmp (key, "threatType"))
+        parser_set_string (&self->update.threat_type, value);
+      else if (!strcmp (key, "platformType"))
+        parser_set_string (&self->update.platform_type, value);
+      else if (!strcmp (key, "threatEntryType"))
+        parser_set_string (&self->update.threat_entry_type, value);
+      else if (!strcmp (key, "responseType"))
+        parser_set_string (&self->update.response_type, value);
+      else if (!strcmp (key, "newClientState"))
+        parser_set_string (&self->update.new_client_state, value);
+      break;
+    case FRAME_CHECKSUM:
+      if (is_string && !strcmp (key, "sha256"))
+        parser_set_string (&self->update.checksum, value);
+      break;
+    case FRAME_RAW_HASHES:
+      if (!strcmp (key, "prefixSize") && parse_int64 (value, &number))
+        self->prefix_size = number;
+      break;
+    case FRAME_INDICES:
+      if (!is_string && parse_int64 (value, &number)) {
+        guint32 index = number;
+        g_array_append_val (self->update.removals, index);
+      }
+      break;
+    case FRAME_RICE:
+      /* firstValue is an int64, which is a string in JSON. */
+      if (!strcmp (key, "firstValue")) {
+        self->rice_first_value = g_ascii_strtoull (value, NULL, 10);
+      } else if (!strcmp (key, "riceParameter") && parse_int64 (value, &number)) {
+        self->rice_parameter = number;
+        self->has_rice_parameter = TRUE;
+      } else if (!strcmp (key, "numEntries") && parse_int64 (value, &number)) {
+        self->rice_num_entries = MAX (number, 0);
+        self->has_rice_num_entries = TRUE;
+      }
+      break;
+    case FRAME_IGNORED:
+    case FRAME_RESPONSES:
+    case FRAME_ADDITIONS:
+    case FRAME_REMOVALS:
+    case FRAME_ENTRY_SET:
+    case FRAME_RAW_INDICES:
+    default:
+      break;
+  }
+}
+
+static void
+parser_begin_string (EphyGSBUpdateParser *self)
+{
+  FrameKind kind = self->depth > 0 ? self->stack[self->depth - 1].kind : FRAME_IGNORED;
+
+  self->string_is_key = self->expect == EXPECT_KEY;
+  self->string_is_streamed = !self->string_is_key &&
+                             ((kind == FRAME_RAW_HASHES && !strcmp (self->key->str, "rawHashes")) ||
+                              (kind == FRAME_RICE && !strcmp (self->key->str, "encodedData")));
+  if (self->string_is_streamed) {
+    self->base64_state = 0;
+    self->base64_save = 0;
+  }
+
+  g_string_truncate (self->token, 0);
+  self->lex_state = LEX_STRING;
+}
+
+static void
+parser_end_string (EphyGSBUpdateParser *self)
+{
+  self->lex_state = LEX_DEFAULT;
+
+  if (self->string_is_key) {
+    g_string_assign (self->key, self->token->str);
+    self->expect = EXPECT_COLON;
+    return;
+  }
+
+  if (self->string_is_streamed) {
+    self->string_is_streamed = FALSE;
+    parser_decode (self, FALSE);
+  } else {
+    parser_handle_value (self, self->token->str, TRUE);
+  }
+
+  self->expect = self->depth == 0 ? EXPECT_END : EXPECT_COMMA;
+}
+
+static void
+parser_end_literal (EphyGSBUpdateParser *self)
+{
+  self->lex_state = LEX_DEFAULT;
+
+  if (strcmp (self->token->str, "null") != 0)
+    parser_handle_value (self, self->token->str, FALSE);
+
+  self->expect = self->depth == 0 ? EXPECT_END : EXPECT_COMMA;
+}
+
+static gboolean
+is_literal_char (char c)
+{
+  return g_ascii_isalnum (c) || c == '-' || c == '+' || c == '.';
+}
+
+static gboolean
+parser_handle_char (EphyGSBUpdateParser  *self,
+                    char                  c,
+                    GError              **error)
+{
+  gboolean in_array = self->depth > 0 && self->stack[self->depth - 1].is_array;
+
+  switch (c) {
+    case ' ':
+    case '\t':
+    case '\n':
+    case '\r':
+      return TRUE;
+    case '{':
+    case '[':
+      if (self->expect != EXPECT_VALUE)
+        break;
+      return parser_push (self, c == '[', error);
+    case '}':
+    case ']':
+      if (self->depth == 0 || in_array != (c == ']'))
+        break;
+      if (self->expect != EXPECT_COMMA &&
+          !(in_array && self->expect == EXPECT_VALUE) &&
+          !(!in_array && self->expect == EXPECT_KEY))
+        break;
+      parser_pop (self);
+      return TRUE;
+    case ':':
+      if (self->expect != EXPECT_COLON)
+        break;
+      self->expect = EXPECT_VALUE;
+      return TRUE;
+    case ',':
+      if (self->expect != EXPECT_COMMA)
+        break;
+      self->expect = in_array ? EXPECT_VALUE : EXPECT_KEY;
+      return TRUE;
+    case '"':
+      if (self->expect != EXPECT_VALUE && self->expect != EXPECT_KEY)
+        break;
+      parser_begin_string (self);
+      return TRUE;
+    default:
+      if (self->expect != EXPECT_VALUE || !is_literal_char (c))
+        break;
+      g_string_truncate (self->token, 0);
+      g_string_append_c (self->token, c);
+      self->lex_state = LEX_LITERAL;
+      return TRUE;
+  }
+
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+               "Unexpected character '%c' in JSON", c);
+  return FALSE;
+}
+
+static gboolean
+parser_handle_escape (EphyGSBUpdateParser  *self,
+                      char                  c,
+                      GError              **error)
+{
+  char unescaped;
+
+  switch (c) {
+    case '"':
+    case '\\':
+    case '/':
+      unescaped = c;
+      break;
+    case 'b':
+      unescaped = '\b';
+      break;
+    case 'f':
+      unescaped = '\f';
+      break;
+    case 'n':
+      unescaped = '\n';
+      break;
+    case 'r':
+      unescaped = '\r';
+      break;
+    case 't':
+      unescaped = '\t';
+      break;
+    case 'u':
+      self->unicode_value = 0;
+      self->unicode_len = 0;
+      self->lex_state = LEX_UNICODE;
+      return TRUE;
+    default:
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Invalid escape sequence '\\%c' in JSON", c);
+      return FALSE;
+  }
+
+  parser_append_string (self, &unescaped, 1);
+  self->lex_state = LEX_STRING;
+
+  return TRUE;
+}
+
+static gboolean
+parser_handle_unicode (EphyGSBUpdateParser  *self,
+                       char                  c,
+                       GError              **error)
+{
+  char utf8[6];
+  int digit = g_ascii_xdigit_value (c);
+
+  if (digit < 0) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                 "Invalid unicode escape in JSON");
+    return FALSE;
+  }
+
+  self->unicode_value = self->unicode_value * 16 + digit;
+  if (++self->unicode_len < 4)
+    return TRUE;
+
+  /* None of the members that are used contain anything but ASCII, so there is
+   * no need to combine surrogate pairs. */
+  if (g_unichar_validate (self->unicode_value))
+    parser_append_string (self, utf8, g_unichar_to_utf8 (self->unicode_value, utf8));
+  self->lex_state = LEX_STRING;
+
+  return TRUE;
+}
+
+/**
+ * ephy_gsb_update_parser_feed:
+ * @parser: an #EphyGSBUpdateParser
+ * @data: the next bytes of the response body
+ * @length: the length of @data
+ * @error: return location for a #GError, or %NULL
+ *
+ * Parse the next chunk of the response body, calling the functions given to
+ * ephy_gsb_update_parser_new() for what @data completes.
+ *
+ * Return value: %FALSE if the response body is not valid JSON
+ **/
+gboolean
+ephy_gsb_update_parser_feed (EphyGSBUpdateParser  *self,
+                             const char           *data,
+                             gsize                 length,
+                             GError              **error)
+{
+  const char *end = data + length;
+  const char *p = data;
+
+  g_assert (self);
+  g_assert (data || length == 0);
+
+  while (p < end) {
+    const char *start;
+
+    switch (self->lex_state) {
+      case LEX_STRING:
+        start = p;
+        while (p < end && *p != '"' && *p != '\\')
+          p++;
+        parser_append_string (self, start, p - start);
+        if (p == end)
+          break;
+        if (*p == '"')
+          parser_end_string (self);
+        else
+          self->lex_state = LEX_ESCAPE;
+        p++;
+        break;
+      case LEX_ESCAPE:
+        if (!parser_handle_escape (self, *p++, error))
+          return FALSE;
+        break;
+      case LEX_UNICODE:
+        if (!parser_handle_unicode (self, *p++, error))
+          return FALSE;
+        break;
+      case LEX_LITERAL:
+        if (is_literal_char (*p)) {
+          if (self->token->len < MAX_TOKEN_LEN)
+            g_string_append_c (self->token, *p);
+          p++;
+        } else {
+          /* The character that ends the literal is handled as usual. */
+          parser_end_literal (self);
+        }
+        break;
+      case LEX_DEFAULT:
+      default:
+        if (self->expect == EXPECT_END && !g_ascii_isspace (*p)) {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "Unexpected data after the end of JSON");
+          return FALSE;
+        }
+        if (!parser_handle_char (self, *p++, error))
+          return FALSE;
+        break;
+    }
+  }
+
+  /* Hand over what the encoded data read so far holds in full. */
+  if (self->string_is_streamed)
+    parser_decode (self, FALSE);
+
+  return TRUE;
+}
+
+/**
+ * ephy_gsb_update_parser_finish:
+ * @parser: an #EphyGSBUpdateParser
+ * @error: return location for a #GError, or %NULL
+ *
+ * Check that the whole response body was fed to @parser.
+ *
+ * Return value: %FALSE if the response body ended early
+ **/
+gboolean
+ephy_gsb_update_parser_finish (EphyGSBUpdateParser  *self,
+                               GError              **error)
+{
+  g_assert (self);
+
+  if (self->lex_state == LEX_LITERAL && self->depth == 0)
+    parser_end_literal (self);
+
+  if (self->expect != EXPECT_END) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                 "Unexpected end of JSON");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * ephy_gsb_update_parser_get_minimum_wait_duration:
+ * @parser: an #EphyGSBUpdateParser
+ *
+ * Return value: the minimumWaitDuration of the response in seconds, or -1 if
+ *               the response has none
+ **/
+double
+ephy_gsb_update_parser_get_minimum_wait_duration (EphyGSBUpdateParser *self)
+{
+  g_assert (self);
+
+  return self->minimum_wait_duration;
+}
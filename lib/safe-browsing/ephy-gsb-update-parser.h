@@ -0,0 +1,59 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2021 Epiphany Developers
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _EphyGSBUpdateParser EphyGSBUpdateParser;
+
+/* A ListUpdateResponse, without its additions. */
+typedef struct {
+  char   *threat_type;
+  char   *platform_type;
+  char   *threat_entry_type;
+  char   *response_type;
+  char   *new_client_state;
+  char   *checksum;  /* The base64-encoded SHA-256 of the list */
+  GArray *removals;  /* The guint32 indices of the removed hash prefixes */
+} EphyGSBListUpdate;
+
+typedef void (*EphyGSBUpdateParserAdditionsFunc) (const guint8 *prefixes,
+                                                  gsize         num_prefixes,
+                                                  gsize         prefix_len,
+                                                  gpointer      user_data);
+typedef void (*EphyGSBUpdateParserListFunc)      (EphyGSBListUpdate *update,
+                                                  gpointer           user_data);
+
+EphyGSBUpdateParser *ephy_gsb_update_parser_new                       (EphyGSBUpdateParserAdditionsFunc additions_func,
+                                                                       EphyGSBUpdateParserListFunc      list_func,
+                                                                       gpointer                         user_data);
+void                 ephy_gsb_update_parser_free                      (EphyGSBUpdateParser *parser);
+gboolean             ephy_gsb_update_parser_feed                      (EphyGSBUpdateParser  *parser,
+                                                                       const char           *data,
+                                                                       gsize                 length,
+                                                                       GError              **error);
+gboolean             ephy_gsb_update_parser_finish                    (EphyGSBUpdateParser  *parser,
+                                                                       GError              **error);
+double               ephy_gsb_update_parser_get_minimum_wait_duration (EphyGSBUpdateParser *parser);
+
+G_END_DECLS
@@ -31,122 +31,139 @@
 
 #define MAX_HOST_SUFFIXES 5
 #define MAX_PATH_PREFIXES 6
+G_STATIC_ASSERT (MAX_HOST_SUFFIXES * MAX_PATH_PREFIXES == GSB_MAX_URL_HASHES);
 #define MAX_UNESCAPE_STEP 1024
 
+/* Reads the bit stream a 64-bit word at a time. Within a byte, the
+ * least-significant bits come before the most-significant bits in the bit
+ * stream, so with little-endian loads the next bit is always the lowest bit
+ * of the buffer.
+ *
+ * https://developers.google.com/safe-browsing/v4/compression#bit-encoderdecoder
+ */
 typedef struct {
-  guint8 *data;     /* The bit stream as an array of bytes */
-  gsize data_len;   /* The number of bytes in the array */
-  guint8 *curr;     /* The current byte in the bit stream */
-  guint8 mask;      /* Bit mask to read a bit within a byte */
-  gsize num_read;   /* The number of bits read so far */
+  const guint8 *data;   /* The bit stream as an array of bytes */
+  gsize data_len;       /* The number of bytes in the array */
+  gsize pos;            /* The next byte to load into the buffer */
+  guint64 buffer;       /* The bits loaded but not read yet. Above num_bits
+                         * are either zeros or the bits that follow. */
+  guint num_bits;       /* The number of bits loaded but not read yet */
 } EphyGSBBitReader;
 
-typedef struct {
-  EphyGSBBitReader *reader;
-  guint parameter;             /* Golomb-Rice parameter, between 2 and 28 */
-} EphyGSBRiceDecoder;
-
-static inline EphyGSBBitReader *
-ephy_gsb_bit_reader_new (const guint8 *data,
-                         gsize         data_len)
+static inline void
+ephy_gsb_bit_reader_init (EphyGSBBitReader *reader,
+                          const guint8     *data,
+                          gsize             data_len)
 {
-  EphyGSBBitReader *reader;
-
-  g_assert (data);
-  g_assert (data_len > 0);
-
-  reader = g_new (EphyGSBBitReader, 1);
-  reader->curr = reader->data = g_malloc (data_len);
-  memcpy (reader->data, data, data_len);
+  reader->data = data;
   reader->data_len = data_len;
-  reader->mask = 0x01;
-  reader->num_read = 0;
-
-  return reader;
+  reader->pos = 0;
+  reader->buffer = 0;
+  reader->num_bits = 0;
 }
 
 static inline void
-ephy_gsb_bit_reader_free (EphyGSBBitReader *reader)
+ephy_gsb_bit_reader_refill (EphyGSBBitReader *reader)
 {
-  g_assert (reader);
+  if (reader->num_bits > 56)
+    return;
+
+  if (reader->pos + sizeof (guint64) <= reader->data_len) {
+    guint64 word;
+    guint num_bytes = (63 - reader->num_bits) / 8;
+
+    /* The bits that don't fit in a whole byte are loaded again next time,
+     * which is harmless since they are the same. */
+    memcpy (&word, reader->data + reader->pos, sizeof (guint64));
+    reader->buffer |= GUINT64_FROM_LE (word) << reader->num_bits;
+    reader->pos += num_bytes;
+    reader->num_bits += num_bytes * 8;
+    return;
+  }
 
-  g_free (reader->data);
-  g_free (reader);
+  while (reader->num_bits <= 56 && reader->pos < reader->data_len) {
+    reader->buffer |= (guint64)reader->data[reader->pos++] << reader->num_bits;
+    reader->num_bits += 8;
+  }
 }
 
-/*
- * https://developers.google.com/safe-browsing/v4/compression#bit-encoderdecoder
- */
-static guint32
-ephy_gsb_bit_reader_read (EphyGSBBitReader *reader,
+static inline void
+ephy_gsb_bit_reader_skip (EphyGSBBitReader *reader,
                           guint             num_bits)
 {
-  guint32 retval = 0;
-
-  /* Cannot read more than 4 bytes at once. */
-  g_assert (num_bits <= 32);
-  /* Cannot read more bits than the buffer has left. */
-  g_assert (reader->num_read + num_bits <= reader->data_len * 8);
-
-  /* Within a byte, the least-significant bits come before the most-significant
-   * bits in the bit stream. */
-  for (guint i = 0; i < num_bits; i++) {
-    if (*reader->curr & reader->mask)
-      retval |= 1 << i;
-
-    reader->mask <<= 1;
-    if (reader->mask == 0) {
-      reader->curr++;
-      reader->mask = 0x01;
-    }
-  }
-
-  reader->num_read += num_bits;
+  g_assert (num_bits <= reader->num_bits);
 
-  return retval;
+  /* Shifting a 64-bit value by 64 is undefined. */
+  reader->buffer = num_bits < 64 ? reader->buffer >> num_bits : 0;
+  reader->num_bits -= num_bits;
 }
 
-static inline EphyGSBRiceDecoder *
-ephy_gsb_rice_decoder_new (const guint8 *data,
-                           gsize         data_len,
-                           guint         parameter)
+/* Reads a run of 1 bits terminated by a 0 bit, and returns its length. */
+static inline gboolean
+ephy_gsb_bit_reader_read_unary (EphyGSBBitReader *reader,
+                                guint32          *value)
 {
-  EphyGSBRiceDecoder *decoder;
+  guint32 count = 0;
+
+  while (TRUE) {
+    guint64 zeros;
+    guint num_ones;
 
-  g_assert (data);
-  g_assert (data_len > 0);
+    ephy_gsb_bit_reader_refill (reader);
+    if (reader->num_bits == 0)
+      return FALSE;
 
-  decoder = g_new (EphyGSBRiceDecoder, 1);
-  decoder->reader = ephy_gsb_bit_reader_new (data, data_len);
-  decoder->parameter = parameter;
+    zeros = ~reader->buffer;
+    num_ones = zeros ? __builtin_ctzll (zeros) : 64;
+    if (num_ones < reader->num_bits) {
+      ephy_gsb_bit_reader_skip (reader, num_ones + 1);
+      *value = count + num_ones;
+      return TRUE;
+    }
 
-  return decoder;
+    count += reader->num_bits;
+    ephy_gsb_bit_reader_skip (reader, reader->num_bits);
+  }
 }
 
-static inline void
-ephy_gsb_rice_decoder_free (EphyGSBRiceDecoder *decoder)
+static inline gboolean
+ephy_gsb_bit_reader_read (EphyGSBBitReader *reader,
+                          guint             num_bits,
+                          guint32          *value)
 {
-  g_assert (decoder);
+  /* A refill leaves at least 57 bits unless the stream ends. */
+  g_assert (num_bits <= 32);
+
+  if (reader->num_bits < num_bits) {
+    ephy_gsb_bit_reader_refill (reader);
+    if (reader->num_bits < num_bits)
+      return FALSE;
+  }
 
-  ephy_gsb_bit_reader_free (decoder->reader);
-  g_free (decoder);
+  *value = reader->buffer & ((G_GUINT64_CONSTANT (1) << num_bits) - 1);
+  ephy_gsb_bit_reader_skip (reader, num_bits);
+
+  return TRUE;
 }
 
-static guint32
-ephy_gsb_rice_decoder_next (EphyGSBRiceDecoder *decoder)
+/*
+ * https://developers.google.com/safe-browsing/v4/compression#rice-compression
+ */
+static inline gboolean
+ephy_gsb_rice_decoder_next (EphyGSBBitReader *reader,
+                            guint             parameter,
+                            guint32          *value)
 {
-  guint32 quotient = 0;
+  guint32 quotient;
   guint32 remainder;
-  guint32 bit;
 
-  g_assert (decoder);
-
-  while ((bit = ephy_gsb_bit_reader_read (decoder->reader, 1)) != 0)
-    quotient += bit;
+  if (!ephy_gsb_bit_reader_read_unary (reader, &quotient) ||
+      !ephy_gsb_bit_reader_read (reader, parameter, &remainder))
+    return FALSE;
 
-  remainder = ephy_gsb_bit_reader_read (decoder->reader, decoder->parameter);
+  *value = (quotient << parameter) + remainder;
 
-  return (quotient << decoder->parameter) + remainder;
+  return TRUE;
 }
 
 EphyGSBThreatList *
@@ -447,6 +464,96 @@ ephy_gsb_utils_make_full_hashes_request (GList *threat_lists,
   return body;
 }
 
+/**
+ * ephy_gsb_utils_rice_decode_deltas:
+ * @data: the Rice-encoded deltas
+ * @data_len: the length of @data
+ * @bit_offset: (inout): the bit of @data to start decoding at. On return, the
+ *   bit right after the last decoded delta.
+ * @parameter: the Golomb-Rice parameter, between 2 and 28
+ * @deltas: the array to decode into
+ * @max_deltas: the length of @deltas
+ *
+ * Decode as many Rice-encoded deltas as @data holds in full, up to
+ * @max_deltas. This allows decoding a stream as it arrives: keep the bytes
+ * from @bit_offset / 8 on, and call again once more bytes are available.
+ *
+ * Return value: the number of deltas decoded
+ **/
+gsize
+ephy_gsb_utils_rice_decode_deltas (const guint8 *data,
+                                   gsize         data_len,
+                                   gsize        *bit_offset,
+                                   guint         parameter,
+                                   guint32      *deltas,
+                                   gsize         max_deltas)
+{
+  EphyGSBBitReader reader;
+  gsize num_deltas = 0;
+  guint32 unused;
+
+  g_assert (data || data_len == 0);
+  g_assert (bit_offset);
+  g_assert (parameter >= 2 && parameter <= 28);
+  g_assert (deltas || max_deltas == 0);
+
+  if (*bit_offset >= data_len * 8)
+    return 0;
+
+  ephy_gsb_bit_reader_init (&reader, data, data_len);
+  reader.pos = *bit_offset / 8;
+  if (!ephy_gsb_bit_reader_read (&reader, *bit_offset % 8, &unused))
+    return 0;
+
+  while (num_deltas < max_deltas &&
+         ephy_gsb_rice_decoder_next (&reader, parameter, &deltas[num_deltas])) {
+    num_deltas++;
+    *bit_offset = reader.pos * 8 - reader.num_bits;
+  }
+
+  return num_deltas;
+}
+
+/**
+ * ephy_gsb_utils_rice_delta_decode_into:
+ * @data: the Rice-encoded deltas
+ * @data_len: the length of @data
+ * @parameter: the Golomb-Rice parameter, between 2 and 28
+ * @first_value: the value the deltas start from
+ * @items: the array to decode into
+ * @num_items: the length of @items, i.e. 1 + the number of deltas
+ *
+ * Decode the deltas of a RiceDeltaEncoding into @items, which starts with
+ * @first_value followed by the running sums of the deltas.
+ *
+ * Return value: the number of items decoded, which is less than @num_items
+ *               if @data is too short
+ **/
+gsize
+ephy_gsb_utils_rice_delta_decode_into (const guint8 *data,
+                                       gsize         data_len,
+                                       guint         parameter,
+                                       guint32       first_value,
+                                       guint32      *items,
+                                       gsize         num_items)
+{
+  gsize bit_offset = 0;
+  gsize num_deltas;
+
+  g_assert (items);
+
+  if (num_items == 0)
+    return 0;
+
+  items[0] = first_value;
+  num_deltas = ephy_gsb_utils_rice_decode_deltas (data, data_len, &bit_offset, parameter,
+                                                  items + 1, num_items - 1);
+  for (gsize i = 1; i <= num_deltas; i++)
+    items[i] += items[i - 1];
+
+  return 1 + num_deltas;
+}
+
 /**
  * ephy_gsb_utils_rice_delta_decode:
  * @rde: a RiceDeltaEncoding object as a #JsonObject
@@ -465,7 +572,6 @@ guint32 *
 ephy_gsb_utils_rice_delta_decode (JsonObject *rde,
                                   gsize      *num_items)
 {
-  EphyGSBRiceDecoder *decoder;
   const char *data_b64 = NULL;
   const char *first_value_str = NULL;
   guint32 *items;
@@ -494,17 +600,19 @@ ephy_gsb_utils_rice_delta_decode (JsonObject *rde,
     return items;
 
   /* Sanity check. */
-  if (parameter < 2 || parameter > 28 || data_b64 == NULL)
+  if (parameter < 2 || parameter > 28 || data_b64 == NULL) {
+    *num_items = 1;
     return items;
+  }
 
   data = g_base64_decode (data_b64, &data_len);
-  decoder = ephy_gsb_rice_decoder_new (data, data_len, parameter);
-
-  for (gsize i = 1; i <= num_entries; i++)
-    items[i] = items[i - 1] + ephy_gsb_rice_decoder_next (decoder);
+  *num_items = ephy_gsb_utils_rice_delta_decode_into (data, data_len, parameter, items[0],
+                                                      items, *num_items);
+  if (*num_items != 1 + num_entries)
+    g_warning ("Rice-encoded data ends after %" G_GSIZE_FORMAT " of %" G_GSIZE_FORMAT " entries",
+               *num_items - 1, num_entries);
 
   g_free (data);
-  ephy_gsb_rice_decoder_free (decoder);
 
   return items;
 }
@@ -711,141 +819,166 @@ ephy_gsb_utils_canonicalize (const char  *url,
   return retval;
 }
 
-/*
+/* Stores the suffixes of @host as pointers into it, the host itself first.
+ *
  * https://developers.google.com/safe-browsing/v4/urls-hashing#suffixprefix-expressions
  */
-static GList *
-ephy_gsb_utils_compute_host_suffixes (const char *host)
+static guint
+ephy_gsb_utils_compute_host_suffixes (const char *host,
+                                      const char *suffixes[MAX_HOST_SUFFIXES])
 {
-  GList *retval = NULL;
   struct in_addr addr;
-  char **tokens;
-  int steps;
-  int start;
-  int num_tokens;
+  guint num_suffixes = 0;
+  int num_dots = 0;
+  int dot = 0;
 
   g_assert (host);
 
-  retval = g_list_prepend (retval, g_strdup (host));
+  suffixes[num_suffixes++] = host;
 
-  /* If host is an IP address, return immediately. */
+  /* If host is an IP address, there are no other suffixes. */
   if (inet_aton (host, &addr) != 0)
-    return retval;
+    return num_suffixes;
 
-  tokens = g_strsplit (host, ".", -1);
-  num_tokens = g_strv_length (tokens);
-  start = MAX (num_tokens - MAX_HOST_SUFFIXES, 1);
-  steps = MIN (num_tokens - 1 - start, MAX_HOST_SUFFIXES - 1);
+  for (const char *c = host; *c; c++) {
+    if (*c == '.')
+      num_dots++;
+  }
 
-  for (int i = start; i < start + steps; i++)
-    retval = g_list_prepend (retval, g_strjoinv (".", tokens + i));
+  /* The suffixes that start after one of the last MAX_HOST_SUFFIXES - 1
+   * dots, except for the top-level domain. */
+  for (const char *c = host; *c; c++) {
+    if (*c != '.')
+      continue;
 
-  g_strfreev (tokens);
+    dot++;
+    if (dot >= MAX (num_dots - (MAX_HOST_SUFFIXES - 1), 1) && dot < num_dots)
+      suffixes[num_suffixes++] = c + 1;
+  }
 
-  return g_list_reverse (retval);
+  return num_suffixes;
 }
 
-/*
+typedef struct {
+  gsize path_len;
+  gboolean with_query;
+} PathPrefix;
+
+/* Stores the prefixes of @path as lengths, with or without @query.
+ *
  * https://developers.google.com/safe-browsing/v4/urls-hashing#suffixprefix-expressions
  */
-static GList *
+static guint
 ephy_gsb_utils_compute_path_prefixes (const char *path,
-                                      const char *query)
+                                      const char *query,
+                                      PathPrefix  prefixes[MAX_PATH_PREFIXES])
 {
-  GList *retval = NULL;
-  char *no_trailing;
-  char **tokens;
-  int steps;
-  int num_tokens;
-  int no_trailing_len;
-  gboolean has_trailing;
+  gsize path_len;
+  gsize no_trailing_len;
+  guint num_prefixes = 0;
+  guint num_dirs = 0;
 
   g_assert (path);
 
-  if (query)
-    retval = g_list_prepend (retval, g_strjoin ("?", path, query, NULL));
-  retval = g_list_prepend (retval, g_strdup (path));
+  path_len = strlen (path);
 
-  if (!g_strcmp0 (path, "/"))
-    return retval;
-
-  has_trailing = path[strlen (path) - 1] == '/';
-  no_trailing = ephy_string_remove_trailing (g_strdup (path), '/');
-  no_trailing_len = strlen (no_trailing);
+  if (!g_strcmp0 (path, "/")) {
+    prefixes[num_prefixes++] = (PathPrefix){ path_len, FALSE };
+    if (query)
+      prefixes[num_prefixes++] = (PathPrefix){ path_len, TRUE };
+    return num_prefixes;
+  }
 
-  tokens = g_strsplit (no_trailing, "/", -1);
-  num_tokens = g_strv_length (tokens);
-  steps = MIN (num_tokens, MAX_PATH_PREFIXES - 2);
+  if (query)
+    prefixes[num_prefixes++] = (PathPrefix){ path_len, TRUE };
+  prefixes[num_prefixes++] = (PathPrefix){ path_len, FALSE };
+
+  no_trailing_len = path_len;
+  while (no_trailing_len > 0 && path[no_trailing_len - 1] == '/')
+    no_trailing_len--;
+
+  /* The directories of the path, from the root, at most MAX_PATH_PREFIXES - 2
+   * of them. */
+  for (gsize i = 0; i < no_trailing_len && num_dirs < MAX_PATH_PREFIXES - 2; i++) {
+    if (path[i] == '/') {
+      prefixes[num_prefixes++] = (PathPrefix){ i + 1, FALSE };
+      num_dirs++;
+    }
+  }
 
-  for (int i = 0; i < steps; i++) {
-    char *value = g_strconcat (i > 0 ? retval->data : "", tokens[i], "/", NULL);
+  return num_prefixes;
+}
 
-    if ((has_trailing && !g_strcmp0 (value, path)) ||
-        (!has_trailing && !strncmp (value, no_trailing, no_trailing_len))) {
-      g_free (value);
-      break;
-    }
+/* URL checks run on any thread, so each one hashes with its own checksum. */
+static GChecksum *
+ephy_gsb_utils_get_thread_checksum (void)
+{
+  static GPrivate checksum_key = G_PRIVATE_INIT ((GDestroyNotify)g_checksum_free);
+  GChecksum *checksum = g_private_get (&checksum_key);
 
-    retval = g_list_prepend (retval, value);
+  if (!checksum) {
+    checksum = g_checksum_new (GSB_HASH_TYPE);
+    g_private_set (&checksum_key, checksum);
   }
 
-  g_free (no_trailing);
-  g_strfreev (tokens);
-
-  return g_list_reverse (retval);
+  return checksum;
 }
 
 /**
- * ephy_gsb_utils_compute_hashes:
+ * ephy_gsb_utils_compute_url_hashes:
  * @url: the URL whose hashes to be computed
+ * @hashes: (out caller-allocates): where to store the hashes
  *
- * Compute the SHA256 hashes of @url.
+ * Compute the SHA256 hashes of @url, one for each host suffix and path prefix
+ * expression. The expressions are hashed in place, so nothing is allocated
+ * beyond the canonicalization of @url.
  *
  * https://developers.google.com/safe-browsing/v4/urls-hashing#hash-computations
  *
- * Return value: (element-type #GBytes) (transfer full): a #GList containing the
- *               full hashes of @url. The caller takes ownership of the list and
- *               its content. Use g_list_free_full() with g_bytes_unref() as
- *               free_func when done using the list.
+ * Return value: %TRUE if @url is a valid URL
  **/
-GList *
-ephy_gsb_utils_compute_hashes (const char *url)
+gboolean
+ephy_gsb_utils_compute_url_hashes (const char       *url,
+                                   EphyGSBUrlHashes *hashes)
 {
+  const char *host_suffixes[MAX_HOST_SUFFIXES];
+  PathPrefix path_prefixes[MAX_PATH_PREFIXES];
   GChecksum *checksum;
-  GList *retval = NULL;
-  GList *host_suffixes;
-  GList *path_prefixes;
   char *url_canonical;
   char *host = NULL;
   char *path = NULL;
   char *query = NULL;
-  gsize hash_len = GSB_HASH_SIZE;
+  guint num_host_suffixes;
+  guint num_path_prefixes;
 
   g_assert (url);
+  g_assert (hashes);
+
+  hashes->num_hashes = 0;
 
   url_canonical = ephy_gsb_utils_canonicalize (url, &host, &path, &query);
   if (!url_canonical)
-    return NULL;
+    return FALSE;
 
-  host_suffixes = ephy_gsb_utils_compute_host_suffixes (host);
-  path_prefixes = ephy_gsb_utils_compute_path_prefixes (path, query);
-  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  num_host_suffixes = ephy_gsb_utils_compute_host_suffixes (host, host_suffixes);
+  num_path_prefixes = ephy_gsb_utils_compute_path_prefixes (path, query, path_prefixes);
+  checksum = ephy_gsb_utils_get_thread_checksum ();
 
   /* Get the hash of every host-path combination.
    * The maximum number of combinations is MAX_HOST_SUFFIXES * MAX_PATH_PREFIXES.
    */
-  for (GList *h = host_suffixes; h && h->data; h = h->next) {
-    for (GList *p = path_prefixes; p && p->data; p = p->next) {
-      char *value = g_strconcat (h->data, p->data, NULL);
-      guint8 *hash = g_malloc (hash_len);
+  for (guint h = 0; h < num_host_suffixes; h++) {
+    for (guint p = 0; p < num_path_prefixes; p++) {
+      gsize hash_len = sizeof (hashes->hashes[0]);
 
       g_checksum_reset (checksum);
-      g_checksum_update (checksum, (const guint8 *)value, strlen (value));
-      g_checksum_get_digest (checksum, hash, &hash_len);
-      retval = g_list_prepend (retval, g_bytes_new (hash, hash_len));
-
-      g_free (hash);
-      g_free (value);
+      g_checksum_update (checksum, (const guint8 *)host_suffixes[h], -1);
+      g_checksum_update (checksum, (const guint8 *)path, path_prefixes[p].path_len);
+      if (path_prefixes[p].with_query) {
+        g_checksum_update (checksum, (const guint8 *)"?", 1);
+        g_checksum_update (checksum, (const guint8 *)query, -1);
+      }
+      g_checksum_get_digest (checksum, hashes->hashes[hashes->num_hashes++], &hash_len);
     }
   }
 
@@ -853,38 +986,37 @@ ephy_gsb_utils_compute_hashes (const char *url)
   g_free (path);
   g_free (query);
   g_free (url_canonical);
-  g_checksum_free (checksum);
-  g_list_free_full (host_suffixes, g_free);
-  g_list_free_full (path_prefixes, g_free);
 
-  return g_list_reverse (retval);
+  return TRUE;
 }
 
 /**
- * ephy_gsb_utils_get_hash_cues:
- * @hashes: a #GList of #GBytes
+ * ephy_gsb_utils_compute_hashes:
+ * @url: the URL whose hashes to be computed
  *
- * Get the hash cues from a list of full hashes. The hash cue length is
- * specified by the GSB_HASH_CUE_LEN macro.
+ * Compute the SHA256 hashes of @url, like ephy_gsb_utils_compute_url_hashes()
+ * does.
  *
- * Return value: (element-type #GBytes) (transfer full): a #GList containing
- *               the cues of each hash in @hashes. The caller takes ownership
- *               of the list and its content. Use g_list_free_full() with
- *               g_bytes_unref() as free_func when done using the list.
+ * Return value: (element-type #GBytes) (transfer full): a #GList containing the
+ *               full hashes of @url. The caller takes ownership of the list and
+ *               its content. Use g_list_free_full() with g_bytes_unref() as
+ *               free_func when done using the list.
  **/
 GList *
-ephy_gsb_utils_get_hash_cues (GList *hashes)
+ephy_gsb_utils_compute_hashes (const char *url)
 {
+  EphyGSBUrlHashes hashes;
   GList *retval = NULL;
 
-  g_assert (hashes);
+  g_assert (url);
 
-  for (GList *l = hashes; l && l->data; l = l->next) {
-    const char *hash = g_bytes_get_data (l->data, NULL);
-    retval = g_list_prepend (retval, g_bytes_new (hash, GSB_HASH_CUE_LEN));
-  }
+  if (!ephy_gsb_utils_compute_url_hashes (url, &hashes))
+    return NULL;
+
+  for (guint i = hashes.num_hashes; i > 0; i--)
+    retval = g_list_prepend (retval, g_bytes_new (hashes.hashes[i - 1], sizeof (hashes.hashes[0])));
 
-  return g_list_reverse (retval);
+  return retval;
 }
 
 /**
@@ -31,6 +31,9 @@ G_BEGIN_DECLS
 #define GSB_HASH_TYPE G_CHECKSUM_SHA256
 #define GSB_HASH_SIZE (g_checksum_type_get_length (GSB_HASH_TYPE))
 
+/* The maximum number of host suffix and path prefix expressions of a URL. */
+#define GSB_MAX_URL_HASHES 30
+
 #define GSB_COMPRESSION_TYPE_RAW         "RAW"
 #define GSB_COMPRESSION_TYPE_RICE        "RICE"
 #define GSB_COMPRESSION_TYPE_UNSPECIFIED "COMPRESSION_TYPE_UNSPECIFIED"
@@ -59,6 +62,11 @@ typedef struct {
   gboolean  expired;
 } EphyGSBHashFullLookup;
 
+typedef struct {
+  guint8 hashes[GSB_MAX_URL_HASHES][32]; /* The SHA256 full hashes */
+  guint  num_hashes;
+} EphyGSBUrlHashes;
+
 EphyGSBThreatList       *ephy_gsb_threat_list_new                 (const char *threat_type,
                                                                    const char *platform_type,
                                                                    const char *threat_entry_type,
@@ -85,13 +93,26 @@ char                    *ephy_gsb_utils_make_full_hashes_request  (GList *threat
 
 guint32                 *ephy_gsb_utils_rice_delta_decode         (JsonObject *rde,
                                                                    gsize      *num_items);
+gsize                    ephy_gsb_utils_rice_decode_deltas        (const guint8 *data,
+                                                                   gsize         data_len,
+                                                                   gsize        *bit_offset,
+                                                                   guint         parameter,
+                                                                   guint32      *deltas,
+                                                                   gsize         max_deltas);
+gsize                    ephy_gsb_utils_rice_delta_decode_into    (const guint8 *data,
+                                                                   gsize         data_len,
+                                                                   guint         parameter,
+                                                                   guint32       first_value,
+                                                                   guint32      *items,
+                                                                   gsize         num_items);
 
 char                    *ephy_gsb_utils_canonicalize              (const char  *url,
                                                                    char       **host_out,
                                                                    char       **path_out,
                                                                    char       **query_out);
+gboolean                 ephy_gsb_utils_compute_url_hashes        (const char       *url,
+                                                                   EphyGSBUrlHashes *hashes);
 GList                   *ephy_gsb_utils_compute_hashes            (const char *url);
-GList                   *ephy_gsb_utils_get_hash_cues             (GList *hashes);
 gboolean                 ephy_gsb_utils_hash_has_prefix           (GBytes *hash,
                                                                    GBytes *prefix);
 
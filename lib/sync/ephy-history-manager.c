@@ -85,33 +85,39 @@ merge_history_async_data_free (MergeHistoryAsyncData *data)
 }
 
 static void
-url_visited_cb (EphyHistoryService *service,
-                EphyHistoryURL     *url,
-                EphyHistoryManager *self)
+urls_visited_cb (EphyHistoryService *service,
+                 GPtrArray          *urls,
+                 EphyHistoryManager *self)
 {
-  EphyHistoryRecord *record;
+  for (guint i = 0; i < urls->len; i++) {
+    EphyHistoryURL *url = g_ptr_array_index (urls, i);
+    EphyHistoryRecord *record;
 
-  if (!url->sync_id)
-    return;
+    if (!url->sync_id)
+      continue;
 
-  record = ephy_history_record_new (url->sync_id, url->title, url->url, url->last_visit_time);
-  g_signal_emit_by_name (self, "synchronizable-modified", record, TRUE);
-  g_object_unref (record);
+    record = ephy_history_record_new (url->sync_id, url->title, url->url, url->last_visit_time);
+    g_signal_emit_by_name (self, "synchronizable-modified", record, TRUE);
+    g_object_unref (record);
+  }
 }
 
 static void
-url_deleted_cb (EphyHistoryService *service,
-                EphyHistoryURL     *url,
-                EphyHistoryManager *self)
+urls_deleted_cb (EphyHistoryService *service,
+                 GPtrArray          *urls,
+                 EphyHistoryManager *self)
 {
-  EphyHistoryRecord *record;
+  for (guint i = 0; i < urls->len; i++) {
+    EphyHistoryURL *url = g_ptr_array_index (urls, i);
+    EphyHistoryRecord *record;
 
-  if (!url->sync_id)
-    return;
+    if (!url->sync_id)
+      continue;
 
-  record = ephy_history_record_new (url->sync_id, url->title, url->url, url->last_visit_time);
-  g_signal_emit_by_name (self, "synchronizable-deleted", record);
-  g_object_unref (record);
+    record = ephy_history_record_new (url->sync_id, url->title, url->url, url->last_visit_time);
+    g_signal_emit_by_name (self, "synchronizable-deleted", record);
+    g_object_unref (record);
+  }
 }
 
 static void
@@ -156,8 +162,8 @@ ephy_history_manager_dispose (GObject *object)
   EphyHistoryManager *self = EPHY_HISTORY_MANAGER (object);
 
   if (self->service) {
-    g_signal_handlers_disconnect_by_func (self->service, url_visited_cb, self);
-    g_signal_handlers_disconnect_by_func (self->service, url_deleted_cb, self);
+    g_signal_handlers_disconnect_by_func (self->service, urls_visited_cb, self);
+    g_signal_handlers_disconnect_by_func (self->service, urls_deleted_cb, self);
   }
 
   g_clear_object (&self->service);
@@ -172,8 +178,8 @@ ephy_history_manager_constructed (GObject *object)
 
   G_OBJECT_CLASS (ephy_history_manager_parent_class)->constructed (object);
 
-  g_signal_connect (self->service, "visit-url", G_CALLBACK (url_visited_cb), self);
-  g_signal_connect (self->service, "url-deleted", G_CALLBACK (url_deleted_cb), self);
+  g_signal_connect (self->service, "visit-urls", G_CALLBACK (urls_visited_cb), self);
+  g_signal_connect (self->service, "urls-deleted", G_CALLBACK (urls_deleted_cb), self);
 }
 
 static void
@@ -318,6 +324,20 @@ ephy_history_manager_handle_different_id_same_url (EphyHistoryManager *self,
   ephy_history_record_add_visit_time (remote, local_last_visit_time);
 }
 
+static void
+add_remote_visit (GPtrArray  *visits,
+                  const char *url,
+                  const char *sync_id,
+                  gint64      visit_time)
+{
+  EphyHistoryPageVisit *visit;
+
+  visit = ephy_history_page_visit_new (url, visit_time, EPHY_PAGE_VISIT_LINK);
+  visit->url->sync_id = g_strdup (sync_id);
+  visit->url->notify_visit = FALSE;
+  g_ptr_array_add (visits, visit);
+}
+
 static GPtrArray *
 ephy_history_manager_handle_initial_merge (EphyHistoryManager *self,
                                            GHashTable         *records_ht_id,
@@ -327,6 +347,7 @@ ephy_history_manager_handle_initial_merge (EphyHistoryManager *self,
   EphyHistoryRecord *record;
   GHashTableIter iter;
   gpointer key, value;
+  g_autoptr (GPtrArray) visits = NULL;
   GPtrArray *to_upload;
   const char *remote_id;
   const char *remote_url;
@@ -336,6 +357,7 @@ ephy_history_manager_handle_initial_merge (EphyHistoryManager *self,
   g_assert (EPHY_IS_HISTORY_MANAGER (self));
 
   to_upload = g_ptr_array_new_with_free_func (g_object_unref);
+  visits = g_ptr_array_new_with_free_func ((GDestroyNotify)ephy_history_page_visit_free);
 
   /* A history record is uniquely identified by its sync ID or by its URL. When
    * importing history records from server, we may encounter duplicates either
@@ -355,9 +377,7 @@ ephy_history_manager_handle_initial_merge (EphyHistoryManager *self,
        * the local last visit time to the remote one. */
       local_last_visit_time = ephy_history_record_get_last_visit_time (record);
       if (remote_last_visit_time > local_last_visit_time)
-        ephy_history_service_visit_url (self->service, remote_url,
-                                        remote_id, remote_last_visit_time,
-                                        EPHY_PAGE_VISIT_LINK, FALSE);
+        add_remote_visit (visits, remote_url, remote_id, remote_last_visit_time);
 
       if (ephy_history_record_add_visit_time (l->data, local_last_visit_time))
         g_ptr_array_add (to_upload, g_object_ref (l->data));
@@ -375,9 +395,7 @@ ephy_history_manager_handle_initial_merge (EphyHistoryManager *self,
       } else {
         /* Different ID, different URL. This is a new record. */
         if (remote_last_visit_time > 0)
-          ephy_history_service_visit_url (self->service, remote_url,
-                                          remote_id, remote_last_visit_time,
-                                          EPHY_PAGE_VISIT_LINK, FALSE);
+          add_remote_visit (visits, remote_url, remote_id, remote_last_visit_time);
       }
     }
   }
@@ -387,6 +405,10 @@ ephy_history_manager_handle_initial_merge (EphyHistoryManager *self,
   while (g_hash_table_iter_next (&iter, &key, &value))
     g_ptr_array_add (to_upload, g_object_ref (value));
 
+  /* Store all the new visits in one go. */
+  if (visits->len > 0)
+    ephy_history_service_import_visits (self->service, visits, NULL, NULL, NULL);
+
   return to_upload;
 }
 
@@ -398,6 +420,7 @@ ephy_history_manager_handle_regular_merge (EphyHistoryManager *self,
                                            GList              *updated_records)
 {
   EphyHistoryRecord *record;
+  g_autoptr (GPtrArray) visits = NULL;
   GPtrArray *to_upload;
   const char *remote_id;
   const char *remote_url;
@@ -407,6 +430,7 @@ ephy_history_manager_handle_regular_merge (EphyHistoryManager *self,
   g_assert (EPHY_IS_HISTORY_MANAGER (self));
 
   to_upload = g_ptr_array_new_with_free_func (g_object_unref);
+  visits = g_ptr_array_new_with_free_func ((GDestroyNotify)ephy_history_page_visit_free);
 
   for (GList *l = deleted_records; l && l->data; l = l->next) {
     remote_id = ephy_history_record_get_id (l->data);
@@ -443,9 +467,7 @@ ephy_history_manager_handle_regular_merge (EphyHistoryManager *self,
         ephy_synchronizable_manager_remove (EPHY_SYNCHRONIZABLE_MANAGER (self),
                                             EPHY_SYNCHRONIZABLE (record));
       else if (remote_last_visit_time > local_last_visit_time)
-        ephy_history_service_visit_url (self->service, remote_url,
-                                        remote_id, remote_last_visit_time,
-                                        EPHY_PAGE_VISIT_LINK, FALSE);
+        add_remote_visit (visits, remote_url, remote_id, remote_last_visit_time);
     } else {
       /* Try find by URL. */
       record = g_hash_table_lookup (records_ht_url, remote_url);
@@ -457,13 +479,15 @@ ephy_history_manager_handle_regular_merge (EphyHistoryManager *self,
       } else {
         /* Different ID, different URL. This is a new record. */
         if (remote_last_visit_time > 0)
-          ephy_history_service_visit_url (self->service, remote_url,
-                                          remote_id, remote_last_visit_time,
-                                          EPHY_PAGE_VISIT_LINK, FALSE);
+          add_remote_visit (visits, remote_url, remote_id, remote_last_visit_time);
       }
     }
   }
 
+  /* Store all the new visits in one go. */
+  if (visits->len > 0)
+    ephy_history_service_import_visits (self->service, visits, NULL, NULL, NULL);
+
   return to_upload;
 }
 
@@ -444,6 +444,16 @@ ephy_sync_crypto_rsa_key_pair_free (SyncCryptoRSAKeyPair *key_pair)
   g_free (key_pair);
 }
 
+static void
+ephy_sync_crypto_key_bundle_set_schedules (SyncCryptoKeyBundle *bundle,
+                                           const guint8        *aes_key,
+                                           const guint8        *hmac_key)
+{
+  aes256_set_decrypt_key (&bundle->aes_decrypt_ctx, aes_key);
+  /* SHA256 expects a 32 bytes key. */
+  hmac_sha256_set_key (&bundle->hmac_ctx, 32, hmac_key);
+}
+
 SyncCryptoKeyBundle *
 ephy_sync_crypto_key_bundle_new (const char *aes_key_b64,
                                  const char *hmac_key_b64)
@@ -465,6 +475,7 @@ ephy_sync_crypto_key_bundle_new (const char *aes_key_b64,
   bundle = g_new (SyncCryptoKeyBundle, 1);
   bundle->aes_key_hex = ephy_sync_utils_encode_hex (aes_key, aes_key_len);
   bundle->hmac_key_hex = ephy_sync_utils_encode_hex (hmac_key, hmac_key_len);
+  ephy_sync_crypto_key_bundle_set_schedules (bundle, aes_key, hmac_key);
 
   g_free (aes_key);
   g_free (hmac_key);
@@ -753,6 +764,7 @@ ephy_sync_crypto_derive_master_bundle (const guint8 *key)
   guint8 *prk;
   guint8 *tmp;
   guint8 *aes_key;
+  guint8 *hmac_key;
   char *prk_hex;
   char *aes_key_hex;
   char *hmac_key_hex;
@@ -785,11 +797,16 @@ ephy_sync_crypto_derive_master_bundle (const guint8 *key)
                                           prk, len,
                                           tmp, len + strlen (info) + 1);
 
+  hmac_key = ephy_sync_utils_decode_hex (hmac_key_hex);
+
   bundle = g_new (SyncCryptoKeyBundle, 1);
   bundle->aes_key_hex = g_strdup (aes_key_hex);
   bundle->hmac_key_hex = g_strdup (hmac_key_hex);
+  ephy_sync_crypto_key_bundle_set_schedules (bundle, aes_key, hmac_key);
 
+  g_free (hmac_key);
   g_free (hmac_key_hex);
+  g_free (aes_key);
   g_free (tmp);
   g_free (aes_key_hex);
   g_free (prk);
@@ -1016,19 +1033,23 @@ ephy_sync_crypto_encrypt_record (const char          *cleartext,
 }
 
 static gboolean
-ephy_sync_crypto_hmac_is_valid (const char   *text,
-                                const guint8 *key,
-                                const char   *expected)
+ephy_sync_crypto_hmac_is_valid (const char          *text,
+                                SyncCryptoKeyBundle *bundle,
+                                const char          *expected)
 {
+  /* Start from a copy of the keyed state, the bundle may be in use by other
+   * threads. */
+  struct hmac_sha256_ctx ctx = bundle->hmac_ctx;
+  guint8 digest[SHA256_DIGEST_SIZE];
   char *hmac;
   gboolean retval;
 
   g_assert (text);
-  g_assert (key);
   g_assert (expected);
 
-  /* SHA256 expects a 32 bytes key. */
-  hmac = g_compute_hmac_for_string (G_CHECKSUM_SHA256, key, 32, text, -1);
+  hmac_sha256_update (&ctx, strlen (text), (const guint8 *)text);
+  hmac_sha256_digest (&ctx, SHA256_DIGEST_SIZE, digest);
+  hmac = ephy_sync_utils_encode_hex (digest, SHA256_DIGEST_SIZE);
   retval = g_strcmp0 (hmac, expected) == 0;
   g_free (hmac);
 
@@ -1058,24 +1079,24 @@ ephy_sync_crypto_unpad (const guint8 *data,
 }
 
 static char *
-ephy_sync_crypto_aes_256_decrypt (const guint8 *data,
-                                  gsize         data_len,
-                                  const guint8 *key,
-                                  const guint8 *iv)
+ephy_sync_crypto_aes_256_decrypt (const guint8            *data,
+                                  gsize                    data_len,
+                                  const struct aes256_ctx *ctx,
+                                  const guint8            *iv)
 {
   guint8 *decrypted;
+  guint8 cbc_iv[AES_BLOCK_SIZE];
   char *unpadded;
-  struct CBC_CTX (struct aes256_ctx, AES_BLOCK_SIZE) ctx;
 
   g_assert (data);
-  g_assert (key);
+  g_assert (ctx);
   g_assert (iv);
 
   decrypted = g_malloc (data_len);
 
-  aes256_set_decrypt_key (&ctx.ctx, key);
-  CBC_SET_IV (&ctx, iv);
-  CBC_DECRYPT (&ctx, aes256_decrypt, data_len, decrypted, data);
+  memcpy (cbc_iv, iv, AES_BLOCK_SIZE);
+  cbc_decrypt (ctx, (nettle_cipher_func *)aes256_decrypt, AES_BLOCK_SIZE,
+               cbc_iv, data_len, decrypted, data);
 
   unpadded = ephy_sync_crypto_unpad (decrypted, data_len, AES_BLOCK_SIZE);
   g_free (decrypted);
@@ -1083,6 +1104,9 @@ ephy_sync_crypto_aes_256_decrypt (const guint8 *data,
   return unpadded;
 }
 
+/* This is called for every record of a collection, possibly from several
+ * threads at once, so it uses the key schedules of @bundle as they are.
+ */
 char *
 ephy_sync_crypto_decrypt_record (const char          *payload,
                                  SyncCryptoKeyBundle *bundle)
@@ -1090,8 +1114,6 @@ ephy_sync_crypto_decrypt_record (const char          *payload,
   JsonNode *node = NULL;
   JsonObject *json = NULL;
   GError *error = NULL;
-  guint8 *aes_key = NULL;
-  guint8 *hmac_key = NULL;
   guint8 *ciphertext = NULL;
   guint8 *iv = NULL;
   char *cleartext = NULL;
@@ -1123,14 +1145,10 @@ ephy_sync_crypto_decrypt_record (const char          *payload,
     goto out;
   }
 
-  /* Get the encryption key and the HMAC key. */
-  aes_key = ephy_sync_utils_decode_hex (bundle->aes_key_hex);
-  hmac_key = ephy_sync_utils_decode_hex (bundle->hmac_key_hex);
-
   /* Under no circumstances should a client try to decrypt a record
    * if the HMAC verification fails.
    */
-  if (!ephy_sync_crypto_hmac_is_valid (ciphertext_b64, hmac_key, hmac)) {
+  if (!ephy_sync_crypto_hmac_is_valid (ciphertext_b64, bundle, hmac)) {
     LOG ("Incorrect HMAC value");
     goto out;
   }
@@ -1138,14 +1156,16 @@ ephy_sync_crypto_decrypt_record (const char          *payload,
   /* Finally, decrypt the record. */
   ciphertext = g_base64_decode (ciphertext_b64, &ciphertext_len);
   iv = g_base64_decode (iv_b64, &iv_len);
+  if (iv_len != AES_BLOCK_SIZE || ciphertext_len == 0 || ciphertext_len % AES_BLOCK_SIZE != 0) {
+    LOG ("Ciphertext or IV has invalid length");
+    goto out;
+  }
   cleartext = ephy_sync_crypto_aes_256_decrypt (ciphertext, ciphertext_len,
-                                                aes_key, iv);
+                                                &bundle->aes_decrypt_ctx, iv);
 
 out:
   g_free (ciphertext);
   g_free (iv);
-  g_free (aes_key);
-  g_free (hmac_key);
   if (node)
     json_node_unref (node);
   if (error)
@@ -21,6 +21,8 @@
 #pragma once
 
 #include <glib-object.h>
+#include <nettle/aes.h>
+#include <nettle/hmac.h>
 #include <nettle/rsa.h>
 
 G_BEGIN_DECLS
@@ -63,6 +65,10 @@ typedef struct {
 typedef struct {
   char *aes_key_hex;
   char *hmac_key_hex;
+  /* Expanded from the keys above once, and only read afterwards, so that
+   * records can be decrypted from several threads with the same bundle. */
+  struct aes256_ctx aes_decrypt_ctx;
+  struct hmac_sha256_ctx hmac_ctx;
 } SyncCryptoKeyBundle;
 
 SyncCryptoHawkOptions *ephy_sync_crypto_hawk_options_new        (const char *app,
@@ -60,6 +60,9 @@ struct _EphySyncService {
 
   gboolean sync_periodically;
   gboolean is_signing_in;
+
+  /* Decrypts and deserializes the records of downloaded collections. */
+  GThreadPool *decrypt_pool;
 };
 
 G_DEFINE_TYPE (EphySyncService, ephy_sync_service, G_TYPE_OBJECT);
@@ -107,8 +110,8 @@ typedef struct {
   char *endpoint;
   char *method;
   char *request_body;
-  gint64 modified_since;
-  gint64 unmodified_since;
+  double modified_since;
+  double unmodified_since;
   SoupSessionCallback callback;
   gpointer user_data;
 } StorageRequestAsyncData;
@@ -130,10 +133,38 @@ typedef struct {
   EphySynchronizableManager *manager;
   gboolean is_initial;
   gboolean is_last;
+  double last_modified;
+  SyncCryptoKeyBundle *bundle;
+  guint num_pending_pages;
+  char *next_offset; /* Of the page to download once fewer pages are pending */
+  gboolean is_downloaded;
+  gboolean failed;
   GList *remotes_deleted;
   GList *remotes_updated;
 } SyncCollectionAsyncData;
 
+/* A downloaded page of a collection, which is parsed and then decrypted in
+ * batches on the decrypt pool. */
+typedef struct {
+  SyncCollectionAsyncData *data;
+  GType type;
+  GBytes *body;
+  JsonParser *parser;
+  JsonArray *array;
+  gboolean failed;
+  gint num_batches_left;
+  GMutex mutex;
+  GList *remotes_deleted; /* Guarded by mutex */
+  GList *remotes_updated; /* Guarded by mutex */
+} DecryptPageAsyncData;
+
+typedef struct {
+  DecryptPageAsyncData *page;
+  gboolean parse;
+  guint start;
+  guint end;
+} DecryptBatchAsyncData;
+
 typedef struct {
   EphySyncService *service;
   EphySynchronizableManager *manager;
@@ -155,8 +186,8 @@ static StorageRequestAsyncData *
 storage_request_async_data_new (const char          *endpoint,
                                 const char          *method,
                                 const char          *request_body,
-                                gint64               modified_since,
-                                gint64               unmodified_since,
+                                double               modified_since,
+                                double               unmodified_since,
                                 SoupSessionCallback  callback,
                                 gpointer             user_data)
 {
@@ -311,6 +342,12 @@ sync_collection_async_data_new (EphySyncService           *service,
   data->manager = g_object_ref (manager);
   data->is_initial = is_initial;
   data->is_last = is_last;
+  data->last_modified = -1;
+  data->bundle = NULL;
+  data->num_pending_pages = 0;
+  data->next_offset = NULL;
+  data->is_downloaded = FALSE;
+  data->failed = FALSE;
   data->remotes_deleted = NULL;
   data->remotes_updated = NULL;
 
@@ -324,11 +361,59 @@ sync_collection_async_data_free (SyncCollectionAsyncData *data)
 
   g_object_unref (data->service);
   g_object_unref (data->manager);
+  if (data->bundle)
+    ephy_sync_crypto_key_bundle_free (data->bundle);
+  g_free (data->next_offset);
   g_list_free_full (data->remotes_deleted, g_object_unref);
   g_list_free_full (data->remotes_updated, g_object_unref);
   g_free (data);
 }
 
+static DecryptPageAsyncData *
+decrypt_page_async_data_new (SyncCollectionAsyncData *data,
+                             GBytes                  *body)
+{
+  DecryptPageAsyncData *page;
+
+  page = g_new0 (DecryptPageAsyncData, 1);
+  page->data = data;
+  page->type = ephy_synchronizable_manager_get_synchronizable_type (data->manager);
+  page->body = g_bytes_ref (body);
+  g_mutex_init (&page->mutex);
+
+  return page;
+}
+
+static void
+decrypt_page_async_data_free (DecryptPageAsyncData *page)
+{
+  g_assert (page);
+
+  g_bytes_unref (page->body);
+  g_clear_object (&page->parser);
+  g_mutex_clear (&page->mutex);
+  g_list_free_full (page->remotes_deleted, g_object_unref);
+  g_list_free_full (page->remotes_updated, g_object_unref);
+  g_free (page);
+}
+
+static DecryptBatchAsyncData *
+decrypt_batch_async_data_new (DecryptPageAsyncData *page,
+                              gboolean              parse,
+                              guint                 start,
+                              guint                 end)
+{
+  DecryptBatchAsyncData *batch;
+
+  batch = g_new (DecryptBatchAsyncData, 1);
+  batch->page = page;
+  batch->parse = parse;
+  batch->start = start;
+  batch->end = end;
+
+  return batch;
+}
+
 static SyncAsyncData *
 sync_async_data_new (EphySyncService           *service,
                      EphySynchronizableManager *manager,
@@ -632,8 +717,8 @@ ephy_sync_service_send_storage_request (EphySyncService         *self,
   SoupMessage *msg;
   SoupMessageHeaders *request_headers;
   char *url;
-  char *if_modified_since = NULL;
-  char *if_unmodified_since = NULL;
+  char if_modified_since[G_ASCII_DTOSTR_BUF_SIZE];
+  char if_unmodified_since[G_ASCII_DTOSTR_BUF_SIZE];
   const char *content_type = "application/json; charset=utf-8";
 
   g_assert (EPHY_IS_SYNC_SERVICE (self));
@@ -668,13 +753,14 @@ ephy_sync_service_send_storage_request (EphySyncService         *self,
   if (!g_strcmp0 (data->method, SOUP_METHOD_PUT) || !g_strcmp0 (data->method, SOUP_METHOD_POST))
     soup_message_headers_append (request_headers, "content-type", content_type);
 
+  /* Server timestamps have two decimals. */
   if (data->modified_since >= 0) {
-    if_modified_since = g_strdup_printf ("%" PRId64, data->modified_since);
+    g_ascii_formatd (if_modified_since, sizeof (if_modified_since), "%.2f", data->modified_since);
     soup_message_headers_append (request_headers, "X-If-Modified-Since", if_modified_since);
   }
 
   if (data->unmodified_since >= 0) {
-    if_unmodified_since = g_strdup_printf ("%" PRId64, data->unmodified_since);
+    g_ascii_formatd (if_unmodified_since, sizeof (if_unmodified_since), "%.2f", data->unmodified_since);
     soup_message_headers_append (request_headers, "X-If-Unmodified-Since", if_unmodified_since);
   }
 
@@ -694,8 +780,6 @@ ephy_sync_service_send_storage_request (EphySyncService         *self,
 #endif
 
   g_free (url);
-  g_free (if_modified_since);
-  g_free (if_unmodified_since);
   ephy_sync_crypto_hawk_header_free (header);
   if (options)
     ephy_sync_crypto_hawk_options_free (options);
@@ -1288,8 +1372,8 @@ ephy_sync_service_queue_storage_request (EphySyncService     *self,
                                          const char          *endpoint,
                                          const char          *method,
                                          const char          *request_body,
-                                         gint64               modified_since,
-                                         gint64               unmodified_since,
+                                         double               modified_since,
+                                         double               unmodified_since,
                                          SoupSessionCallback  callback,
                                          gpointer             user_data)
 {
@@ -1817,20 +1901,175 @@ out:
   sync_collection_async_data_free (data);
 }
 
+static void ephy_sync_service_download_collection_page (SyncCollectionAsyncData *data,
+                                                        const char              *offset);
+
+/* Merges the collection once all of its pages are downloaded and decrypted. */
+static void
+sync_collection_finish (SyncCollectionAsyncData *data)
+{
+  const char *collection;
+
+  if (!data->is_downloaded || data->num_pending_pages > 0)
+    return;
+
+  if (data->failed) {
+    if (data->is_last)
+      g_signal_emit (data->service, signals[SYNC_FINISHED], 0);
+    sync_collection_async_data_free (data);
+    return;
+  }
+
+  collection = ephy_synchronizable_manager_get_collection_name (data->manager);
+  LOG ("Found %u deleted objects and %u new/updated objects in %s collection",
+       g_list_length (data->remotes_deleted),
+       g_list_length (data->remotes_updated),
+       collection);
+
+  ephy_synchronizable_manager_set_is_initial_sync (data->manager, FALSE);
+  ephy_synchronizable_manager_merge (data->manager, data->is_initial,
+                                     data->remotes_deleted, data->remotes_updated,
+                                     merge_collection_finished_cb, data);
+}
+
+static gboolean
+decrypt_page_finished_cb (DecryptPageAsyncData *page)
+{
+  SyncCollectionAsyncData *data = page->data;
+
+  LOG ("Found %u deleted objects and %u new/updated objects in page of %s collection",
+       g_list_length (page->remotes_deleted),
+       g_list_length (page->remotes_updated),
+       ephy_synchronizable_manager_get_collection_name (data->manager));
+
+  if (page->failed)
+    data->failed = TRUE;
+  data->remotes_deleted = g_list_concat (page->remotes_deleted, data->remotes_deleted);
+  data->remotes_updated = g_list_concat (page->remotes_updated, data->remotes_updated);
+  page->remotes_deleted = NULL;
+  page->remotes_updated = NULL;
+
+  data->num_pending_pages--;
+  decrypt_page_async_data_free (page);
+
+  /* The download stopped to let the decryption catch up. */
+  if (data->next_offset) {
+    g_autofree char *next_offset = g_steal_pointer (&data->next_offset);
+
+    if (!data->failed) {
+      ephy_sync_service_download_collection_page (data, next_offset);
+      return G_SOURCE_REMOVE;
+    }
+    data->is_downloaded = TRUE;
+  }
+
+  sync_collection_finish (data);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+decrypt_page_parse (DecryptPageAsyncData *page)
+{
+  EphySyncService *self = page->data->service;
+  g_autoptr (GError) error = NULL;
+  JsonNode *node;
+  guint length;
+
+  page->parser = json_parser_new ();
+  if (!json_parser_load_from_data (page->parser,
+                                   g_bytes_get_data (page->body, NULL),
+                                   g_bytes_get_size (page->body),
+                                   &error)) {
+    g_warning ("Response is not a valid JSON: %s", error->message);
+    page->failed = TRUE;
+    goto out;
+  }
+  node = json_parser_get_root (page->parser);
+  page->array = node ? json_node_get_array (node) : NULL;
+  if (!page->array) {
+    g_warning ("JSON node does not hold an array");
+    page->failed = TRUE;
+    goto out;
+  }
+
+  length = json_array_get_length (page->array);
+  if (length == 0)
+    goto out;
+
+  /* Batches only read the parsed page. */
+  json_node_seal (node);
+  page->num_batches_left = (length + EPHY_SYNC_DECRYPT_BATCH_SIZE - 1) / EPHY_SYNC_DECRYPT_BATCH_SIZE;
+  for (guint i = 0; i < length; i += EPHY_SYNC_DECRYPT_BATCH_SIZE) {
+    g_thread_pool_push (self->decrypt_pool,
+                        decrypt_batch_async_data_new (page, FALSE, i,
+                                                      MIN (i + EPHY_SYNC_DECRYPT_BATCH_SIZE, length)),
+                        NULL);
+  }
+
+  return;
+
+out:
+  g_idle_add_full (G_PRIORITY_DEFAULT, (GSourceFunc)decrypt_page_finished_cb, page, NULL);
+}
+
+static void
+decrypt_page_decrypt (DecryptPageAsyncData *page,
+                      guint                 start,
+                      guint                 end)
+{
+  EphySynchronizable *remote;
+  GList *remotes_deleted = NULL;
+  GList *remotes_updated = NULL;
+  gboolean is_deleted;
+
+  for (guint i = start; i < end; i++) {
+    remote = EPHY_SYNCHRONIZABLE (ephy_synchronizable_from_bso (json_array_get_element (page->array, i),
+                                                                page->type, page->data->bundle,
+                                                                &is_deleted));
+    if (!remote) {
+      g_warning ("Failed to create synchronizable object from BSO, skipping...");
+      continue;
+    }
+    if (is_deleted)
+      remotes_deleted = g_list_prepend (remotes_deleted, remote);
+    else
+      remotes_updated = g_list_prepend (remotes_updated, remote);
+  }
+
+  g_mutex_lock (&page->mutex);
+  page->remotes_deleted = g_list_concat (remotes_deleted, page->remotes_deleted);
+  page->remotes_updated = g_list_concat (remotes_updated, page->remotes_updated);
+  g_mutex_unlock (&page->mutex);
+
+  /* The last batch hands the whole page over to the main thread. */
+  if (g_atomic_int_dec_and_test (&page->num_batches_left))
+    g_idle_add_full (G_PRIORITY_DEFAULT, (GSourceFunc)decrypt_page_finished_cb, page, NULL);
+}
+
+static void
+decrypt_batch_run (DecryptBatchAsyncData *batch,
+                   gpointer               user_data)
+{
+  if (batch->parse)
+    decrypt_page_parse (batch->page);
+  else
+    decrypt_page_decrypt (batch->page, batch->start, batch->end);
+
+  g_free (batch);
+}
+
 static void
 sync_collection_cb (SoupSession *session,
                     SoupMessage *msg,
                     gpointer     user_data)
 {
   SyncCollectionAsyncData *data = (SyncCollectionAsyncData *)user_data;
-  EphySynchronizable *remote;
-  SyncCryptoKeyBundle *bundle = NULL;
-  JsonNode *node = NULL;
-  JsonArray *array = NULL;
-  g_autoptr (GError) error = NULL;
-  GType type;
+  DecryptPageAsyncData *page;
+  SoupMessageHeaders *response_headers;
   const char *collection;
-  gboolean is_deleted;
+  const char *last_modified;
+  const char *next_offset;
   guint status_code;
   g_autoptr (GBytes) response_body = NULL;
 
@@ -1838,66 +2077,101 @@ sync_collection_cb (SoupSession *session,
 
 #if SOUP_CHECK_VERSION (2, 99, 4)
   status_code = soup_message_get_status (msg);
+  response_headers = soup_message_get_response_headers (msg);
   response_body = g_bytes_ref (g_object_get_data (G_OBJECT (msg), "ephy-request-body"));
 #else
   status_code = msg->status_code;
+  response_headers = msg->response_headers;
   response_body = g_bytes_new_static (msg->response_body->data, msg->response_body->length);
 #endif
 
+  /* The collection was modified by another client since the first page was
+   * fetched, so the pages don't add up anymore. Try again on the next sync. */
+  if (status_code == 412) {
+    g_warning ("Collection %s was modified while downloading it", collection);
+    goto out_error;
+  }
   if (status_code != 200) {
     g_warning ("Failed to get records in collection %s. Status code: %u, response: %s",
                collection, status_code, (const char *)g_bytes_get_data (response_body, NULL));
     goto out_error;
   }
-  node = json_from_string (g_bytes_get_data (response_body, NULL), &error);
-  if (error) {
-    g_warning ("Response is not a valid JSON: %s", error->message);
-    goto out_error;
-  }
-  array = json_node_get_array (node);
-  if (!array) {
-    g_warning ("JSON node does not hold an array");
-    goto out_error;
-  }
 
-  type = ephy_synchronizable_manager_get_synchronizable_type (data->manager);
-  bundle = ephy_sync_service_get_key_bundle (data->service, collection);
-  if (!bundle)
+  if (!data->bundle)
+    data->bundle = ephy_sync_service_get_key_bundle (data->service, collection);
+  if (!data->bundle)
     goto out_error;
 
-  for (guint i = 0; i < json_array_get_length (array); i++) {
-    remote = EPHY_SYNCHRONIZABLE (ephy_synchronizable_from_bso (json_array_get_element (array, i),
-                                                                type, bundle, &is_deleted));
-    if (!remote) {
-      g_warning ("Failed to create synchronizable object from BSO, skipping...");
-      continue;
+  /* Parse and decrypt the page off the main thread, while the next one is
+   * downloaded, unless too many pages are waiting to be decrypted already. */
+#if SOUP_CHECK_VERSION (2, 99, 4)
+  page = decrypt_page_async_data_new (data, response_body);
+#else
+  {
+    /* The response body goes away with the message. */
+    g_autoptr (GBytes) body = g_bytes_new (msg->response_body->data, msg->response_body->length);
+    page = decrypt_page_async_data_new (data, body);
+  }
+#endif
+  data->num_pending_pages++;
+  g_thread_pool_push (data->service->decrypt_pool,
+                      decrypt_batch_async_data_new (page, TRUE, 0, 0),
+                      NULL);
+
+  next_offset = soup_message_headers_get_one (response_headers, "X-Weave-Next-Offset");
+  if (next_offset) {
+    /* All pages must come from the same version of the collection. */
+    if (data->last_modified < 0) {
+      last_modified = soup_message_headers_get_one (response_headers, "X-Last-Modified");
+      data->last_modified = last_modified ? g_ascii_strtod (last_modified, NULL) : -1;
     }
-    if (is_deleted)
-      data->remotes_deleted = g_list_prepend (data->remotes_deleted, remote);
+    if (data->num_pending_pages < EPHY_SYNC_MAX_PENDING_PAGES)
+      ephy_sync_service_download_collection_page (data, next_offset);
     else
-      data->remotes_updated = g_list_prepend (data->remotes_updated, remote);
+      data->next_offset = g_strdup (next_offset);
+    return;
   }
 
-  LOG ("Found %u deleted objects and %u new/updated objects in %s collection",
-       g_list_length (data->remotes_deleted),
-       g_list_length (data->remotes_updated),
-       collection);
-
-  ephy_synchronizable_manager_set_is_initial_sync (data->manager, FALSE);
-  ephy_synchronizable_manager_merge (data->manager, data->is_initial,
-                                     data->remotes_deleted, data->remotes_updated,
-                                     merge_collection_finished_cb, data);
-  goto out_no_error;
+  data->is_downloaded = TRUE;
+  sync_collection_finish (data);
+  return;
 
 out_error:
-  if (data->is_last)
-    g_signal_emit (data->service, signals[SYNC_FINISHED], 0);
-  sync_collection_async_data_free (data);
-out_no_error:
-  if (bundle)
-    ephy_sync_crypto_key_bundle_free (bundle);
-  if (node)
-    json_node_unref (node);
+  data->failed = TRUE;
+  data->is_downloaded = TRUE;
+  sync_collection_finish (data);
+}
+
+/* Asks for the records of the collection in pages of
+ * EPHY_SYNC_DOWNLOAD_PAGE_SIZE, so that neither a response nor the work of
+ * decrypting it grows with the collection. See
+ * https://mozilla-services.readthedocs.io/en/latest/storage/apis-1.5.html
+ */
+static void
+ephy_sync_service_download_collection_page (SyncCollectionAsyncData *data,
+                                            const char              *offset)
+{
+  const char *collection;
+  GString *endpoint;
+
+  collection = ephy_synchronizable_manager_get_collection_name (data->manager);
+
+  endpoint = g_string_new (NULL);
+  g_string_printf (endpoint, "storage/%s?full=true&limit=%u",
+                   collection, EPHY_SYNC_DOWNLOAD_PAGE_SIZE);
+  if (!data->is_initial)
+    g_string_append_printf (endpoint, "&newer=%" PRId64,
+                            ephy_synchronizable_manager_get_sync_time (data->manager));
+  if (offset) {
+    g_autofree char *escaped = g_uri_escape_string (offset, NULL, TRUE);
+    g_string_append_printf (endpoint, "&offset=%s", escaped);
+  }
+
+  ephy_sync_service_queue_storage_request (data->service, endpoint->str, SOUP_METHOD_GET,
+                                           NULL, -1, offset ? data->last_modified : -1,
+                                           sync_collection_cb, data);
+
+  g_string_free (endpoint, TRUE);
 }
 
 static void
@@ -1907,7 +2181,6 @@ ephy_sync_service_sync_collection (EphySyncService           *self,
 {
   SyncCollectionAsyncData *data;
   const char *collection;
-  char *endpoint;
   gboolean is_initial;
 
   g_assert (EPHY_IS_SYNC_SERVICE (self));
@@ -1917,20 +2190,9 @@ ephy_sync_service_sync_collection (EphySyncService           *self,
   collection = ephy_synchronizable_manager_get_collection_name (manager);
   is_initial = ephy_synchronizable_manager_is_initial_sync (manager);
 
-  if (is_initial) {
-    endpoint = g_strdup_printf ("storage/%s?full=true", collection);
-  } else {
-    endpoint = g_strdup_printf ("storage/%s?newer=%" PRId64 "&full=true", collection,
-                                ephy_synchronizable_manager_get_sync_time (manager));
-  }
-
   LOG ("Syncing %s collection %s...", collection, is_initial ? "initial" : "regular");
   data = sync_collection_async_data_new (self, manager, is_initial, is_last);
-  ephy_sync_service_queue_storage_request (self, endpoint, SOUP_METHOD_GET,
-                                           NULL, -1, -1,
-                                           sync_collection_cb, data);
-
-  g_free (endpoint);
+  ephy_sync_service_download_collection_page (data, NULL);
 }
 
 static gboolean
@@ -2261,6 +2523,7 @@ ephy_sync_service_finalize (GObject *object)
   g_slist_free (self->managers);
   g_queue_free_full (self->storage_queue, (GDestroyNotify)storage_request_async_data_free);
   ephy_sync_service_clear_storage_credentials (self);
+  g_thread_pool_free (self->decrypt_pool, FALSE, TRUE);
 
   G_OBJECT_CLASS (ephy_sync_service_parent_class)->finalize (object);
 }
@@ -2305,6 +2568,8 @@ ephy_sync_service_init (EphySyncService *self)
   self->storage_queue = g_queue_new ();
   self->secrets = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
   self->cancellable = g_cancellable_new ();
+  self->decrypt_pool = g_thread_pool_new ((GFunc)decrypt_batch_run, NULL,
+                                          g_get_num_processors (), FALSE, NULL);
 
   if (ephy_sync_utils_user_is_signed_in ())
     ephy_sync_service_load_secrets (self);
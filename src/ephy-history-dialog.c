@@ -78,6 +78,11 @@ struct _EphyHistoryDialog {
   GList *urls;
   guint sorter_source;
 
+  /* The next page of URLs is fetched after the last one fetched so far. */
+  EphyHistoryURL *last_fetched_url;
+  GCancellable *page_cancellable;
+  gboolean fetched_all_urls;
+
   gint num_fetch;
   gboolean shift_modifier_active;
   gboolean is_loading;
@@ -265,6 +270,17 @@ clear_listbox (GtkWidget *listbox)
   g_list_free (children);
 }
 
+static void
+set_last_fetched_url (EphyHistoryDialog *self,
+                      GList             *urls)
+{
+  g_clear_pointer (&self->last_fetched_url, ephy_history_url_free);
+
+  if (urls)
+    self->last_fetched_url = ephy_history_url_copy (g_list_last (urls)->data);
+  self->fetched_all_urls = g_list_length (urls) < NUM_FETCH_LIMIT;
+}
+
 static void
 on_find_urls_cb (gpointer service,
                  gboolean success,
@@ -276,6 +292,8 @@ on_find_urls_cb (gpointer service,
   if (!success)
     return;
 
+  set_last_fetched_url (self, result_data);
+
   if (self->urls)
     ephy_history_url_list_free (self->urls);
   self->urls = ephy_history_url_list_copy (result_data);
@@ -320,26 +338,63 @@ remove_pending_sorter_source (EphyHistoryDialog *self,
 }
 
 static void
-filter_now (EphyHistoryDialog *self)
+on_find_more_urls_cb (gpointer service,
+                      gboolean success,
+                      gpointer result_data,
+                      gpointer user_data)
 {
-  gint64 from, to;
-  GList *substrings;
-  EphyHistorySortType type;
-  substrings = substrings_filter (self);
+  EphyHistoryDialog *self = EPHY_HISTORY_DIALOG (user_data);
+
+  g_clear_object (&self->page_cancellable);
 
-  from = to = -1;       /* all */
+  if (!success)
+    return;
+
+  set_last_fetched_url (self, result_data);
+  self->urls = g_list_concat (self->urls, ephy_history_url_list_copy (result_data));
+
+  remove_pending_sorter_source (self, FALSE);
+  self->sorter_source = g_idle_add ((GSourceFunc)add_urls_source, self);
+}
 
-  type = EPHY_HISTORY_SORT_MOST_RECENTLY_VISITED;
+static EphyHistoryQuery *
+create_page_query (EphyHistoryDialog *self)
+{
+  EphyHistoryQuery *query = ephy_history_query_new ();
 
+  query->from = query->to = -1;       /* all */
+  query->limit = NUM_FETCH_LIMIT;
+  query->substring_list = substrings_filter (self);
+  query->sort_type = EPHY_HISTORY_SORT_MOST_RECENTLY_VISITED;
+
+  return query;
+}
+
+static void
+cancel_page_fetch (EphyHistoryDialog *self)
+{
+  if (self->page_cancellable) {
+    g_cancellable_cancel (self->page_cancellable);
+    g_clear_object (&self->page_cancellable);
+  }
+}
+
+static void
+filter_now (EphyHistoryDialog *self)
+{
+  g_autoptr (EphyHistoryQuery) query = create_page_query (self);
+
+  /* Skip the queries for filters that changed again before they ran. */
+  query->coalescing_key = g_strdup_printf ("history-dialog-%p", self);
+
+  cancel_page_fetch (self);
+  g_clear_pointer (&self->last_fetched_url, ephy_history_url_free);
   remove_pending_sorter_source (self, TRUE);
 
-  ephy_history_service_find_urls (self->history_service,
-                                  from, to,
-                                  -1, 0,
-                                  substrings,
-                                  type,
-                                  self->cancellable,
-                                  (EphyHistoryJobCallback)on_find_urls_cb, self);
+  ephy_history_service_query_urls (self->history_service,
+                                   query,
+                                   self->cancellable,
+                                   (EphyHistoryJobCallback)on_find_urls_cb, self);
 }
 
 static GList *
@@ -602,6 +657,25 @@ load_further_data (EphyHistoryDialog *self)
   remove_pending_sorter_source (self, FALSE);
 
   self->num_fetch += NUM_FETCH_LIMIT;
+
+  /* All fetched rows are shown, fetch the next page. */
+  if (!self->urls && !self->fetched_all_urls && self->last_fetched_url) {
+    g_autoptr (EphyHistoryQuery) query = NULL;
+
+    if (self->page_cancellable)
+      return;
+
+    query = create_page_query (self);
+    query->page_after = ephy_history_url_copy (self->last_fetched_url);
+
+    self->page_cancellable = g_cancellable_new ();
+    ephy_history_service_query_urls (self->history_service,
+                                     query,
+                                     self->page_cancellable,
+                                     (EphyHistoryJobCallback)on_find_more_urls_cb, self);
+    return;
+  }
+
   self->sorter_source = g_idle_add ((GSourceFunc)add_urls_source, self);
 }
 
@@ -824,6 +898,9 @@ ephy_history_dialog_dispose (GObject *object)
     g_clear_object (&self->cancellable);
   }
 
+  cancel_page_fetch (self);
+  g_clear_pointer (&self->last_fetched_url, ephy_history_url_free);
+
   g_clear_object (&self->history_service);
 
   remove_pending_sorter_source (self, TRUE);
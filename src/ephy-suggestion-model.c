@@ -364,6 +364,7 @@ typedef struct {
   GSequence *history;
   GSequence *google_suggestions;
   int active_sources;
+  gboolean history_failed;
 } QueryData;
 
 static QueryData *
@@ -423,6 +424,14 @@ query_collection_done (EphySuggestionModel *self,
   if (--data->active_sources)
     return;
 
+  /* Leave the model to the newer query, or as it is if the query failed. */
+  if (data->history_failed) {
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                             "History query for “%s” failed or was superseded", data->query);
+    g_object_unref (task);
+    return;
+  }
+
   g_cancellable_cancel (self->icon_cancellable);
   g_clear_object (&self->icon_cancellable);
 
@@ -607,15 +616,22 @@ history_query_completed_cb (EphyHistoryService *service,
   GTask *task = user_data;
   EphySuggestionModel *self;
   QueryData *data;
-  GList *urls;
+  EphyHistoryURLSet *urls;
 
   self = g_task_get_source_object (task);
   data = g_task_get_task_data (task);
-  urls = (GList *)result_data;
+  urls = (EphyHistoryURLSet *)result_data;
+
+  /* Superseded queries complete without results, like failed ones. */
+  if (!success) {
+    data->history_failed = TRUE;
+    query_collection_done (self, g_steal_pointer (&task));
+    return;
+  }
 
   if (strlen (data->query) > 0) {
-    for (const GList *p = urls; p != NULL; p = p->next) {
-      EphyHistoryURL *url = (EphyHistoryURL *)p->data;
+    for (guint i = 0; i < ephy_history_url_set_get_length (urls); i++) {
+      const EphyHistoryURLRow *url = ephy_history_url_set_get_row (urls, i);
       EphySuggestion *suggestion;
       g_autofree gchar *escaped_title = NULL;
       g_autofree gchar *markup = NULL;
@@ -770,22 +786,24 @@ ephy_suggestion_model_query_async (EphySuggestionModel *self,
   }
 
   if (data->scope == QUERY_SCOPE_ALL || data->scope == QUERY_SCOPE_HISTORY) {
-    GList *qlist = NULL;
+    g_autoptr (EphyHistoryQuery) history_query = ephy_history_query_new ();
     g_auto (GStrv) strings = NULL;
 
     strings = g_strsplit (data->query, " ", -1);
 
     for (guint i = 0; strings[i]; i++)
-      qlist = g_list_append (qlist, g_strdup (strings[i]));
-
-    ephy_history_service_find_urls (self->history_service,
-                                    0, 0,
-                                    MAX_URL_ENTRIES, 0,
-                                    qlist,
-                                    EPHY_HISTORY_SORT_MOST_VISITED,
-                                    cancellable,
-                                    (EphyHistoryJobCallback)history_query_completed_cb,
-                                    task);
+      history_query->substring_list = g_list_append (history_query->substring_list, g_strdup (strings[i]));
+
+    history_query->limit = MAX_URL_ENTRIES;
+    history_query->sort_type = EPHY_HISTORY_SORT_FRECENCY;
+    /* Only the results for the latest keystroke matter. */
+    history_query->coalescing_key = g_strdup_printf ("suggestion-model-%p", self);
+
+    ephy_history_service_query_url_set (self->history_service,
+                                        history_query,
+                                        cancellable,
+                                        (EphyHistoryJobCallback)history_query_completed_cb,
+                                        task);
   }
 
   if (data->scope == QUERY_SCOPE_ALL || data->scope == QUERY_SCOPE_TABS)
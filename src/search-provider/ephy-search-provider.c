@@ -78,7 +78,8 @@ on_model_updated (GObject      *source_object,
       g_ptr_array_add (results, g_strdup (ephy_suggestion_get_uri (suggestion)));
     }
   } else {
-    g_warning ("Failed to query suggestion model: %s", error->message);
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      g_warning ("Failed to query suggestion model: %s", error->message);
     g_error_free (error);
   }
 
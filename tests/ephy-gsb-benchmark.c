@@ -0,0 +1,483 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2021 Epiphany Developers
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Times the Safe Browsing code paths that run on every list update, and
+ * EphyGSBService against a local stand-in server: a full update of empty
+ * lists, updates of up-to-date lists, and URL verification. Results are
+ * written as JSON, so that they can be compared across releases:
+ *
+ *   benchmark-ephy-gsb --entries 500000 --list-entries 250000 --output gsb.json
+ */
+
+#include "config.h"
+#include "ephy-debug.h"
+#include "ephy-gsb-service.h"
+#include "ephy-gsb-storage.h"
+#include "ephy-gsb-test-server.h"
+#include "ephy-gsb-utils.h"
+
+#include <glib/gstdio.h>
+#include <json-glib/json-glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_RUNS 5
+
+/* One in LISTED_URL_INTERVAL verified URLs is in a list. */
+#define NUM_LISTED_URLS     10
+#define LISTED_URL_INTERVAL 100
+
+/* The bit-at-a-time decoder that the word-at-a-time one replaced, kept here
+ * as the baseline. */
+typedef struct {
+  const guint8 *curr;
+  guint8 mask;
+} ReferenceBitReader;
+
+static guint32
+reference_bit_reader_read (ReferenceBitReader *reader,
+                           guint               num_bits)
+{
+  guint32 retval = 0;
+
+  for (guint i = 0; i < num_bits; i++) {
+    if (*reader->curr & reader->mask)
+      retval |= 1 << i;
+
+    reader->mask <<= 1;
+    if (reader->mask == 0) {
+      reader->curr++;
+      reader->mask = 0x01;
+    }
+  }
+
+  return retval;
+}
+
+static void
+reference_rice_delta_decode (const guint8 *data,
+                             guint         parameter,
+                             guint32       first_value,
+                             guint32      *items,
+                             gsize         num_items)
+{
+  ReferenceBitReader reader = { data, 0x01 };
+
+  items[0] = first_value;
+  for (gsize i = 1; i < num_items; i++) {
+    guint32 quotient = 0;
+    guint32 bit;
+
+    while ((bit = reference_bit_reader_read (&reader, 1)) != 0)
+      quotient += bit;
+
+    items[i] = items[i - 1] + (quotient << parameter) + reference_bit_reader_read (&reader, parameter);
+  }
+}
+
+static void
+write_bits (GByteArray *array,
+            gsize      *num_bits,
+            guint32     value,
+            guint       count)
+{
+  for (guint i = 0; i < count; i++) {
+    if (*num_bits % 8 == 0)
+      g_byte_array_append (array, (const guint8 *)"\0", 1);
+    if (value & (1u << i))
+      array->data[*num_bits / 8] |= 1 << (*num_bits % 8);
+    (*num_bits)++;
+  }
+}
+
+/* Encodes the deltas between sorted random values, like the hash prefixes of
+ * a FULL_UPDATE, with the parameter that suits them best. */
+static GByteArray *
+rice_encode_random (GRand   *rand,
+                    gsize    num_items,
+                    guint   *parameter_out,
+                    guint32 *first_value)
+{
+  GByteArray *array = g_byte_array_new ();
+  guint32 mean_delta = G_MAXUINT32 / (num_items + 1);
+  guint parameter = CLAMP (g_bit_storage (mean_delta) - 1, 2, 28);
+  gsize num_bits = 0;
+
+  *parameter_out = parameter;
+
+  *first_value = g_rand_int_range (rand, 0, mean_delta);
+  for (gsize i = 1; i < num_items; i++) {
+    guint32 delta = g_rand_double (rand) * 2 * mean_delta;
+
+    for (guint32 q = delta >> parameter; q > 0; q--)
+      write_bits (array, &num_bits, 1, 1);
+    write_bits (array, &num_bits, 0, 1);
+    write_bits (array, &num_bits, delta & ((1u << parameter) - 1), parameter);
+  }
+
+  return array;
+}
+
+static int
+compare_doubles (gconstpointer a,
+                 gconstpointer b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+static double
+median (double *values,
+        guint   num_values)
+{
+  qsort (values, num_values, sizeof (double), compare_doubles);
+  return values[num_values / 2];
+}
+
+static void
+run_rice (JsonBuilder *builder,
+          gsize        num_items)
+{
+  g_autoptr (GRand) rand = g_rand_new_with_seed (42);
+  g_autoptr (GByteArray) data = NULL;
+  g_autofree guint32 *reference_items = g_new (guint32, num_items);
+  g_autofree guint32 *items = g_new (guint32, num_items);
+  double reference_ms[NUM_RUNS];
+  double buffered_ms[NUM_RUNS];
+  guint32 first_value;
+  guint parameter;
+
+  data = rice_encode_random (rand, num_items, &parameter, &first_value);
+
+  for (guint run = 0; run < NUM_RUNS; run++) {
+    gint64 start_time = g_get_monotonic_time ();
+    gsize num_decoded;
+
+    reference_rice_delta_decode (data->data, parameter, first_value, reference_items, num_items);
+    reference_ms[run] = (g_get_monotonic_time () - start_time) / 1000.0;
+
+    start_time = g_get_monotonic_time ();
+    num_decoded = ephy_gsb_utils_rice_delta_decode_into (data->data, data->len, parameter, first_value,
+                                                         items, num_items);
+    buffered_ms[run] = (g_get_monotonic_time () - start_time) / 1000.0;
+
+    g_assert_cmpuint (num_decoded, ==, num_items);
+    g_assert_cmpmem (items, num_items * sizeof (guint32), reference_items, num_items * sizeof (guint32));
+  }
+
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "entries");
+  json_builder_add_int_value (builder, num_items - 1);
+  json_builder_set_member_name (builder, "parameter");
+  json_builder_add_int_value (builder, parameter);
+  json_builder_set_member_name (builder, "encoded_bytes");
+  json_builder_add_int_value (builder, data->len);
+  json_builder_set_member_name (builder, "reference_ms");
+  json_builder_add_double_value (builder, median (reference_ms, NUM_RUNS));
+  json_builder_set_member_name (builder, "buffered_ms");
+  json_builder_add_double_value (builder, median (buffered_ms, NUM_RUNS));
+  json_builder_end_object (builder);
+}
+
+static void
+update_finished_cb (EphyGSBService *service,
+                    GMainLoop      *loop)
+{
+  g_main_loop_quit (loop);
+}
+
+/* Creates a service, which updates the lists of @storage at once, and
+ * returns it when the update is done. */
+static EphyGSBService *
+run_update (EphyGSBStorage    *storage,
+            EphyGSBTestServer *server,
+            double            *ms)
+{
+  g_autoptr (GMainLoop) loop = g_main_loop_new (NULL, FALSE);
+  EphyGSBService *service;
+  gint64 start_time;
+
+  ephy_gsb_storage_set_metadata (storage, "next_list_updates_time", 0);
+
+  start_time = g_get_monotonic_time ();
+  service = g_object_new (EPHY_TYPE_GSB_SERVICE,
+                          "api-key", "benchmark",
+                          "api-prefix", ephy_gsb_test_server_get_api_prefix (server),
+                          "gsb-storage", storage,
+                          NULL);
+  g_signal_connect (service, "update-finished", G_CALLBACK (update_finished_cb), loop);
+  g_main_loop_run (loop);
+  *ms = (g_get_monotonic_time () - start_time) / 1000.0;
+
+  g_signal_handlers_disconnect_by_func (service, update_finished_cb, loop);
+
+  return service;
+}
+
+typedef struct {
+  GMainLoop *loop;
+  GList *threats;
+} VerifyData;
+
+static void
+verify_url_cb (EphyGSBService *service,
+               GAsyncResult   *result,
+               VerifyData     *data)
+{
+  data->threats = ephy_gsb_service_verify_url_finish (service, result);
+  g_main_loop_quit (data->loop);
+}
+
+static char *
+make_listed_url (guint i)
+{
+  return g_strdup_printf ("http://malware-%u.test/download.html", i % NUM_LISTED_URLS);
+}
+
+static void
+remove_dir (const char *path)
+{
+  g_autoptr (GDir) dir = g_dir_open (path, 0, NULL);
+  const char *name;
+
+  while (dir && (name = g_dir_read_name (dir))) {
+    g_autofree char *file = g_build_filename (path, name, NULL);
+
+    g_unlink (file);
+  }
+
+  g_rmdir (path);
+}
+
+static gboolean
+run_service (JsonBuilder  *builder,
+             gsize         num_entries,
+             guint         num_updates,
+             guint         num_lookups,
+             GError      **error)
+{
+  g_autoptr (EphyGSBTestServer) server = NULL;
+  g_autoptr (EphyGSBStorage) storage = NULL;
+  g_autoptr (EphyGSBService) service = NULL;
+  g_autoptr (GMainLoop) loop = g_main_loop_new (NULL, FALSE);
+  g_autofree double *update_ms = g_new (double, MAX (num_updates, 1));
+  g_autofree double *lookup_ms = g_new (double, MAX (num_lookups, 1));
+  g_autofree char *tmp_dir = NULL;
+  g_autofree char *db_path = NULL;
+  GList *threat_lists;
+  gsize update_size = MAX (num_entries / 100, 1);
+  double full_update_ms;
+
+  server = ephy_gsb_test_server_new (error);
+  if (!server)
+    return FALSE;
+
+  tmp_dir = g_dir_make_tmp ("ephy-gsb-benchmark-XXXXXX", error);
+  if (!tmp_dir)
+    return FALSE;
+
+  db_path = g_build_filename (tmp_dir, "gsb-threats.db", NULL);
+  storage = ephy_gsb_storage_new (db_path);
+
+  /* Serve the lists that the storage asks for, with the listed URLs in the
+   * first one. */
+  threat_lists = ephy_gsb_storage_get_threat_lists (storage);
+  g_assert_nonnull (threat_lists);
+  for (guint i = 0; i < NUM_LISTED_URLS; i++) {
+    EphyGSBThreatList *list = threat_lists->data;
+    g_autofree char *url = make_listed_url (i);
+    GList *hashes = ephy_gsb_utils_compute_hashes (url);
+
+    ephy_gsb_test_server_add_threat (server, list->threat_type, list->platform_type,
+                                     list->threat_entry_type, hashes->data);
+    g_list_free_full (hashes, (GDestroyNotify)g_bytes_unref);
+  }
+  for (GList *l = threat_lists; l; l = l->next) {
+    EphyGSBThreatList *list = l->data;
+
+    ephy_gsb_test_server_add_list (server, list->threat_type, list->platform_type,
+                                   list->threat_entry_type, num_entries, num_updates, update_size);
+  }
+
+  service = run_update (storage, server, &full_update_ms);
+
+  for (guint i = 0; i < num_updates; i++) {
+    g_clear_object (&service);
+    service = run_update (storage, server, &update_ms[i]);
+  }
+
+  /* A checksum mismatch would have reset a list instead. */
+  g_list_free_full (threat_lists, (GDestroyNotify)ephy_gsb_threat_list_free);
+  threat_lists = ephy_gsb_storage_get_threat_lists (storage);
+  for (GList *l = threat_lists; l; l = l->next) {
+    EphyGSBThreatList *list = l->data;
+    g_autofree char *state = g_strdup_printf ("%u", num_updates);
+
+    g_assert_cmpstr (list->client_state, ==, state);
+  }
+  g_list_free_full (threat_lists, (GDestroyNotify)ephy_gsb_threat_list_free);
+
+  for (guint i = 0; i < num_lookups; i++) {
+    VerifyData data = { loop, NULL };
+    gboolean listed = i % LISTED_URL_INTERVAL == 0;
+    g_autofree char *url = NULL;
+    gint64 start_time;
+
+    if (listed)
+      url = make_listed_url (i / LISTED_URL_INTERVAL);
+    else
+      url = g_strdup_printf ("http://www.example-%u.test/page-%u.html", i % 997, i);
+
+    start_time = g_get_monotonic_time ();
+    ephy_gsb_service_verify_url (service, url, (GAsyncReadyCallback)verify_url_cb, &data);
+    g_main_loop_run (loop);
+    lookup_ms[i] = (g_get_monotonic_time () - start_time) / 1000.0;
+
+    g_assert_true (listed == (data.threats != NULL));
+    g_list_free_full (data.threats, g_free);
+  }
+
+  qsort (lookup_ms, num_lookups, sizeof (double), compare_doubles);
+
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "list_entries");
+  json_builder_add_int_value (builder, num_entries);
+  json_builder_set_member_name (builder, "update_size");
+  json_builder_add_int_value (builder, update_size);
+  json_builder_set_member_name (builder, "full_update_ms");
+  json_builder_add_double_value (builder, full_update_ms);
+  json_builder_set_member_name (builder, "updates");
+  json_builder_add_int_value (builder, num_updates);
+  if (num_updates > 0) {
+    json_builder_set_member_name (builder, "update_ms");
+    json_builder_add_double_value (builder, median (update_ms, num_updates));
+  }
+  json_builder_set_member_name (builder, "lookups");
+  json_builder_add_int_value (builder, num_lookups);
+  if (num_lookups > 0) {
+    json_builder_set_member_name (builder, "lookup_p50_ms");
+    json_builder_add_double_value (builder, lookup_ms[num_lookups / 2]);
+    json_builder_set_member_name (builder, "lookup_p99_ms");
+    json_builder_add_double_value (builder, lookup_ms[MIN (num_lookups * 99 / 100, num_lookups - 1)]);
+  }
+  json_builder_set_member_name (builder, "requests");
+  json_builder_add_int_value (builder, ephy_gsb_test_server_get_num_requests (server));
+  json_builder_end_object (builder);
+
+  g_clear_object (&service);
+  g_clear_object (&storage);
+  remove_dir (tmp_dir);
+
+  return TRUE;
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr (GOptionContext) context = NULL;
+  g_autoptr (JsonBuilder) builder = NULL;
+  g_autoptr (JsonGenerator) generator = NULL;
+  g_autoptr (JsonNode) root = NULL;
+  g_autoptr (GDateTime) date = NULL;
+  g_autofree char *date_string = NULL;
+  g_autofree char *json = NULL;
+  g_auto (GStrv) sizes = NULL;
+  g_autofree char *output = NULL;
+  g_autoptr (GError) error = NULL;
+  int list_entries = 100000;
+  int num_updates = 10;
+  int num_lookups = 1000;
+  const GOptionEntry entries[] = {
+    { "entries", 'n', 0, G_OPTION_ARG_STRING_ARRAY, &sizes, "Number of entries of a list, may be repeated", "N" },
+    { "list-entries", 0, 0, G_OPTION_ARG_INT, &list_entries, "Number of entries of each list served to the service", "N" },
+    { "updates", 0, 0, G_OPTION_ARG_INT, &num_updates, "Number of updates after the full update", "N" },
+    { "lookups", 0, 0, G_OPTION_ARG_INT, &num_lookups, "Number of URLs to verify", "N" },
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output, "Write the results to FILE instead of stdout", "FILE" },
+    { NULL }
+  };
+  const char * const default_sizes[] = { "10000", "500000", NULL };
+
+  context = g_option_context_new ("- benchmark Safe Browsing");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_printerr ("%s\n", error->message);
+    return 1;
+  }
+
+  if (list_entries < 1 || num_updates < 0 || num_lookups < 0) {
+    g_printerr ("Invalid number of list entries, updates or lookups\n");
+    return 1;
+  }
+
+  ephy_debug_init ();
+
+  date = g_date_time_new_now_utc ();
+  date_string = g_date_time_format_iso8601 (date);
+
+  builder = json_builder_new ();
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "benchmark");
+  json_builder_add_string_value (builder, "gsb");
+  json_builder_set_member_name (builder, "version");
+  json_builder_add_string_value (builder, VERSION);
+  json_builder_set_member_name (builder, "date");
+  json_builder_add_string_value (builder, date_string);
+  json_builder_set_member_name (builder, "rice_decode");
+  json_builder_begin_array (builder);
+
+  for (const char * const *size = sizes ? (const char * const *)sizes : default_sizes; *size; size++) {
+    guint64 num_entries;
+
+    if (!g_ascii_string_to_unsigned (*size, 10, 1, G_MAXUINT32 - 1, &num_entries, &error)) {
+      g_printerr ("Invalid number of entries: %s\n", error->message);
+      return 1;
+    }
+
+    run_rice (builder, num_entries + 1);
+  }
+
+  json_builder_end_array (builder);
+
+  json_builder_set_member_name (builder, "service");
+  if (!run_service (builder, list_entries, num_updates, num_lookups, &error)) {
+    g_printerr ("Could not run the service benchmark: %s\n", error->message);
+    return 1;
+  }
+
+  json_builder_end_object (builder);
+
+  root = json_builder_get_root (builder);
+  generator = json_generator_new ();
+  json_generator_set_pretty (generator, TRUE);
+  json_generator_set_root (generator, root);
+  json = json_generator_to_data (generator, NULL);
+
+  if (!output) {
+    g_print ("%s\n", json);
+  } else if (!g_file_set_contents (output, json, -1, &error)) {
+    g_printerr ("Could not write %s: %s\n", output, error->message);
+    return 1;
+  }
+
+  return 0;
+}
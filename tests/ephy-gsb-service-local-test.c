@@ -0,0 +1,403 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2021 Epiphany Developers
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Tests EphyGSBService against the local stand-in server, so that they run
+ * without network access or an API key. The server only answers while the
+ * main loop runs, which is what makes the verifications below concurrent:
+ * all of them are issued before the first fullHashes:find request can
+ * complete.
+ */
+
+#include "config.h"
+#include "ephy-debug.h"
+#include "ephy-gsb-service.h"
+#include "ephy-gsb-storage.h"
+#include "ephy-gsb-test-server.h"
+#include "ephy-gsb-utils.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+/* In the first list, with its full hash. */
+#define LISTED_URL "http://malware.test/download.html"
+
+/* In the first list, but only its hash prefix: the server knows no full hash
+ * that matches it. It is also an expression of LISTED_URL. */
+#define PREFIX_ONLY_URL "http://malware.test/"
+
+#define SAFE_URL "http://www.example.test/index.html"
+
+#define INVALID_URL "http://[invalid/"
+
+typedef struct {
+  GMainLoop *loop;
+  EphyGSBTestServer *server;
+  EphyGSBStorage *storage;
+  EphyGSBService *service;
+  char *tmp_dir;
+  char *threat_type;
+  guint num_pending;
+} Fixture;
+
+typedef struct {
+  Fixture *fixture;
+  GList *threats;
+} VerifyData;
+
+typedef struct {
+  Fixture *fixture;
+  GPtrArray *threats;
+} VerifyURLsData;
+
+static GBytes *
+compute_hash (const char *url)
+{
+  GList *hashes = ephy_gsb_utils_compute_hashes (url);
+  GBytes *hash = g_bytes_ref (hashes->data);
+
+  g_list_free_full (hashes, (GDestroyNotify)g_bytes_unref);
+
+  return hash;
+}
+
+/* A full hash with the same prefix as that of @url, but which doesn't match it. */
+static GBytes *
+compute_other_hash (const char *url)
+{
+  gsize length;
+  guint8 *data = g_bytes_unref_to_data (compute_hash (url), &length);
+
+  data[length - 1] ^= 0xff;
+
+  return g_bytes_new_take (data, length);
+}
+
+static void
+remove_dir (const char *path)
+{
+  g_autoptr (GDir) dir = g_dir_open (path, 0, NULL);
+  const char *name;
+
+  while (dir && (name = g_dir_read_name (dir))) {
+    g_autofree char *file = g_build_filename (path, name, NULL);
+
+    g_unlink (file);
+  }
+
+  g_rmdir (path);
+}
+
+static void
+fixture_setup (Fixture       *fixture,
+               gconstpointer  data)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GBytes) listed_hash = NULL;
+  g_autoptr (GBytes) other_hash = NULL;
+  g_autofree char *db_path = NULL;
+  EphyGSBThreatList *first_list;
+  GList *threat_lists;
+
+  fixture->loop = g_main_loop_new (NULL, FALSE);
+
+  fixture->server = ephy_gsb_test_server_new (&error);
+  g_assert_no_error (error);
+
+  fixture->tmp_dir = g_dir_make_tmp ("ephy-gsb-service-test-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  db_path = g_build_filename (fixture->tmp_dir, "gsb-threats.db", NULL);
+  fixture->storage = ephy_gsb_storage_new (db_path);
+  ephy_gsb_storage_set_metadata (fixture->storage, "next_list_updates_time", 0);
+
+  /* Serve the lists that the storage asks for, with the test URLs in the
+   * first one. */
+  threat_lists = ephy_gsb_storage_get_threat_lists (fixture->storage);
+  g_assert_nonnull (threat_lists);
+
+  first_list = threat_lists->data;
+  fixture->threat_type = g_strdup (first_list->threat_type);
+
+  listed_hash = compute_hash (LISTED_URL);
+  ephy_gsb_test_server_add_threat (fixture->server, first_list->threat_type, first_list->platform_type,
+                                   first_list->threat_entry_type, listed_hash);
+  other_hash = compute_other_hash (PREFIX_ONLY_URL);
+  ephy_gsb_test_server_add_threat (fixture->server, first_list->threat_type, first_list->platform_type,
+                                   first_list->threat_entry_type, other_hash);
+
+  for (GList *l = threat_lists; l; l = l->next) {
+    EphyGSBThreatList *list = l->data;
+
+    ephy_gsb_test_server_add_list (fixture->server, list->threat_type, list->platform_type,
+                                   list->threat_entry_type, 100, 0, 1);
+  }
+
+  g_list_free_full (threat_lists, (GDestroyNotify)ephy_gsb_threat_list_free);
+}
+
+static void
+fixture_teardown (Fixture       *fixture,
+                  gconstpointer  data)
+{
+  g_clear_object (&fixture->service);
+  g_clear_object (&fixture->storage);
+  g_clear_pointer (&fixture->server, ephy_gsb_test_server_free);
+
+  remove_dir (fixture->tmp_dir);
+  g_free (fixture->tmp_dir);
+  g_free (fixture->threat_type);
+
+  g_main_loop_unref (fixture->loop);
+}
+
+static void
+update_finished_cb (EphyGSBService *service,
+                    Fixture        *fixture)
+{
+  g_main_loop_quit (fixture->loop);
+}
+
+/* Creates the service, which updates the lists at once. */
+static void
+fixture_start_service (Fixture *fixture)
+{
+  fixture->service = g_object_new (EPHY_TYPE_GSB_SERVICE,
+                                   "api-key", "test",
+                                   "api-prefix", ephy_gsb_test_server_get_api_prefix (fixture->server),
+                                   "gsb-storage", fixture->storage,
+                                   NULL);
+  g_signal_connect (fixture->service, "update-finished", G_CALLBACK (update_finished_cb), fixture);
+}
+
+static void
+verify_url_cb (EphyGSBService *service,
+               GAsyncResult   *result,
+               VerifyData     *data)
+{
+  data->threats = ephy_gsb_service_verify_url_finish (service, result);
+
+  if (--data->fixture->num_pending == 0)
+    g_main_loop_quit (data->fixture->loop);
+}
+
+static void
+verify_url (Fixture    *fixture,
+            const char *url,
+            VerifyData *data)
+{
+  data->fixture = fixture;
+  data->threats = NULL;
+  fixture->num_pending++;
+
+  ephy_gsb_service_verify_url (fixture->service, url, (GAsyncReadyCallback)verify_url_cb, data);
+}
+
+static void
+verify_urls_cb (EphyGSBService *service,
+                GAsyncResult   *result,
+                VerifyURLsData *data)
+{
+  data->threats = ephy_gsb_service_verify_urls_finish (service, result);
+
+  if (--data->fixture->num_pending == 0)
+    g_main_loop_quit (data->fixture->loop);
+}
+
+static void
+assert_threats (Fixture *fixture,
+                GList   *threats,
+                gboolean listed)
+{
+  if (listed) {
+    g_assert_cmpuint (g_list_length (threats), ==, 1);
+    g_assert_cmpstr (threats->data, ==, fixture->threat_type);
+  } else {
+    g_assert_null (threats);
+  }
+
+  g_list_free_full (threats, g_free);
+}
+
+static void
+test_ephy_gsb_service_full_hashes_dedup (Fixture       *fixture,
+                                         gconstpointer  data)
+{
+  VerifyData first;
+  VerifyData second;
+
+  fixture_start_service (fixture);
+  g_main_loop_run (fixture->loop);
+  g_assert_cmpuint (ephy_gsb_test_server_get_num_full_hashes_requests (fixture->server), ==, 0);
+
+  /* The second verification finds the prefix pending and waits for the
+   * request of the first one. */
+  verify_url (fixture, LISTED_URL, &first);
+  verify_url (fixture, LISTED_URL, &second);
+  g_main_loop_run (fixture->loop);
+
+  g_assert_cmpuint (ephy_gsb_test_server_get_num_full_hashes_requests (fixture->server), ==, 1);
+  assert_threats (fixture, first.threats, TRUE);
+  assert_threats (fixture, second.threats, TRUE);
+}
+
+static void
+test_ephy_gsb_service_resume_waiting (Fixture       *fixture,
+                                      gconstpointer  data)
+{
+  VerifyData prefix_only;
+  VerifyData listed;
+  VerifyData safe;
+
+  fixture_start_service (fixture);
+  g_main_loop_run (fixture->loop);
+
+  /* LISTED_URL matches the prefix of PREFIX_ONLY_URL, which is pending, and
+   * its own, which it asks for. It resumes once both responses are in. The
+   * safe URL needs no response at all. */
+  verify_url (fixture, PREFIX_ONLY_URL, &prefix_only);
+  verify_url (fixture, LISTED_URL, &listed);
+  verify_url (fixture, SAFE_URL, &safe);
+  g_main_loop_run (fixture->loop);
+
+  g_assert_cmpuint (ephy_gsb_test_server_get_num_full_hashes_requests (fixture->server), ==, 2);
+  assert_threats (fixture, prefix_only.threats, FALSE);
+  assert_threats (fixture, listed.threats, TRUE);
+  assert_threats (fixture, safe.threats, FALSE);
+}
+
+static void
+test_ephy_gsb_service_cache (Fixture       *fixture,
+                             gconstpointer  data)
+{
+  VerifyData prefix_only;
+  VerifyData listed;
+
+  fixture_start_service (fixture);
+  g_main_loop_run (fixture->loop);
+
+  /* In this order, since the response for LISTED_URL has the one for
+   * PREFIX_ONLY_URL too. */
+  verify_url (fixture, PREFIX_ONLY_URL, &prefix_only);
+  g_main_loop_run (fixture->loop);
+  assert_threats (fixture, prefix_only.threats, FALSE);
+
+  verify_url (fixture, LISTED_URL, &listed);
+  g_main_loop_run (fixture->loop);
+  assert_threats (fixture, listed.threats, TRUE);
+
+  g_assert_cmpuint (ephy_gsb_test_server_get_num_full_hashes_requests (fixture->server), ==, 2);
+
+  /* The positive and the negative responses are cached for CACHE_DURATION. */
+  verify_url (fixture, PREFIX_ONLY_URL, &prefix_only);
+  verify_url (fixture, LISTED_URL, &listed);
+  g_main_loop_run (fixture->loop);
+
+  g_assert_cmpuint (ephy_gsb_test_server_get_num_full_hashes_requests (fixture->server), ==, 2);
+  assert_threats (fixture, prefix_only.threats, FALSE);
+  assert_threats (fixture, listed.threats, TRUE);
+}
+
+static void
+test_ephy_gsb_service_verify_during_update (Fixture       *fixture,
+                                            gconstpointer  data)
+{
+  VerifyData listed;
+
+  /* Keep the service in the middle of its first update, after the lists
+   * were written but before it is done. */
+  ephy_gsb_test_server_hold_list_updates (fixture->server);
+  fixture_start_service (fixture);
+  while (ephy_gsb_test_server_get_num_requests (fixture->server) == 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* The lists were empty before the update. */
+  verify_url (fixture, LISTED_URL, &listed);
+  g_main_loop_run (fixture->loop);
+  assert_threats (fixture, listed.threats, FALSE);
+  g_assert_cmpuint (ephy_gsb_test_server_get_num_full_hashes_requests (fixture->server), ==, 0);
+
+  ephy_gsb_test_server_release_list_updates (fixture->server);
+  g_main_loop_run (fixture->loop);
+
+  verify_url (fixture, LISTED_URL, &listed);
+  g_main_loop_run (fixture->loop);
+  assert_threats (fixture, listed.threats, TRUE);
+}
+
+static void
+test_ephy_gsb_service_verify_urls (Fixture       *fixture,
+                                   gconstpointer  data)
+{
+  const char * const urls[] = { SAFE_URL, LISTED_URL, INVALID_URL, PREFIX_ONLY_URL, NULL };
+  const gboolean listed[] = { FALSE, TRUE, FALSE, FALSE };
+  VerifyURLsData verify_data = { fixture, NULL };
+
+  fixture_start_service (fixture);
+  g_main_loop_run (fixture->loop);
+
+  fixture->num_pending++;
+  ephy_gsb_service_verify_urls (fixture->service, urls, (GAsyncReadyCallback)verify_urls_cb, &verify_data);
+  g_main_loop_run (fixture->loop);
+
+  /* The server is asked once for all of the URLs. */
+  g_assert_cmpuint (ephy_gsb_test_server_get_num_full_hashes_requests (fixture->server), ==, 1);
+
+  g_assert_nonnull (verify_data.threats);
+  g_assert_cmpuint (verify_data.threats->len, ==, G_N_ELEMENTS (listed));
+  for (guint i = 0; i < verify_data.threats->len; i++) {
+    GList *threats = g_ptr_array_index (verify_data.threats, i);
+
+    if (listed[i]) {
+      g_assert_cmpuint (g_list_length (threats), ==, 1);
+      g_assert_cmpstr (threats->data, ==, fixture->threat_type);
+    } else {
+      g_assert_null (threats);
+    }
+  }
+
+  g_ptr_array_unref (verify_data.threats);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  ephy_debug_init ();
+
+  g_test_add ("/lib/safe-browsing/service/full-hashes-dedup",
+              Fixture, NULL, fixture_setup,
+              test_ephy_gsb_service_full_hashes_dedup, fixture_teardown);
+  g_test_add ("/lib/safe-browsing/service/resume-waiting",
+              Fixture, NULL, fixture_setup,
+              test_ephy_gsb_service_resume_waiting, fixture_teardown);
+  g_test_add ("/lib/safe-browsing/service/cache",
+              Fixture, NULL, fixture_setup,
+              test_ephy_gsb_service_cache, fixture_teardown);
+  g_test_add ("/lib/safe-browsing/service/verify-during-update",
+              Fixture, NULL, fixture_setup,
+              test_ephy_gsb_service_verify_during_update, fixture_teardown);
+  g_test_add ("/lib/safe-browsing/service/verify-urls",
+              Fixture, NULL, fixture_setup,
+              test_ephy_gsb_service_verify_urls, fixture_teardown);
+
+  return g_test_run ();
+}
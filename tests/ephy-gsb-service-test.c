@@ -175,6 +175,28 @@ test_ephy_gsb_utils_compute_hashes (void)
   }
 }
 
+static void
+test_ephy_gsb_utils_compute_url_hashes (void)
+{
+  EphyGSBUrlHashes hashes;
+
+  for (guint i = 0; i < G_N_ELEMENTS (compute_hashes_tests); i++) {
+    ComputeHashesTest test = compute_hashes_tests[i];
+
+    g_assert_true (ephy_gsb_utils_compute_url_hashes (test.url, &hashes));
+    g_assert_cmpuint (hashes.num_hashes, ==, test.num_hashes);
+
+    for (guint k = 0; k < test.num_hashes; k++) {
+      char *hash_hex = bytes_to_hex (hashes.hashes[k], sizeof (hashes.hashes[k]));
+      g_assert_cmpstr (hash_hex, ==, test.hashes_hex[k]);
+      g_free (hash_hex);
+    }
+  }
+
+  g_assert_false (ephy_gsb_utils_compute_url_hashes ("data:text/plain,safe", &hashes));
+  g_assert_cmpuint (hashes.num_hashes, ==, 0);
+}
+
 typedef struct {
   const char *url;
   gboolean is_threat;
@@ -275,6 +297,8 @@ main (int   argc,
                    test_ephy_gsb_utils_canonicalize);
   g_test_add_func ("/lib/safe-browsing/test_ephy_gsb_utils_compute_hashes",
                    test_ephy_gsb_utils_compute_hashes);
+  g_test_add_func ("/lib/safe-browsing/test_ephy_gsb_utils_compute_url_hashes",
+                   test_ephy_gsb_utils_compute_url_hashes);
   g_test_add_func ("/lib/safe-browsing/test_ephy_gsb_service_verify_url",
                    test_ephy_gsb_service_verify_url);
 
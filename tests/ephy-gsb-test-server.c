@@ -0,0 +1,755 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2021 Epiphany Developers
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A local stand-in for the Safe Browsing API v4, so that updates and lookups
+ * can be measured without network access or an API key. It serves
+ * threatListUpdates:fetch and fullHashes:find at the API prefix returned by
+ * ephy_gsb_test_server_get_api_prefix(), on the thread-default main context
+ * of the thread that created it.
+ *
+ * Each list is a number of random 4-byte hash prefixes followed by a number
+ * of updates, all generated from a fixed seed, so that every run sees the
+ * same responses. Clients without a state get the first generation of the
+ * list as a FULL_UPDATE, Rice-encoded like the real server does. Clients at
+ * generation N get the PARTIAL_UPDATE to generation N + 1, which removes and
+ * adds update_size prefixes, and clients at the last generation get an empty
+ * update. fullHashes:find answers with the full hashes registered with
+ * ephy_gsb_test_server_add_threat(), whose prefixes are in the lists too.
+ *
+ * Responses to threatListUpdates:fetch can be held after the list updates,
+ * so that tests can do things while the client is in the middle of an update.
+ */
+
+#include "config.h"
+#include "ephy-gsb-test-server.h"
+
+#include "ephy-gsb-prefix-set.h"
+#include "ephy-gsb-utils.h"
+
+#include <json-glib/json-glib.h>
+#include <libsoup/soup.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define API_PATH "/v4"
+
+#define MINIMUM_WAIT_DURATION "1800s"
+#define CACHE_DURATION        "300s"
+
+/* What follows the list updates in a threatListUpdates:fetch response. */
+#define LIST_UPDATES_TAIL "],\"minimumWaitDuration\":\"" MINIMUM_WAIT_DURATION "\"}"
+
+typedef struct {
+  char *threat_type;
+  char *platform_type;
+  char *threat_entry_type;
+  GBytes *hash;
+} TestThreat;
+
+typedef struct {
+  char *threat_type;
+  char *platform_type;
+  char *threat_entry_type;
+
+  /* The ListUpdateResponses: the FULL_UPDATE to the first generation, the
+   * update from each generation to the next, then the empty update of the
+   * last generation. Clients at generation N get the one at N + 1. */
+  GPtrArray *responses;
+} TestList;
+
+struct _EphyGSBTestServer {
+  SoupServer *server;
+  char *api_prefix;
+  GPtrArray *threats;
+  GPtrArray *lists;
+  guint num_requests;
+  guint num_full_hashes_requests;
+
+  gboolean hold_list_updates;
+  GPtrArray *held_messages;
+};
+
+static void
+test_threat_free (TestThreat *threat)
+{
+  g_free (threat->threat_type);
+  g_free (threat->platform_type);
+  g_free (threat->threat_entry_type);
+  g_bytes_unref (threat->hash);
+  g_free (threat);
+}
+
+static void
+test_list_free (TestList *list)
+{
+  g_free (list->threat_type);
+  g_free (list->platform_type);
+  g_free (list->threat_entry_type);
+  g_ptr_array_unref (list->responses);
+  g_free (list);
+}
+
+static int
+compare_uints (gconstpointer a,
+               gconstpointer b)
+{
+  guint32 x = *(const guint32 *)a;
+  guint32 y = *(const guint32 *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void
+sort_unique (GArray *values)
+{
+  guint len = 0;
+
+  g_array_sort (values, compare_uints);
+
+  for (guint i = 0; i < values->len; i++) {
+    if (len == 0 || g_array_index (values, guint32, i) != g_array_index (values, guint32, len - 1))
+      g_array_index (values, guint32, len++) = g_array_index (values, guint32, i);
+  }
+
+  g_array_set_size (values, len);
+}
+
+static gboolean
+sorted_contains (GArray  *values,
+                 guint32  value)
+{
+  return bsearch (&value, values->data, values->len, sizeof (guint32), compare_uints) != NULL;
+}
+
+static void
+write_bits (GByteArray *array,
+            gsize      *num_bits,
+            guint32     value,
+            guint       count)
+{
+  for (guint i = 0; i < count; i++) {
+    if (*num_bits % 8 == 0)
+      g_byte_array_append (array, (const guint8 *)"\0", 1);
+    if (value & (1u << i))
+      array->data[*num_bits / 8] |= 1 << (*num_bits % 8);
+    (*num_bits)++;
+  }
+}
+
+/* Appends @values, which are sorted, as a RiceDeltaEncoding member. */
+static void
+append_rice (GString       *json,
+             const char    *member,
+             const guint32 *values,
+             gsize          num_values)
+{
+  g_autoptr (GByteArray) data = g_byte_array_new ();
+  g_autofree char *encoded = NULL;
+  guint32 mean_delta;
+  guint parameter;
+  gsize num_bits = 0;
+
+  g_assert (num_values > 0);
+
+  mean_delta = num_values > 1 ? (values[num_values - 1] - values[0]) / (num_values - 1) : 0;
+  parameter = mean_delta > 0 ? CLAMP (g_bit_storage (mean_delta) - 1, 2, 28) : 2;
+
+  for (gsize i = 1; i < num_values; i++) {
+    guint32 delta = values[i] - values[i - 1];
+
+    for (guint32 q = delta >> parameter; q > 0; q--)
+      write_bits (data, &num_bits, 1, 1);
+    write_bits (data, &num_bits, 0, 1);
+    write_bits (data, &num_bits, delta & ((1u << parameter) - 1), parameter);
+  }
+
+  encoded = g_base64_encode (data->data, data->len);
+  g_string_append_printf (json,
+                          "\"%s\":{\"firstValue\":\"%u\",\"riceParameter\":%u,"
+                          "\"numEntries\":%" G_GSIZE_FORMAT ",\"encodedData\":\"%s\"}",
+                          member, values[0], parameter, num_values - 1, encoded);
+}
+
+/* Lists are kept as the big-endian values of their prefixes, so that they
+ * sort like the prefixes. */
+static char *
+compute_checksum (GArray *keys)
+{
+  GChecksum *checksum;
+  guint8 digest[64];
+  gsize digest_len = sizeof (digest);
+
+  checksum = g_checksum_new (GSB_HASH_TYPE);
+  for (guint i = 0; i < keys->len; i++) {
+    guint32 prefix = GUINT32_TO_BE (g_array_index (keys, guint32, i));
+
+    g_checksum_update (checksum, (const guint8 *)&prefix, sizeof (prefix));
+  }
+
+  g_checksum_get_digest (checksum, digest, &digest_len);
+  g_checksum_free (checksum);
+
+  return g_base64_encode (digest, digest_len);
+}
+
+static char *
+make_list_update_response (TestList   *list,
+                           const char *response_type,
+                           GArray     *additions,
+                           GArray     *removals,
+                           guint       generation,
+                           GArray     *keys)
+{
+  GString *json = g_string_new (NULL);
+  g_autofree char *checksum = compute_checksum (keys);
+
+  g_string_append_printf (json,
+                          "{\"threatType\":\"%s\",\"platformType\":\"%s\","
+                          "\"threatEntryType\":\"%s\",\"responseType\":\"%s\",",
+                          list->threat_type, list->platform_type,
+                          list->threat_entry_type, response_type);
+
+  if (additions && additions->len > 0) {
+    g_autoptr (GArray) values = g_array_sized_new (FALSE, FALSE, sizeof (guint32), additions->len);
+
+    /* Rice-encoded hash prefixes are little-endian integers. */
+    for (guint i = 0; i < additions->len; i++) {
+      guint32 value = GUINT32_SWAP_LE_BE (g_array_index (additions, guint32, i));
+
+      g_array_append_val (values, value);
+    }
+    g_array_sort (values, compare_uints);
+
+    g_string_append (json, "\"additions\":[{\"compressionType\":\"RICE\",");
+    append_rice (json, "riceHashes", (guint32 *)values->data, values->len);
+    g_string_append (json, "}],");
+  }
+
+  if (removals && removals->len > 0) {
+    g_string_append (json, "\"removals\":[{\"compressionType\":\"RICE\",");
+    append_rice (json, "riceIndices", (guint32 *)removals->data, removals->len);
+    g_string_append (json, "}],");
+  }
+
+  g_string_append_printf (json,
+                          "\"newClientState\":\"%u\",\"checksum\":{\"sha256\":\"%s\"}}",
+                          generation, checksum);
+
+  return g_string_free (json, FALSE);
+}
+
+static gboolean
+threat_matches_list (TestThreat *threat,
+                     const char *threat_type,
+                     const char *platform_type,
+                     const char *threat_entry_type)
+{
+  return !g_strcmp0 (threat->threat_type, threat_type) &&
+         !g_strcmp0 (threat->platform_type, platform_type) &&
+         !g_strcmp0 (threat->threat_entry_type, threat_entry_type);
+}
+
+static TestList *
+find_list (EphyGSBTestServer *self,
+           const char        *threat_type,
+           const char        *platform_type,
+           const char        *threat_entry_type)
+{
+  for (guint i = 0; i < self->lists->len; i++) {
+    TestList *list = g_ptr_array_index (self->lists, i);
+
+    if (!g_strcmp0 (list->threat_type, threat_type) &&
+        !g_strcmp0 (list->platform_type, platform_type) &&
+        !g_strcmp0 (list->threat_entry_type, threat_entry_type))
+      return list;
+  }
+
+  return NULL;
+}
+
+static void
+append_list_updates (EphyGSBTestServer *self,
+                     JsonObject        *body,
+                     GString           *response)
+{
+  JsonArray *requests;
+  gboolean first = TRUE;
+
+  g_string_append (response, "{\"listUpdateResponses\":[");
+
+  requests = json_object_has_member (body, "listUpdateRequests") ?
+             json_object_get_array_member (body, "listUpdateRequests") : NULL;
+  for (guint i = 0; requests && i < json_array_get_length (requests); i++) {
+    JsonObject *request = json_array_get_object_element (requests, i);
+    const char *state = json_object_get_string_member_with_default (request, "state", NULL);
+    TestList *list;
+    guint64 generation;
+    guint index = 0;
+
+    list = find_list (self,
+                      json_object_get_string_member_with_default (request, "threatType", NULL),
+                      json_object_get_string_member_with_default (request, "platformType", NULL),
+                      json_object_get_string_member_with_default (request, "threatEntryType", NULL));
+    if (!list)
+      continue;
+
+    /* Unknown states get a full update, like expired ones do. */
+    if (state && g_ascii_string_to_unsigned (state, 10, 0, list->responses->len - 2, &generation, NULL))
+      index = generation + 1;
+
+    if (!first)
+      g_string_append_c (response, ',');
+    g_string_append (response, g_ptr_array_index (list->responses, index));
+    first = FALSE;
+  }
+}
+
+static void
+append_full_hashes (EphyGSBTestServer *self,
+                    JsonObject        *body,
+                    GString           *response)
+{
+  JsonObject *threat_info;
+  JsonArray *entries = NULL;
+  gboolean first = TRUE;
+
+  g_string_append (response, "{\"matches\":[");
+
+  threat_info = json_object_has_member (body, "threatInfo") ?
+                json_object_get_object_member (body, "threatInfo") : NULL;
+  if (threat_info && json_object_has_member (threat_info, "threatEntries"))
+    entries = json_object_get_array_member (threat_info, "threatEntries");
+
+  for (guint i = 0; entries && i < json_array_get_length (entries); i++) {
+    JsonObject *entry = json_array_get_object_element (entries, i);
+    const char *prefix_b64 = json_object_get_string_member_with_default (entry, "hash", "");
+    g_autofree guint8 *prefix = NULL;
+    gsize prefix_len;
+
+    prefix = g_base64_decode (prefix_b64, &prefix_len);
+
+    for (guint j = 0; j < self->threats->len; j++) {
+      TestThreat *threat = g_ptr_array_index (self->threats, j);
+      g_autofree char *hash_b64 = NULL;
+      gsize hash_len;
+      const guint8 *hash = g_bytes_get_data (threat->hash, &hash_len);
+
+      if (prefix_len == 0 || prefix_len > hash_len || memcmp (hash, prefix, prefix_len) != 0)
+        continue;
+
+      hash_b64 = g_base64_encode (hash, hash_len);
+      g_string_append_printf (response,
+                              "%s{\"threatType\":\"%s\",\"platformType\":\"%s\","
+                              "\"threatEntryType\":\"%s\",\"threat\":{\"hash\":\"%s\"},"
+                              "\"cacheDuration\":\"" CACHE_DURATION "\"}",
+                              first ? "" : ",",
+                              threat->threat_type, threat->platform_type,
+                              threat->threat_entry_type, hash_b64);
+      first = FALSE;
+    }
+  }
+
+  g_string_append (response,
+                   "],\"minimumWaitDuration\":\"0s\","
+                   "\"negativeCacheDuration\":\"" CACHE_DURATION "\"}");
+}
+
+#if SOUP_CHECK_VERSION (2, 99, 4)
+static void
+server_callback (SoupServer        *server,
+                 SoupServerMessage *msg,
+                 const char        *path,
+                 GHashTable        *query,
+                 gpointer           user_data)
+#else
+static void
+server_callback (SoupServer        *server,
+                 SoupMessage       *msg,
+                 const char        *path,
+                 GHashTable        *query,
+                 SoupClientContext *context,
+                 gpointer           user_data)
+#endif
+{
+  EphyGSBTestServer *self = user_data;
+  g_autoptr (JsonParser) parser = json_parser_new ();
+  SoupMessageHeaders *response_headers;
+  SoupMessageBody *request_body;
+  SoupMessageBody *response_body;
+  JsonObject *body = NULL;
+  GString *response = NULL;
+  guint status = SOUP_STATUS_OK;
+  gboolean held = FALSE;
+
+#if SOUP_CHECK_VERSION (2, 99, 4)
+  request_body = soup_server_message_get_request_body (msg);
+  response_headers = soup_server_message_get_response_headers (msg);
+  response_body = soup_server_message_get_response_body (msg);
+#else
+  request_body = msg->request_body;
+  response_headers = msg->response_headers;
+  response_body = msg->response_body;
+#endif
+
+  self->num_requests++;
+
+  if (json_parser_load_from_data (parser, request_body->data, request_body->length, NULL) &&
+      JSON_NODE_HOLDS_OBJECT (json_parser_get_root (parser)))
+    body = json_node_get_object (json_parser_get_root (parser));
+
+  if (!body) {
+    status = SOUP_STATUS_BAD_REQUEST;
+  } else if (!strcmp (path, API_PATH "/threatListUpdates:fetch")) {
+    response = g_string_new (NULL);
+    append_list_updates (self, body, response);
+    if (self->hold_list_updates) {
+      /* Send the list updates, but not the end of the response, which
+       * ephy_gsb_test_server_release_list_updates() appends. */
+      soup_message_headers_set_encoding (response_headers, SOUP_ENCODING_CHUNKED);
+      g_ptr_array_add (self->held_messages, g_object_ref (msg));
+      held = TRUE;
+    } else {
+      g_string_append (response, LIST_UPDATES_TAIL);
+    }
+  } else if (!strcmp (path, API_PATH "/fullHashes:find")) {
+    self->num_full_hashes_requests++;
+    response = g_string_new (NULL);
+    append_full_hashes (self, body, response);
+  } else {
+    status = SOUP_STATUS_NOT_FOUND;
+  }
+
+#if SOUP_CHECK_VERSION (2, 99, 4)
+  soup_server_message_set_status (msg, status, NULL);
+#else
+  soup_message_set_status (msg, status);
+#endif
+
+  if (response) {
+    gsize length = response->len;
+
+    soup_message_headers_set_content_type (response_headers, "application/json", NULL);
+    soup_message_body_append (response_body, SOUP_MEMORY_TAKE,
+                              g_string_free (response, FALSE), length);
+  }
+
+  if (!held)
+    soup_message_body_complete (response_body);
+}
+
+/**
+ * ephy_gsb_test_server_new:
+ * @error: return location for a #GError, or %NULL
+ *
+ * Start a stand-in Safe Browsing server on a free port of the loopback
+ * interface. It has no lists until ephy_gsb_test_server_add_list() is called.
+ *
+ * Return value: (transfer full): a new server, or %NULL on error
+ **/
+EphyGSBTestServer *
+ephy_gsb_test_server_new (GError **error)
+{
+  EphyGSBTestServer *self;
+  GSList *uris;
+
+  self = g_new0 (EphyGSBTestServer, 1);
+  self->threats = g_ptr_array_new_with_free_func ((GDestroyNotify)test_threat_free);
+  self->lists = g_ptr_array_new_with_free_func ((GDestroyNotify)test_list_free);
+  self->held_messages = g_ptr_array_new_with_free_func (g_object_unref);
+
+  self->server = soup_server_new ("server-header", "ephy-gsb-test-server", NULL);
+  soup_server_add_handler (self->server, API_PATH, server_callback, self, NULL);
+  if (!soup_server_listen_local (self->server, 0, SOUP_SERVER_LISTEN_IPV4_ONLY, error)) {
+    ephy_gsb_test_server_free (self);
+    return NULL;
+  }
+
+  uris = soup_server_get_uris (self->server);
+  g_assert (uris);
+#if SOUP_CHECK_VERSION (2, 99, 4)
+  self->api_prefix = g_strdup_printf ("http://127.0.0.1:%d" API_PATH "/", g_uri_get_port (uris->data));
+  g_slist_free_full (uris, (GDestroyNotify)g_uri_unref);
+#else
+  self->api_prefix = g_strdup_printf ("http://127.0.0.1:%u" API_PATH "/", soup_uri_get_port (uris->data));
+  g_slist_free_full (uris, (GDestroyNotify)soup_uri_free);
+#endif
+
+  return self;
+}
+
+void
+ephy_gsb_test_server_free (EphyGSBTestServer *self)
+{
+  g_assert (self);
+
+  ephy_gsb_test_server_release_list_updates (self);
+  soup_server_disconnect (self->server);
+  g_object_unref (self->server);
+  g_free (self->api_prefix);
+  g_ptr_array_unref (self->threats);
+  g_ptr_array_unref (self->lists);
+  g_ptr_array_unref (self->held_messages);
+  g_free (self);
+}
+
+/**
+ * ephy_gsb_test_server_get_api_prefix:
+ * @self: an #EphyGSBTestServer
+ *
+ * Return value: the value to use as #EphyGSBService:api-prefix
+ **/
+const char *
+ephy_gsb_test_server_get_api_prefix (EphyGSBTestServer *self)
+{
+  g_assert (self);
+
+  return self->api_prefix;
+}
+
+/**
+ * ephy_gsb_test_server_add_threat:
+ * @self: an #EphyGSBTestServer
+ * @threat_type: the threat type of the list
+ * @platform_type: the platform type of the list
+ * @threat_entry_type: the threat entry type of the list
+ * @hash: a full hash, as returned by ephy_gsb_utils_compute_hashes()
+ *
+ * Make @hash a match of fullHashes:find requests for its prefix. Call this
+ * before adding the list, so that the prefix of @hash is in the list, where
+ * no update removes it.
+ **/
+void
+ephy_gsb_test_server_add_threat (EphyGSBTestServer *self,
+                                 const char        *threat_type,
+                                 const char        *platform_type,
+                                 const char        *threat_entry_type,
+                                 GBytes            *hash)
+{
+  TestThreat *threat;
+
+  g_assert (self);
+  g_assert (hash);
+  g_assert (!find_list (self, threat_type, platform_type, threat_entry_type));
+
+  threat = g_new0 (TestThreat, 1);
+  threat->threat_type = g_strdup (threat_type);
+  threat->platform_type = g_strdup (platform_type);
+  threat->threat_entry_type = g_strdup (threat_entry_type);
+  threat->hash = g_bytes_ref (hash);
+  g_ptr_array_add (self->threats, threat);
+}
+
+/**
+ * ephy_gsb_test_server_add_list:
+ * @self: an #EphyGSBTestServer
+ * @threat_type: the threat type of the list
+ * @platform_type: the platform type of the list
+ * @threat_entry_type: the threat entry type of the list
+ * @num_entries: the number of random hash prefixes of the first generation
+ * @num_updates: the number of generations after the first one
+ * @update_size: the number of hash prefixes each update removes and adds
+ *
+ * Serve a list. All its responses are generated here, so that requests only
+ * cost what sending them does.
+ **/
+void
+ephy_gsb_test_server_add_list (EphyGSBTestServer *self,
+                               const char        *threat_type,
+                               const char        *platform_type,
+                               const char        *threat_entry_type,
+                               gsize              num_entries,
+                               guint              num_updates,
+                               gsize              update_size)
+{
+  g_autoptr (GRand) rand = NULL;
+  g_autoptr (GArray) keys = NULL;
+  g_autoptr (GArray) threat_keys = NULL;
+  TestList *list;
+  gsize num_removals;
+
+  g_assert (self);
+  g_assert (!find_list (self, threat_type, platform_type, threat_entry_type));
+
+  list = g_new0 (TestList, 1);
+  list->threat_type = g_strdup (threat_type);
+  list->platform_type = g_strdup (platform_type);
+  list->threat_entry_type = g_strdup (threat_entry_type);
+  list->responses = g_ptr_array_new_with_free_func (g_free);
+  g_ptr_array_add (self->lists, list);
+
+  rand = g_rand_new_with_seed (g_str_hash (threat_type) ^ g_str_hash (platform_type) ^
+                               g_str_hash (threat_entry_type));
+
+  threat_keys = g_array_new (FALSE, FALSE, sizeof (guint32));
+  for (guint i = 0; i < self->threats->len; i++) {
+    TestThreat *threat = g_ptr_array_index (self->threats, i);
+    guint32 key;
+
+    if (!threat_matches_list (threat, threat_type, platform_type, threat_entry_type))
+      continue;
+
+    key = ephy_gsb_prefix_set_cue_to_uint (g_bytes_get_data (threat->hash, NULL));
+    g_array_append_val (threat_keys, key);
+  }
+  sort_unique (threat_keys);
+
+  keys = g_array_sized_new (FALSE, FALSE, sizeof (guint32), num_entries + threat_keys->len);
+  for (gsize i = 0; i < num_entries; i++) {
+    guint32 key = g_rand_int (rand);
+
+    g_array_append_val (keys, key);
+  }
+  g_array_append_vals (keys, threat_keys->data, threat_keys->len);
+  sort_unique (keys);
+
+  g_ptr_array_add (list->responses,
+                   make_list_update_response (list, "FULL_UPDATE", keys, NULL, 0, keys));
+
+  /* Leave at least half of the list, so that picking the removals ends. */
+  num_removals = MIN (update_size, (keys->len - threat_keys->len) / 2);
+
+  for (guint generation = 1; generation <= num_updates; generation++) {
+    g_autoptr (GArray) additions = g_array_sized_new (FALSE, FALSE, sizeof (guint32), update_size);
+    g_autoptr (GArray) removals = g_array_sized_new (FALSE, FALSE, sizeof (guint32), num_removals);
+    g_autoptr (GArray) next_keys = NULL;
+    g_autofree guint8 *removed = g_new0 (guint8, keys->len);
+
+    for (gsize i = 0; i < num_removals;) {
+      guint32 index = g_rand_int_range (rand, 0, keys->len);
+
+      if (removed[index] || sorted_contains (threat_keys, g_array_index (keys, guint32, index)))
+        continue;
+
+      removed[index] = TRUE;
+      g_array_append_val (removals, index);
+      i++;
+    }
+    g_array_sort (removals, compare_uints);
+
+    while (additions->len < update_size) {
+      guint32 key = g_rand_int (rand);
+
+      if (!sorted_contains (keys, key))
+        g_array_append_val (additions, key);
+    }
+    sort_unique (additions);
+
+    next_keys = g_array_sized_new (FALSE, FALSE, sizeof (guint32), keys->len + additions->len);
+    for (guint i = 0; i < keys->len; i++) {
+      if (!removed[i])
+        g_array_append_val (next_keys, g_array_index (keys, guint32, i));
+    }
+    g_array_append_vals (next_keys, additions->data, additions->len);
+    sort_unique (next_keys);
+
+    g_ptr_array_add (list->responses,
+                     make_list_update_response (list, "PARTIAL_UPDATE", additions, removals,
+                                                generation, next_keys));
+
+    g_array_unref (keys);
+    keys = g_steal_pointer (&next_keys);
+  }
+
+  /* Clients that are up to date. */
+  g_ptr_array_add (list->responses,
+                   make_list_update_response (list, "PARTIAL_UPDATE", NULL, NULL, num_updates, keys));
+}
+
+/**
+ * ephy_gsb_test_server_get_num_requests:
+ * @self: an #EphyGSBTestServer
+ *
+ * Return value: the number of requests received so far
+ **/
+guint
+ephy_gsb_test_server_get_num_requests (EphyGSBTestServer *self)
+{
+  g_assert (self);
+
+  return self->num_requests;
+}
+
+/**
+ * ephy_gsb_test_server_get_num_full_hashes_requests:
+ * @self: an #EphyGSBTestServer
+ *
+ * Return value: the number of fullHashes:find requests received so far
+ **/
+guint
+ephy_gsb_test_server_get_num_full_hashes_requests (EphyGSBTestServer *self)
+{
+  g_assert (self);
+
+  return self->num_full_hashes_requests;
+}
+
+/**
+ * ephy_gsb_test_server_hold_list_updates:
+ * @self: an #EphyGSBTestServer
+ *
+ * Send the list updates of threatListUpdates:fetch responses, but not the
+ * end of the responses, until ephy_gsb_test_server_release_list_updates() is
+ * called. Meanwhile, the client is in the middle of an update.
+ **/
+void
+ephy_gsb_test_server_hold_list_updates (EphyGSBTestServer *self)
+{
+  g_assert (self);
+
+  self->hold_list_updates = TRUE;
+}
+
+/**
+ * ephy_gsb_test_server_release_list_updates:
+ * @self: an #EphyGSBTestServer
+ *
+ * Finish the responses held since ephy_gsb_test_server_hold_list_updates(),
+ * and stop holding new ones.
+ **/
+void
+ephy_gsb_test_server_release_list_updates (EphyGSBTestServer *self)
+{
+  g_assert (self);
+
+  self->hold_list_updates = FALSE;
+
+  for (guint i = 0; i < self->held_messages->len; i++) {
+    gpointer msg = g_ptr_array_index (self->held_messages, i);
+    SoupMessageBody *response_body;
+
+#if SOUP_CHECK_VERSION (2, 99, 4)
+    response_body = soup_server_message_get_response_body (msg);
+#else
+    response_body = ((SoupMessage *)msg)->response_body;
+#endif
+
+    soup_message_body_append (response_body, SOUP_MEMORY_STATIC,
+                              LIST_UPDATES_TAIL, strlen (LIST_UPDATES_TAIL));
+    soup_message_body_complete (response_body);
+
+#if SOUP_CHECK_VERSION (3, 2, 0)
+    soup_server_message_unpause (msg);
+#else
+    soup_server_unpause_message (self->server, msg);
+#endif
+  }
+
+  g_ptr_array_set_size (self->held_messages, 0);
+}
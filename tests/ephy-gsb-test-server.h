@@ -0,0 +1,53 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2021 Epiphany Developers
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _EphyGSBTestServer EphyGSBTestServer;
+
+EphyGSBTestServer *ephy_gsb_test_server_new                 (GError            **error);
+void               ephy_gsb_test_server_free                (EphyGSBTestServer  *server);
+const char        *ephy_gsb_test_server_get_api_prefix      (EphyGSBTestServer  *server);
+void               ephy_gsb_test_server_add_threat          (EphyGSBTestServer  *server,
+                                                             const char         *threat_type,
+                                                             const char         *platform_type,
+                                                             const char         *threat_entry_type,
+                                                             GBytes             *hash);
+void               ephy_gsb_test_server_add_list            (EphyGSBTestServer  *server,
+                                                             const char         *threat_type,
+                                                             const char         *platform_type,
+                                                             const char         *threat_entry_type,
+                                                             gsize               num_entries,
+                                                             guint               num_updates,
+                                                             gsize               update_size);
+guint              ephy_gsb_test_server_get_num_requests    (EphyGSBTestServer  *server);
+guint              ephy_gsb_test_server_get_num_full_hashes_requests
+                                                            (EphyGSBTestServer  *server);
+void               ephy_gsb_test_server_hold_list_updates   (EphyGSBTestServer  *server);
+void               ephy_gsb_test_server_release_list_updates
+                                                            (EphyGSBTestServer  *server);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EphyGSBTestServer, ephy_gsb_test_server_free)
+
+G_END_DECLS
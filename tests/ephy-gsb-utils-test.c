@@ -0,0 +1,422 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2021 Epiphany Developers
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "ephy-gsb-prefix-list.h"
+#include "ephy-gsb-prefix-set.h"
+#include "ephy-gsb-update-parser.h"
+#include "ephy-gsb-utils.h"
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <string.h>
+
+static void
+cue_from_uint (guint32  value,
+               guint8  *cue)
+{
+  cue[0] = value >> 24;
+  cue[1] = value >> 16;
+  cue[2] = value >> 8;
+  cue[3] = value;
+}
+
+static void
+test_ephy_gsb_prefix_set_contains (void)
+{
+  g_autoptr (EphyGSBPrefixSet) set = NULL;
+  g_autoptr (GHashTable) expected = NULL;
+  g_autoptr (GRand) rand = g_rand_new_with_seed (42);
+  guint32 *cues;
+  guint num_cues = 50000;
+  guint8 cue[GSB_HASH_CUE_LEN];
+
+  /* Mix random cues with close ones and duplicates, so that runs are split
+   * both by large deltas and by their maximum length. */
+  expected = g_hash_table_new (NULL, NULL);
+  cues = g_new (guint32, num_cues);
+  for (guint i = 0; i < num_cues; i++) {
+    if (i % 3 == 0)
+      cues[i] = g_rand_int (rand);
+    else if (i % 3 == 1)
+      cues[i] = cues[i - 1] + g_rand_int_range (rand, 1, 16);
+    else
+      cues[i] = cues[i - 1];
+    g_hash_table_add (expected, GUINT_TO_POINTER (cues[i]));
+  }
+
+  set = ephy_gsb_prefix_set_new (cues, num_cues);
+  g_assert_cmpuint (ephy_gsb_prefix_set_get_size (set), ==, g_hash_table_size (expected));
+
+  for (guint i = 0; i < num_cues; i++) {
+    cue_from_uint (cues[i], cue);
+    g_assert_true (ephy_gsb_prefix_set_contains (set, cue));
+  }
+
+  for (guint i = 0; i < 100000; i++) {
+    guint32 value = g_rand_int (rand);
+
+    cue_from_uint (value, cue);
+    g_assert_cmpint (ephy_gsb_prefix_set_contains (set, cue), ==,
+                     g_hash_table_contains (expected, GUINT_TO_POINTER (value)));
+  }
+
+  cue_from_uint (0, cue);
+  g_assert_cmpint (ephy_gsb_prefix_set_contains (set, cue), ==,
+                   g_hash_table_contains (expected, GUINT_TO_POINTER (0)));
+  cue_from_uint (G_MAXUINT32, cue);
+  g_assert_cmpint (ephy_gsb_prefix_set_contains (set, cue), ==,
+                   g_hash_table_contains (expected, GUINT_TO_POINTER (G_MAXUINT32)));
+
+  g_free (cues);
+}
+
+static void
+test_ephy_gsb_prefix_set_empty (void)
+{
+  g_autoptr (EphyGSBPrefixSet) set = NULL;
+  guint8 cue[GSB_HASH_CUE_LEN] = { 0 };
+
+  set = ephy_gsb_prefix_set_new (NULL, 0);
+  g_assert_cmpuint (ephy_gsb_prefix_set_get_size (set), ==, 0);
+  g_assert_false (ephy_gsb_prefix_set_contains (set, cue));
+}
+
+static void
+test_ephy_gsb_prefix_set_cue_order (void)
+{
+  const guint8 low[GSB_HASH_CUE_LEN] = { 0x00, 0xff, 0xff, 0xff };
+  const guint8 high[GSB_HASH_CUE_LEN] = { 0x01, 0x00, 0x00, 0x00 };
+
+  g_assert_cmpuint (ephy_gsb_prefix_set_cue_to_uint (low), <, ephy_gsb_prefix_set_cue_to_uint (high));
+}
+
+static void
+test_ephy_gsb_prefix_list (void)
+{
+  const char * const prefixes[] = { "aaaa", "aaaab", "abcd", "bbbb", "zzzz" };
+  const guint32 indices[] = { 3, 1, 1, 99 };
+  g_autoptr (EphyGSBPrefixList) list = ephy_gsb_prefix_list_new ();
+  g_autoptr (EphyGSBPrefixList) additions = ephy_gsb_prefix_list_new ();
+  g_autoptr (GArray) cues = g_array_new (FALSE, FALSE, sizeof (guint32));
+  g_autofree guint8 *digest = NULL;
+  g_autofree char *checksum = NULL;
+  g_autofree char *expected = NULL;
+  gsize digest_len = GSB_HASH_SIZE;
+  GChecksum *sha256;
+  GList *removed;
+  gsize num_removed;
+
+  for (guint i = 0; i < G_N_ELEMENTS (prefixes); i++)
+    g_assert_true (ephy_gsb_prefix_list_append (list, (const guint8 *)prefixes[i], strlen (prefixes[i])));
+  g_assert_false (ephy_gsb_prefix_list_append (list, (const guint8 *)"zzzz", 4));
+  g_assert_false (ephy_gsb_prefix_list_append (list, (const guint8 *)"yyyy", 4));
+  g_assert_cmpuint (ephy_gsb_prefix_list_get_size (list), ==, 5);
+
+  removed = ephy_gsb_prefix_list_remove (list, indices, G_N_ELEMENTS (indices), &num_removed);
+  g_assert_cmpuint (num_removed, ==, 2);
+  g_assert_cmpuint (g_list_length (removed), ==, 2);
+  g_list_free_full (removed, (GDestroyNotify)g_bytes_unref);
+  g_assert_cmpuint (ephy_gsb_prefix_list_get_size (list), ==, 3);
+
+  ephy_gsb_prefix_list_append (additions, (const guint8 *)"aaaa", 4);
+  ephy_gsb_prefix_list_append (additions, (const guint8 *)"bbbb", 4);
+  ephy_gsb_prefix_list_merge (list, additions);
+  g_assert_cmpuint (ephy_gsb_prefix_list_get_size (list), ==, 4);
+  g_assert_false (ephy_gsb_prefix_list_append (list, (const guint8 *)"yyyy", 4));
+
+  sha256 = g_checksum_new (GSB_HASH_TYPE);
+  g_checksum_update (sha256, (const guint8 *)"aaaaabcdbbbbzzzz", 16);
+  digest = g_malloc (digest_len);
+  g_checksum_get_digest (sha256, digest, &digest_len);
+  g_checksum_free (sha256);
+  expected = g_base64_encode (digest, digest_len);
+  checksum = ephy_gsb_prefix_list_compute_checksum (list);
+  g_assert_cmpstr (checksum, ==, expected);
+
+  ephy_gsb_prefix_list_get_cues (list, cues);
+  g_assert_cmpuint (cues->len, ==, 4);
+  g_assert_cmpuint (g_array_index (cues, guint32, 0), ==, ephy_gsb_prefix_set_cue_to_uint ((const guint8 *)"aaaa"));
+  g_assert_cmpuint (g_array_index (cues, guint32, 3), ==, ephy_gsb_prefix_set_cue_to_uint ((const guint8 *)"zzzz"));
+}
+
+static void
+rice_write_bits (GByteArray *array,
+                 gsize      *num_bits,
+                 guint32     value,
+                 guint       count)
+{
+  for (guint i = 0; i < count; i++) {
+    if (*num_bits % 8 == 0)
+      g_byte_array_append (array, (const guint8 *)"\0", 1);
+    if (value & (1u << i))
+      array->data[*num_bits / 8] |= 1 << (*num_bits % 8);
+    (*num_bits)++;
+  }
+}
+
+static GByteArray *
+rice_encode (const guint32 *deltas,
+             gsize          num_deltas,
+             guint          parameter)
+{
+  GByteArray *array = g_byte_array_new ();
+  gsize num_bits = 0;
+
+  for (gsize i = 0; i < num_deltas; i++) {
+    for (guint32 q = deltas[i] >> parameter; q > 0; q--)
+      rice_write_bits (array, &num_bits, 1, 1);
+    rice_write_bits (array, &num_bits, 0, 1);
+    rice_write_bits (array, &num_bits, deltas[i] & ((1u << parameter) - 1), parameter);
+  }
+
+  return array;
+}
+
+static void
+test_ephy_gsb_rice_delta_decode (void)
+{
+  g_autoptr (GRand) rand = g_rand_new_with_seed (42);
+
+  for (guint parameter = 2; parameter <= 28; parameter++) {
+    g_autoptr (GByteArray) data = NULL;
+    g_autofree guint32 *deltas = NULL;
+    g_autofree guint32 *items = NULL;
+    gsize num_deltas = 1000;
+    guint32 expected = 1234;
+
+    /* Mostly small quotients, with a few unary runs longer than the 64 bits
+     * the decoder buffers. */
+    deltas = g_new (guint32, num_deltas);
+    for (gsize i = 0; i < num_deltas; i++) {
+      deltas[i] = g_rand_int_range (rand, 0, 1 << MIN (parameter + 2, 30));
+      if (i % 100 == 0 && parameter <= 20)
+        deltas[i] += 300u << parameter;
+    }
+
+    data = rice_encode (deltas, num_deltas, parameter);
+    items = g_new (guint32, num_deltas + 1);
+    g_assert_cmpuint (ephy_gsb_utils_rice_delta_decode_into (data->data, data->len, parameter, expected,
+                                                             items, num_deltas + 1), ==, num_deltas + 1);
+
+    g_assert_cmpuint (items[0], ==, expected);
+    for (gsize i = 0; i < num_deltas; i++) {
+      expected += deltas[i];
+      g_assert_cmpuint (items[i + 1], ==, expected);
+    }
+  }
+}
+
+static void
+test_ephy_gsb_rice_delta_decode_truncated (void)
+{
+  const guint32 deltas[] = { 5, 1000, 17, 0, 123456 };
+  const guint32 expected[] = { 0, 5, 1005, 1022, 1022, 124478 };
+  g_autoptr (GByteArray) data = rice_encode (deltas, G_N_ELEMENTS (deltas), 4);
+  guint32 items[G_N_ELEMENTS (expected)];
+  gsize num_items;
+
+  /* The last delta has the longest encoding, so it is the one cut off. */
+  num_items = ephy_gsb_utils_rice_delta_decode_into (data->data, data->len - 1, 4, 0,
+                                                     items, G_N_ELEMENTS (items));
+  g_assert_cmpuint (num_items, ==, G_N_ELEMENTS (items) - 1);
+  for (gsize i = 0; i < num_items; i++)
+    g_assert_cmpuint (items[i], ==, expected[i]);
+
+  g_assert_cmpuint (ephy_gsb_utils_rice_delta_decode_into (NULL, 0, 4, 7, items, G_N_ELEMENTS (items)), ==, 1);
+  g_assert_cmpuint (items[0], ==, 7);
+}
+
+static void
+test_ephy_gsb_rice_delta_decode_json (void)
+{
+  const guint32 deltas[] = { 1, 2, 3, 1000000 };
+  g_autoptr (GByteArray) data = rice_encode (deltas, G_N_ELEMENTS (deltas), 10);
+  g_autoptr (JsonObject) rde = json_object_new ();
+  g_autofree char *data_b64 = g_base64_encode (data->data, data->len);
+  g_autofree guint32 *items = NULL;
+  gsize num_items;
+
+  json_object_set_string_member (rde, "firstValue", "100");
+  json_object_set_int_member (rde, "riceParameter", 10);
+  json_object_set_int_member (rde, "numEntries", G_N_ELEMENTS (deltas));
+  json_object_set_string_member (rde, "encodedData", data_b64);
+
+  items = ephy_gsb_utils_rice_delta_decode (rde, &num_items);
+  g_assert_cmpuint (num_items, ==, 5);
+  g_assert_cmpuint (items[0], ==, 100);
+  g_assert_cmpuint (items[1], ==, 101);
+  g_assert_cmpuint (items[2], ==, 103);
+  g_assert_cmpuint (items[3], ==, 106);
+  g_assert_cmpuint (items[4], ==, 1000106);
+}
+
+typedef struct {
+  GByteArray *additions;
+  GString *lists;
+} UpdateParserResult;
+
+static void
+update_parser_additions_cb (const guint8 *prefixes,
+                            gsize         num_prefixes,
+                            gsize         prefix_len,
+                            gpointer      user_data)
+{
+  UpdateParserResult *result = user_data;
+
+  g_byte_array_append (result->additions, prefixes, num_prefixes * prefix_len);
+}
+
+static void
+update_parser_list_cb (EphyGSBListUpdate *update,
+                       gpointer           user_data)
+{
+  UpdateParserResult *result = user_data;
+
+  g_string_append_printf (result->lists, "%s/%s/%s %s %s %s:",
+                          update->threat_type, update->platform_type, update->threat_entry_type,
+                          update->response_type, update->new_client_state, update->checksum);
+  for (guint i = 0; i < update->removals->len; i++)
+    g_string_append_printf (result->lists, " %u", g_array_index (update->removals, guint32, i));
+  g_string_append_c (result->lists, ';');
+}
+
+static void
+test_ephy_gsb_update_parser (void)
+{
+  const guint32 deltas[] = { 1, 2, 3, 1000000 };
+  const guint32 expected_rice[] = { 100, 101, 103, 106, 1000106 };
+  const guint8 raw_hashes[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+  g_autoptr (GByteArray) data = rice_encode (deltas, G_N_ELEMENTS (deltas), 10);
+  g_autofree char *data_b64 = g_base64_encode (data->data, data->len);
+  g_autofree char *raw_b64 = g_base64_encode (raw_hashes, sizeof (raw_hashes));
+  g_autofree char *json = NULL;
+  gsize json_len;
+
+  json = g_strdup_printf ("{\"listUpdateResponses\": [{"
+                          "  \"threatType\": \"MALWARE\", \"threatEntryType\": \"URL\","
+                          "  \"platformType\": \"LINUX\", \"responseType\": \"FULL_UPDATE\","
+                          "  \"additions\": ["
+                          "    {\"compressionType\": \"RAW\", \"rawHashes\": {\"prefixSize\": 5, \"rawHashes\": \"%s\"}},"
+                          "    {\"compressionType\": \"RICE\", \"riceHashes\": {\"firstValue\": \"100\", \"riceParameter\": 10,"
+                          "                                                \"numEntries\": 4, \"encodedData\": \"%s\"}}"
+                          "  ],"
+                          "  \"removals\": [{\"compressionType\": \"RAW\", \"rawIndices\": {\"indices\": [3, 1]}}],"
+                          "  \"newClientState\": \"c3RhdGU=\", \"checksum\": {\"sha256\": \"c2hh\\/\"},"
+                          "  \"unknown\": [{\"rawHashes\": \"\\u0041\"}, null, true, -1.5e3]"
+                          "}, {"
+                          "  \"threatType\": \"SOCIAL_ENGINEERING\", \"threatEntryType\": \"URL\","
+                          "  \"platformType\": \"ANY_PLATFORM\", \"responseType\": \"PARTIAL_UPDATE\","
+                          "  \"removals\": [{\"compressionType\": \"RICE\", \"riceIndices\": {\"encodedData\": \"%s\","
+                          "                                                                 \"numEntries\": 4, \"riceParameter\": 10}}],"
+                          "  \"newClientState\": \"\", \"checksum\": {\"sha256\": \"\"}"
+                          "}], \"minimumWaitDuration\": \"593.440s\"}",
+                          raw_b64, data_b64, data_b64);
+  json_len = strlen (json);
+
+  /* Feed the response in chunks of various sizes, so that every token gets
+   * split somewhere. */
+  for (gsize chunk_len = 1; chunk_len <= json_len; chunk_len = chunk_len * 3 + 1) {
+    g_autoptr (GError) error = NULL;
+    EphyGSBUpdateParser *parser;
+    UpdateParserResult result;
+
+    result.additions = g_byte_array_new ();
+    result.lists = g_string_new (NULL);
+    parser = ephy_gsb_update_parser_new (update_parser_additions_cb, update_parser_list_cb, &result);
+
+    for (gsize i = 0; i < json_len; i += chunk_len) {
+      g_assert_true (ephy_gsb_update_parser_feed (parser, json + i, MIN (chunk_len, json_len - i), &error));
+      g_assert_no_error (error);
+    }
+    g_assert_true (ephy_gsb_update_parser_finish (parser, &error));
+    g_assert_no_error (error);
+
+    g_assert_cmpuint (result.additions->len, ==, sizeof (raw_hashes) + sizeof (expected_rice));
+    g_assert_cmpmem (result.additions->data, sizeof (raw_hashes), raw_hashes, sizeof (raw_hashes));
+    g_assert_cmpmem (result.additions->data + sizeof (raw_hashes), sizeof (expected_rice),
+                     expected_rice, sizeof (expected_rice));
+    g_assert_cmpstr (result.lists->str, ==,
+                     "MALWARE/LINUX/URL FULL_UPDATE c3RhdGU= c2hh/: 3 1;"
+                     "SOCIAL_ENGINEERING/ANY_PLATFORM/URL PARTIAL_UPDATE  : 0 1 3 6 1000006;");
+    g_assert_cmpfloat (ephy_gsb_update_parser_get_minimum_wait_duration (parser), ==, 593.44);
+
+    ephy_gsb_update_parser_free (parser);
+    g_byte_array_free (result.additions, TRUE);
+    g_string_free (result.lists, TRUE);
+  }
+}
+
+static void
+test_ephy_gsb_update_parser_invalid (void)
+{
+  const char * const invalid[] = {
+    "{\"listUpdateResponses\": [{}",
+    "{\"listUpdateResponses\": [}",
+    "{\"minimumWaitDuration\" \"1s\"}",
+    "{} {}",
+  };
+
+  for (guint i = 0; i < G_N_ELEMENTS (invalid); i++) {
+    g_autoptr (GError) error = NULL;
+    EphyGSBUpdateParser *parser;
+    UpdateParserResult result;
+
+    result.additions = g_byte_array_new ();
+    result.lists = g_string_new (NULL);
+    parser = ephy_gsb_update_parser_new (update_parser_additions_cb, update_parser_list_cb, &result);
+
+    if (ephy_gsb_update_parser_feed (parser, invalid[i], strlen (invalid[i]), &error))
+      ephy_gsb_update_parser_finish (parser, &error);
+    g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+
+    ephy_gsb_update_parser_free (parser);
+    g_byte_array_free (result.additions, TRUE);
+    g_string_free (result.lists, TRUE);
+  }
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/lib/safe-browsing/prefix-set/contains",
+                   test_ephy_gsb_prefix_set_contains);
+  g_test_add_func ("/lib/safe-browsing/prefix-set/empty",
+                   test_ephy_gsb_prefix_set_empty);
+  g_test_add_func ("/lib/safe-browsing/prefix-set/cue-order",
+                   test_ephy_gsb_prefix_set_cue_order);
+  g_test_add_func ("/lib/safe-browsing/prefix-list",
+                   test_ephy_gsb_prefix_list);
+  g_test_add_func ("/lib/safe-browsing/rice/delta-decode",
+                   test_ephy_gsb_rice_delta_decode);
+  g_test_add_func ("/lib/safe-browsing/rice/delta-decode-truncated",
+                   test_ephy_gsb_rice_delta_decode_truncated);
+  g_test_add_func ("/lib/safe-browsing/rice/delta-decode-json",
+                   test_ephy_gsb_rice_delta_decode_json);
+  g_test_add_func ("/lib/safe-browsing/update-parser/parse",
+                   test_ephy_gsb_update_parser);
+  g_test_add_func ("/lib/safe-browsing/update-parser/invalid",
+                   test_ephy_gsb_update_parser_invalid);
+
+  return g_test_run ();
+}
@@ -0,0 +1,433 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2; -*- */
+/*
+ *  Copyright © 2021 Epiphany Developers
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Builds synthetic history profiles of increasing size and times the
+ * operations the UI waits for. Results are written as JSON, so that they can
+ * be compared across releases:
+ *
+ *   benchmark-ephy-history --visits 100000 --output history.json
+ */
+
+#include "config.h"
+#include "ephy-about-handler.h"
+#include "ephy-debug.h"
+#include "ephy-history-service.h"
+#include "ephy-sqlite-connection.h"
+
+#include <glib/gstdio.h>
+#include <json-glib/json-glib.h>
+#include <math.h>
+
+/* Roughly what a real profile looks like: most visits go to a few URLs. */
+#define VISITS_PER_URL 10
+#define URLS_PER_HOST 20
+
+#define IMPORT_CHUNK_SIZE 50000
+#define MAX_ADDED_VISITS 10000
+#define NUM_QUERY_RUNS 5
+#define SEARCH_LIMIT 25
+
+static const char * const words[] = {
+  "gnome", "news", "linux", "recipe", "weather", "music", "video", "photo",
+  "travel", "science", "sport", "football", "garden", "kernel", "release", "review",
+  "guide", "forum", "blog", "wiki", "shop", "book", "movie", "game",
+  "health", "market", "finance", "school", "history", "design", "code", "browser",
+  "epiphany", "webkit", "desktop", "mobile", "camera", "bicycle", "coffee", "mountain",
+  "river", "ocean", "planet", "galaxy", "library", "museum", "theater", "concert",
+  "podcast", "radio", "maps", "train", "flight", "hotel", "kitchen", "bakery",
+  "chess", "puzzle", "poetry", "novel", "comic", "anime", "language", "dictionary"
+};
+
+static const char * const search_terms[] = { "gnome", "news" };
+
+static gint64 now;
+
+typedef struct {
+  GMainLoop *loop;
+  gboolean success;
+  EphyHistoryHost *host;
+} BenchmarkJob;
+
+static void
+job_done_cb (EphyHistoryService *service,
+             gboolean            success,
+             gpointer            result_data,
+             gpointer            user_data)
+{
+  BenchmarkJob *job = user_data;
+
+  job->success = success;
+  g_main_loop_quit (job->loop);
+}
+
+static void
+job_host_cb (EphyHistoryService *service,
+             gboolean            success,
+             gpointer            result_data,
+             gpointer            user_data)
+{
+  BenchmarkJob *job = user_data;
+
+  job->host = ephy_history_host_copy (result_data);
+  job_done_cb (service, success, result_data, user_data);
+}
+
+static void
+job_init (BenchmarkJob *job)
+{
+  job->loop = g_main_loop_new (NULL, FALSE);
+  job->success = FALSE;
+  job->host = NULL;
+}
+
+/* Waits for the job and returns how long it took since @start_time, in
+ * seconds. */
+static double
+job_wait (BenchmarkJob *job,
+          gint64        start_time)
+{
+  g_main_loop_run (job->loop);
+  g_main_loop_unref (job->loop);
+
+  if (!job->success)
+    g_warning ("History benchmark job failed");
+
+  return (g_get_monotonic_time () - start_time) / (double)G_USEC_PER_SEC;
+}
+
+static EphyHistoryURL *
+synthetic_url (guint url_index,
+               guint num_hosts)
+{
+  guint host_index = url_index % num_hosts;
+  guint n = G_N_ELEMENTS (words);
+  g_autofree char *url = NULL;
+  g_autofree char *title = NULL;
+
+  url = g_strdup_printf ("https://%s%u.example.com/%s/%s-%u",
+                         words[host_index % n], host_index,
+                         words[(url_index * 7) % n], words[(url_index * 13 + 5) % n], url_index);
+  title = g_strdup_printf ("%s %s and %s on %s%u",
+                           words[(url_index * 13 + 5) % n], words[(url_index / num_hosts) % n],
+                           words[(url_index * 7) % n], words[host_index % n], host_index);
+
+  return ephy_history_url_new (url, title, 0, 0, 0);
+}
+
+static EphyHistoryPageVisit *
+synthetic_visit (GRand *rand,
+                 guint  num_urls,
+                 guint  num_hosts,
+                 gint64 max_age)
+{
+  /* Squaring a uniform variable favours the low indexes. */
+  guint url_index = (guint)(num_urls * pow (g_rand_double (rand), 2.0));
+  gint64 visit_time = now - (gint64)(g_rand_double (rand) * max_age);
+
+  return ephy_history_page_visit_new_with_url (synthetic_url (MIN (url_index, num_urls - 1), num_hosts),
+                                               visit_time,
+                                               g_rand_int_range (rand, 0, 10) == 0 ? EPHY_PAGE_VISIT_TYPED
+                                                                                   : EPHY_PAGE_VISIT_LINK);
+}
+
+/* Returns the number of visits stored per second. */
+static double
+build_profile (EphyHistoryService *service,
+               GRand              *rand,
+               guint               num_visits,
+               guint               num_urls,
+               guint               num_hosts)
+{
+  double elapsed = 0;
+
+  for (guint done = 0; done < num_visits; done += IMPORT_CHUNK_SIZE) {
+    g_autoptr (GPtrArray) visits = g_ptr_array_new_with_free_func ((GDestroyNotify)ephy_history_page_visit_free);
+    BenchmarkJob job;
+    gint64 start_time;
+
+    for (guint i = done; i < MIN (done + IMPORT_CHUNK_SIZE, num_visits); i++)
+      g_ptr_array_add (visits, synthetic_visit (rand, num_urls, num_hosts, 365 * G_TIME_SPAN_DAY));
+
+    job_init (&job);
+    start_time = g_get_monotonic_time ();
+    ephy_history_service_import_visits (service, visits, NULL, job_done_cb, &job);
+    elapsed += job_wait (&job, start_time);
+  }
+
+  return num_visits / elapsed;
+}
+
+/* Visits added one by one, as when browsing. Returns visits per second. */
+static double
+time_add_visit (EphyHistoryService *service,
+                GRand              *rand,
+                guint               num_visits,
+                guint               num_urls,
+                guint               num_hosts)
+{
+  BenchmarkJob job;
+  gint64 start_time;
+
+  job_init (&job);
+  start_time = g_get_monotonic_time ();
+
+  /* Callbacks run in order, so waiting for the last visit is enough. */
+  for (guint i = 0; i < num_visits; i++) {
+    g_autoptr (EphyHistoryPageVisit) visit = synthetic_visit (rand, num_urls, num_hosts, G_TIME_SPAN_HOUR);
+
+    ephy_history_service_add_visit (service, visit, NULL,
+                                    i == num_visits - 1 ? job_done_cb : NULL,
+                                    i == num_visits - 1 ? &job : NULL);
+  }
+
+  return num_visits / job_wait (&job, start_time);
+}
+
+static int
+compare_doubles (gconstpointer a,
+                 gconstpointer b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* Returns the median time of @query_url_set, in milliseconds. */
+static double
+time_url_set_query (EphyHistoryService *service,
+                    EphyHistoryQuery   *query)
+{
+  double times[NUM_QUERY_RUNS];
+
+  for (guint i = 0; i < NUM_QUERY_RUNS; i++) {
+    BenchmarkJob job;
+    gint64 start_time;
+
+    job_init (&job);
+    start_time = g_get_monotonic_time ();
+    ephy_history_service_query_url_set (service, query, NULL, job_done_cb, &job);
+    times[i] = job_wait (&job, start_time) * 1000;
+  }
+
+  qsort (times, NUM_QUERY_RUNS, sizeof (double), compare_doubles);
+  return times[NUM_QUERY_RUNS / 2];
+}
+
+static double
+time_overview_query (EphyHistoryService *service)
+{
+  g_autoptr (EphyHistoryQuery) query = ephy_history_query_new_for_overview ();
+
+  return time_url_set_query (service, query);
+}
+
+static double
+time_substring_search (EphyHistoryService *service)
+{
+  g_autoptr (EphyHistoryQuery) query = ephy_history_query_new ();
+
+  /* The same query as the suggestions of the location entry. */
+  for (guint i = 0; i < G_N_ELEMENTS (search_terms); i++)
+    query->substring_list = g_list_append (query->substring_list, g_strdup (search_terms[i]));
+  query->limit = SEARCH_LIMIT;
+  query->sort_type = EPHY_HISTORY_SORT_FRECENCY;
+
+  return time_url_set_query (service, query);
+}
+
+static double
+time_visits_in_month (EphyHistoryService *service)
+{
+  double times[NUM_QUERY_RUNS];
+
+  for (guint i = 0; i < NUM_QUERY_RUNS; i++) {
+    BenchmarkJob job;
+    gint64 start_time;
+
+    job_init (&job);
+    start_time = g_get_monotonic_time ();
+    ephy_history_service_find_visits_in_time (service, now - 30 * G_TIME_SPAN_DAY, now, NULL, job_done_cb, &job);
+    times[i] = job_wait (&job, start_time) * 1000;
+  }
+
+  qsort (times, NUM_QUERY_RUNS, sizeof (double), compare_doubles);
+  return times[NUM_QUERY_RUNS / 2];
+}
+
+/* Deletes the host with the most visits. Returns milliseconds. */
+static double
+time_delete_host (EphyHistoryService *service,
+                  guint               num_hosts)
+{
+  g_autoptr (EphyHistoryURL) url = synthetic_url (0, num_hosts);
+  g_autoptr (EphyHistoryHost) host = NULL;
+  BenchmarkJob job;
+  gint64 start_time;
+
+  job_init (&job);
+  ephy_history_service_get_host_for_url (service, url->url, NULL, job_host_cb, &job);
+  job_wait (&job, g_get_monotonic_time ());
+  host = job.host;
+
+  job_init (&job);
+  start_time = g_get_monotonic_time ();
+  ephy_history_service_delete_host (service, host, NULL, job_done_cb, &job);
+  return job_wait (&job, start_time) * 1000;
+}
+
+static double
+time_clear (EphyHistoryService *service)
+{
+  BenchmarkJob job;
+  gint64 start_time;
+
+  job_init (&job);
+  start_time = g_get_monotonic_time ();
+  ephy_history_service_clear (service, NULL, job_done_cb, &job);
+  return job_wait (&job, start_time) * 1000;
+}
+
+static void
+run_profile (JsonBuilder *builder,
+             guint        num_visits)
+{
+  g_autofree char *filename = NULL;
+  g_autoptr (GRand) rand = g_rand_new_with_seed (num_visits);
+  EphyHistoryService *service;
+  guint num_urls = MAX (1, num_visits / VISITS_PER_URL);
+  guint num_hosts = MAX (1, num_urls / URLS_PER_HOST);
+  guint num_added_visits = MIN (MAX_ADDED_VISITS, MAX (1, num_visits / 10));
+  GStatBuf buf;
+
+  filename = g_build_filename (g_get_tmp_dir (), "epiphany-history-benchmark.db", NULL);
+  g_unlink (filename);
+
+  g_printerr ("Building a profile with %u visits to %u URLs on %u hosts\n", num_visits, num_urls, num_hosts);
+
+  service = ephy_history_service_new (filename, EPHY_SQLITE_CONNECTION_MODE_READWRITE);
+
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "visits");
+  json_builder_add_int_value (builder, num_visits);
+  json_builder_set_member_name (builder, "urls");
+  json_builder_add_int_value (builder, num_urls);
+  json_builder_set_member_name (builder, "hosts");
+  json_builder_add_int_value (builder, num_hosts);
+
+  json_builder_set_member_name (builder, "import_visits_per_second");
+  json_builder_add_double_value (builder, build_profile (service, rand, num_visits, num_urls, num_hosts));
+  json_builder_set_member_name (builder, "add_visit_per_second");
+  json_builder_add_double_value (builder, time_add_visit (service, rand, num_added_visits, num_urls, num_hosts));
+
+  json_builder_set_member_name (builder, "database_bytes");
+  json_builder_add_int_value (builder, g_stat (filename, &buf) == 0 ? buf.st_size : -1);
+
+  json_builder_set_member_name (builder, "overview_ms");
+  json_builder_add_double_value (builder, time_overview_query (service));
+  json_builder_set_member_name (builder, "substring_search_ms");
+  json_builder_add_double_value (builder, time_substring_search (service));
+  json_builder_set_member_name (builder, "visits_in_month_ms");
+  json_builder_add_double_value (builder, time_visits_in_month (service));
+  json_builder_set_member_name (builder, "delete_host_ms");
+  json_builder_add_double_value (builder, time_delete_host (service, num_hosts));
+  json_builder_set_member_name (builder, "clear_ms");
+  json_builder_add_double_value (builder, time_clear (service));
+
+  json_builder_end_object (builder);
+
+  g_object_unref (service);
+  g_unlink (filename);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr (GOptionContext) context = NULL;
+  g_autoptr (JsonBuilder) builder = NULL;
+  g_autoptr (JsonGenerator) generator = NULL;
+  g_autoptr (JsonNode) root = NULL;
+  g_autoptr (GDateTime) date = NULL;
+  g_autofree char *date_string = NULL;
+  g_autofree char *json = NULL;
+  g_auto (GStrv) sizes = NULL;
+  g_autofree char *output = NULL;
+  g_autoptr (GError) error = NULL;
+  const GOptionEntry entries[] = {
+    { "visits", 'n', 0, G_OPTION_ARG_STRING_ARRAY, &sizes, "Number of visits of a profile, may be repeated", "N" },
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output, "Write the results to FILE instead of stdout", "FILE" },
+    { NULL }
+  };
+  const char * const default_sizes[] = { "100000", "1000000", "5000000", NULL };
+
+  context = g_option_context_new ("- benchmark the history service");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_printerr ("%s\n", error->message);
+    return 1;
+  }
+
+  ephy_debug_init ();
+
+  now = g_get_real_time ();
+  date = g_date_time_new_now_utc ();
+  date_string = g_date_time_format_iso8601 (date);
+
+  builder = json_builder_new ();
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "benchmark");
+  json_builder_add_string_value (builder, "history");
+  json_builder_set_member_name (builder, "version");
+  json_builder_add_string_value (builder, VERSION);
+  json_builder_set_member_name (builder, "date");
+  json_builder_add_string_value (builder, date_string);
+  json_builder_set_member_name (builder, "profiles");
+  json_builder_begin_array (builder);
+
+  for (const char * const *size = sizes ? (const char * const *)sizes : default_sizes; *size; size++) {
+    guint64 num_visits;
+
+    if (!g_ascii_string_to_unsigned (*size, 10, 1, G_MAXUINT, &num_visits, &error)) {
+      g_printerr ("Invalid number of visits: %s\n", error->message);
+      return 1;
+    }
+
+    run_profile (builder, num_visits);
+  }
+
+  json_builder_end_array (builder);
+  json_builder_end_object (builder);
+
+  root = json_builder_get_root (builder);
+  generator = json_generator_new ();
+  json_generator_set_pretty (generator, TRUE);
+  json_generator_set_root (generator, root);
+  json = json_generator_to_data (generator, NULL);
+
+  if (!output) {
+    g_print ("%s\n", json);
+  } else if (!g_file_set_contents (output, json, -1, &error)) {
+    g_printerr ("Could not write %s: %s\n", output, error->message);
+    return 1;
+  }
+
+  return 0;
+}
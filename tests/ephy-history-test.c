@@ -22,6 +22,7 @@
 #include "ephy-debug.h"
 #include "ephy-file-helpers.h"
 #include "ephy-history-service.h"
+#include "ephy-sqlite-connection.h"
 
 #include <glib/gstdio.h>
 #include <gtk/gtk.h>
@@ -421,6 +422,148 @@ test_complex_url_query (void)
   gtk_main ();
 }
 
+static void
+perform_imported_url_query (EphyHistoryService *service,
+                            gboolean            success,
+                            gpointer            result_data,
+                            gpointer            user_data)
+{
+  EphyHistoryQuery *query;
+  EphyHistoryURL *url;
+
+  g_assert_true (success);
+
+  query = ephy_history_query_new ();
+  query->substring_list = g_list_prepend (query->substring_list, (gpointer)"gnome");
+  query->limit = 1;
+  query->sort_type = EPHY_HISTORY_SORT_MOST_VISITED;
+
+  /* The visit added before the import plus the imported ones. */
+  url = ephy_history_url_new ("http://www.gnome.org", "GNOME", 11, 11, 0);
+
+  ephy_history_service_query_urls (service, query, NULL, verify_complex_url_query, url);
+  ephy_history_query_free (query);
+}
+
+static void
+test_import_visits (void)
+{
+  EphyHistoryService *service = ensure_empty_history (test_db_filename ());
+  g_autoptr (GPtrArray) imported = g_ptr_array_new ();
+  EphyHistoryPageVisit *visit;
+  GList *visits;
+
+  /* Import into a URL that already exists, and into new ones. */
+  visit = ephy_history_page_visit_new ("http://www.gnome.org", 5, EPHY_PAGE_VISIT_TYPED);
+  ephy_history_service_add_visit (service, visit, NULL, NULL, NULL);
+  ephy_history_page_visit_free (visit);
+
+  visits = create_visits_for_complex_tests ();
+  for (GList *l = visits; l; l = l->next)
+    g_ptr_array_add (imported, l->data);
+
+  ephy_history_service_import_visits (service, imported, NULL, perform_imported_url_query, NULL);
+  ephy_history_page_visit_list_free (visits);
+
+  gtk_main ();
+}
+
+static void
+verify_visits_after_compact (EphyHistoryService *service,
+                             gboolean            success,
+                             gpointer            result_data,
+                             gpointer            user_data)
+{
+  GList *visits = (GList *)result_data;
+
+  g_assert_true (success);
+
+  /* Only the last visit to each URL is left... */
+  g_assert_cmpint (g_list_length (visits), ==, 5);
+
+  /* ...but the URLs still count all of them. */
+  perform_complex_url_query (service, TRUE, NULL, NULL);
+}
+
+static void
+perform_compact (EphyHistoryService *service,
+                 gboolean            success,
+                 gpointer            result_data,
+                 gpointer            user_data)
+{
+  g_assert_true (success);
+
+  ephy_history_service_find_visits_in_time (service, 0, 10000, NULL, verify_visits_after_compact, NULL);
+}
+
+static void
+test_compact (void)
+{
+  EphyHistoryService *service = ensure_empty_history (test_db_filename ());
+  GList *visits;
+
+  /* All the test visits are from 1970. */
+  g_object_set (service, "visit-retention-days", 1, NULL);
+
+  visits = create_visits_for_complex_tests ();
+
+  ephy_history_service_add_visits (service, visits, NULL, NULL, NULL);
+  ephy_history_service_compact (service, NULL, perform_compact, NULL);
+  ephy_history_page_visit_list_free (visits);
+
+  gtk_main ();
+}
+
+static void
+verify_zoom_level_dropped (EphyHistoryService *service,
+                           gboolean            success,
+                           gpointer            result_data,
+                           gpointer            user_data)
+{
+  double zoom_level;
+
+  g_assert_true (success);
+  g_assert_false (ephy_history_service_get_cached_zoom_level (service, "http://www.gnome.org", &zoom_level));
+
+  gtk_main_quit ();
+}
+
+static void
+verify_zoom_level_cached (EphyHistoryService *service,
+                          gboolean            success,
+                          gpointer            result_data,
+                          gpointer            user_data)
+{
+  EphyHistoryHost *host = (EphyHistoryHost *)result_data;
+  double zoom_level = -1;
+
+  g_assert_true (success);
+
+  /* Any page of the host now has its zoom level at hand. */
+  g_assert_true (ephy_history_service_get_cached_zoom_level (service, "http://www.gnome.org/about/", &zoom_level));
+  g_assert_cmpfloat (zoom_level, ==, host->zoom_level);
+  g_assert_false (ephy_history_service_get_cached_zoom_level (service, "http://www.webkitgtk.org", &zoom_level));
+
+  ephy_history_service_delete_host (service, host, NULL, verify_zoom_level_dropped, NULL);
+}
+
+static void
+test_cached_zoom_level (void)
+{
+  EphyHistoryService *service = ensure_empty_history (test_db_filename ());
+  EphyHistoryPageVisit *visit;
+  double zoom_level;
+
+  visit = ephy_history_page_visit_new ("http://www.gnome.org", 0, EPHY_PAGE_VISIT_TYPED);
+  ephy_history_service_add_visit (service, visit, NULL, NULL, NULL);
+  ephy_history_page_visit_free (visit);
+
+  g_assert_false (ephy_history_service_get_cached_zoom_level (service, "http://www.gnome.org", &zoom_level));
+  ephy_history_service_get_host_for_url (service, "http://www.gnome.org", NULL, verify_zoom_level_cached, NULL);
+
+  gtk_main ();
+}
+
 static void
 perform_complex_url_query_with_time_range (EphyHistoryService *service,
                                            gboolean            success,
@@ -460,6 +603,349 @@ test_complex_url_query_with_time_range (void)
   gtk_main ();
 }
 
+static void
+perform_complex_url_query_with_long_substring (EphyHistoryService *service,
+                                               gboolean            success,
+                                               gpointer            result_data,
+                                               gpointer            user_data)
+{
+  EphyHistoryQuery *query;
+  EphyHistoryURL *url;
+
+  g_assert_true (success);
+
+  /* Substrings of three characters or more go through the full-text index. */
+  query = ephy_history_query_new ();
+  query->substring_list = g_list_prepend (query->substring_list, (gpointer)".org");
+  query->substring_list = g_list_prepend (query->substring_list, (gpointer)"brainz");
+  query->sort_type = EPHY_HISTORY_SORT_RELEVANCE;
+
+  /* The expected result. */
+  url = ephy_history_url_new ("http://www.musicbrainz.org",
+                              "MusicBrainz",
+                              5, 5, 0);
+
+  ephy_history_service_query_urls (service, query, NULL, verify_complex_url_query, url);
+}
+
+static void
+test_complex_url_query_with_long_substring (void)
+{
+  EphyHistoryService *service = ensure_empty_history (test_db_filename ());
+  GList *visits;
+
+  visits = create_visits_for_complex_tests ();
+
+  ephy_history_service_add_visits (service, visits, NULL, perform_complex_url_query_with_long_substring, NULL);
+
+  gtk_main ();
+}
+
+static void
+perform_frecency_url_query (EphyHistoryService *service,
+                            gboolean            success,
+                            gpointer            result_data,
+                            gpointer            user_data)
+{
+  EphyHistoryQuery *query;
+  EphyHistoryURL *url;
+
+  g_assert_true (success);
+
+  query = ephy_history_query_new ();
+  query->limit = 1;
+  query->sort_type = EPHY_HISTORY_SORT_FRECENCY;
+
+  /* A few recent visits outrank many visits from a year ago. */
+  url = ephy_history_url_new ("http://www.webkitgtk.org",
+                              "WebKitGTK",
+                              2, 2, 0);
+
+  ephy_history_service_query_urls (service, query, NULL, verify_complex_url_query, url);
+}
+
+static void
+test_frecency_url_query (void)
+{
+  EphyHistoryService *service = ensure_empty_history (test_db_filename ());
+  gint64 one_year = (gint64)365 * 24 * 60 * 60 * G_USEC_PER_SEC;
+  GList *visits = NULL;
+  int i;
+
+  for (i = 0; i < 20; i++)
+    visits = g_list_append (visits, ephy_history_page_visit_new ("http://www.gnome.org", 10 * i, EPHY_PAGE_VISIT_TYPED));
+  for (i = 0; i < 2; i++)
+    visits = g_list_append (visits, ephy_history_page_visit_new ("http://www.webkitgtk.org", one_year + 10 * i, EPHY_PAGE_VISIT_LINK));
+
+  ephy_history_service_add_visits (service, visits, NULL, perform_frecency_url_query, NULL);
+  ephy_history_page_visit_list_free (visits);
+
+  gtk_main ();
+}
+
+typedef struct {
+  int num_callbacks;
+  gboolean got_last_results;
+} CoalescedQueriesData;
+
+static void
+coalesced_query_done (EphyHistoryService *service,
+                      gboolean            success,
+                      gpointer            result_data,
+                      gpointer            user_data)
+{
+  CoalescedQueriesData *data = user_data;
+
+  /* Superseded queries complete without results. Only the last query
+   * matches a single URL. */
+  if (!success)
+    g_assert_null (result_data);
+  else if (g_list_length (result_data) == 1)
+    data->got_last_results = TRUE;
+
+  if (++data->num_callbacks == 3) {
+    g_assert_true (data->got_last_results);
+    g_object_unref (service);
+    gtk_main_quit ();
+  }
+}
+
+static void
+test_coalesced_url_queries (void)
+{
+  EphyHistoryService *service = ensure_empty_history (test_db_filename ());
+  const char *substrings[] = { "org", "w", "wiki" };
+  CoalescedQueriesData data = { 0, FALSE };
+  GList *visits;
+
+  visits = create_visits_for_complex_tests ();
+  ephy_history_service_add_visits (service, visits, NULL, NULL, NULL);
+  ephy_history_page_visit_list_free (visits);
+
+  for (guint i = 0; i < G_N_ELEMENTS (substrings); i++) {
+    g_autoptr (EphyHistoryQuery) query = ephy_history_query_new ();
+
+    query->substring_list = g_list_prepend (NULL, g_strdup (substrings[i]));
+    query->sort_type = EPHY_HISTORY_SORT_MOST_VISITED;
+    query->coalescing_key = g_strdup ("test");
+
+    ephy_history_service_query_urls (service, query, NULL, coalesced_query_done, &data);
+  }
+
+  gtk_main ();
+
+  g_assert_cmpint (data.num_callbacks, ==, 3);
+}
+
+static void
+verify_paginated_url_query (EphyHistoryService *service,
+                            gboolean            success,
+                            gpointer            result_data,
+                            gpointer            user_data)
+{
+  static const char * const expected_urls[] = {
+    "http://www.wikipedia.org",
+    "http://www.freedesktop.org",
+    "http://www.gnome.org",
+    "http://www.musicbrainz.org",
+    "http://www.webkitgtk.org",
+  };
+  int *num_fetched = user_data;
+  g_autoptr (EphyHistoryQuery) query = NULL;
+  GList *urls = result_data;
+
+  g_assert_true (success);
+  g_assert_cmpint (g_list_length (urls), <=, 2);
+
+  for (GList *l = urls; l; l = l->next) {
+    EphyHistoryURL *url = l->data;
+    g_assert_cmpint (*num_fetched, <, G_N_ELEMENTS (expected_urls));
+    g_assert_cmpstr (url->url, ==, expected_urls[(*num_fetched)++]);
+  }
+
+  if (g_list_length (urls) < 2) {
+    g_assert_cmpint (*num_fetched, ==, G_N_ELEMENTS (expected_urls));
+    g_free (num_fetched);
+    g_object_unref (service);
+    gtk_main_quit ();
+    return;
+  }
+
+  /* Fetch the next page, after the last URL of this one. */
+  query = ephy_history_query_new ();
+  query->limit = 2;
+  query->sort_type = EPHY_HISTORY_SORT_MOST_VISITED;
+  query->page_after = ephy_history_url_copy (g_list_last (urls)->data);
+
+  ephy_history_service_query_urls (service, query, NULL, verify_paginated_url_query, num_fetched);
+}
+
+static void
+perform_paginated_url_query (EphyHistoryService *service,
+                             gboolean            success,
+                             gpointer            result_data,
+                             gpointer            user_data)
+{
+  g_autoptr (EphyHistoryQuery) query = ephy_history_query_new ();
+
+  g_assert_true (success);
+
+  query->limit = 2;
+  query->sort_type = EPHY_HISTORY_SORT_MOST_VISITED;
+
+  ephy_history_service_query_urls (service, query, NULL, verify_paginated_url_query, g_new0 (int, 1));
+}
+
+static void
+test_paginated_url_query (void)
+{
+  EphyHistoryService *service = ensure_empty_history (test_db_filename ());
+  GList *visits;
+
+  visits = create_visits_for_complex_tests ();
+
+  ephy_history_service_add_visits (service, visits, NULL, perform_paginated_url_query, NULL);
+  ephy_history_page_visit_list_free (visits);
+
+  gtk_main ();
+}
+
+static void
+verify_url_set_query (EphyHistoryService *service,
+                      gboolean            success,
+                      gpointer            result_data,
+                      gpointer            user_data)
+{
+  EphyHistoryURLSet *urls = result_data;
+  const EphyHistoryURLRow *row;
+  GList *list;
+
+  g_assert_true (success);
+  g_assert_cmpuint (ephy_history_url_set_get_length (urls), ==, 2);
+
+  row = ephy_history_url_set_get_row (urls, 0);
+  g_assert_cmpstr (row->url, ==, "http://www.wikipedia.org");
+  g_assert_cmpint (row->visit_count, ==, 30);
+  row = ephy_history_url_set_get_row (urls, 1);
+  g_assert_cmpstr (row->url, ==, "http://www.freedesktop.org");
+  g_assert_cmpint (row->visit_count, ==, 20);
+
+  list = ephy_history_url_set_to_list (urls);
+  g_assert_cmpint (g_list_length (list), ==, 2);
+  g_assert_cmpstr (((EphyHistoryURL *)list->data)->url, ==, "http://www.wikipedia.org");
+  g_assert_cmpint (((EphyHistoryURL *)list->data)->id, ==, ephy_history_url_set_get_row (urls, 0)->id);
+  ephy_history_url_list_free (list);
+
+  g_object_unref (service);
+  gtk_main_quit ();
+}
+
+static void
+perform_url_set_query (EphyHistoryService *service,
+                       gboolean            success,
+                       gpointer            result_data,
+                       gpointer            user_data)
+{
+  g_autoptr (EphyHistoryQuery) query = ephy_history_query_new ();
+
+  g_assert_true (success);
+
+  query->limit = 2;
+  query->sort_type = EPHY_HISTORY_SORT_MOST_VISITED;
+
+  ephy_history_service_query_url_set (service, query, NULL, verify_url_set_query, NULL);
+}
+
+static void
+test_url_set_query (void)
+{
+  EphyHistoryService *service = ensure_empty_history (test_db_filename ());
+  GList *visits;
+
+  visits = create_visits_for_complex_tests ();
+
+  ephy_history_service_add_visits (service, visits, NULL, perform_url_set_query, NULL);
+  ephy_history_page_visit_list_free (visits);
+
+  gtk_main ();
+}
+
+static void
+count_url_deleted_cb (EphyHistoryService *service,
+                      EphyHistoryURL     *url,
+                      int                *num_url_deleted)
+{
+  (*num_url_deleted)++;
+}
+
+static void
+count_urls_deleted_cb (EphyHistoryService *service,
+                       GPtrArray          *urls,
+                       GArray             *batch_sizes)
+{
+  g_array_append_val (batch_sizes, urls->len);
+}
+
+static void
+verify_batched_delete_signals (EphyHistoryService *service,
+                               gboolean            success,
+                               gpointer            result_data,
+                               gpointer            user_data)
+{
+  GArray *batch_sizes = g_object_get_data (G_OBJECT (service), "batch-sizes");
+  int *num_url_deleted = g_object_get_data (G_OBJECT (service), "num-url-deleted");
+
+  g_assert_true (success);
+
+  /* The signals were queued while the deletion ran, so they were delivered
+   * before this callback, and all in the same main loop iteration. */
+  g_assert_cmpint (*num_url_deleted, ==, 3);
+  g_assert_cmpuint (batch_sizes->len, ==, 1);
+  g_assert_cmpuint (g_array_index (batch_sizes, guint, 0), ==, 3);
+
+  g_object_unref (service);
+  gtk_main_quit ();
+}
+
+static void
+perform_batched_delete (EphyHistoryService *service,
+                        gboolean            success,
+                        gpointer            result_data,
+                        gpointer            user_data)
+{
+  GList *urls = NULL;
+
+  g_assert_true (success);
+
+  urls = g_list_prepend (urls, ephy_history_url_new ("http://www.gnome.org", NULL, 0, 0, 0));
+  urls = g_list_prepend (urls, ephy_history_url_new ("http://www.wikipedia.org", NULL, 0, 0, 0));
+  urls = g_list_prepend (urls, ephy_history_url_new ("http://www.freedesktop.org", NULL, 0, 0, 0));
+
+  ephy_history_service_delete_urls (service, urls, NULL, verify_batched_delete_signals, NULL);
+  g_list_free_full (urls, (GDestroyNotify)ephy_history_url_free);
+}
+
+static void
+test_batched_delete_signals (void)
+{
+  EphyHistoryService *service = ensure_empty_history (test_db_filename ());
+  g_autoptr (GArray) batch_sizes = g_array_new (FALSE, FALSE, sizeof (guint));
+  int num_url_deleted = 0;
+  GList *visits;
+
+  g_object_set_data (G_OBJECT (service), "batch-sizes", batch_sizes);
+  g_object_set_data (G_OBJECT (service), "num-url-deleted", &num_url_deleted);
+  g_signal_connect (service, "url-deleted", G_CALLBACK (count_url_deleted_cb), &num_url_deleted);
+  g_signal_connect (service, "urls-deleted", G_CALLBACK (count_urls_deleted_cb), batch_sizes);
+
+  visits = create_visits_for_complex_tests ();
+
+  ephy_history_service_add_visits (service, visits, NULL, perform_batched_delete, NULL);
+  ephy_history_page_visit_list_free (visits);
+
+  gtk_main ();
+}
+
 static void
 verify_query_after_clear (EphyHistoryService *service,
                           gboolean            success,
@@ -507,6 +993,161 @@ test_clear (void)
   gtk_main ();
 }
 
+#define PERF_NUM_URLS 1000000
+#define PERF_NUM_LOOKUPS 200
+
+static void
+create_unindexed_history (const char *filename,
+                          int         num_urls)
+{
+  EphySQLiteConnection *connection;
+  EphySQLiteStatement *statement;
+  GError *error = NULL;
+
+  if (g_file_test (filename, G_FILE_TEST_IS_REGULAR))
+    g_unlink (filename);
+
+  /* The schema as it was before the history database became versioned. */
+  connection = ephy_sqlite_connection_new (EPHY_SQLITE_CONNECTION_MODE_READWRITE, filename);
+  g_assert_true (ephy_sqlite_connection_open (connection, &error));
+  g_assert_no_error (error);
+
+  ephy_sqlite_connection_execute (connection,
+                                  "CREATE TABLE hosts (id INTEGER PRIMARY KEY, url LONGVARCAR, title LONGVARCAR, "
+                                  "visit_count INTEGER DEFAULT 0 NOT NULL, zoom_level REAL DEFAULT 0.0)", &error);
+  g_assert_no_error (error);
+  ephy_sqlite_connection_execute (connection,
+                                  "CREATE TABLE urls (id INTEGER PRIMARY KEY, host INTEGER NOT NULL REFERENCES hosts(id) ON DELETE CASCADE, "
+                                  "url LONGVARCAR, title LONGVARCAR, sync_id LONGVARCAR, visit_count INTEGER DEFAULT 0 NOT NULL, "
+                                  "typed_count INTEGER DEFAULT 0 NOT NULL, last_visit_time INTEGER, thumbnail_update_time INTEGER DEFAULT 0, "
+                                  "hidden_from_overview INTEGER DEFAULT 0)", &error);
+  g_assert_no_error (error);
+  ephy_sqlite_connection_execute (connection,
+                                  "CREATE TABLE visits (id INTEGER PRIMARY KEY, url INTEGER NOT NULL REFERENCES urls(id) ON DELETE CASCADE, "
+                                  "visit_time INTEGER NOT NULL, visit_type INTEGER NOT NULL, referring_visit INTEGER)", &error);
+  g_assert_no_error (error);
+
+  ephy_sqlite_connection_begin_transaction (connection, &error);
+  g_assert_no_error (error);
+
+  statement = ephy_sqlite_connection_create_statement (connection,
+                                                       "INSERT INTO hosts (url, title) VALUES (?, ?)", &error);
+  for (int i = 0; i < num_urls / 100; i++) {
+    g_autofree char *url = g_strdup_printf ("http://host%d.example.com/", i);
+
+    ephy_sqlite_statement_bind_string (statement, 0, url, &error);
+    ephy_sqlite_statement_bind_string (statement, 1, url + 7, &error);
+    ephy_sqlite_statement_step (statement, &error);
+    g_assert_no_error (error);
+    ephy_sqlite_statement_reset (statement);
+  }
+  g_object_unref (statement);
+
+  statement = ephy_sqlite_connection_create_statement (connection,
+                                                       "INSERT INTO urls (host, url, title, visit_count, last_visit_time) VALUES (?, ?, ?, ?, ?)", &error);
+  for (int i = 0; i < num_urls; i++) {
+    g_autofree char *url = g_strdup_printf ("http://host%d.example.com/page%d", i / 100, i);
+
+    ephy_sqlite_statement_bind_int (statement, 0, i / 100 + 1, &error);
+    ephy_sqlite_statement_bind_string (statement, 1, url, &error);
+    ephy_sqlite_statement_bind_string (statement, 2, url + 7, &error);
+    ephy_sqlite_statement_bind_int (statement, 3, i % 37, &error);
+    ephy_sqlite_statement_bind_int64 (statement, 4, (gint64)i * G_USEC_PER_SEC, &error);
+    ephy_sqlite_statement_step (statement, &error);
+    g_assert_no_error (error);
+    ephy_sqlite_statement_reset (statement);
+  }
+  g_object_unref (statement);
+
+  ephy_sqlite_connection_execute (connection,
+                                  "INSERT INTO visits (url, visit_time, visit_type) SELECT id, last_visit_time, 1 FROM urls", &error);
+  g_assert_no_error (error);
+
+  ephy_sqlite_connection_commit_transaction (connection, &error);
+  g_assert_no_error (error);
+
+  ephy_sqlite_connection_close (connection);
+  g_object_unref (connection);
+}
+
+static double
+time_history_lookups (const char *filename,
+                      int         num_urls)
+{
+  EphySQLiteConnection *connection;
+  EphySQLiteStatement *statement;
+  GError *error = NULL;
+  GRand *rand = g_rand_new_with_seed (42);
+
+  connection = ephy_sqlite_connection_new (EPHY_SQLITE_CONNECTION_MODE_READWRITE, filename);
+  g_assert_true (ephy_sqlite_connection_open (connection, &error));
+  g_assert_no_error (error);
+
+  g_test_timer_start ();
+
+  for (int i = 0; i < PERF_NUM_LOOKUPS; i++) {
+    int id = g_rand_int_range (rand, 0, num_urls);
+    int num_visits;
+    g_autofree char *url = g_strdup_printf ("http://host%d.example.com/page%d", id / 100, id);
+
+    /* ephy_history_service_get_url_row() */
+    statement = ephy_sqlite_connection_create_statement (connection,
+                                                         "SELECT id, url, title, visit_count, typed_count, last_visit_time, hidden_from_overview, sync_id FROM urls "
+                                                         "WHERE url=?", &error);
+    ephy_sqlite_statement_bind_string (statement, 0, url, &error);
+    g_assert_true (ephy_sqlite_statement_step (statement, &error));
+    g_object_unref (statement);
+
+    /* ephy_history_service_find_visits_in_time() over a one hour window */
+    statement = ephy_sqlite_connection_create_statement (connection,
+                                                         "SELECT visits.url, visits.visit_time, visits.visit_type FROM visits "
+                                                         "WHERE visits.visit_time >= ? AND visits.visit_time <= ?", &error);
+    ephy_sqlite_statement_bind_int64 (statement, 0, (gint64)id * G_USEC_PER_SEC, &error);
+    ephy_sqlite_statement_bind_int64 (statement, 1, (gint64)(id + 3600) * G_USEC_PER_SEC, &error);
+    num_visits = 0;
+    while (ephy_sqlite_statement_step (statement, &error))
+      num_visits++;
+    g_assert_no_error (error);
+    g_assert_cmpint (num_visits, >, 0);
+    g_object_unref (statement);
+  }
+
+  g_rand_free (rand);
+  ephy_sqlite_connection_close (connection);
+  g_object_unref (connection);
+
+  return g_test_timer_elapsed () / PERF_NUM_LOOKUPS;
+}
+
+static void
+test_perf_schema_indexes (void)
+{
+  g_autofree char *filename = g_build_filename (g_get_tmp_dir (), "epiphany-history-perf-test.db", NULL);
+  EphyHistoryService *service;
+  double before, after;
+
+  if (!g_test_perf ()) {
+    g_test_skip ("Run with -m perf");
+    return;
+  }
+
+  create_unindexed_history (filename, PERF_NUM_URLS);
+  before = time_history_lookups (filename, PERF_NUM_URLS);
+
+  /* Opening the service migrates the database to the current schema. */
+  service = ephy_history_service_new (filename, EPHY_SQLITE_CONNECTION_MODE_READWRITE);
+  g_object_unref (service);
+
+  after = time_history_lookups (filename, PERF_NUM_URLS);
+
+  g_test_message ("URL lookup + one hour visit range at %d URLs: %.3f ms unindexed, %.3f ms indexed",
+                  PERF_NUM_URLS, before * 1000, after * 1000);
+  g_test_minimized_result (after, "Indexed lookup: %.6f s", after);
+  g_assert_cmpfloat (after, <, before);
+
+  g_unlink (filename);
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -535,8 +1176,18 @@ main (int   argc,
   g_test_add_func ("/embed/history/test_get_url", test_get_url);
   g_test_add_func ("/embed/history/test_get_url_not_existent", test_get_url_not_existent);
   g_test_add_func ("/embed/history/test_complex_url_query", test_complex_url_query);
+  g_test_add_func ("/embed/history/test_import_visits", test_import_visits);
+  g_test_add_func ("/embed/history/test_compact", test_compact);
+  g_test_add_func ("/embed/history/test_cached_zoom_level", test_cached_zoom_level);
   g_test_add_func ("/embed/history/test_complex_url_query_with_time_range", test_complex_url_query_with_time_range);
+  g_test_add_func ("/embed/history/test_complex_url_query_with_long_substring", test_complex_url_query_with_long_substring);
+  g_test_add_func ("/embed/history/test_frecency_url_query", test_frecency_url_query);
+  g_test_add_func ("/embed/history/test_coalesced_url_queries", test_coalesced_url_queries);
+  g_test_add_func ("/embed/history/test_paginated_url_query", test_paginated_url_query);
+  g_test_add_func ("/embed/history/test_url_set_query", test_url_set_query);
+  g_test_add_func ("/embed/history/test_batched_delete_signals", test_batched_delete_signals);
   g_test_add_func ("/embed/history/test_clear", test_clear);
+  g_test_add_func ("/embed/history/perf/schema_indexes", test_perf_schema_indexes);
 
   ret = g_test_run ();
 
@@ -217,6 +217,68 @@ test_table_exists (void)
   g_free (temporary_file);
 }
 
+static void
+test_cached_statement (void)
+{
+  gchar *temporary_file;
+  EphySQLiteConnection *connection;
+  GError *error = NULL;
+  EphySQLiteStatement *statement = NULL;
+  EphySQLiteStatement *nested = NULL;
+  guint hits, misses;
+
+  temporary_file = g_build_filename (g_get_tmp_dir (), "epiphany-sqlite-test.db", NULL);
+  connection = ephy_sqlite_connection_new (EPHY_SQLITE_CONNECTION_MODE_READWRITE, temporary_file);
+  g_assert_true (ephy_sqlite_connection_open (connection, &error));
+  g_assert_no_error (error);
+
+  ephy_sqlite_connection_execute (connection, "CREATE TABLE test (id INTEGER, text LONGVARCHAR)", &error);
+  g_assert_no_error (error);
+
+  for (int i = 0; i < 3; i++) {
+    statement = ephy_sqlite_connection_create_cached_statement (connection, "INSERT INTO test (id, text) VALUES (?, ?)", &error);
+    g_assert_nonnull (statement);
+    g_assert_no_error (error);
+    g_assert_true (ephy_sqlite_statement_bind_int (statement, 0, i, &error));
+    g_assert_true (ephy_sqlite_statement_bind_string (statement, 1, "foo", &error));
+    g_assert_false (ephy_sqlite_statement_step (statement, &error));
+    g_assert_no_error (error);
+    g_object_unref (statement);
+  }
+
+  ephy_sqlite_connection_get_statement_cache_stats (connection, &hits, &misses);
+  g_assert_cmpuint (hits, ==, 2);
+  g_assert_cmpuint (misses, ==, 1);
+
+  /* A reused statement must come back with its bindings cleared. */
+  statement = ephy_sqlite_connection_create_cached_statement (connection, "INSERT INTO test (id, text) VALUES (?, ?)", &error);
+  g_assert_false (ephy_sqlite_statement_step (statement, &error));
+  g_assert_no_error (error);
+  g_object_unref (statement);
+
+  statement = ephy_sqlite_connection_create_statement (connection, "SELECT COUNT(*) FROM test WHERE text IS NULL", &error);
+  g_assert_true (ephy_sqlite_statement_step (statement, &error));
+  g_assert_cmpint (ephy_sqlite_statement_get_column_as_int (statement, 0), ==, 1);
+  g_object_unref (statement);
+
+  /* Requesting the same SQL while a statement is in use must not share it. */
+  statement = ephy_sqlite_connection_create_cached_statement (connection, "SELECT id FROM test WHERE id IS NOT NULL ORDER BY id", &error);
+  g_assert_true (ephy_sqlite_statement_step (statement, &error));
+  nested = ephy_sqlite_connection_create_cached_statement (connection, "SELECT id FROM test WHERE id IS NOT NULL ORDER BY id", &error);
+  g_assert_true (nested != statement);
+  g_assert_true (ephy_sqlite_statement_step (nested, &error));
+  g_object_unref (nested);
+  g_assert_true (ephy_sqlite_statement_step (statement, &error));
+  g_assert_cmpint (ephy_sqlite_statement_get_column_as_int (statement, 0), ==, 1);
+  g_object_unref (statement);
+
+  ephy_sqlite_connection_close (connection);
+  ephy_sqlite_connection_delete_database (connection);
+
+  g_object_unref (connection);
+  g_free (temporary_file);
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -228,6 +290,7 @@ main (int   argc,
   g_test_add_func ("/lib/sqlite/ephy-sqlite/create_table_and_insert_row", test_create_table_and_insert_row);
   g_test_add_func ("/lib/sqlite/ephy-sqlite/bind_data", test_bind_data);
   g_test_add_func ("/lib/sqlite/ephy-sqlite/table_exists", test_table_exists);
+  g_test_add_func ("/lib/sqlite/ephy-sqlite/cached_statement", test_cached_statement);
 
   return g_test_run ();
 }